@@ -35,19 +35,38 @@ Based on esp-idf 'spi_master', modified by LoBo (https://github.com/loboris) 03/
 * Some helper functions are added ('spi_nodma_get_speed', 'spi_nodma_set_speed', ...)
 * All structures are available in header file for easy creation of user low level spi functions. See **tftfunc.c** source for examples.
 * Transimt and receive lenghts are limited only by available memory
+* Queued transactions use chained dma descriptors from the host's pool ('SPI_DMA_DESC_NUM'), a transmit buffer can be sent repeatedly ('SPI_TRANS_REPEAT_TX')
+* Transmit only transfers fill one half of the hw spi buffer while the other half is sent ('spi_nodma_stream_begin', ...)
+* 'spi_nodma_transfer_data_async' transfers data in direct mode from the spi interrupt, without busy waiting
+* Queued transactions of different devices are scheduled by the host's policy ('spi_nodma_set_sched_policy'), queue wait times are measured
+* 'spi_nodma_transfer_batch' executes an array of direct mode transactions with a single device select
+* Device's register values are precomputed when the device is added or its speed changed, switching devices only writes them
+* Re-selecting the last used device takes only the semaphore and sets the CS (no device lookup, queue checks or reconfiguration)
+* Per-device and per-host performance counters ('spi_nodma_get_stats'), can be compiled out with 'SPI_NODMA_STATS'
+* Full duplex direct transfers stream transmit and receive data through both halves of the hw spi buffer
+* Transfer lengths can be any number of bits, in direct and queued mode
+* Dual and quad I/O (SPI_TRANS_MODE_DIO/QIO) in direct mode, WP/HD pins are routed as D2/D3
+* Clock divider: nearest or highest not above requested clock (SPI_DEVICE_CLK_NOT_ABOVE), cached per device, follows APB clock changes
+* Per-device pool of preallocated transaction descriptors with staging buffers ('spi_nodma_trans_get', 'spi_nodma_trans_put')
+* HSPI and VSPI are independent (own semaphore, dma channel and interrupt, allocated on the cpu set in bus_config 'intr_cpu')
+* Bus arbitration with owner tracking, recursive takes, per-device wait limit, preemption points for urgent devices and wait time histograms
+* Queued transactions can report completion by task notification, one wakeup for a batch ('SPI_TRANS_NOTIFY', 'spi_nodma_trans_wait')
+* Optional capture of the transactions into a ring buffer, exported as text or VCD ('SPI_NODMA_CAPTURE', 'spi_nodma_capture_start', ...)
 
 
 Main driver's function is 'spi_nodma_transfer_data()'
 
- * TRANSMIT 8-bit data to spi device from 'trans->tx_buffer' or 'trans->tx_data' (trans->lenght/8 bytes)
- * and RECEIVE data to 'trans->rx_buffer' or 'trans->rx_data' (trans->rx_length/8 bytes)
- * Lengths must be 8-bit multiples!
+ * TRANSMIT data to spi device from 'trans->tx_buffer' or 'trans->tx_data' (trans->lenght bits)
+ * and RECEIVE data to 'trans->rx_buffer' or 'trans->rx_data' (trans->rx_length bits)
+ * Lengths can be any number of bits (9-bit words for 3-wire displays, for example), the bits are sent
+ *   in the order of bytes in the buffer; the last byte is partially sent/received if the length is not a multiple of 8
  * If trans->rx_buffer is NULL or trans->rx_length is 0, only transmits data
  * If trans->tx_buffer is NULL or trans->length is 0, only receives data
  * If the device is in duplex mode (SPI_DEVICE_HALFDUPLEX flag NOT set), data are transmitted and received simultaneously.
  * If the device is in half duplex mode (SPI_DEVICE_HALFDUPLEX flag IS set), data are received after transmission
  * 'address', 'command' and 'dummy bits' are transmitted before data phase IF set in device's configuration
  *   and IF 'trans->length' and 'trans->rx_length' are NOT both 0
+ * With SPI_TRANS_MODE_DIO/QIO flags data are transferred on 2/4 lines (half duplex only)
  * If configured, devices 'pre_cb' callback is called before and 'post_cb' after the transmission
  * If device was not previously selected, it will be selected before transmission and deselected after transmission.
 
@@ -59,6 +78,7 @@ Main driver's function is 'spi_nodma_transfer_data()'
  if the driver is located in esp-isf/components
 */
 #include "spi_master_nodma.h"
+#include "spi_nodma_buf.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -83,9 +103,13 @@ Main driver's function is 'spi_nodma_transfer_data()'
 #include "driver/gpio.h"
 #include "driver/periph_ctrl.h"
 #include "esp_heap_alloc_caps.h"
+#include "xtensa/hal.h"
 
 
+// Each host has its own state, lock, interrupt and dma channel; nothing is shared between HSPI and VSPI
 static spi_nodma_host_t *spihost[3] = {NULL};
+// Set while the host's bus is being initialized or freed (adding/removing devices from tasks on both cores)
+static volatile uint32_t spihost_busy[3] = {0};
 
 
 static const char *SPI_TAG = "spi_nodma_master";
@@ -192,50 +216,61 @@ static const spi_signal_conn_t io_signal[3]={
 };
 
 
+// Request to allocate or free the host's interrupt (spi_nodma_intr_call)
+typedef struct {
+    spi_nodma_host_device_t host;
+    int alloc;
+    esp_err_t ret;
+    TaskHandle_t caller;            // task waiting for the result if executed by the helper task
+} spi_nodma_intr_call_t;
+
 static void spi_intr(void *arg);
+static void spi_nodma_dev_regs(spi_nodma_device_t *dev);
 
-//-------------------------------------------------------------------------------------------------------------------
-static esp_err_t spi_nodma_bus_initialize(spi_nodma_host_device_t host, spi_nodma_bus_config_t *bus_config, int init)
+// Check if the bus pins correspond to the native pins of the peripheral
+//-----------------------------------------------------------------------------------------------
+static bool spi_nodma_native_pins(spi_nodma_host_device_t host, spi_nodma_bus_config_t *bus_config)
 {
-    bool native=true;
-
-    if (init > 0) {
-        /* ToDo: remove this when we have flash operations cooperating with this */
-        SPI_CHECK(host!=SPI_HOST, "SPI1 is not supported", ESP_ERR_NOT_SUPPORTED);
+    if (bus_config->mosi_io_num >= 0 && bus_config->mosi_io_num!=io_signal[host].spid_native) return false;
+    if (bus_config->miso_io_num >= 0 && bus_config->miso_io_num!=io_signal[host].spiq_native) return false;
+    if (bus_config->sclk_io_num >= 0 && bus_config->sclk_io_num!=io_signal[host].spiclk_native) return false;
+    if (bus_config->quadwp_io_num >= 0 && bus_config->quadwp_io_num!=io_signal[host].spiwp_native) return false;
+    if (bus_config->quadhd_io_num >= 0 && bus_config->quadhd_io_num!=io_signal[host].spihd_native) return false;
+    return true;
+}
 
-        SPI_CHECK(host>=SPI_HOST && host<=VSPI_HOST, "invalid host", ESP_ERR_INVALID_ARG);
-        SPI_CHECK(spihost[host]==NULL, "host already in use", ESP_ERR_INVALID_STATE);
-    }
-    else {
-        SPI_CHECK(spihost[host]!=NULL, "host not in use", ESP_ERR_INVALID_STATE);
-    }
-    
+// Check the bus pins
+//------------------------------------------------------------------------
+static esp_err_t spi_nodma_bus_check_pins(spi_nodma_bus_config_t *bus_config)
+{
     SPI_CHECK(bus_config->mosi_io_num<0 || GPIO_IS_VALID_OUTPUT_GPIO(bus_config->mosi_io_num), "spid pin invalid", ESP_ERR_INVALID_ARG);
     SPI_CHECK(bus_config->sclk_io_num<0 || GPIO_IS_VALID_OUTPUT_GPIO(bus_config->sclk_io_num), "spiclk pin invalid", ESP_ERR_INVALID_ARG);
     SPI_CHECK(bus_config->miso_io_num<0 || GPIO_IS_VALID_GPIO(bus_config->miso_io_num), "spiq pin invalid", ESP_ERR_INVALID_ARG);
     SPI_CHECK(bus_config->quadwp_io_num<0 || GPIO_IS_VALID_OUTPUT_GPIO(bus_config->quadwp_io_num), "spiwp pin invalid", ESP_ERR_INVALID_ARG);
     SPI_CHECK(bus_config->quadhd_io_num<0 || GPIO_IS_VALID_OUTPUT_GPIO(bus_config->quadhd_io_num), "spihd pin invalid", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(bus_config->intr_cpu>=SPI_NODMA_INTR_CPU_AUTO && bus_config->intr_cpu<=SPI_NODMA_INTR_CPU_1, "invalid interrupt cpu", ESP_ERR_INVALID_ARG);
+    return ESP_OK;
+}
 
-    if (init > 0) {
-		//spihost[host]=malloc(sizeof(spi_nodma_host_t));
-		spihost[host]=pvPortMallocCaps(sizeof(spi_nodma_host_t), MALLOC_CAP_DMA);
-		if (spihost[host]==NULL) return ESP_ERR_NO_MEM;
-		memset(spihost[host], 0, sizeof(spi_nodma_host_t));
-		// Create semaphore
-		spihost[host]->spi_nodma_bus_mutex = xSemaphoreCreateMutex();
-		if (!spihost[host]->spi_nodma_bus_mutex) return ESP_ERR_NO_MEM;
-    }
+// Bus configurations are the same if they use the same pins
+//-------------------------------------------------------------------------------------------
+static bool spi_nodma_same_pins(spi_nodma_bus_config_t *a, spi_nodma_bus_config_t *b)
+{
+    return ((a->mosi_io_num == b->mosi_io_num) && (a->miso_io_num == b->miso_io_num) && (a->sclk_io_num == b->sclk_io_num) &&
+            (a->quadwp_io_num == b->quadwp_io_num) && (a->quadhd_io_num == b->quadhd_io_num));
+}
+
+// Route the host's signals to the bus pins
+// Only the pins are changed, the host's interrupt, dma channel and registers are not touched
+//---------------------------------------------------------------------------------------------
+static void spi_nodma_bus_route(spi_nodma_host_device_t host, spi_nodma_bus_config_t *bus_config)
+{
+    bool native=true;
 
-    spihost[host]->cur_device = -1;
     memcpy(&spihost[host]->cur_bus_config, bus_config, sizeof(spi_nodma_bus_config_t));
 
     //Check if the selected pins correspond to the native pins of the peripheral
-    if (bus_config->mosi_io_num >= 0 && bus_config->mosi_io_num!=io_signal[host].spid_native) native=false;
-    if (bus_config->miso_io_num >= 0 && bus_config->miso_io_num!=io_signal[host].spiq_native) native=false;
-    if (bus_config->sclk_io_num >= 0 && bus_config->sclk_io_num!=io_signal[host].spiclk_native) native=false;
-    if (bus_config->quadwp_io_num >= 0 && bus_config->quadwp_io_num!=io_signal[host].spiwp_native) native=false;
-    if (bus_config->quadhd_io_num >= 0 && bus_config->quadhd_io_num!=io_signal[host].spihd_native) native=false;
-    
+    native=spi_nodma_native_pins(host, bus_config);
     spihost[host]->no_gpio_matrix=native;
     if (native) {
         //All SPI native pin selections resolve to 1, so we put that here instead of trying to figure
@@ -249,25 +284,25 @@ static esp_err_t spi_nodma_bus_initialize(spi_nodma_host_device_t host, spi_nodm
         //Use GPIO 
         if (bus_config->mosi_io_num>0) {
             PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[bus_config->mosi_io_num], PIN_FUNC_GPIO);
-            gpio_set_direction(bus_config->mosi_io_num, GPIO_MODE_OUTPUT);
+            gpio_set_direction(bus_config->mosi_io_num, GPIO_MODE_INPUT_OUTPUT);  // D0, input in DIO/QIO read
             gpio_matrix_out(bus_config->mosi_io_num, io_signal[host].spid_out, false, false);
             gpio_matrix_in(bus_config->mosi_io_num, io_signal[host].spid_in, false);
         }
         if (bus_config->miso_io_num>0) {
             PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[bus_config->miso_io_num], PIN_FUNC_GPIO);
-            gpio_set_direction(bus_config->miso_io_num, GPIO_MODE_INPUT);
+            gpio_set_direction(bus_config->miso_io_num, GPIO_MODE_INPUT_OUTPUT);  // D1, output in DIO/QIO write
             gpio_matrix_out(bus_config->miso_io_num, io_signal[host].spiq_out, false, false);
             gpio_matrix_in(bus_config->miso_io_num, io_signal[host].spiq_in, false);
         }
         if (bus_config->quadwp_io_num>0) {
             PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[bus_config->quadwp_io_num], PIN_FUNC_GPIO);
-            gpio_set_direction(bus_config->quadwp_io_num, GPIO_MODE_OUTPUT);
+            gpio_set_direction(bus_config->quadwp_io_num, GPIO_MODE_INPUT_OUTPUT);
             gpio_matrix_out(bus_config->quadwp_io_num, io_signal[host].spiwp_out, false, false);
             gpio_matrix_in(bus_config->quadwp_io_num, io_signal[host].spiwp_in, false);
         }
         if (bus_config->quadhd_io_num>0) {
             PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[bus_config->quadhd_io_num], PIN_FUNC_GPIO);
-            gpio_set_direction(bus_config->quadhd_io_num, GPIO_MODE_OUTPUT);
+            gpio_set_direction(bus_config->quadhd_io_num, GPIO_MODE_INPUT_OUTPUT);
             gpio_matrix_out(bus_config->quadhd_io_num, io_signal[host].spihd_out, false, false);
             gpio_matrix_in(bus_config->quadhd_io_num, io_signal[host].spihd_in, false);
         }
@@ -277,61 +312,146 @@ static esp_err_t spi_nodma_bus_initialize(spi_nodma_host_device_t host, spi_nodm
             gpio_matrix_out(bus_config->sclk_io_num, io_signal[host].spiclk_out, false, false);
         }
     }
+}
+
+// Allocate or free the host's interrupt on the cpu it is (to be) allocated on
+//--------------------------------------------------
+static void spi_nodma_intr_task(void *arg)
+{
+    spi_nodma_intr_call_t *call = (spi_nodma_intr_call_t *)arg;
+    spi_nodma_host_t *host = spihost[call->host];
+
+    if (call->alloc) {
+        call->ret = esp_intr_alloc(io_signal[call->host].irq, ESP_INTR_FLAG_INTRDISABLED, spi_intr, (void*)host, &host->intr);
+        // Remember the cpu, the interrupt must be freed from it
+        host->intr_cpu = SPI_NODMA_INTR_CPU_0 + xPortGetCoreID();
+    }
+    else call->ret = esp_intr_free(host->intr);
+
+    if (call->caller) {
+        // Executed by the helper task pinned to the interrupt's cpu
+        xTaskNotifyGive(call->caller);
+        vTaskDelete(NULL);
+    }
+}
+
+// Interrupts are allocated on the cpu which calls esp_intr_alloc and must be freed from the same cpu,
+// so a short lived task pinned to the requested cpu is used if the calling task runs on the other one
+//-------------------------------------------------------------------------------------
+static esp_err_t spi_nodma_intr_call(spi_nodma_host_device_t host, int alloc)
+{
+    spi_nodma_intr_call_t call = { .host=host, .alloc=alloc, .ret=ESP_OK, .caller=NULL };
+    int cpu = spihost[host]->intr_cpu;
+
+    if ((cpu == SPI_NODMA_INTR_CPU_AUTO) || ((cpu - SPI_NODMA_INTR_CPU_0) == xPortGetCoreID())) {
+        spi_nodma_intr_task(&call);
+        return call.ret;
+    }
+
+    call.caller = xTaskGetCurrentTaskHandle();
+    if (xTaskCreatePinnedToCore(spi_nodma_intr_task, "spi_nodma_intr", 2048, &call, configMAX_PRIORITIES-1, NULL, cpu - SPI_NODMA_INTR_CPU_0) != pdPASS) return ESP_ERR_NO_MEM;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return call.ret;
+}
+
+//--------------------------------------------------------------------------------------------------------
+static esp_err_t spi_nodma_bus_initialize(spi_nodma_host_device_t host, spi_nodma_bus_config_t *bus_config)
+{
+    esp_err_t ret;
+
+    /* ToDo: remove this when we have flash operations cooperating with this */
+    SPI_CHECK(host!=SPI_HOST, "SPI1 is not supported", ESP_ERR_NOT_SUPPORTED);
+
+    SPI_CHECK(host>=SPI_HOST && host<=VSPI_HOST, "invalid host", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(spihost[host]==NULL, "host already in use", ESP_ERR_INVALID_STATE);
+
+    ret = spi_nodma_bus_check_pins(bus_config);
+    if (ret) return ret;
+
+	//spihost[host]=malloc(sizeof(spi_nodma_host_t));
+	spihost[host]=pvPortMallocCaps(sizeof(spi_nodma_host_t), MALLOC_CAP_DMA);
+	if (spihost[host]==NULL) return ESP_ERR_NO_MEM;
+	memset(spihost[host], 0, sizeof(spi_nodma_host_t));
+	// Create semaphore
+	spihost[host]->spi_nodma_bus_mutex = xSemaphoreCreateMutex();
+	spihost[host]->async.done = xSemaphoreCreateBinary();
+	spihost[host]->arb.handoff = xSemaphoreCreateBinary();
+	if ((!spihost[host]->spi_nodma_bus_mutex) || (!spihost[host]->async.done) || (!spihost[host]->arb.handoff)) {
+		if (spihost[host]->spi_nodma_bus_mutex) vSemaphoreDelete(spihost[host]->spi_nodma_bus_mutex);
+		if (spihost[host]->async.done) vSemaphoreDelete(spihost[host]->async.done);
+		if (spihost[host]->arb.handoff) vSemaphoreDelete(spihost[host]->arb.handoff);
+		free(spihost[host]);
+		spihost[host]=NULL;
+		return ESP_ERR_NO_MEM;
+	}
+	spihost[host]->sched.policy = SPI_SCHED_LOW_CS_FIRST;
+	spihost[host]->sched.max_run = SPI_SCHED_MAX_RUN;
+	spihost[host]->host_dev = host;
+	spihost[host]->intr_cpu = bus_config->intr_cpu;
+    spihost[host]->cur_device = -1;
+
+	spi_nodma_bus_route(host, bus_config);
 	periph_module_enable(io_signal[host].module);
 	spihost[host]->hw=io_signal[host].hw;
 
-	if (init > 0) {
-		esp_intr_alloc(io_signal[host].irq, ESP_INTR_FLAG_INTRDISABLED, spi_intr, (void*)spihost[host], &spihost[host]->intr);
-		//Reset DMA
-		spihost[host]->hw->dma_conf.val|=SPI_OUT_RST|SPI_AHBM_RST|SPI_AHBM_FIFO_RST;
-		spihost[host]->hw->dma_out_link.start=0;
-		spihost[host]->hw->dma_in_link.start=0;
-		spihost[host]->hw->dma_conf.val&=~(SPI_OUT_RST|SPI_AHBM_RST|SPI_AHBM_FIFO_RST);
-        //Reset timing
-        spihost[host]->hw->ctrl2.val=0;
-
-		//Disable unneeded ints
-		spihost[host]->hw->slave.rd_buf_done=0;
-		spihost[host]->hw->slave.wr_buf_done=0;
-		spihost[host]->hw->slave.rd_sta_done=0;
-		spihost[host]->hw->slave.wr_sta_done=0;
-		spihost[host]->hw->slave.rd_buf_inten=0;
-		spihost[host]->hw->slave.wr_buf_inten=0;
-		spihost[host]->hw->slave.rd_sta_inten=0;
-		spihost[host]->hw->slave.wr_sta_inten=0;
-
-		//Force a transaction done interrupt. This interrupt won't fire yet because we initialized the SPI interrupt as
-		//disabled.  This way, we can just enable the SPI interrupt and the interrupt handler will kick in, handling
-		//any transactions that are queued.
-		spihost[host]->hw->slave.trans_inten=1;
-		spihost[host]->hw->slave.trans_done=1;
-
-		//Select DMA channel.
-		SET_PERI_REG_BITS(DPORT_SPI_DMA_CHAN_SEL_REG, 3, init, (host * 2));
-    }
+	ret = spi_nodma_intr_call(host, 1);
+	if (ret) {
+		periph_module_disable(io_signal[host].module);
+		vSemaphoreDelete(spihost[host]->spi_nodma_bus_mutex);
+		vSemaphoreDelete(spihost[host]->async.done);
+		vSemaphoreDelete(spihost[host]->arb.handoff);
+		free(spihost[host]);
+		spihost[host]=NULL;
+		return ret;
+	}
+
+	//Reset DMA
+	spihost[host]->hw->dma_conf.val|=SPI_OUT_RST|SPI_AHBM_RST|SPI_AHBM_FIFO_RST;
+	spihost[host]->hw->dma_out_link.start=0;
+	spihost[host]->hw->dma_in_link.start=0;
+	spihost[host]->hw->dma_conf.val&=~(SPI_OUT_RST|SPI_AHBM_RST|SPI_AHBM_FIFO_RST);
+    //Reset timing
+    spihost[host]->hw->ctrl2.val=0;
+
+	//Disable unneeded ints
+	spihost[host]->hw->slave.rd_buf_done=0;
+	spihost[host]->hw->slave.wr_buf_done=0;
+	spihost[host]->hw->slave.rd_sta_done=0;
+	spihost[host]->hw->slave.wr_sta_done=0;
+	spihost[host]->hw->slave.rd_buf_inten=0;
+	spihost[host]->hw->slave.wr_buf_inten=0;
+	spihost[host]->hw->slave.rd_sta_inten=0;
+	spihost[host]->hw->slave.wr_sta_inten=0;
+
+	//Force a transaction done interrupt. This interrupt won't fire yet because we initialized the SPI interrupt as
+	//disabled.  This way, we can just enable the SPI interrupt and the interrupt handler will kick in, handling
+	//any transactions that are queued.
+	spihost[host]->hw->slave.trans_inten=1;
+	spihost[host]->hw->slave.trans_done=1;
+
+	//Select DMA channel, each host uses its own (HSPI: 1, VSPI: 2), so both can run queued transactions at the same time
+	SET_PERI_REG_BITS(DPORT_SPI_DMA_CHAN_SEL_REG, 3, SPI_NODMA_DMA_CHAN(host), (host * 2));
     return ESP_OK;
 }
 
-//---------------------------------------------------------------------------
-static esp_err_t spi_nodma_bus_free(spi_nodma_host_device_t host, int dofree)
+//-----------------------------------------------------------------
+static esp_err_t spi_nodma_bus_free(spi_nodma_host_device_t host)
 {
     int x;
     SPI_CHECK(host>=SPI_HOST && host<=VSPI_HOST, "invalid host", ESP_ERR_INVALID_ARG);
     SPI_CHECK(spihost[host]!=NULL, "host not in use", ESP_ERR_INVALID_STATE);
-    if (dofree) {
-		for (x=0; x<NO_DEV; x++) {
-			SPI_CHECK(spihost[host]->device[x]==NULL, "not all devices freed", ESP_ERR_INVALID_STATE);
-		}
-    }
+	for (x=0; x<NO_DEV; x++) {
+		SPI_CHECK(spihost[host]->device[x]==NULL, "not all devices freed", ESP_ERR_INVALID_STATE);
+	}
     spihost[host]->hw->slave.trans_inten=0;
     spihost[host]->hw->slave.trans_done=0;
-    esp_intr_free(spihost[host]->intr);
+    spi_nodma_intr_call(host, 0);
     periph_module_disable(io_signal[host].module);
-    if (dofree) {
-		vSemaphoreDelete(spihost[host]->spi_nodma_bus_mutex);
-		free(spihost[host]);
-		spihost[host]=NULL;
-    }
+	vSemaphoreDelete(spihost[host]->spi_nodma_bus_mutex);
+	vSemaphoreDelete(spihost[host]->async.done);
+	vSemaphoreDelete(spihost[host]->arb.handoff);
+	free(spihost[host]);
+	spihost[host]=NULL;
     return ESP_OK;
 }
 
@@ -340,14 +460,17 @@ esp_err_t spi_nodma_bus_add_device(spi_nodma_host_device_t host, spi_nodma_bus_c
 {
 	SPI_CHECK(host!=SPI_HOST, "SPI1 is not supported", ESP_ERR_NOT_SUPPORTED);
 	SPI_CHECK(host>=SPI_HOST && host<=VSPI_HOST, "invalid host", ESP_ERR_NOT_SUPPORTED);
-	
-	if (spihost[host] == NULL) {
-		esp_err_t ret = spi_nodma_bus_initialize(host, bus_config, 1);
-		if (ret) return ret;
-	}
+	esp_err_t ret = spi_nodma_bus_check_pins(bus_config);
+	if (ret) return ret;
+
+	// Only tasks adding devices to the same host wait for each other here
+	while (!__sync_bool_compare_and_swap(&spihost_busy[host], 0, 1)) vTaskDelay(1);
+	if (spihost[host] == NULL) ret = spi_nodma_bus_initialize(host, bus_config);
+	spihost_busy[host] = 0;
+	if (ret) return ret;
 	
 	int freecs, maxdev;
-    int apbclk=APB_CLK_FREQ;
+    int apbclk=SPI_NODMA_APB_FREQ();
 
 	SPI_CHECK(spihost[host] != NULL, "host not initialized", ESP_ERR_INVALID_STATE);
     if (dev_config->spics_io_num >= 0) {
@@ -386,11 +509,19 @@ esp_err_t spi_nodma_bus_add_device(spi_nodma_host_device_t host, spi_nodma_bus_c
     if (dev_config->duty_cycle_pos==0) dev_config->duty_cycle_pos=128;
     dev->host=spihost[host];
 	dev->host_dev = host;
+    dev->cs=freecs;
+    //Deadlines are compared in cpu cycles; no deadline is the longest time which can be compared safely
+    if ((dev_config->deadline_us == 0) || (dev_config->deadline_us > (0x3FFFFFFF / ets_get_cpu_frequency()))) dev->deadline_cycles = 0x3FFFFFFF;
+    else dev->deadline_cycles = dev_config->deadline_us * ets_get_cpu_frequency();
+    dev->bus_wait_ticks = ((dev_config->bus_wait_ms) ? dev_config->bus_wait_ms : SPI_SEMAPHORE_WAIT) / portTICK_PERIOD_MS;
+    if (dev->bus_wait_ticks == 0) dev->bus_wait_ticks = 1;
 
     //We want to save a copy of the dev config in the dev struct.
     memcpy(&dev->cfg, dev_config, sizeof(spi_nodma_device_interface_config_t));
     //We want to save a copy of the bus config in the dev struct.
     memcpy(&dev->bus_config, bus_config, sizeof(spi_nodma_bus_config_t));
+    //Register values used when switching to the device
+    spi_nodma_dev_regs(dev);
 
     //Set CS pin, CS options
     if (dev_config->spics_io_num > 0) {
@@ -429,28 +560,29 @@ esp_err_t spi_nodma_bus_remove_device(spi_nodma_device_handle_t handle)
     SPI_CHECK(handle!=NULL, "invalid handle", ESP_ERR_INVALID_ARG);
     //These checks aren't exhaustive; another thread could sneak in a transaction inbetween. These are only here to
     //catch design errors and aren't meant to be triggered during normal operation.
-    SPI_CHECK(uxQueueMessagesWaiting(handle->trans_queue)==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
-    SPI_CHECK(handle->host->cur_trans==0 || handle->host->device[handle->host->cur_device]!=handle, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
-    SPI_CHECK(uxQueueMessagesWaiting(handle->ret_queue)==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
+    SPI_CHECK(handle->inflight==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
+    SPI_CHECK(handle->host->cur_trans==0 || handle->host->cur_device!=handle->cs, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
 
     //Kill queues
     vQueueDelete(handle->trans_queue);
     vQueueDelete(handle->ret_queue);
+    //Free transaction descriptor pool
+    free(handle->pool.items);
+    free(handle->pool.bufs);
 
     //Remove device from list of csses and free memory
-    for (x=0; x<NO_DEV; x++) {
-        if (handle->host->device[x] == handle) handle->host->device[x]=NULL;
-    }
+    handle->host->device[handle->cs]=NULL;
 	
+	int host_dev = handle->host_dev;
+	free(handle);
+
 	//Check if all devices are removed from this host
+	while (!__sync_bool_compare_and_swap(&spihost_busy[host_dev], 0, 1)) vTaskDelay(1);
 	for (x=0; x<NO_DEV; x++) {
-		if (spihost[handle->host_dev]->device[x] !=NULL) break;
-	}
-	if (x == NO_DEV) {
-		free(handle);
-		spi_nodma_bus_free(handle->host_dev, 1);
+		if (spihost[host_dev]->device[x] !=NULL) break;
 	}
-	else free(handle);
+	if (x == NO_DEV) spi_nodma_bus_free(host_dev);
+	spihost_busy[host_dev] = 0;
 
 	return ESP_OK;
 }
@@ -461,42 +593,42 @@ static int IRAM_ATTR spi_freq_for_pre_n(int fapb, int pre, int n) {
 }
 
 /*
- * Set the SPI clock to a certain frequency. Returns the effective frequency set, which may be slightly
- * different from the requested frequency.
+ * Calculate the SPI clock register value for a certain frequency. Returns the effective frequency, which may be slightly
+ * different from the requested frequency: the nearest possible one or, if 'not_above' is set, the highest one not above 'hz'.
  */
-//------------------------------------------------------------------------------------
-static int IRAM_ATTR spi_set_clock(spi_dev_t *hw, int fapb, int hz, int duty_cycle) {
+//--------------------------------------------------------------------------------------------
+static int spi_calc_clock(int fapb, int hz, int duty_cycle, int not_above, uint32_t *reg) {
    int pre, n, h, l, eff_clk;
 
     //In hw, n, h and l are 1-64, pre is 1-8K. Value written to register is one lower than used value.
-    if (hz>((fapb/4)*3)) {
+    if ((hz>=fapb) || ((!not_above) && (hz>((fapb/4)*3)))) {
         //Using Fapb directly will give us the best result here.
-        hw->clock.clkcnt_l=0;
-        hw->clock.clkcnt_h=0;
-        hw->clock.clkcnt_n=0;
-        hw->clock.clkdiv_pre=0;
-        hw->clock.clk_equ_sysclk=1;
+        *reg=SPI_CLK_EQU_SYSCLK;
         eff_clk=fapb;
     } else {
         //For best duty cycle resolution, we want n to be as close to 32 as possible, but
         //we also need a pre/n combo that gets us as close as possible to the intended freq.
-        //To do this, we bruteforce n and calculate the best pre to go along with that.
+        //To do this, we bruteforce n; for each n only the two pre values around (fapb/n)/hz can
+        //give the best frequency, both are checked, so the result is the best of all pre/n combos.
         //If there's a choice between pre/n combos that give the same result, use the one
         //with the higher n.
-        int bestn=-1;
-        int bestpre=-1;
-        int besterr=0;
+        int bestn=64;
+        int bestpre=8192;   //the lowest clock, used if no combo is below 'hz'
+        int besterr=-1;
         int errval;
         for (n=1; n<=64; n++) {
-            //Effectively, this does pre=round((fapb/n)/hz).
-            pre=((fapb/n)+(hz/2))/hz;
-            if (pre<=0) pre=1;
-            if (pre>8192) pre=8192;
-            errval=abs(spi_freq_for_pre_n(fapb, pre, n)-hz);
-            if (bestn==-1 || errval<=besterr) {
-                besterr=errval;
-                bestn=n;
-                bestpre=pre;
+            //Effectively, this does pre=floor((fapb/n)/hz).
+            pre=(fapb/n)/hz;
+            if (pre>8191) pre=8191;
+            for (int p=pre; p<=pre+1; p++) {
+                if (p<=0) continue;
+                if ((not_above) && (((int64_t)hz*p*n) < fapb)) continue;
+                errval=abs(spi_freq_for_pre_n(fapb, p, n)-hz);
+                if (besterr<0 || errval<=besterr) {
+                    besterr=errval;
+                    bestn=n;
+                    bestpre=p;
+                }
             }
         }
 
@@ -507,20 +639,437 @@ static int IRAM_ATTR spi_set_clock(spi_dev_t *hw, int fapb, int hz, int duty_cyc
         h=(duty_cycle*n+127)/256;
         if (h<=0) h=1;
 
-        hw->clock.clk_equ_sysclk=0;
-        hw->clock.clkcnt_n=n-1;
-        hw->clock.clkdiv_pre=pre-1;
-        hw->clock.clkcnt_h=h-1;
-        hw->clock.clkcnt_l=l-1;
+        *reg=((pre-1)<<SPI_CLKDIV_PRE_S) | ((n-1)<<SPI_CLKCNT_N_S) | ((h-1)<<SPI_CLKCNT_H_S) | ((l-1)<<SPI_CLKCNT_L_S);
         eff_clk=spi_freq_for_pre_n(fapb, pre, n);
     }
     return eff_clk;
 }
 
+/*
+ * Get the clock register value for the device's clock speed and the APB clock 'apbclk'.
+ * The divider is only calculated if it is not in the device's cache of recently used dividers.
+ */
+//-------------------------------------------------------------------------------
+static int spi_nodma_dev_clock(spi_nodma_device_t *dev, int apbclk, uint32_t *reg)
+{
+    spi_nodma_clk_cache_t *c;
+
+    for (int i=0; i<SPI_NODMA_CLK_CACHE_SIZE; i++) {
+        c=&dev->clk_cache[i];
+        if ((c->hz==(uint32_t)dev->cfg.clock_speed_hz) && (c->apb_clk==(uint32_t)apbclk)) {
+            *reg=c->reg;
+            return c->eff_clk;
+        }
+    }
+    c=&dev->clk_cache[dev->clk_cache_next];
+    dev->clk_cache_next=(dev->clk_cache_next+1) % SPI_NODMA_CLK_CACHE_SIZE;
+    c->eff_clk=spi_calc_clock(apbclk, dev->cfg.clock_speed_hz, dev->cfg.duty_cycle_pos, (dev->cfg.flags & SPI_DEVICE_CLK_NOT_ABOVE), &c->reg);
+    c->hz=dev->cfg.clock_speed_hz;
+    c->apb_clk=apbclk;
+    *reg=c->reg;
+    return c->eff_clk;
+}
+
+// Device's bits in the 'user' and 'pin' registers, the other bits are set per transaction or per host
+#define SPI_NODMA_USER_DEV_MASK (SPI_USR_DUMMY|SPI_USR_ADDR|SPI_USR_COMMAND|SPI_CK_OUT_EDGE|SPI_DOUTDIN|SPI_SIO|SPI_CS_SETUP|SPI_CS_HOLD)
+#define SPI_NODMA_PIN_DEV_MASK  (SPI_CK_IDLE_EDGE|SPI_CS0_DIS|SPI_CS1_DIS|SPI_CS2_DIS)
+
+/*
+ * Calculate the register values for the device.
+ * Everything which depends only on the device configuration is done here, so switching to the device
+ * only writes the precomputed values (spi_nodma_dev_apply).
+ */
+//-----------------------------------------------------
+static void spi_nodma_dev_regs(spi_nodma_device_t *dev)
+{
+    spi_nodma_dev_regs_t *regs = &dev->regs;
+    int apbclk=SPI_NODMA_APB_FREQ();
+    bool native=spi_nodma_native_pins(dev->host_dev, &dev->bus_config);
+
+    //Speeds >=40MHz over GPIO matrix needs a dummy cycle, but these don't work for full-duplex connections.
+    if (((dev->cfg.flags & SPI_DEVICE_HALFDUPLEX) == 0) && (dev->cfg.clock_speed_hz > ((apbclk*2)/5)) && (!native)) {
+        // set speed to 32 MHz
+        dev->cfg.clock_speed_hz = (apbclk*2)/5;
+    }
+
+    int effclk=spi_nodma_dev_clock(dev, apbclk, &regs->clock);
+    regs->eff_clk=effclk;
+    regs->apb_clk=apbclk;
+
+    //Configure bit order
+    regs->ctrl=((dev->cfg.flags & SPI_DEVICE_RXBIT_LSBFIRST)?SPI_RD_BIT_ORDER:0) | ((dev->cfg.flags & SPI_DEVICE_TXBIT_LSBFIRST)?SPI_WR_BIT_ORDER:0);
+
+    //Configure polarity
+    //SPI iface needs to be configured for a delay in some cases.
+    int nodelay=0;
+    int extra_dummy=0;
+    if (native) {
+        if (effclk >= apbclk/2) {
+            nodelay=1;
+        }
+    } else {
+        if (effclk >= apbclk/2) {
+            nodelay=1;
+            extra_dummy=1;          //Note: This only works on half-duplex connections. spi_nodma_bus_add_device checks for this.
+        } else if (effclk >= apbclk/4) {
+            nodelay=1;
+        }
+    }
+    int miso_delay=0;
+    regs->user=0;
+    regs->pin=0;
+    if (dev->cfg.mode==0) {
+        miso_delay=nodelay?0:2;
+    } else if (dev->cfg.mode==1) {
+        regs->user|=SPI_CK_OUT_EDGE;
+        miso_delay=nodelay?0:1;
+    } else if (dev->cfg.mode==2) {
+        regs->pin|=SPI_CK_IDLE_EDGE;
+        regs->user|=SPI_CK_OUT_EDGE;
+        miso_delay=nodelay?0:1;
+    } else if (dev->cfg.mode==3) {
+        regs->pin|=SPI_CK_IDLE_EDGE;
+        miso_delay=nodelay?0:2;
+    }
+
+    //Configure bit sizes, addr and command
+    if (dev->cfg.dummy_bits+extra_dummy) regs->user|=SPI_USR_DUMMY;
+    if (dev->cfg.address_bits) regs->user|=SPI_USR_ADDR;
+    if (dev->cfg.command_bits) regs->user|=SPI_USR_COMMAND;
+    regs->user1=(((dev->cfg.address_bits-1) & SPI_USR_ADDR_BITLEN_V) << SPI_USR_ADDR_BITLEN_S) |
+                (((dev->cfg.dummy_bits+extra_dummy-1) & SPI_USR_DUMMY_CYCLELEN_V) << SPI_USR_DUMMY_CYCLELEN_S);
+    regs->user2=((dev->cfg.command_bits-1) & SPI_USR_COMMAND_BITLEN_V) << SPI_USR_COMMAND_BITLEN_S;
+    //Configure misc stuff
+    if ((dev->cfg.flags & SPI_DEVICE_HALFDUPLEX) == 0) regs->user|=SPI_DOUTDIN;
+    if (dev->cfg.flags & SPI_DEVICE_3WIRE) regs->user|=SPI_SIO;
+
+    regs->ctrl2=(((dev->cfg.cs_ena_pretrans-1) & SPI_SETUP_TIME_V) << SPI_SETUP_TIME_S) |
+                (((dev->cfg.cs_ena_posttrans-1) & SPI_HOLD_TIME_V) << SPI_HOLD_TIME_S) |
+                (miso_delay << SPI_MISO_DELAY_MODE_S);
+    if (dev->cfg.cs_ena_pretrans) regs->user|=SPI_CS_SETUP;
+    if (dev->cfg.cs_ena_posttrans) regs->user|=SPI_CS_HOLD;
+
+    //Configure CS pin
+    if (dev->cs!=0) regs->pin|=SPI_CS0_DIS;
+    if (dev->cs!=1) regs->pin|=SPI_CS1_DIS;
+    if (dev->cs!=2) regs->pin|=SPI_CS2_DIS;
+}
+
+// Switch the hw to the device, writing its precomputed register values
+//-------------------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_nodma_dev_apply(spi_dev_t *hw, spi_nodma_device_t *dev)
+{
+    hw->clock.val=dev->regs.clock;
+    hw->ctrl.val=(hw->ctrl.val & ~(SPI_RD_BIT_ORDER|SPI_WR_BIT_ORDER)) | dev->regs.ctrl;
+    hw->ctrl2.val=dev->regs.ctrl2;
+    hw->user.val=(hw->user.val & ~SPI_NODMA_USER_DEV_MASK) | dev->regs.user;
+    hw->user1.val=dev->regs.user1;
+    hw->user2.val=dev->regs.user2;
+    hw->pin.val=(hw->pin.val & ~SPI_NODMA_PIN_DEV_MASK) | dev->regs.pin;
+}
+
+// Set the number of lines used in the address and data phases from the transaction's SPI_TRANS_MODE_x flags
+// Outside of DIO/QIO transactions the hw is kept in 1-bit mode
+//-------------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_nodma_set_io_mode(spi_dev_t *hw, uint32_t flags)
+{
+    hw->ctrl.val &= ~(SPI_FREAD_DUAL|SPI_FREAD_QUAD|SPI_FREAD_DIO|SPI_FREAD_QIO);
+    hw->user.val &= ~(SPI_FWRITE_DUAL|SPI_FWRITE_QUAD|SPI_FWRITE_DIO|SPI_FWRITE_QIO);
+    if (flags & SPI_TRANS_MODE_DIO) {
+        if (flags & SPI_TRANS_MODE_DIOQIO_ADDR) {
+            hw->ctrl.fread_dio=1;
+            hw->user.fwrite_dio=1;
+        } else {
+            hw->ctrl.fread_dual=1;
+            hw->user.fwrite_dual=1;
+        }
+        hw->ctrl.fastrd_mode=1;
+    } else if (flags & SPI_TRANS_MODE_QIO) {
+        if (flags & SPI_TRANS_MODE_DIOQIO_ADDR) {
+            hw->ctrl.fread_qio=1;
+            hw->user.fwrite_qio=1;
+        } else {
+            hw->ctrl.fread_quad=1;
+            hw->user.fwrite_quad=1;
+        }
+        hw->ctrl.fastrd_mode=1;
+    }
+}
+
 //If a transaction is smaller than or equal to of bits, we do not use DMA; instead, we directly copy/paste
 //bits from/to the work registers. Keep between 32 and (8*32) please.
 #define THRESH_DMA_TRANS (8*32)
 
+//Maximum number of bytes one dma descriptor can transfer, kept word aligned
+#define SPI_MAX_DMA_LEN (4096-4)
+
+/*
+ Fill the chain of dma descriptors to transfer 'len' bytes from/to 'data'.
+ If 'loop' is set, the last descriptor points back to the first one, so the data are transferred repeatedly
+ until the spi transaction is finished.
+ Returns the number of descriptors used.
+*/
+//-----------------------------------------------------------------------------------------
+static int IRAM_ATTR spi_dma_chain(lldesc_t *desc, const uint8_t *data, int len, int loop)
+{
+    int n=0;
+    int chunk;
+
+    while (len > 0) {
+        chunk=(len > SPI_MAX_DMA_LEN) ? SPI_MAX_DMA_LEN : len;
+        desc[n].size=chunk;
+        desc[n].length=chunk;
+        desc[n].buf=(uint8_t*)data;
+        desc[n].eof=0;
+        desc[n].sosf=0;
+        desc[n].owner=1;
+        desc[n].qe.stqe_next=&desc[n+1];
+        len-=chunk;
+        data+=chunk;
+        n++;
+    }
+    if (loop) {
+        desc[n-1].qe.stqe_next=&desc[0];
+    } else {
+        desc[n-1].eof=1;
+        desc[n-1].qe.stqe_next=NULL;
+    }
+    return n;
+}
+
+//Number of dma descriptors needed for the queued transaction
+//------------------------------------------------------------
+static int spi_dma_desc_count(spi_nodma_transaction_t *trans)
+{
+    int n=0;
+    int rxlength=(trans->rxlength==0) ? trans->length : trans->rxlength;
+
+    if ((trans->rx_buffer || (trans->flags & SPI_TRANS_USE_RXDATA)) && rxlength > THRESH_DMA_TRANS) {
+        n+=(((rxlength+7)/8)+SPI_MAX_DMA_LEN-1)/SPI_MAX_DMA_LEN;
+    }
+    if ((trans->tx_buffer || (trans->flags & SPI_TRANS_USE_TXDATA)) && trans->length > THRESH_DMA_TRANS) {
+        if (trans->flags & SPI_TRANS_REPEAT_TX) n+=(trans->txpattern_size+SPI_MAX_DMA_LEN-1)/SPI_MAX_DMA_LEN;
+        else n+=(((trans->length+7)/8)+SPI_MAX_DMA_LEN-1)/SPI_MAX_DMA_LEN;
+    }
+    return n;
+}
+
+// Enable or disable the host's spi interrupt, the driver keeps track of its state
+//-------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_nodma_intr_set(spi_nodma_host_t *host, int enable)
+{
+    host->intr_enabled=enable;
+    if (enable) esp_intr_enable(host->intr);
+    else esp_intr_disable(host->intr);
+}
+
+// Disable the spi interrupt while the state used by the interrupt is accessed, returns the previous state
+// to be restored by spi_nodma_intr_restore; an interrupt which was off is not enabled on a stale 'trans_done'
+//--------------------------------------------------------------
+static inline int IRAM_ATTR spi_nodma_intr_suspend(spi_nodma_host_t *host)
+{
+    int enabled=host->intr_enabled;
+    spi_nodma_intr_set(host, 0);
+    return enabled;
+}
+
+//-------------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_nodma_intr_restore(spi_nodma_host_t *host, int enabled)
+{
+    if (enabled) spi_nodma_intr_set(host, 1);
+}
+
+// The device left selected after an interrupt transfer deactivated its software CS, other devices'
+// queued transactions held back by the interrupt can be sent
+//----------------------------------------------------------------
+static inline void IRAM_ATTR spi_async_release(spi_nodma_host_t *host)
+{
+    if (host->async.hold == NULL) return;
+    host->async.hold=NULL;
+    host->hw->slave.trans_done=1;
+    spi_nodma_intr_set(host, 1);
+}
+
+// Start the hw transfer from the spi interrupt, counted in device's interrupt counters
+//-----------------------------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_nodma_kick_isr(spi_nodma_device_t *dev, uint32_t txbytes, uint32_t rxbytes)
+{
+    SPI_NODMA_STAT(dev->isr_stats.tx_bytes+=txbytes; dev->isr_stats.rx_bytes+=rxbytes; dev->isr_stats.kicks++);
+    dev->host->hw->cmd.usr=1;
+}
+
+// Start the next transfer of the direct mode transaction executed from interrupt (spi_nodma_transfer_data_async)
+// Data are transmitted from alternating halves of the hw spi buffer, the next half is filled while the current is sent
+// Returns 1 if the transfer was started, 0 if the transaction is finished
+//-------------------------------------------------------
+static int IRAM_ATTR spi_async_next(spi_nodma_host_t *host)
+{
+    spi_nodma_async_t *as=&host->async;
+    uint32_t size;
+
+    if (as->rxchunk) {
+        //Get the data received in the previous transfer
+        spi_nodma_buf_drain(host->hw->data_buf, as->rxbuf, as->rxchunk);
+        as->rxbuf+=as->rxchunk;
+        as->rxleft-=as->rxchunk;
+        as->rxchunk=0;
+    }
+    if (as->nextbits) {
+        //Send the prefilled half of the hw spi buffer
+        host->hw->user.usr_mosi_highpart=as->half;
+        host->hw->mosi_dlen.usr_mosi_dbitlen=as->nextbits-1;
+        spi_nodma_kick_isr(as->dev, as->nextbits/8, 0);
+        as->half^=1;
+        as->nextbits=0;
+        //Fill the other half while sending
+        if (as->txleft) {
+            size=(as->txleft > SPI_NODMA_STREAM_BUF_SIZE) ? SPI_NODMA_STREAM_BUF_SIZE : as->txleft;
+            spi_nodma_buf_fill(&host->hw->data_buf[as->half*8], as->txbuf, size);
+            as->txbuf+=size;
+            as->txleft-=size;
+            as->nextbits=size*8;
+        }
+        return 1;
+    }
+    if (as->rxleft) {
+        //Receive after all data are sent
+        size=(as->rxleft > SPI_NODMA_HWBUF_SIZE) ? SPI_NODMA_HWBUF_SIZE : as->rxleft;
+        host->hw->user.usr_mosi=0;
+        host->hw->user.usr_miso=1;
+        host->hw->user.usr_mosi_highpart=0;
+        host->hw->miso_dlen.usr_miso_dbitlen=(size*8)-1;
+        spi_nodma_kick_isr(as->dev, 0, size);
+        as->rxchunk=size;
+        return 1;
+    }
+    return 0;
+}
+
+// Choose the device whose queued transaction is sent next, according to the host's scheduling policy
+// The device used for the last transaction is preferred while the policy allows it, to avoid bus reconfiguration
+// Returns the device slot or -1 if no transaction is waiting
+//---------------------------------------------------
+static int IRAM_ATTR spi_sched_next(spi_nodma_host_t *host)
+{
+    spi_nodma_sched_t *sc=&host->sched;
+    spi_nodma_transaction_t *trans;
+    spi_nodma_device_t *dev;
+    uint32_t now=xthal_get_ccount();
+    int32_t key, best_key=0;
+    int best=-1, cur=-1, overdue=0;
+
+    for (int i=0; i<NO_DEV; i++) {
+        dev=host->device[i];
+        if (dev==NULL) continue;
+        if (!xQueuePeekFromISR(dev->trans_queue, &trans)) continue;
+        if (sc->policy==SPI_SCHED_LOW_CS_FIRST) return i;
+
+        if (sc->policy==SPI_SCHED_ROUND_ROBIN) {
+            //Distance from the last served device
+            key=(i+NO_DEV-1-host->cur_device) % NO_DEV;
+        } else if (sc->policy==SPI_SCHED_PRIORITY) {
+            key=-(int32_t)dev->cfg.priority;
+        } else if (sc->policy==SPI_SCHED_WEIGHTED_FAIR) {
+            //Device which was idle can not use the bus time it did not use
+            if ((int32_t)(dev->vtime - sc->vclock) < 0) dev->vtime=sc->vclock;
+            key=dev->vtime - sc->vclock;
+        } else {
+            //Time left to the deadline
+            key=(trans->queued_time + dev->deadline_cycles) - now;
+            if ((key < 0) && (i != host->cur_device)) overdue=1;
+        }
+        if (i==host->cur_device) cur=i;
+        if ((best < 0) || (key < best_key)) {
+            best=i;
+            best_key=key;
+        }
+    }
+
+    if ((cur >= 0) && (cur != best) && (sc->run < sc->max_run)) {
+        //Stay on the current device if allowed
+        if (sc->policy==SPI_SCHED_PRIORITY) {
+            if (host->device[cur]->cfg.priority == host->device[best]->cfg.priority) best=cur;
+        } else if (sc->policy==SPI_SCHED_DEADLINE) {
+            if (!overdue) best=cur;
+        } else {
+            best=cur;
+        }
+    }
+    if (best < 0) return -1;
+
+    if (best==host->cur_device) sc->run++;
+    else sc->run=1;
+    return best;
+}
+
+// Update device's scheduling and wait time data for the transaction taken from the queue
+//---------------------------------------------------------------------------------------------------------------
+static void IRAM_ATTR spi_sched_account(spi_nodma_host_t *host, spi_nodma_device_t *dev, spi_nodma_transaction_t *trans)
+{
+    uint32_t wait=xthal_get_ccount() - trans->queued_time;
+    uint32_t bits=0;
+
+    dev->wait_count++;
+    dev->wait_total+=wait;
+    if (wait > dev->wait_max) dev->wait_max=wait;
+
+    if (host->sched.policy==SPI_SCHED_WEIGHTED_FAIR) {
+        if (trans->tx_buffer || (trans->flags & SPI_TRANS_USE_TXDATA)) bits+=trans->length;
+        if (trans->rx_buffer || (trans->flags & SPI_TRANS_USE_RXDATA)) bits+=trans->rxlength;
+        host->sched.vclock=dev->vtime;
+        dev->vtime+=bits / ((dev->cfg.weight) ? dev->cfg.weight : 1);
+    }
+}
+
+#if SPI_NODMA_CAPTURE
+// Capture ring, shared by all hosts; records are claimed lock-free by the tasks and the spi interrupts
+static spi_nodma_capture_rec_t spi_capture[SPI_NODMA_CAPTURE_SIZE];
+static volatile uint32_t spi_capture_next = 0;     // sequence number of the next record
+static volatile uint32_t spi_capture_first = 0;    // sequence number of the first record of the capture
+static volatile uint8_t spi_capture_on = 0;
+
+// Claim the next record of the capture ring and fill it from the transaction, returns NULL if not capturing
+//-------------------------------------------------------------------------------------------------------------------------------
+static spi_nodma_capture_rec_t IRAM_ATTR *spi_capture_begin(spi_nodma_device_t *dev, spi_nodma_transaction_t *trans,
+        const uint8_t *txbuffer, uint32_t txbits, uint32_t rxbits, uint8_t kind)
+{
+    if (!spi_capture_on) return NULL;
+    uint32_t seq=__sync_fetch_and_add(&spi_capture_next, 1);
+    spi_nodma_capture_rec_t *rec=&spi_capture[seq % SPI_NODMA_CAPTURE_SIZE];
+    uint32_t ndata=(txbuffer) ? (txbits+7)/8 : 0;
+
+    //The repeated pattern may be shorter than the data
+    if ((trans->flags & SPI_TRANS_REPEAT_TX) && (ndata > trans->txpattern_size)) ndata=trans->txpattern_size;
+    if (ndata > SPI_NODMA_CAPTURE_DATA) ndata=SPI_NODMA_CAPTURE_DATA;
+    rec->seq=seq;
+    rec->clock_hz=dev->regs.eff_clk;
+    rec->dev_flags=dev->cfg.flags;
+    rec->txbits=(txbuffer) ? txbits : 0;
+    rec->rxbits=rxbits;
+    rec->address=trans->address;
+    rec->command=trans->command;
+    rec->flags=trans->flags;
+    rec->host=dev->host_dev;
+    rec->dev=dev->cs;
+    rec->kind=kind;
+    rec->ndata=ndata;
+    rec->command_bits=dev->cfg.command_bits;
+    rec->address_bits=dev->cfg.address_bits;
+    rec->dummy_bits=dev->cfg.dummy_bits;
+    if (ndata) memcpy(rec->data, txbuffer, ndata);
+    rec->start=xthal_get_ccount();
+    rec->end=rec->start;
+    return rec;
+}
+
+// The transaction of the record is finished; the record is not changed if it was reused meanwhile
+//-------------------------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_capture_end(spi_nodma_capture_rec_t *rec, uint32_t seq)
+{
+    if ((rec) && (rec->seq == seq)) rec->end=xthal_get_ccount();
+}
+#endif
+
 //This is run in interrupt context and apart from initialization and destruction, this is the only code
 //touching the host (=spihost[x]) variable. The rest of the data arrives in queues. That is why there are
 //no muxes in this code.
@@ -536,6 +1085,31 @@ static void IRAM_ATTR spi_intr(void *arg)
 
     //Ignore all but the trans_done int.
     if (!host->hw->slave.trans_done) return;
+#if SPI_NODMA_STATS
+    uint32_t t_entry=xthal_get_ccount();
+    host->stats.intr_count++;
+#endif
+
+    if (host->async.trans) {
+        //Direct mode transaction executed from interrupt
+        host->hw->slave.trans_done=0; //clear int bit
+        //Command, address and dummy phases are only sent before the first data
+        host->hw->user.val &= ~(SPI_USR_COMMAND|SPI_USR_ADDR|SPI_USR_DUMMY);
+        if (spi_async_next(host)) {
+            SPI_NODMA_STAT(host->stats.intr_cycles+=xthal_get_ccount()-t_entry);
+            return;
+        }
+
+        //Transaction is done; restore the device settings
+        host->hw->user.val=host->async.user_val;
+        if (host->async.dev->cfg.post_cb) host->async.dev->cfg.post_cb(host->async.trans);
+        //The device stays selected; while its software CS is active, only its own queued transactions may be sent
+        if ((host->async.dev->cfg.spics_io_num < 0) && (host->async.dev->cfg.selected)) host->async.hold=host->async.dev;
+        host->async.trans=NULL;
+        xSemaphoreGiveFromISR(host->async.done, &do_yield);
+        //Continue with the queued transactions, if any
+        host->hw->slave.trans_done=1;
+    }
 
     if (host->cur_trans) {
         //Okay, transaction is done.
@@ -547,30 +1121,49 @@ static void IRAM_ATTR spi_intr(void *arg)
             } else {
                 data=(uint32_t*)host->cur_trans->rx_buffer;
             }
-            for (int x=0; x < host->cur_trans->rxlength; x+=32) {
-                //Do a memcpy to get around possible alignment issues in rx_buffer
-                uint32_t word=host->hw->data_buf[x/32];
-                memcpy(&data[x/32], &word, 4);
-            }
+            //Only the bytes holding 'rxlength' bits are written, the length does not have to be a multiple of 32
+            spi_nodma_buf_drain(host->hw->data_buf, (uint8_t*)data, (host->cur_trans->rxlength+7)/8);
         }
+#if SPI_NODMA_CAPTURE
+        spi_capture_end(host->capture, host->capture_seq);
+        host->capture=NULL;
+#endif
+        //Back to 1-bit mode for the direct mode transfers
+        if (host->cur_trans->flags & (SPI_TRANS_MODE_DIO|SPI_TRANS_MODE_QIO)) spi_nodma_set_io_mode(host->hw, 0);
+        spi_nodma_device_t *dev=host->device[host->cur_device];
         //Call post-transaction callback, if any
-        if (host->device[host->cur_device]->cfg.post_cb) host->device[host->cur_device]->cfg.post_cb(host->cur_trans);
+        if (dev->cfg.post_cb) dev->cfg.post_cb(host->cur_trans);
+        if (host->cur_trans->flags & (SPI_TRANS_NOTIFY|SPI_TRANS_NO_RESULT)) {
+            //Completion without the result queue
+            __sync_fetch_and_sub(&dev->inflight, 1);
+            if (host->cur_trans->flags & SPI_TRANS_NOTIFY) {
+                //Count first, then check for the waiting task (it checks the count after it sets the request);
+                //the task is notified once, when all transactions it waits for are finished
+                uint32_t done=__sync_add_and_fetch(&dev->notify_done, 1);
+                TaskHandle_t task=dev->notify_task;
+                if ((task) && (done >= dev->notify_at) && (__sync_bool_compare_and_swap(&dev->notify_task, task, NULL))) {
+                    vTaskNotifyGiveFromISR(task, &do_yield);
+                }
+            }
+        }
         //Return transaction descriptor.
-        xQueueSendFromISR(host->device[host->cur_device]->ret_queue, &host->cur_trans, &do_yield);
+        else xQueueSendFromISR(dev->ret_queue, &host->cur_trans, &do_yield);
         host->cur_trans=NULL;
         prevCs=host->cur_device;
     }
-    //ToDo: This is a stupidly simple low-cs-first priority scheme. Make this configurable somehow. - JD
-    for (i=0; i<NO_DEV; i++) {
-        if (host->device[i]) {
-            r=xQueueReceiveFromISR(host->device[i]->trans_queue, &trans, &do_yield);
-            //Stop looking if we have a transaction to send.
-            if (r) break;
-        }
+    //Get the next transaction according to the scheduling policy
+    i=spi_sched_next(host);
+    if ((i >= 0) && (host->async.hold) && (host->device[i] != host->async.hold)) {
+        //Other device's transaction; the interrupt is enabled again when the device is deselected
+        i=-1;
+    }
+    if (i >= 0) {
+        r=xQueueReceiveFromISR(host->device[i]->trans_queue, &trans, &do_yield);
+        if (!r) i=-1;
     }
-    if (i==NO_DEV) {
+    if (i < 0) {
         //No packet waiting. Disable interrupt.
-        esp_intr_disable(host->intr);
+        spi_nodma_intr_set(host, 0);
     } else {
         host->hw->slave.trans_done=0; //clear int bit
         //We have a transaction. Send it.
@@ -584,78 +1177,13 @@ static void IRAM_ATTR spi_intr(void *arg)
         if (trans->rxlength==0) {
             trans->rxlength=trans->length;
         }
+        spi_sched_account(host, dev, trans);
 
-        //Reconfigure according to device settings, but only if we change CSses.
-        if (i!=prevCs) {
-			//Assumes a hardcoded 80MHz Fapb for now. ToDo: figure out something better once we have clock scaling working.
-            int apbclk=APB_CLK_FREQ;
-
-            //Speeds >=40MHz over GPIO matrix needs a dummy cycle, but these don't work for full-duplex connections.
-            if (((dev->cfg.flags & SPI_DEVICE_HALFDUPLEX) == 0) && (dev->cfg.clock_speed_hz > ((apbclk*2)/5)) && (!host->no_gpio_matrix)) {
-                // set speed to 32 MHz
-                dev->cfg.clock_speed_hz = (apbclk*2)/5;
-            }
-
-            int effclk=spi_set_clock(host->hw, apbclk, dev->cfg.clock_speed_hz, dev->cfg.duty_cycle_pos);
-            //Configure bit order
-            host->hw->ctrl.rd_bit_order=(dev->cfg.flags & SPI_DEVICE_RXBIT_LSBFIRST)?1:0;
-            host->hw->ctrl.wr_bit_order=(dev->cfg.flags & SPI_DEVICE_TXBIT_LSBFIRST)?1:0;
-
-            //Configure polarity
-            //SPI iface needs to be configured for a delay in some cases.
-            int nodelay=0;
-            int extra_dummy=0;
-            if (host->no_gpio_matrix) {
-                if (effclk >= apbclk/2) {
-                    nodelay=1;
-                }
-            } else {
-                if (effclk >= apbclk/2) {
-                    nodelay=1;
-                    extra_dummy=1;          //Note: This only works on half-duplex connections. spi_bus_add_device checks for this.
-                } else if (effclk >= apbclk/4) {
-                    nodelay=1;
-                }
-            }
-
-            if (dev->cfg.mode==0) {
-                host->hw->pin.ck_idle_edge=0;
-                host->hw->user.ck_out_edge=0;
-                host->hw->ctrl2.miso_delay_mode=nodelay?0:2;
-            } else if (dev->cfg.mode==1) {
-                host->hw->pin.ck_idle_edge=0;
-                host->hw->user.ck_out_edge=1;
-                host->hw->ctrl2.miso_delay_mode=nodelay?0:1;
-            } else if (dev->cfg.mode==2) {
-                host->hw->pin.ck_idle_edge=1;
-                host->hw->user.ck_out_edge=1;
-                host->hw->ctrl2.miso_delay_mode=nodelay?0:1;
-            } else if (dev->cfg.mode==3) {
-                host->hw->pin.ck_idle_edge=1;
-                host->hw->user.ck_out_edge=0;
-                host->hw->ctrl2.miso_delay_mode=nodelay?0:2;
-            }
-
-            //Configure bit sizes, load addr and command
-            host->hw->user.usr_dummy=(dev->cfg.dummy_bits+extra_dummy)?1:0;
-            host->hw->user.usr_addr=(dev->cfg.address_bits)?1:0;
-            host->hw->user.usr_command=(dev->cfg.command_bits)?1:0;
-            host->hw->user1.usr_addr_bitlen=dev->cfg.address_bits-1;
-            host->hw->user1.usr_dummy_cyclelen=dev->cfg.dummy_bits+extra_dummy-1;
-            host->hw->user2.usr_command_bitlen=dev->cfg.command_bits-1;
-            //Configure misc stuff
-            host->hw->user.doutdin=(dev->cfg.flags & SPI_DEVICE_HALFDUPLEX)?0:1;
-            host->hw->user.sio=(dev->cfg.flags & SPI_DEVICE_3WIRE)?1:0;
-
-            host->hw->ctrl2.setup_time=dev->cfg.cs_ena_pretrans-1;
-            host->hw->user.cs_setup=dev->cfg.cs_ena_pretrans?1:0;
-            host->hw->ctrl2.hold_time=dev->cfg.cs_ena_posttrans-1;
-            host->hw->user.cs_hold=(dev->cfg.cs_ena_posttrans)?1:0;
-
-            //Configure CS pin
-            host->hw->pin.cs0_dis=(i==0)?0:1;
-            host->hw->pin.cs1_dis=(i==1)?0:1;
-            host->hw->pin.cs2_dis=(i==2)?0:1;
+        //Reconfigure according to device settings, but only if we change CSses or the settings were recalculated.
+        if ((i!=prevCs) || (dev->regs_dirty)) {
+            dev->regs_dirty=0;
+            spi_nodma_dev_apply(host->hw, dev);
+            if (i!=prevCs) SPI_NODMA_STAT(dev->isr_stats.dev_switches++);
         }
         //Reset DMA
 		host->hw->dma_conf.val |= SPI_OUT_RST|SPI_AHBM_RST|SPI_AHBM_FIFO_RST;
@@ -663,30 +1191,11 @@ static void IRAM_ATTR spi_intr(void *arg)
         host->hw->dma_in_link.start=0;
         host->hw->dma_conf.val &= ~(SPI_OUT_RST|SPI_AHBM_RST|SPI_AHBM_FIFO_RST);
         //QIO/DIO
-        host->hw->ctrl.val &= ~(SPI_FREAD_DUAL|SPI_FREAD_QUAD|SPI_FREAD_DIO|SPI_FREAD_QIO);
-        host->hw->user.val &= ~(SPI_FWRITE_DUAL|SPI_FWRITE_QUAD|SPI_FWRITE_DIO|SPI_FWRITE_QIO);
-        if (trans->flags & SPI_TRANS_MODE_DIO) {
-            if (trans->flags & SPI_TRANS_MODE_DIOQIO_ADDR) {
-                host->hw->ctrl.fread_dio=1;
-                host->hw->user.fwrite_dio=1;
-            } else {
-                host->hw->ctrl.fread_dual=1;
-                host->hw->user.fwrite_dual=1;
-            }
-            host->hw->ctrl.fastrd_mode=1;
-        } else if (trans->flags & SPI_TRANS_MODE_QIO) {
-            if (trans->flags & SPI_TRANS_MODE_DIOQIO_ADDR) {
-                host->hw->ctrl.fread_qio=1;
-                host->hw->user.fwrite_qio=1;
-            } else {
-                host->hw->ctrl.fread_quad=1;
-                host->hw->user.fwrite_quad=1;
-            }
-            host->hw->ctrl.fastrd_mode=1;
-        }
+        spi_nodma_set_io_mode(host->hw, trans->flags);
 
 
-        //Fill DMA descriptors
+        //Fill DMA descriptors, receive chain first, transmit chain after it
+        int ndesc=0;
         if (trans->rx_buffer || (trans->flags & SPI_TRANS_USE_RXDATA)) {
             uint32_t *data;
             if (trans->flags & SPI_TRANS_USE_RXDATA) {
@@ -698,13 +1207,8 @@ static void IRAM_ATTR spi_intr(void *arg)
                 //No need for DMA; we'll copy the result out of the work registers directly later.
             } else {
                 host->hw->user.usr_miso_highpart=0;
-                host->dmadesc_rx.size=(trans->rxlength+7)/8;
-                host->dmadesc_rx.length=(trans->rxlength+7)/8;
-                host->dmadesc_rx.buf=(uint8_t*)data;
-                host->dmadesc_rx.eof=1;
-                host->dmadesc_rx.sosf=0;
-                host->dmadesc_rx.owner=1;
-                host->hw->dma_in_link.addr=(int)(&host->dmadesc_rx) & 0xFFFFF;
+                ndesc=spi_dma_chain(&host->dmadesc[0], (uint8_t*)data, (trans->rxlength+7)/8, 0);
+                host->hw->dma_in_link.addr=(uint32_t)(uintptr_t)(&host->dmadesc[0]) & 0xFFFFF;
                 host->hw->dma_in_link.start=1;
             }
             host->hw->user.usr_miso=1;
@@ -721,22 +1225,27 @@ static void IRAM_ATTR spi_intr(void *arg)
             }
             if (trans->length <= THRESH_DMA_TRANS) {
                 //No need for DMA.
-                for (int x=0; x < trans->length; x+=32) {
-                    //Use memcpy to get around alignment issues for txdata
-                    uint32_t word;
-                    memcpy(&word, &data[x/32], 4);
-                    host->hw->data_buf[(x/32)+8]=word;
+                if (trans->flags & SPI_TRANS_REPEAT_TX) {
+                    int nwords=trans->txpattern_size/4;
+                    for (uint32_t x=0; x < trans->length; x+=32) {
+                        //Use memcpy to get around alignment issues for txdata
+                        uint32_t word;
+                        memcpy(&word, &data[(x/32) % nwords], 4);
+                        host->hw->data_buf[(x/32)+8]=word;
+                    }
+                } else {
+                    //Only the bytes holding 'length' bits are read
+                    spi_nodma_buf_fill(&host->hw->data_buf[8], (const uint8_t*)data, (trans->length+7)/8);
                 }
                 host->hw->user.usr_mosi_highpart=1;
             } else {
                 host->hw->user.usr_mosi_highpart=0;
-                host->dmadesc_tx.size=(trans->length+7)/8;
-                host->dmadesc_tx.length=(trans->length+7)/8;
-                host->dmadesc_tx.buf=(uint8_t*)data;
-                host->dmadesc_tx.eof=1;
-                host->dmadesc_tx.sosf=0;
-                host->dmadesc_tx.owner=1;
-                host->hw->dma_out_link.addr=(int)(&host->dmadesc_tx) & 0xFFFFF;
+                if (trans->flags & SPI_TRANS_REPEAT_TX) {
+                    spi_dma_chain(&host->dmadesc[ndesc], (uint8_t*)data, trans->txpattern_size, 1);
+                } else {
+                    spi_dma_chain(&host->dmadesc[ndesc], (uint8_t*)data, (trans->length+7)/8, 0);
+                }
+                host->hw->dma_out_link.addr=(uint32_t)(uintptr_t)(&host->dmadesc[ndesc]) & 0xFFFFF;
                 host->hw->dma_out_link.start=1;
             }
         }
@@ -754,9 +1263,16 @@ static void IRAM_ATTR spi_intr(void *arg)
 
         //Call pre-transmission callback, if any
         if (dev->cfg.pre_cb) dev->cfg.pre_cb(trans);
+#if SPI_NODMA_CAPTURE
+        host->capture=spi_capture_begin(dev, trans, (trans->flags & SPI_TRANS_USE_TXDATA) ? trans->tx_data : trans->tx_buffer,
+                trans->length, (trans->rx_buffer) ? trans->rxlength : 0, SPI_CAPTURE_QUEUED);
+        if (host->capture) host->capture_seq=host->capture->seq;
+#endif
         //Kick off transfer
-        host->hw->cmd.usr=1;
+        SPI_NODMA_STAT(dev->isr_stats.queued_trans++);
+        spi_nodma_kick_isr(dev, (trans->tx_buffer) ? (trans->length+7)/8 : 0, (trans->rx_buffer) ? (trans->rxlength+7)/8 : 0);
     }
+    SPI_NODMA_STAT(host->stats.intr_cycles+=xthal_get_ccount()-t_entry);
     if (do_yield) portYIELD_FROM_ISR();
 }
 
@@ -768,10 +1284,27 @@ esp_err_t spi_device_queue_trans(spi_nodma_device_handle_t handle, spi_nodma_tra
     SPI_CHECK((trans_desc->flags & SPI_TRANS_USE_TXDATA)==0 ||trans_desc->length <= 32, "txdata transfer > 32bytes", ESP_ERR_INVALID_ARG);
     SPI_CHECK(!((trans_desc->flags & (SPI_TRANS_MODE_DIO|SPI_TRANS_MODE_QIO)) && (handle->cfg.flags & SPI_DEVICE_3WIRE)), "incompatible iface params", ESP_ERR_INVALID_ARG);
     SPI_CHECK(!((trans_desc->flags & (SPI_TRANS_MODE_DIO|SPI_TRANS_MODE_QIO)) && (!(handle->cfg.flags & SPI_DEVICE_HALFDUPLEX))), "incompatible iface params", ESP_ERR_INVALID_ARG);
+    SPI_CHECK((trans_desc->flags & SPI_TRANS_REPEAT_TX)==0 || (trans_desc->txpattern_size > 0 && (trans_desc->txpattern_size & 3)==0 && trans_desc->tx_buffer), "invalid tx pattern size", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(trans_desc->length < (1<<24) && trans_desc->rxlength < (1<<24), "transfer too long", ESP_ERR_INVALID_SIZE);
+    SPI_CHECK(spi_dma_desc_count(trans_desc) <= SPI_DMA_DESC_NUM, "not enough dma descriptors", ESP_ERR_INVALID_SIZE);
+
+    //APB clock was changed (dynamic frequency scaling), the clock divider must be recalculated; the device
+    //need not be selected for queued transactions, so it is done here, with the interrupt suspended
+    if (handle->regs.apb_clk != (uint32_t)SPI_NODMA_APB_FREQ()) {
+        int intr_en=spi_nodma_intr_suspend(handle->host);
+        spi_nodma_dev_regs(handle);
+        handle->regs_dirty=1;
+        spi_nodma_intr_restore(handle->host, intr_en);
+    }
 
+    trans_desc->queued_time=xthal_get_ccount();
+    __sync_fetch_and_add(&handle->inflight, 1);
 	r=xQueueSend(handle->trans_queue, (void*)&trans_desc, ticks_to_wait);
-    if (!r) return ESP_ERR_TIMEOUT;
-    esp_intr_enable(handle->host->intr);
+    if (!r) {
+        __sync_fetch_and_sub(&handle->inflight, 1);
+        return ESP_ERR_TIMEOUT;
+    }
+    spi_nodma_intr_set(handle->host, 1);
     return ESP_OK;
 }
 
@@ -781,202 +1314,642 @@ esp_err_t spi_device_get_trans_result(spi_nodma_device_handle_t handle, spi_nodm
     SPI_CHECK(handle!=NULL, "invalid dev handle", ESP_ERR_INVALID_ARG);
     r=xQueueReceive(handle->ret_queue, (void*)trans_desc, ticks_to_wait);
     if (!r) return ESP_ERR_TIMEOUT;
+    __sync_fetch_and_sub(&handle->inflight, 1);
     return ESP_OK;
 }
 
-//Porcelain to do one blocking transmission.
-esp_err_t spi_device_transmit(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans_desc)
+//------------------------------------------------------------------------------------------------------------
+esp_err_t IRAM_ATTR spi_nodma_trans_wait(spi_nodma_device_handle_t handle, uint32_t count, TickType_t ticks_to_wait)
 {
-    esp_err_t ret;
-    spi_nodma_transaction_t *ret_trans;
-    //ToDo: check if any spi transfers in flight
-    ret=spi_device_queue_trans(handle, trans_desc, portMAX_DELAY);
-    if (ret!=ESP_OK) return ret;
-    ret=spi_device_get_trans_result(handle, &ret_trans, portMAX_DELAY);
-    if (ret!=ESP_OK) return ret;
-    assert(ret_trans==trans_desc);
+    SPI_CHECK(handle!=NULL, "invalid dev handle", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(count>0, "invalid count", ESP_ERR_INVALID_ARG);
+    TaskHandle_t task=xTaskGetCurrentTaskHandle();
+
+    while (handle->notify_done < count) {
+        //Set the request, then check the count again (the interrupt counts first, then checks the request)
+        handle->notify_at=count;
+        __sync_synchronize();
+        handle->notify_task=task;
+        __sync_synchronize();
+        if ((handle->notify_done < count) && (ulTaskNotifyTake(pdTRUE, ticks_to_wait))) continue;
+        //Finished meanwhile or timeout; if the interrupt already took the request, its notification is consumed
+        if (!__sync_bool_compare_and_swap(&handle->notify_task, task, NULL)) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (handle->notify_done < count) return ESP_ERR_TIMEOUT;
+    }
+    __sync_fetch_and_sub(&handle->notify_done, count);
     return ESP_OK;
 }
 
-
-
-//--------------------------------------------------------------------------------------
-esp_err_t IRAM_ATTR spi_nodma_device_select(spi_nodma_device_handle_t handle, int force)
+//---------------------------------------------------------------------------------------------------
+esp_err_t spi_nodma_trans_pool_init(spi_nodma_device_handle_t handle, int count, uint32_t buf_size)
 {
-	SPI_CHECK(handle!=NULL, "invalid handle", ESP_ERR_INVALID_ARG);
-
-	if ((handle->cfg.selected == 1) && (!force)) return ESP_OK;
-
-    // Check if queued transfer is in progress
-    SPI_CHECK(uxQueueMessagesWaiting(handle->trans_queue)==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
-    SPI_CHECK(uxQueueMessagesWaiting(handle->ret_queue)==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
-
-	int i;
-	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
-
-	// find device's host bus
-	for (i=0; i<NO_DEV; i++) {
-		if (host->device[i] == handle) break;
-	}
-	SPI_CHECK(i != NO_DEV, "invalid dev handle", ESP_ERR_INVALID_ARG);
-
-	if (!(xSemaphoreTake(host->spi_nodma_bus_mutex, SPI_SEMAPHORE_WAIT))) return ESP_ERR_INVALID_STATE;
-
-	// Check if previously used device's bus device is the same
-	if (memcmp(&host->cur_bus_config, &handle->bus_config, sizeof(spi_nodma_bus_config_t)) != 0) {
-		// device has different bus configuration, we need to reconfigure the bus
-		esp_err_t err = spi_nodma_bus_free(1, 0);
-		if (err) {
-			xSemaphoreGive(host->spi_nodma_bus_mutex);
-			return err;
-		}
-		err = spi_nodma_bus_initialize(i, &handle->bus_config, -1);
-		if (err) {
-			xSemaphoreGive(host->spi_nodma_bus_mutex);
-			return err;
-		}
-	}
-
-	//Reconfigure according to device settings, but only if the device changed or forced.
-	if ((force) || (host->device[host->cur_device] != handle)) {
-	    //Assumes a hardcoded 80MHz Fapb for now. ToDo: figure out something better once we have clock scaling working.
-		int apbclk=APB_CLK_FREQ;
-
-	    //Speeds >=40MHz over GPIO matrix needs a dummy cycle, but these don't work for full-duplex connections.
-	    if (((handle->cfg.flags & SPI_DEVICE_HALFDUPLEX) == 0) && (handle->cfg.clock_speed_hz > ((apbclk*2)/5)) && (!host->no_gpio_matrix)) {
-	    	// set speed to 32 MHz
-	    	handle->cfg.clock_speed_hz = (apbclk*2)/5;
-	    }
-
-		int effclk=spi_set_clock(host->hw, apbclk, handle->cfg.clock_speed_hz, handle->cfg.duty_cycle_pos);
-		//Configure bit order
-		host->hw->ctrl.rd_bit_order=(handle->cfg.flags & SPI_DEVICE_RXBIT_LSBFIRST)?1:0;
-		host->hw->ctrl.wr_bit_order=(handle->cfg.flags & SPI_DEVICE_TXBIT_LSBFIRST)?1:0;
-		
-		//Configure polarity
-        //SPI iface needs to be configured for a delay in some cases.
-		int nodelay=0;
-        int extra_dummy=0;
-        if (host->no_gpio_matrix) {
-            if (effclk >= apbclk/2) {
-                nodelay=1;
-            }
-        } else {
-            if (effclk >= apbclk/2) {
-                nodelay=1;
-                extra_dummy=1;          //Note: This only works on half-duplex connections. spi_nodma_bus_add_device checks for this.
-            } else if (effclk >= apbclk/4) {
-                nodelay=1;
-            }
+    spi_nodma_trans_pool_t *pool;
+    SPI_CHECK(handle!=NULL, "invalid dev handle", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(count>0 && count<=SPI_NODMA_POOL_MAX, "invalid pool size", ESP_ERR_INVALID_ARG);
+    pool=&handle->pool;
+    SPI_CHECK(pool->items==NULL, "pool already created", ESP_ERR_INVALID_STATE);
+
+    //Staging buffers are word aligned, so they can be used by dma
+    buf_size=(buf_size+3) & ~3;
+    spi_nodma_pool_item_t *items=malloc(count*sizeof(spi_nodma_pool_item_t));
+    if (items==NULL) return ESP_ERR_NO_MEM;
+    memset(items, 0, count*sizeof(spi_nodma_pool_item_t));
+    if (buf_size) {
+        pool->bufs=pvPortMallocCaps(count*buf_size, MALLOC_CAP_DMA);
+        if (pool->bufs==NULL) {
+            free(items);
+            return ESP_ERR_NO_MEM;
         }
-		if (handle->cfg.mode==0) {
-			host->hw->pin.ck_idle_edge=0;
-			host->hw->user.ck_out_edge=0;
-			host->hw->ctrl2.miso_delay_mode=nodelay?0:2;
-		} else if (handle->cfg.mode==1) {
-			host->hw->pin.ck_idle_edge=0;
-			host->hw->user.ck_out_edge=1;
-			host->hw->ctrl2.miso_delay_mode=nodelay?0:1;
-		} else if (handle->cfg.mode==2) {
-			host->hw->pin.ck_idle_edge=1;
-			host->hw->user.ck_out_edge=1;
-			host->hw->ctrl2.miso_delay_mode=nodelay?0:1;
-		} else if (handle->cfg.mode==3) {
-			host->hw->pin.ck_idle_edge=1;
-			host->hw->user.ck_out_edge=0;
-			host->hw->ctrl2.miso_delay_mode=nodelay?0:2;
-		}
-
-		//Configure bit sizes, load addr and command
-		host->hw->user.usr_dummy=(handle->cfg.dummy_bits+extra_dummy)?1:0;
-		host->hw->user.usr_addr=(handle->cfg.address_bits)?1:0;
-		host->hw->user.usr_command=(handle->cfg.command_bits)?1:0;
-		host->hw->user1.usr_addr_bitlen=handle->cfg.address_bits-1;
-		host->hw->user1.usr_dummy_cyclelen=handle->cfg.dummy_bits+extra_dummy-1;
-		host->hw->user2.usr_command_bitlen=handle->cfg.command_bits-1;
-		//Configure misc stuff
-		host->hw->user.doutdin=(handle->cfg.flags & SPI_DEVICE_HALFDUPLEX)?0:1;
-		host->hw->user.sio=(handle->cfg.flags & SPI_DEVICE_3WIRE)?1:0;
-
-		host->hw->ctrl2.setup_time=handle->cfg.cs_ena_pretrans-1;
-		host->hw->user.cs_setup=handle->cfg.cs_ena_pretrans?1:0;
-		host->hw->ctrl2.hold_time=handle->cfg.cs_ena_posttrans-1;
-		host->hw->user.cs_hold=(handle->cfg.cs_ena_posttrans)?1:0;
-
-		//Configure CS pin
-		host->hw->pin.cs0_dis=(i==0)?0:1;
-		host->hw->pin.cs1_dis=(i==1)?0:1;
-		host->hw->pin.cs2_dis=(i==2)?0:1;
-		
-		host->cur_device = i;
-	}
+        for (int i=0; i<count; i++) items[i].buf=pool->bufs+(i*buf_size);
+    }
+    pool->count=count;
+    pool->buf_size=buf_size;
+    pool->free=(count==32) ? 0xFFFFFFFF : ((1UL<<count)-1);
+    pool->items=items;
+    return ESP_OK;
+}
 
-	if ((handle->cfg.spics_io_num < 0) && (handle->cfg.spics_ext_io_num > 0)) {
-		gpio_set_level(handle->cfg.spics_ext_io_num, 0);
-	}
+//-------------------------------------------------------------------------------------------
+spi_nodma_transaction_t IRAM_ATTR *spi_nodma_trans_get(spi_nodma_device_handle_t handle)
+{
+    spi_nodma_trans_pool_t *pool=&handle->pool;
+    uint32_t free_mask;
+    int i;
 
-	handle->cfg.selected = 1;
+    if (pool->items==NULL) return NULL;
+    //Take the lowest free descriptor; retried if another task or the interrupt took or returned one meanwhile
+    do {
+        free_mask=pool->free;
+        if (free_mask==0) return NULL;
+        i=__builtin_ctz(free_mask);
+    } while (!__sync_bool_compare_and_swap(&pool->free, free_mask, free_mask & ~(1UL<<i)));
+
+    //Only the fields the driver reads are cleared
+    spi_nodma_transaction_t *trans=&pool->items[i].trans;
+    trans->flags=0;
+    trans->command=0;
+    trans->address=0;
+    trans->length=0;
+    trans->rxlength=0;
+    trans->user=NULL;
+    trans->tx_buffer=pool->items[i].buf;
+    trans->rx_buffer=NULL;
+    trans->txpattern_size=0;
+    return trans;
+}
 
-	return ESP_OK;
+//-------------------------------------------------------------
+void IRAM_ATTR *spi_nodma_trans_buffer(spi_nodma_transaction_t *trans)
+{
+    return ((spi_nodma_pool_item_t *)trans)->buf;
 }
 
-//-----------------------------------------------------------------------------
-esp_err_t IRAM_ATTR spi_nodma_device_deselect(spi_nodma_device_handle_t handle)
+//----------------------------------------------------------------------------------------------
+void IRAM_ATTR spi_nodma_trans_put(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans)
 {
-	SPI_CHECK(handle!=NULL, "invalid handle", ESP_ERR_INVALID_ARG);
+    int i=(spi_nodma_pool_item_t *)trans - handle->pool.items;
+    if ((i<0) || (i>=(int)handle->pool.count)) return;
+    __sync_fetch_and_or(&handle->pool.free, 1UL<<i);
+}
 
-	if (handle->cfg.selected == 0) return ESP_OK;
+//----------------------------------------------------------------------------------------------------------------
+esp_err_t spi_nodma_set_sched_policy(spi_nodma_host_device_t host, spi_nodma_sched_policy_t policy, int max_run)
+{
+    SPI_CHECK(host>=SPI_HOST && host<=VSPI_HOST, "invalid host", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(spihost[host]!=NULL, "host not in use", ESP_ERR_INVALID_STATE);
+    SPI_CHECK(policy>=SPI_SCHED_LOW_CS_FIRST && policy<=SPI_SCHED_DEADLINE, "invalid policy", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(max_run>=0, "invalid max run", ESP_ERR_INVALID_ARG);
+
+    if (max_run == 0) max_run = SPI_SCHED_MAX_RUN;
+    //The scheduler state is used from spi interrupt
+    int intr=spi_nodma_intr_suspend(spihost[host]);
+    spihost[host]->sched.policy = policy;
+    spihost[host]->sched.max_run = max_run;
+    spihost[host]->sched.run = 0;
+    spihost[host]->sched.vclock = 0;
+    for (int i=0; i<NO_DEV; i++) {
+        if (spihost[host]->device[i]) spihost[host]->device[i]->vtime = 0;
+    }
+    spi_nodma_intr_restore(spihost[host], intr);
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------------------------------------------
+esp_err_t spi_nodma_get_wait_stats(spi_nodma_device_handle_t handle, spi_nodma_wait_stats_t *stats, int reset)
+{
+    SPI_CHECK(handle!=NULL, "invalid dev handle", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(stats!=NULL, "invalid stats", ESP_ERR_INVALID_ARG);
+    uint32_t cpu_mhz = ets_get_cpu_frequency();
+
+    int intr = spi_nodma_intr_suspend(handle->host);
+    stats->count = handle->wait_count;
+    stats->max_us = handle->wait_max / cpu_mhz;
+    stats->avg_us = (handle->wait_count) ? (uint32_t)((handle->wait_total / handle->wait_count) / cpu_mhz) : 0;
+    if (reset) {
+        handle->wait_count = 0;
+        handle->wait_max = 0;
+        handle->wait_total = 0;
+    }
+    spi_nodma_intr_restore(handle->host, intr);
+    return ESP_OK;
+}
+
+// Add the counters 'src' to 'dst'
+//----------------------------------------------------------------------------------
+static void spi_nodma_counters_add(spi_nodma_counters_t *dst, spi_nodma_counters_t *src)
+{
+    dst->tx_bytes += src->tx_bytes;
+    dst->rx_bytes += src->rx_bytes;
+    dst->direct_trans += src->direct_trans;
+    dst->queued_trans += src->queued_trans;
+    dst->kicks += src->kicks;
+    dst->selects += src->selects;
+    dst->dev_switches += src->dev_switches;
+    dst->bus_reconfigs += src->bus_reconfigs;
+    dst->intr_count += src->intr_count;
+    dst->busy_wait_cycles += src->busy_wait_cycles;
+    dst->select_wait_cycles += src->select_wait_cycles;
+    dst->intr_cycles += src->intr_cycles;
+    dst->bus_timeouts += src->bus_timeouts;
+    dst->bus_yields += src->bus_yields;
+    dst->bus_hold_cycles += src->bus_hold_cycles;
+    if (src->bus_hold_max > dst->bus_hold_max) dst->bus_hold_max = src->bus_hold_max;
+    for (int i=0; i<SPI_NODMA_BUS_HIST_SIZE; i++) dst->bus_wait_hist[i] += src->bus_wait_hist[i];
+}
+
+//---------------------------------------------------------------------------------------------------------------------------
+esp_err_t spi_nodma_get_stats(spi_nodma_host_device_t host, spi_nodma_device_handle_t handle, spi_nodma_stats_t *stats)
+{
+    SPI_CHECK(stats!=NULL, "invalid stats", ESP_ERR_INVALID_ARG);
+    if (handle == NULL) {
+        SPI_CHECK(host>=SPI_HOST && host<=VSPI_HOST, "invalid host", ESP_ERR_INVALID_ARG);
+        SPI_CHECK(spihost[host]!=NULL, "host not in use", ESP_ERR_INVALID_STATE);
+    }
+    spi_nodma_host_t *h = (handle) ? handle->host : spihost[host];
+    spi_nodma_counters_t c;
+    uint32_t cpu_mhz = ets_get_cpu_frequency();
+
+    memset(&c, 0, sizeof(spi_nodma_counters_t));
+    //Counters are also updated from spi interrupt
+    int intr = spi_nodma_intr_suspend(h);
+    if (handle) {
+        spi_nodma_counters_add(&c, &handle->stats);
+        spi_nodma_counters_add(&c, &handle->isr_stats);
+    }
+    else {
+        spi_nodma_counters_add(&c, &h->stats);
+        for (int i=0; i<NO_DEV; i++) {
+            if (h->device[i]) {
+                spi_nodma_counters_add(&c, &h->device[i]->stats);
+                spi_nodma_counters_add(&c, &h->device[i]->isr_stats);
+            }
+        }
+    }
+    spi_nodma_intr_restore(h, intr);
+
+    stats->tx_bytes = c.tx_bytes;
+    stats->rx_bytes = c.rx_bytes;
+    stats->direct_trans = c.direct_trans;
+    stats->queued_trans = c.queued_trans;
+    stats->kicks = c.kicks;
+    stats->selects = c.selects;
+    stats->dev_switches = c.dev_switches;
+    stats->bus_reconfigs = c.bus_reconfigs;
+    stats->intr_count = c.intr_count;
+    stats->busy_wait_us = c.busy_wait_cycles / cpu_mhz;
+    stats->select_wait_us = c.select_wait_cycles / cpu_mhz;
+    stats->intr_us = c.intr_cycles / cpu_mhz;
+    stats->bus_timeouts = c.bus_timeouts;
+    stats->bus_yields = c.bus_yields;
+    stats->bus_hold_us = c.bus_hold_cycles / cpu_mhz;
+    stats->bus_hold_max_us = c.bus_hold_max / cpu_mhz;
+    memcpy(stats->bus_wait_hist, c.bus_wait_hist, sizeof(stats->bus_wait_hist));
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------------------------------------------
+esp_err_t spi_nodma_reset_stats(spi_nodma_host_device_t host, spi_nodma_device_handle_t handle)
+{
+    if (handle == NULL) {
+        SPI_CHECK(host>=SPI_HOST && host<=VSPI_HOST, "invalid host", ESP_ERR_INVALID_ARG);
+        SPI_CHECK(spihost[host]!=NULL, "host not in use", ESP_ERR_INVALID_STATE);
+    }
+    spi_nodma_host_t *h = (handle) ? handle->host : spihost[host];
+
+    int intr = spi_nodma_intr_suspend(h);
+    if (handle) {
+        memset(&handle->stats, 0, sizeof(spi_nodma_counters_t));
+        memset(&handle->isr_stats, 0, sizeof(spi_nodma_counters_t));
+    }
+    else {
+        memset(&h->stats, 0, sizeof(spi_nodma_counters_t));
+        for (int i=0; i<NO_DEV; i++) {
+            if (h->device[i]) {
+                memset(&h->device[i]->stats, 0, sizeof(spi_nodma_counters_t));
+                memset(&h->device[i]->isr_stats, 0, sizeof(spi_nodma_counters_t));
+            }
+        }
+    }
+    spi_nodma_intr_restore(h, intr);
+    return ESP_OK;
+}
+
+//--------------------------------------
+void spi_nodma_capture_start(int clear)
+{
+#if SPI_NODMA_CAPTURE
+    if (clear) spi_capture_first=spi_capture_next;
+    spi_capture_on=1;
+#endif
+}
+
+//---------------------------------
+void spi_nodma_capture_stop(void)
+{
+#if SPI_NODMA_CAPTURE
+    spi_capture_on=0;
+#endif
+}
+
+#if SPI_NODMA_CAPTURE
+// Sequence number of the oldest record still in the ring, returns the number of records
+//-------------------------------------------------
+static uint32_t spi_capture_range(uint32_t *first)
+{
+    uint32_t next=spi_capture_next;
+    uint32_t n=next-spi_capture_first;
+
+    if (n > SPI_NODMA_CAPTURE_SIZE) n=SPI_NODMA_CAPTURE_SIZE;
+    *first=next-n;
+    return n;
+}
+
+// Write the time stamp if the time advanced; value changes are never written back in time
+//------------------------------------------------------------------------------
+static uint64_t spi_capture_vcd_time(FILE *f, uint64_t *last, uint64_t t)
+{
+    if (t > *last) {
+        fprintf(f, "#%llu\n", (unsigned long long)t);
+        *last=t;
+    }
+    return *last;
+}
+
+// Value change dump of the records: CS of each device, SCLK and MOSI of each host, times in ns
+//------------------------------------------------------------------
+static void spi_capture_export_vcd(FILE *f, uint32_t first, uint32_t n)
+{
+    uint32_t mhz=ets_get_cpu_frequency();
+    uint32_t used[3]={0};
+    spi_nodma_capture_rec_t *rec;
+    int h, d;
+
+    for (uint32_t i=0; i<n; i++) {
+        rec=&spi_capture[(first+i) % SPI_NODMA_CAPTURE_SIZE];
+        used[rec->host] |= 1<<rec->dev;
+    }
+    fprintf(f, "$version spi_nodma capture $end\n$timescale 1ns $end\n$scope module spi $end\n");
+    for (h=0; h<3; h++) {
+        if (used[h] == 0) continue;
+        fprintf(f, "$var wire 1 s%d host%d_sclk $end\n$var wire 1 m%d host%d_mosi $end\n", h, h, h, h);
+        for (d=0; d<NO_DEV; d++) {
+            if (used[h] & (1<<d)) fprintf(f, "$var wire 1 c%d_%d host%d_cs%d $end\n", h, d, h, d);
+        }
+    }
+    fprintf(f, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+    for (h=0; h<3; h++) {
+        if (used[h] == 0) continue;
+        fprintf(f, "0s%d\n0m%d\n", h, h);
+        for (d=0; d<NO_DEV; d++) {
+            if (used[h] & (1<<d)) fprintf(f, "1c%d_%d\n", h, d);
+        }
+    }
+    fprintf(f, "$end\n");
+
+    //Cycle counts are accumulated from the differences, they can wrap around between the records
+    uint64_t cycles=0, last=0;
+    uint32_t prev=(n) ? spi_capture[first % SPI_NODMA_CAPTURE_SIZE].start : 0;
+    for (uint32_t i=0; i<n; i++) {
+        rec=&spi_capture[(first+i) % SPI_NODMA_CAPTURE_SIZE];
+        h=rec->host;
+        cycles+=(uint32_t)(rec->start - prev);
+        prev=rec->start;
+        uint64_t t=spi_capture_vcd_time(f, &last, (cycles * 1000) / mhz);
+        uint64_t tend=((cycles + (uint32_t)(rec->end - rec->start)) * 1000) / mhz;
+        uint32_t half=(rec->clock_hz) ? 500000000 / rec->clock_hz : 1;
+        if (half == 0) half=1;
+
+        fprintf(f, "0c%d_%d\n", h, rec->dev);
+        //Command, address, dummy and recorded data bits, msb first, on one line
+        uint32_t cmd=rec->command_bits, addr=cmd+rec->address_bits, dummy=addr+rec->dummy_bits;
+        uint32_t databits=rec->ndata*8;
+        if (databits > rec->txbits) databits=rec->txbits;
+        for (uint32_t b=0; b<dummy+databits; b++) {
+            int v=-1;
+            if (b < cmd) v=(rec->command >> (cmd-1-b)) & 1;
+            else if (b < addr) v=(rec->address >> (addr-1-b)) & 1;
+            else if (b >= dummy) v=(rec->data[(b-dummy)/8] >> (7-((b-dummy)%8))) & 1;
+            if (v >= 0) fprintf(f, "%dm%d\n", v, h);
+            spi_capture_vcd_time(f, &last, t+half);
+            fprintf(f, "1s%d\n", h);
+            t=spi_capture_vcd_time(f, &last, t+(2*half));
+            fprintf(f, "0s%d\n", h);
+        }
+        //Not recorded data bits, unknown clock and data until the end of the transaction
+        if ((rec->txbits > databits) || (rec->rxbits)) fprintf(f, "xs%d\nxm%d\n", h, h);
+        spi_capture_vcd_time(f, &last, (tend > t) ? tend : t);
+        fprintf(f, "0s%d\n1c%d_%d\n", h, h, rec->dev);
+    }
+}
+#endif
 
+//---------------------------------------------------------
+int spi_nodma_capture_read(spi_nodma_capture_rec_t *recs, int max)
+{
+#if SPI_NODMA_CAPTURE
+    uint32_t first;
+    uint32_t n=spi_capture_range(&first);
+
+    if ((recs == NULL) || (max <= 0)) return 0;
+    if (n > (uint32_t)max) {
+        //Only the newest records
+        first+=n-max;
+        n=max;
+    }
+    for (uint32_t i=0; i<n; i++) memcpy(&recs[i], &spi_capture[(first+i) % SPI_NODMA_CAPTURE_SIZE], sizeof(spi_nodma_capture_rec_t));
+    return n;
+#else
+    return 0;
+#endif
+}
+
+//------------------------------------------------------------------------------
+esp_err_t spi_nodma_capture_export(FILE *f, spi_nodma_capture_format_t format)
+{
+#if SPI_NODMA_CAPTURE
+    SPI_CHECK(f!=NULL, "invalid file", ESP_ERR_INVALID_ARG);
+    SPI_CHECK(format==SPI_CAPTURE_FORMAT_TEXT || format==SPI_CAPTURE_FORMAT_VCD, "invalid format", ESP_ERR_INVALID_ARG);
+    uint32_t first;
+    uint32_t n=spi_capture_range(&first);
+
+    if (format == SPI_CAPTURE_FORMAT_VCD) spi_capture_export_vcd(f, first, n);
+    else {
+        fprintf(f, "# spi_nodma capture, cpu_mhz=%u\n", (unsigned)ets_get_cpu_frequency());
+        fprintf(f, "# seq start end host dev kind clock_hz dev_flags flags command_bits command address_bits address dummy_bits txbits rxbits data\n");
+        for (uint32_t i=0; i<n; i++) {
+            spi_nodma_capture_rec_t *rec=&spi_capture[(first+i) % SPI_NODMA_CAPTURE_SIZE];
+            fprintf(f, "%u %u %u %u %u %u %u 0x%x 0x%x %u 0x%x %u 0x%llx %u %u %u ",
+                    (unsigned)rec->seq, (unsigned)rec->start, (unsigned)rec->end, rec->host, rec->dev, rec->kind,
+                    (unsigned)rec->clock_hz, (unsigned)rec->dev_flags, rec->flags, rec->command_bits, rec->command,
+                    rec->address_bits, (unsigned long long)rec->address, rec->dummy_bits, (unsigned)rec->txbits, (unsigned)rec->rxbits);
+            if (rec->ndata == 0) fprintf(f, "-");
+            for (int k=0; k<rec->ndata; k++) fprintf(f, "%02x", rec->data[k]);
+            fprintf(f, "\n");
+        }
+    }
+    return (ferror(f)) ? ESP_FAIL : ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+//Porcelain to do one blocking transmission.
+esp_err_t spi_device_transmit(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans_desc)
+{
+    esp_err_t ret;
+    spi_nodma_transaction_t *ret_trans;
+    //ToDo: check if any spi transfers in flight
+    ret=spi_device_queue_trans(handle, trans_desc, portMAX_DELAY);
+    if (ret!=ESP_OK) return ret;
+    ret=spi_device_get_trans_result(handle, &ret_trans, portMAX_DELAY);
+    if (ret!=ESP_OK) return ret;
+    assert(ret_trans==trans_desc);
+    return ESP_OK;
+}
+
+
+
+// Bucket of the bus wait time histogram for the wait of 'cycles' cpu cycles
+//------------------------------------------------------------------
+static inline uint32_t IRAM_ATTR spi_nodma_hist_bucket(uint32_t cycles)
+{
+	uint32_t us = cycles / ets_get_cpu_frequency();
+	uint32_t i = (us) ? 32 - __builtin_clz(us) : 0;
+	return (i < SPI_NODMA_BUS_HIST_SIZE) ? i : SPI_NODMA_BUS_HIST_SIZE-1;
+}
+
+// Take the bus for the device, waiting max. 'ticks'
+// The task already holding the bus for the same device only increments the nesting depth,
+// taking it for another device would switch the bus under the selected device and is refused
+//---------------------------------------------------------------------------------------------------------
+static esp_err_t IRAM_ATTR spi_nodma_bus_take(spi_nodma_host_t *host, spi_nodma_device_t *dev, TickType_t ticks)
+{
+	spi_nodma_arbiter_t *arb = &host->arb;
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	BaseType_t res;
+
+	if (arb->owner_task == task) {
+		if (arb->owner != dev) return ESP_ERR_INVALID_STATE;
+		arb->depth++;
+		return ESP_OK;
+	}
+
+#if SPI_NODMA_STATS
+	uint32_t t = xthal_get_ccount();
+#endif
+	// Waiting urgent devices are seen by the bus owner at its preemption points
+	if (dev->cfg.flags & SPI_DEVICE_BUS_URGENT) __sync_fetch_and_add(&arb->urgent, 1);
+	res = xSemaphoreTake(host->spi_nodma_bus_mutex, ticks);
+	if (dev->cfg.flags & SPI_DEVICE_BUS_URGENT) __sync_fetch_and_sub(&arb->urgent, 1);
+	if (!res) {
+		SPI_NODMA_STAT(dev->stats.bus_timeouts++);
+		return ESP_ERR_TIMEOUT;
+	}
+
+	arb->owner_task = task;
+	arb->owner = dev;
+	arb->depth = 1;
+	// The previous owner waits at its preemption point until the bus is taken
+	if (arb->yielding) {
+		arb->yielding = 0;
+		xSemaphoreGive(arb->handoff);
+	}
+#if SPI_NODMA_STATS
+	arb->taken_time = xthal_get_ccount();
+	t = arb->taken_time - t;
+	dev->stats.select_wait_cycles += t;
+	dev->stats.selects++;
+	dev->stats.bus_wait_hist[spi_nodma_hist_bucket(t)]++;
+#endif
+	return ESP_OK;
+}
+
+// Give the bus taken by the calling task; it is released when all nested takes are given
+//-------------------------------------------------------------------
+static esp_err_t IRAM_ATTR spi_nodma_bus_give(spi_nodma_host_t *host)
+{
+	spi_nodma_arbiter_t *arb = &host->arb;
+
+	if ((arb->owner_task != xTaskGetCurrentTaskHandle()) || (arb->depth == 0)) return ESP_ERR_INVALID_STATE;
+	if (--arb->depth) return ESP_OK;
+
+#if SPI_NODMA_STATS
+	uint32_t t = xthal_get_ccount() - arb->taken_time;
+	arb->owner->stats.bus_hold_cycles += t;
+	if (t > arb->owner->stats.bus_hold_max) arb->owner->stats.bus_hold_max = t;
+#endif
+	arb->owner = NULL;
+	arb->owner_task = NULL;
+	xSemaphoreGive(host->spi_nodma_bus_mutex);
+	return ESP_OK;
+}
+
+// Switch the bus to the device: reconfigure the bus if the device uses different pins, write device's registers
+//-----------------------------------------------------------------------------------------
+static esp_err_t spi_nodma_device_switch(spi_nodma_host_t *host, spi_nodma_device_t *handle)
+{
+	int i = handle->cs;
+
+	// Check if previously used device's bus pins are the same
+	if (!spi_nodma_same_pins(&host->cur_bus_config, &handle->bus_config)) {
+		// device uses different pins, only the device's host is rerouted
+		spi_nodma_bus_route(handle->host_dev, &handle->bus_config);
+		SPI_NODMA_STAT(handle->stats.bus_reconfigs++);
+	}
+
+	spi_nodma_dev_apply(host->hw, handle);
+	host->cur_device = i;
+	SPI_NODMA_STAT(handle->stats.dev_switches++);
+	return ESP_OK;
+}
+
+//--------------------------------------------------------------------------------------
+esp_err_t IRAM_ATTR spi_nodma_device_select(spi_nodma_device_handle_t handle, int force)
+{
 	SPI_CHECK(handle!=NULL, "invalid handle", ESP_ERR_INVALID_ARG);
+
+	if ((handle->cfg.selected == 1) && (!force)) return ESP_OK;
+
     // Check if queued transfer is in progress
-    SPI_CHECK(uxQueueMessagesWaiting(handle->trans_queue)==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
-    SPI_CHECK(uxQueueMessagesWaiting(handle->ret_queue)==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
+    SPI_CHECK(handle->inflight==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
 
-	int i;
 	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
 
-	for (i=0; i<NO_DEV; i++) {
-		if (host->device[i] == handle) break;
+	// Forced re-select of the selected device already holds the bus
+	esp_err_t err;
+	if (handle->cfg.selected == 0) {
+		err = spi_nodma_bus_take(host, handle, handle->bus_wait_ticks);
+		if (err) return err;
 	}
-	SPI_CHECK(i != NO_DEV, "invalid dev handle", ESP_ERR_INVALID_ARG);
-	
-	if (host->device[host->cur_device] == handle) {
-		if ((handle->cfg.spics_io_num < 0) && (handle->cfg.spics_ext_io_num > 0)) {
-			gpio_set_level(handle->cfg.spics_ext_io_num, 1);
+
+	//APB clock was changed (dynamic frequency scaling), the clock divider must be recalculated
+	if (handle->regs.apb_clk != (uint32_t)SPI_NODMA_APB_FREQ()) {
+		spi_nodma_dev_regs(handle);
+		if (host->cur_device == handle->cs) spi_nodma_dev_apply(host->hw, handle);
+	}
+
+	//Reconfigure according to device settings, but only if the device changed or forced.
+	//Re-selecting the device used last (the common case) needs no reconfiguration.
+	if ((force) || (host->cur_device != handle->cs)) {
+		err = spi_nodma_device_switch(host, handle);
+		if (err) {
+			if (handle->cfg.selected == 0) spi_nodma_bus_give(host);
+			return err;
 		}
 	}
 
-	handle->cfg.selected = 0;
-	xSemaphoreGive(host->spi_nodma_bus_mutex);
+	if (handle->cfg.spics_io_num < 0) {
+		gpio_set_level(handle->cfg.spics_ext_io_num, 0);
+	}
+
+	handle->cfg.selected = 1;
 
 	return ESP_OK;
 }
 
+//-----------------------------------------------------------------------------
+esp_err_t IRAM_ATTR spi_nodma_device_deselect(spi_nodma_device_handle_t handle)
+{
+	SPI_CHECK(handle!=NULL, "invalid handle", ESP_ERR_INVALID_ARG);
+
+	if (handle->cfg.selected == 0) return ESP_OK;
+
+    // Check if queued transfer is in progress
+    SPI_CHECK(handle->inflight==0, "Have unfinished transactions", ESP_ERR_INVALID_STATE);
+
+	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
+
+	// Wait for the direct mode transfer executed from interrupt to finish
+	if (host->async.trans) spi_nodma_transfer_async_wait(handle, portMAX_DELAY);
+	
+	if ((host->cur_device == handle->cs) && (handle->cfg.spics_io_num < 0)) {
+		gpio_set_level(handle->cfg.spics_ext_io_num, 1);
+	}
+
+	handle->cfg.selected = 0;
+	spi_async_release(host);
+	return spi_nodma_bus_give(host);
+}
+
 //----------------------------------------------------------------------------------
 esp_err_t IRAM_ATTR spi_nodma_device_TakeSemaphore(spi_nodma_device_handle_t handle)
 {
-	xSemaphoreTake(handle->host->spi_nodma_bus_mutex, portMAX_DELAY);
-	if (!(xSemaphoreTake(handle->host->spi_nodma_bus_mutex, 5000))) return ESP_ERR_INVALID_STATE;
-	else return ESP_OK;
+	SPI_CHECK(handle!=NULL, "invalid handle", ESP_ERR_INVALID_ARG);
+	return spi_nodma_bus_take(handle->host, handle, handle->bus_wait_ticks);
 }
 
 //-----------------------------------------------------------------------------
 void IRAM_ATTR spi_nodma_device_GiveSemaphore(spi_nodma_device_handle_t handle)
 {
-	xSemaphoreTake(handle->host->spi_nodma_bus_mutex, portMAX_DELAY);
+	if (spi_nodma_bus_give(handle->host) != ESP_OK) ESP_LOGE(SPI_TAG, "bus not taken by this task");
 }
 
-//------------------------------------------------------------
-uint32_t spi_nodma_get_speed(spi_nodma_device_handle_t handle)
+//-----------------------------------------------------------------
+int IRAM_ATTR spi_nodma_device_yield(spi_nodma_device_handle_t handle)
 {
 	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
-	uint32_t speed = 0;
-	if (spi_nodma_device_select(handle, 0) == ESP_OK) {
-		if (host->hw->clock.clk_equ_sysclk == 1) speed = 80000000;
-		else speed =  80000000/(host->hw->clock.clkdiv_pre+1)/(host->hw->clock.clkcnt_n+1);
+	spi_nodma_arbiter_t *arb = &host->arb;
+
+	if ((arb->urgent == 0) || (handle->cfg.flags & SPI_DEVICE_BUS_URGENT)) return 0;
+	if ((!handle->cfg.selected) || (handle->inflight) || (host->async.trans) || (arb->owner_task != xTaskGetCurrentTaskHandle())) return 0;
+
+	uint32_t depth = arb->depth;
+	spi_nodma_wait_ready(handle);
+	if (handle->cfg.spics_io_num < 0) gpio_set_level(handle->cfg.spics_ext_io_num, 1);
+	spi_async_release(host);
+
+	// Release the bus completely, also if taken recursively
+	TickType_t wait = SPI_NODMA_YIELD_WAIT_MS / portTICK_RATE_MS;
+	xSemaphoreTake(arb->handoff, 0);
+	arb->yielding = 1;
+	arb->depth = 1;
+	spi_nodma_bus_give(host);
+	// Block until the urgent device's task has taken the bus, so it runs even if it has lower priority;
+	// waiting for the bus again then raises its priority (mutex priority inheritance) until it is given back
+	xSemaphoreTake(arb->handoff, (wait) ? wait : 1);
+	arb->yielding = 0;
+
+	if (spi_nodma_bus_take(host, handle, portMAX_DELAY) != ESP_OK) {
+		ESP_LOGE(SPI_TAG, "bus not taken back after yield");
+		handle->cfg.selected = 0;
+		return -1;
 	}
-	spi_nodma_device_deselect(handle);
-	return speed;
+	arb->depth = depth;
+	if (host->cur_device != handle->cs) spi_nodma_device_switch(host, handle);
+	if (handle->cfg.spics_io_num < 0) gpio_set_level(handle->cfg.spics_ext_io_num, 0);
+	SPI_NODMA_STAT(handle->stats.bus_yields++);
+	return 1;
+}
+
+//------------------------------------------------------------
+uint32_t spi_nodma_get_speed(spi_nodma_device_handle_t handle)
+{
+	int apbclk = SPI_NODMA_APB_FREQ();
+	uint32_t reg;
+
+	if (handle->regs.apb_clk == (uint32_t)apbclk) return handle->regs.eff_clk;
+	// APB clock was changed, the device's registers are recalculated on the next select
+	return spi_calc_clock(apbclk, handle->cfg.clock_speed_hz, handle->cfg.duty_cycle_pos, (handle->cfg.flags & SPI_DEVICE_CLK_NOT_ABOVE), &reg);
 }
 
 //----------------------------------------------------------------------------
@@ -984,13 +1957,14 @@ uint32_t spi_nodma_set_speed(spi_nodma_device_handle_t handle, uint32_t speed)
 {
 	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
 	uint32_t newspeed = 0;
+
+	if (speed == 0) return 0;
 	if (spi_nodma_device_select(handle, 0) == ESP_OK) {
-		spi_nodma_device_deselect(handle);
+		// The device is selected, no transaction can use its registers while they are recalculated
 		handle->cfg.clock_speed_hz = speed;
-		if (spi_nodma_device_select(handle, 1) == ESP_OK) {
-			if (host->hw->clock.clk_equ_sysclk == 1) newspeed = 80000000;
-			else newspeed =  80000000/(host->hw->clock.clkdiv_pre+1)/(host->hw->clock.clkcnt_n+1);
-		}
+		spi_nodma_dev_regs(handle);
+		spi_nodma_dev_apply(host->hw, handle);
+		newspeed = handle->regs.eff_clk;
 	}
 	spi_nodma_device_deselect(handle);
 	
@@ -1011,6 +1985,68 @@ void spi_nodma_get_native_pins(int host, int *sdi, int *sdo, int *sck)
 	*sck = io_signal[host].spiclk_native;
 }
 
+//--------------------------------------------------------------------------------------------------------------------
+volatile uint32_t IRAM_ATTR *spi_nodma_stream_begin(spi_nodma_device_handle_t handle, spi_nodma_stream_t *stream)
+{
+	spi_dev_t *hw = handle->host->hw;
+
+	// Wait for SPI bus ready
+	if (handle->host->async.trans) spi_nodma_transfer_async_wait(handle, portMAX_DELAY);
+	spi_nodma_wait_ready(handle);
+
+	hw->user.usr_mosi = 1;
+	hw->user.usr_miso = 0;
+	hw->miso_dlen.usr_miso_dbitlen = 0;
+
+	stream->hw = hw;
+	stream->dev = handle;
+	stream->half = 0;
+	stream->bits = 0;
+	return &hw->data_buf[0];
+}
+
+//--------------------------------------------------------------------------------------------
+volatile uint32_t IRAM_ATTR *spi_nodma_stream_kick(spi_nodma_stream_t *stream, uint32_t bits)
+{
+	spi_dev_t *hw = stream->hw;
+
+	// Wait for the previous half to be sent
+	spi_nodma_wait_ready(stream->dev);
+
+	hw->user.usr_mosi_highpart = stream->half;	// send from data_buf[8-15] if set
+	hw->mosi_dlen.usr_mosi_dbitlen = bits-1;
+	stream->bits = bits;
+	spi_nodma_kick(stream->dev, (bits+7)/8, 0);	// Start transfer, don't wait
+
+	stream->half ^= 1;
+	return &hw->data_buf[stream->half * 8];
+}
+
+//-----------------------------------------------------------------------------
+void IRAM_ATTR spi_nodma_stream_repeat(spi_nodma_stream_t *stream, uint32_t bits)
+{
+	spi_dev_t *hw = stream->hw;
+
+	// Wait for the previous transfer to finish
+	spi_nodma_wait_ready(stream->dev);
+
+	if (bits != stream->bits) {
+		// First or shorter (last) transfer
+		hw->user.usr_mosi_highpart = 0;		// send from data_buf[0]
+		hw->mosi_dlen.usr_mosi_dbitlen = bits-1;
+		stream->bits = bits;
+	}
+	spi_nodma_kick(stream->dev, (bits+7)/8, 0);	// Start transfer, don't wait
+}
+
+//----------------------------------------------------------------
+void IRAM_ATTR spi_nodma_stream_end(spi_nodma_stream_t *stream)
+{
+	// Wait for the last half to be sent
+	spi_nodma_wait_ready(stream->dev);
+	stream->hw->user.usr_mosi_highpart = 0;
+}
+
 /*
 When using  'spi_nodma_transfer_data' function we can have several scenarios:
 
@@ -1020,81 +2056,138 @@ C: Send & receive (trans->txlength > 0 & trans->rxlength > 0)
 D: No operation   (trans->txlength = 0 & trans->rxlength = 0)
 
 */
-//-------------------------------------------------------------------------------------------------------------
-esp_err_t IRAM_ATTR spi_nodma_transfer_data(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans) {
-	if (!handle) return ESP_ERR_INVALID_ARG;
-
-	// *** For now we can only handle 8-bit bytes transmission
-	if (((trans->length % 8) != 0) || ((trans->rxlength % 8) != 0)) return ESP_ERR_INVALID_ARG;
-
-	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
-	esp_err_t ret;
-	uint8_t do_deselect = 0;
-    const uint8_t *txbuffer = NULL;
-	uint8_t *rxbuffer = NULL;
+// Get the transmit & receive buffers and lengths (in bits) of the direct mode transaction
+//----------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+static esp_err_t IRAM_ATTR spi_nodma_trans_buffers(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans, const uint8_t **txbuffer, uint32_t *txbits, uint8_t **rxbuffer, uint32_t *rxbits)
+{
+	// DIO/QIO use the data lines in both directions, only possible in half duplex 4-wire mode
+	if ((trans->flags & (SPI_TRANS_MODE_DIO|SPI_TRANS_MODE_QIO)) &&
+			((handle->cfg.flags & SPI_DEVICE_3WIRE) || (!(handle->cfg.flags & SPI_DEVICE_HALFDUPLEX)))) return ESP_ERR_INVALID_ARG;
 
 	if (trans->flags & SPI_TRANS_USE_TXDATA) {
         // Send data from 'trans->tx_data'
-		txbuffer=(uint8_t*)&trans->tx_data[0];
+		*txbuffer=(uint8_t*)&trans->tx_data[0];
 	} else {
         // Send data from 'trans->tx_buffer'
-		txbuffer=(uint8_t*)trans->tx_buffer;
+		*txbuffer=(uint8_t*)trans->tx_buffer;
 	}
 	if (trans->flags & SPI_TRANS_USE_RXDATA) {
         // Receive data to 'trans->rx_data'
-		rxbuffer=(uint8_t*)&trans->rx_data[0];
+		*rxbuffer=(uint8_t*)&trans->rx_data[0];
 	} else {
         // Receive data to 'trans->rx_buffer'
-		rxbuffer=(uint8_t*)trans->rx_buffer;
+		*rxbuffer=(uint8_t*)trans->rx_buffer;
 	}
 
-	// ** Set transmit & receive length in bytes
-	uint32_t txlen = trans->length / 8;
-	uint32_t rxlen = trans->rxlength / 8;
+	// ** Set transmit & receive length in bits
+	*txbits = trans->length;
+	*rxbits = trans->rxlength;
 
-	if (txbuffer == NULL) txlen = 0;
-	if (rxbuffer == NULL) rxlen = 0;
-	if ((rxlen == 0) && (txlen == 0)) {
+	if (*txbuffer == NULL) *txbits = 0;
+	if (*rxbuffer == NULL) *rxbits = 0;
+	if ((*rxbits == 0) && (*txbits == 0)) {
         // ** NOTHING TO SEND or RECEIVE, return
         return ESP_ERR_INVALID_ARG;
     }
 
-    // If using 'trans->tx_data' and/or 'trans->rx_data', maximum 4 bytes can be sent/received
-	if ((txbuffer == &trans->tx_data[0]) && (txlen > 4)) return ESP_ERR_INVALID_ARG;
-	if ((rxbuffer == &trans->rx_data[0]) && (rxlen > 4)) return ESP_ERR_INVALID_ARG;
+    // If using 'trans->tx_data' and/or 'trans->rx_data', maximum 32 bits can be sent/received
+	if ((*txbuffer == &trans->tx_data[0]) && (*txbits > 32)) return ESP_ERR_INVALID_ARG;
+	if ((*rxbuffer == &trans->rx_data[0]) && (*rxbits > 32)) return ESP_ERR_INVALID_ARG;
 
-	// --- Wait for SPI bus ready ---
-	while (host->hw->cmd.usr);
+	return ESP_OK;
+}
 
-    // ** If the device was not selected, select it
-	if (handle->cfg.selected == 0) {
-		ret = spi_nodma_device_select(handle, 0);
-		if (ret) return ret;
-		do_deselect = 1;     // We will deselect the device after the operation !
+// Start the full duplex transfer of 'bits' bits from/to one half of the hw spi buffer
+// 'rxbits' is the number of the received bits which will be used, for the performance counters
+//--------------------------------------------------------------------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_nodma_duplex_kick(spi_nodma_device_handle_t handle, uint32_t half, uint32_t bits, uint32_t rxbits)
+{
+	spi_dev_t *hw = handle->host->hw;
+
+	hw->user.usr_mosi_highpart = half;
+	hw->user.usr_miso_highpart = half;
+	hw->mosi_dlen.usr_mosi_dbitlen = bits-1;
+	hw->miso_dlen.usr_miso_dbitlen = bits-1;
+	spi_nodma_kick(handle, (bits+7)/8, (((rxbits > bits) ? bits : rxbits)+7)/8);
+}
+
+// Transmit and receive simultaneously (full duplex) without command, address and dummy phases
+// Both halves of the hw spi buffer are used: while one half is on the wire, the data received
+// to the other half are read and the half is filled with the next data to be sent
+// Only receives while transmitting, returns the number of bits received
+//---------------------------------------------------------------------------------------------------------------------------------------------------------
+static uint32_t IRAM_ATTR spi_nodma_duplex_stream(spi_nodma_device_handle_t handle, const uint8_t *txbuffer, uint32_t txbits, uint8_t *rxbuffer, uint32_t rxbits)
+{
+	spi_dev_t *hw = handle->host->hw;
+	uint32_t sent = 0;		// number of bits whose transfer was started
+	uint32_t done = 0;		// number of bits whose transfer is finished
+	uint32_t half = 0;
+	uint32_t chunk, next;
+
+	if (rxbits > txbits) rxbits = txbits;
+
+	chunk = (txbits > SPI_NODMA_STREAM_BUF_SIZE*8) ? SPI_NODMA_STREAM_BUF_SIZE*8 : txbits;
+	spi_nodma_buf_fill(&hw->data_buf[0], txbuffer, (chunk+7)/8);
+	spi_nodma_duplex_kick(handle, half, chunk, rxbits);
+	sent = chunk;
+
+	while (chunk) {
+		// Fill the other half while the data are on the wire
+		next = txbits - sent;
+		if (next > SPI_NODMA_STREAM_BUF_SIZE*8) next = SPI_NODMA_STREAM_BUF_SIZE*8;
+		if (next) spi_nodma_buf_fill(&hw->data_buf[(half^1)*8], txbuffer+(sent/8), (next+7)/8);
+
+		spi_nodma_wait_ready(handle);
+		if (next) {
+			// Keep the bus busy, the next chunk uses the other half
+			spi_nodma_duplex_kick(handle, half^1, next, (rxbits > sent) ? rxbits-sent : 0);
+			sent += next;
+		}
+		// Read the data received with the finished chunk
+		if (rxbits > done) spi_nodma_buf_drain(&hw->data_buf[half*8], rxbuffer+(done/8), (((rxbits-done > chunk) ? chunk : rxbits-done)+7)/8);
+		done += chunk;
+		half ^= 1;
+		chunk = next;
 	}
-	
-	// ** Call pre-transmission callback, if any
-	if (handle->cfg.pre_cb) handle->cfg.pre_cb(trans);
+	hw->user.usr_mosi_highpart = 0;
+	hw->user.usr_miso_highpart = 0;
+	return rxbits;
+}
+
+// Execute the direct mode transaction on the selected device; callbacks are not called
+// Lengths are in bits, all chunks except the last one are whole bytes
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+static void IRAM_ATTR spi_nodma_transfer_selected(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans, const uint8_t *txbuffer, uint32_t txbits, uint8_t *rxbuffer, uint32_t rxbits)
+{
+	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
 
     // Test if operating in full duplex mode
 	uint8_t duplex = 1;
 	if (handle->cfg.flags & SPI_DEVICE_HALFDUPLEX) duplex = 0; // Half duplex mode !
 
-    uint32_t bits, rdbits;
-	uint32_t wd;
-	uint8_t bc, rdidx;
-	uint32_t rdcount = rxlen;  // Total number of bytes to read
-	uint32_t rd_read = 0;      // Number of bytes read so far
+	SPI_NODMA_STAT(handle->stats.direct_trans++);
+#if SPI_NODMA_CAPTURE
+	spi_nodma_capture_rec_t *capture = spi_capture_begin(handle, trans, txbuffer, txbits, (rxbuffer) ? rxbits : 0, SPI_CAPTURE_DIRECT);
+	uint32_t capture_seq = (capture) ? capture->seq : 0;
+#endif
+
+    uint32_t rdbits = 0;
+	uint32_t chunk;
+	uint32_t rdcount = rxbits;  // Total number of bits to read
+	uint32_t rd_read = 0;       // Number of bits read so far
 
 	host->hw->user.usr_mosi_highpart = 0;
 
+	// ** Dual/quad mode, address and data phases use 2 or 4 lines
+	if (trans->flags & (SPI_TRANS_MODE_DIO|SPI_TRANS_MODE_QIO)) spi_nodma_set_io_mode(host->hw, trans->flags);
+
     // ** Check if mosi phase will be used
-    if ((txbuffer != NULL) && (txlen > 0)) host->hw->user.usr_mosi = 1;  // We have to send some data
-	else host->hw->user.usr_mosi = 0;                                    // Nothing to send, no mosi phase
+    if ((txbuffer != NULL) && (txbits > 0)) host->hw->user.usr_mosi = 1;  // We have to send some data
+	else host->hw->user.usr_mosi = 0;                                      // Nothing to send, no mosi phase
 
     // ** Check if miso phase will be used
-	if ((rxbuffer != NULL) && (rxlen > 0)) host->hw->user.usr_miso = 1;  // We have to receive some data
-	else host->hw->user.usr_miso = 0;                                    // Nothing to receive, no miso phase
+	if ((rxbuffer != NULL) && (rxbits > 0)) host->hw->user.usr_miso = 1;  // We have to receive some data
+	else host->hw->user.usr_miso = 0;                                      // Nothing to receive, no miso phase
 
     // ** Check if address phase will be used
 	host->hw->user2.usr_command_value=trans->command;
@@ -1109,122 +2202,69 @@ esp_err_t IRAM_ATTR spi_nodma_transfer_data(spi_nodma_device_handle_t handle, sp
 	// *** If host->hw->user.usr_mosi == 1 we have to transmit some data ***
 	//     host->hw->user.usr_mosi == 0  if no data needs to be transmitted
 	// ---------------------------------------------------------------------
-	if (host->hw->user.usr_mosi == 1) {
-		uint8_t idx;
-		uint32_t count;
-
-		bits = 0;   // remaining bits to send
-		rdbits = 0; // remaining bits to receive
-		idx = 0;    // index to spi hw data_buf (16 32-bit words, 64 bytes, 512 bits)
-		count = 0;  // number of bytes transmitted so far
-
-        // ** Transimit 'txlen' bytes
-		while (count < txlen) {
-			wd = 0;
-			for (bc=0;bc<32;bc+=8) {
-				wd |= (uint32_t)txbuffer[count] << bc;
-				count++;                    // Increment sent data count
-				bits += 8;                  // Increment bits count
-				if (count == txlen) break;  // If all transmit data pushed to hw spi buffer break from the loop
-			}
-			host->hw->data_buf[idx] = wd;
-			idx++;
-			if (idx == 16) {
-				// Hw SPI buffer full (all 64 bytes filled, START THE TRANSSACTION
-				host->hw->mosi_dlen.usr_mosi_dbitlen=bits-1;            // Set mosi dbitlen
-
-				if ((duplex) && (host->hw->user.usr_miso == 1)) {
-                    // In full duplex mode we are receiving while sending !
-			    	if (rdcount <= 64) rdbits = rdcount * 8;
-			    	else rdbits = 64 * 8;
-					host->hw->mosi_dlen.usr_mosi_dbitlen = rdbits-1;    // Set miso dbitlen
-				}
-				else host->hw->miso_dlen.usr_miso_dbitlen = 0;          // In half duplex mode nothing will be received
-
-				// ** Start the transaction ***
-				host->hw->cmd.usr=1;
-                // Wait the transaction to finish
-				while (host->hw->cmd.usr);
-
-				if ((duplex) && (host->hw->user.usr_miso == 1)) {
-					// *** in full duplex mode transfer received data to input buffer ***
-					rdidx = 0;
-			    	while (rdbits > 0) {
-						wd = host->hw->data_buf[rdidx];
-						rdidx++;
-						for (bc=0;bc<32;bc+=8) {
-							rxbuffer[rd_read++] = (uint8_t)((wd >> bc) & 0xFF);
-							rdcount--;
-							rdbits -= 8;
-							if (rdcount == 0) {
-								// Finished reading data
-								host->hw->user.usr_miso = 0;
-								break;
-							}
-						}
-			    	}
-				}
-
-				bits = 0;   // nothing in hw spi buffer yet
-				idx = 0;    // start from the begining of the hw spi buffer
-			}
+	if ((host->hw->user.usr_mosi == 1) && (host->hw->user.usr_miso == 0) &&
+			(handle->cfg.command_bits == 0) && (handle->cfg.address_bits == 0) && (handle->cfg.dummy_bits == 0)) {
+		// ** Transmit only, without command & address phases
+		//    fill one half of the hw spi buffer while the other half is sent
+		uint32_t count = 0;
+		spi_nodma_stream_t stream;
+		volatile uint32_t *buf = spi_nodma_stream_begin(handle, &stream);
+
+		while (count < txbits) {
+			chunk = txbits - count;
+			if (chunk > SPI_NODMA_STREAM_BUF_SIZE*8) chunk = SPI_NODMA_STREAM_BUF_SIZE*8;
+
+			spi_nodma_buf_fill(buf, txbuffer+(count/8), (chunk+7)/8);
+			count += chunk;
+			buf = spi_nodma_stream_kick(&stream, chunk);
 		}
-		// *** All transmit data are sent or oushed to hw spi buffer
-		// bits > 0  IF SOME DATA STILL WAITING IN THE HW SPI TRANSMIT BUFFER
-		if (bits > 0) {
-			// ** WE HAVE SOME DATA IN THE HW SPI TRANSMIT BUFFER
-			host->hw->mosi_dlen.usr_mosi_dbitlen=bits-1;            // Set mosi dbitlen
+		spi_nodma_stream_end(&stream);
+	}
+	else if ((duplex) && (host->hw->user.usr_mosi == 1) && (host->hw->user.usr_miso == 1) &&
+			(handle->cfg.command_bits == 0) && (handle->cfg.address_bits == 0) && (handle->cfg.dummy_bits == 0)) {
+		// ** Full duplex without command & address phases, streamed through both halves of the hw spi buffer
+		rd_read = spi_nodma_duplex_stream(handle, txbuffer, txbits, rxbuffer, rxbits);
+		rdcount -= rd_read;
+	}
+	else if (host->hw->user.usr_mosi == 1) {
+		uint32_t count = 0;  // number of bits transmitted so far
+
+        // ** Transimit 'txbits' bits in chunks of max 64 bytes (hw spi buffer size)
+		while (count < txbits) {
+			chunk = txbits - count;
+			if (chunk > SPI_NODMA_HWBUF_SIZE*8) chunk = SPI_NODMA_HWBUF_SIZE*8;
+
+			// ** Push the data to hw spi buffer
+			spi_nodma_buf_fill(host->hw->data_buf, txbuffer+(count/8), (chunk+7)/8);
+			count += chunk;
+
+			host->hw->mosi_dlen.usr_mosi_dbitlen=chunk-1;           // Set mosi dbitlen
 
 			if ((duplex) && (host->hw->user.usr_miso == 1)) {
-                // In full duplex mode we are receiving while sending !
-		    	if (rdcount <= 64) rdbits = rdcount * 8;
-		    	else rdbits = 64 * 8;
-				host->hw->mosi_dlen.usr_mosi_dbitlen = rdbits-1;    // Set miso dbitlen
+                // In full duplex mode we are receiving while sending, the whole chunk is clocked in
+                // but only the bits still needed are read from the hw spi buffer
+		    	rdbits = (rdcount < chunk) ? rdcount : chunk;
+				host->hw->miso_dlen.usr_miso_dbitlen = chunk-1;     // Set miso dbitlen
+			}
+			else {
+				// In half duplex mode nothing is received while sending
+				host->hw->miso_dlen.usr_miso_dbitlen = 0;
+				host->hw->user.usr_miso = 0;
 			}
-			else host->hw->miso_dlen.usr_miso_dbitlen = 0;          // In half duplex mode nothing will be received
 
 			// ** Start the transaction ***
-			host->hw->cmd.usr=1;
+			spi_nodma_kick(handle, (chunk+7)/8, ((duplex) && (host->hw->user.usr_miso == 1)) ? (rdbits+7)/8 : 0);
             // Wait the transaction to finish
-			while (host->hw->cmd.usr);
-
-			if ((duplex) && (host->hw->user.usr_miso == 1))  {
-                // *** in full duplex mode transfer received data to input buffer ***
-				rdidx = 0;
-		    	while (rdbits > 0) {
-					wd = host->hw->data_buf[rdidx];
-					rdidx++;
-					for (bc=0;bc<32;bc+=8) {
-						rxbuffer[rd_read++] = (uint8_t)((wd >> bc) & 0xFF);
-						rdcount--;
-						rdbits -= 8;
-						if (rdcount == 0) {
-							// Finished reading data
-							host->hw->user.usr_miso = 0;
-							break;
-						}
-					}
-		    	}
-			}
-		}
-		if (duplex) rdcount = 0;
-	}
+			spi_nodma_wait_ready(handle);
 
-	// ------------------------------------------------------------------------
-	// *** If rdcount = 0 we have nothing to receive and we exit the function
-    //     This is true if no data receive was requested,
-    //     or the data was received in Full duplex mode during the transmission
-	// ------------------------------------------------------------------------
-	if (rdcount == 0) {
-		// ** Call post-transmission callback, if any
-		if (handle->cfg.post_cb) handle->cfg.post_cb(trans);
-
-		if (do_deselect) {
-            // Spi device was selected in this function, we have to deselect it now 
-			ret = spi_nodma_device_deselect(handle);
-			if (ret) return ret;
+			if ((duplex) && (host->hw->user.usr_miso == 1)) {
+				// *** in full duplex mode transfer received data to input buffer ***
+				spi_nodma_buf_drain(host->hw->data_buf, rxbuffer+(rd_read/8), (rdbits+7)/8);
+				rd_read += rdbits;
+				rdcount -= rdbits;
+				if (rdcount == 0) host->hw->user.usr_miso = 0;  // Finished reading data
+			}
 		}
-		return ESP_OK;
 	}
 
 	// ----------------------------------------------------------------------------------------------------------------
@@ -1232,36 +2272,122 @@ esp_err_t IRAM_ATTR spi_nodma_transfer_data(spi_nodma_device_handle_t handle, sp
     //     This is true if we operate in Half duplex mode when receiving after transmission is done,
     //     or not all data was received in Full duplex mode during the transmission (trans->rxlength > trans->txlength)
 	// ----------------------------------------------------------------------------------------------------------------
+    if (rdcount > 0) {
+		// Nothing is sent while receiving the rest of the data
+		host->hw->user.usr_mosi = 0;
+		host->hw->user.usr_miso = 1;
+	}
     while (rdcount > 0) {
-    	if (rdcount <= 64) rdbits = rdcount * 8;
-    	else rdbits = 64 * 8;
+    	chunk = rdcount;
+    	if (chunk > SPI_NODMA_HWBUF_SIZE*8) chunk = SPI_NODMA_HWBUF_SIZE*8;
 
 		// Load receive buffer
 		host->hw->mosi_dlen.usr_mosi_dbitlen=0;
-		host->hw->miso_dlen.usr_miso_dbitlen=rdbits-1;
+		host->hw->miso_dlen.usr_miso_dbitlen=chunk-1;
 
         // ** Start the transaction ***
-		host->hw->cmd.usr=1;
+		spi_nodma_kick(handle, 0, (chunk+7)/8);
         // Wait the transaction to finish
-		while (host->hw->cmd.usr);
+		spi_nodma_wait_ready(handle);
 
         // *** transfer received data to input buffer ***
-		rdidx = 0;
-    	while (rdbits > 0) {
-			wd = host->hw->data_buf[rdidx];
-			rdidx++;
-			for (bc=0;bc<32;bc+=8) {
-				rxbuffer[rd_read++] = (uint8_t)((wd >> bc) & 0xFF);
-				rdcount--;
-				rdbits -= 8;
-				if (rdcount == 0) break;
-			}
-    	}
+		spi_nodma_buf_drain(host->hw->data_buf, rxbuffer+(rd_read/8), (chunk+7)/8);
+		rd_read += chunk;
+		rdcount -= chunk;
     }
 
+	if (trans->flags & (SPI_TRANS_MODE_DIO|SPI_TRANS_MODE_QIO)) spi_nodma_set_io_mode(host->hw, 0);
+#if SPI_NODMA_CAPTURE
+	spi_capture_end(capture, capture_seq);
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------------------
+esp_err_t IRAM_ATTR spi_nodma_transfer_data(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans) {
+	if (!handle) return ESP_ERR_INVALID_ARG;
+
+	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
+	esp_err_t ret;
+	uint8_t do_deselect = 0;
+    const uint8_t *txbuffer = NULL;
+	uint8_t *rxbuffer = NULL;
+	uint32_t txbits, rxbits;
+
+	ret = spi_nodma_trans_buffers(handle, trans, &txbuffer, &txbits, &rxbuffer, &rxbits);
+	if (ret) return ret;
+
+	// --- Wait for SPI bus ready ---
+	if (host->async.trans) spi_nodma_transfer_async_wait(handle, portMAX_DELAY);
+	spi_nodma_wait_ready(handle);
+
+    // ** If the device was not selected, select it
+	if (handle->cfg.selected == 0) {
+		ret = spi_nodma_device_select(handle, 0);
+		if (ret) return ret;
+		do_deselect = 1;     // We will deselect the device after the operation !
+	}
+	
+	// ** Call pre-transmission callback, if any
+	if (handle->cfg.pre_cb) handle->cfg.pre_cb(trans);
+
+	spi_nodma_transfer_selected(handle, trans, txbuffer, txbits, rxbuffer, rxbits);
+
 	// ** Call post-transmission callback, if any
 	if (handle->cfg.post_cb) handle->cfg.post_cb(trans);
 
+	if (do_deselect) {
+        // Spi device was selected in this function, we have to deselect it now 
+		ret = spi_nodma_device_deselect(handle);
+		if (ret) return ret;
+	}
+
+	return ESP_OK;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+esp_err_t IRAM_ATTR spi_nodma_transfer_batch(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans, int n) {
+	if ((!handle) || (!trans) || (n <= 0)) return ESP_ERR_INVALID_ARG;
+
+	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
+	esp_err_t ret;
+	uint8_t do_deselect = 0;
+    const uint8_t *txbuffer = NULL;
+	uint8_t *rxbuffer = NULL;
+	uint32_t txbits, rxbits;
+	int i;
+
+	// ** Check all transactions before anything is sent
+	for (i=0; i<n; i++) {
+		ret = spi_nodma_trans_buffers(handle, &trans[i], &txbuffer, &txbits, &rxbuffer, &rxbits);
+		if (ret) return ret;
+	}
+
+	// --- Wait for SPI bus ready ---
+	if (host->async.trans) spi_nodma_transfer_async_wait(handle, portMAX_DELAY);
+	spi_nodma_wait_ready(handle);
+
+    // ** Select the device and take the bus only once for all transactions
+	if (handle->cfg.selected == 0) {
+		ret = spi_nodma_device_select(handle, 0);
+		if (ret) return ret;
+		do_deselect = 1;
+	}
+
+	for (i=0; i<n; i++) {
+		// ** Preemption point, an urgent device may use the bus before this transaction
+		int yielded = ((i > 0) && (trans[i].flags & SPI_TRANS_PREEMPTIBLE)) ? spi_nodma_device_yield(handle) : 0;
+		if (yielded < 0) return ESP_ERR_TIMEOUT;
+
+		// ** Call pre-transmission callback, if any (DC line etc.)
+		if (handle->cfg.pre_cb) handle->cfg.pre_cb(&trans[i]);
+
+		spi_nodma_trans_buffers(handle, &trans[i], &txbuffer, &txbits, &rxbuffer, &rxbits);
+		spi_nodma_transfer_selected(handle, &trans[i], txbuffer, txbits, rxbuffer, rxbits);
+
+		// ** Call post-transmission callback, if any
+		if (handle->cfg.post_cb) handle->cfg.post_cb(&trans[i]);
+	}
+
 	if (do_deselect) {
 		ret = spi_nodma_device_deselect(handle);
 		if (ret) return ret;
@@ -1269,3 +2395,123 @@ esp_err_t IRAM_ATTR spi_nodma_transfer_data(spi_nodma_device_handle_t handle, sp
 
 	return ESP_OK;
 }
+
+//-------------------------------------------------------------------------------------------------------------------
+esp_err_t IRAM_ATTR spi_nodma_transfer_data_async(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans)
+{
+	SPI_CHECK(handle!=NULL, "invalid handle", ESP_ERR_INVALID_ARG);
+	SPI_CHECK(handle->cfg.selected == 1, "device not selected", ESP_ERR_INVALID_STATE);
+
+	// *** For now we can only handle 8-bit bytes transmission in 1-bit mode
+	if (((trans->length % 8) != 0) || ((trans->rxlength % 8) != 0)) return ESP_ERR_INVALID_ARG;
+	SPI_CHECK((trans->flags & (SPI_TRANS_MODE_DIO|SPI_TRANS_MODE_QIO)) == 0, "DIO/QIO not supported", ESP_ERR_NOT_SUPPORTED);
+
+	spi_nodma_host_t *host=(spi_nodma_host_t*)handle->host;
+	spi_nodma_async_t *as=&host->async;
+	const uint8_t *txbuffer;
+	uint8_t *rxbuffer;
+
+	if (trans->flags & SPI_TRANS_USE_TXDATA) txbuffer=(uint8_t*)&trans->tx_data[0];
+	else txbuffer=(uint8_t*)trans->tx_buffer;
+	if (trans->flags & SPI_TRANS_USE_RXDATA) rxbuffer=(uint8_t*)&trans->rx_data[0];
+	else rxbuffer=(uint8_t*)trans->rx_buffer;
+
+	uint32_t txlen = (txbuffer == NULL) ? 0 : trans->length / 8;
+	uint32_t rxlen = (rxbuffer == NULL) ? 0 : trans->rxlength / 8;
+
+	if ((rxlen == 0) && (txlen == 0)) return ESP_ERR_INVALID_ARG;
+	if ((txbuffer == &trans->tx_data[0]) && (txlen > 4)) return ESP_ERR_INVALID_ARG;
+	if ((rxbuffer == &trans->rx_data[0]) && (rxlen > 4)) return ESP_ERR_INVALID_ARG;
+	SPI_CHECK((rxlen == 0) || (handle->cfg.flags & SPI_DEVICE_HALFDUPLEX), "full duplex receive not supported", ESP_ERR_NOT_SUPPORTED);
+
+	// Wait for the previous transfer to finish
+	if (as->trans) spi_nodma_transfer_async_wait(handle, portMAX_DELAY);
+	spi_nodma_wait_ready(handle);
+	SPI_CHECK(host->cur_trans == NULL, "queued transaction in progress", ESP_ERR_INVALID_STATE);
+
+	// ** Call pre-transmission callback, if any
+	if (handle->cfg.pre_cb) handle->cfg.pre_cb(trans);
+
+	host->hw->user2.usr_command_value=trans->command;
+	if (handle->cfg.address_bits>32) {
+		host->hw->addr=trans->address >> 32;
+		host->hw->slv_wr_status=trans->address & 0xffffffff;
+	} else {
+		host->hw->addr=trans->address & 0xffffffff;
+	}
+
+	uint32_t size, txbytes = 0, rxbytes = 0;
+
+	as->user_val = host->hw->user.val;
+	as->dev = handle;
+	as->txbuf = txbuffer;
+	as->txleft = txlen;
+	as->rxbuf = rxbuffer;
+	as->rxleft = rxlen;
+	as->rxchunk = 0;
+	as->nextbits = 0;
+	as->half = 0;
+
+	// ** The first transfer is prepared completely before it is started: once it is started
+	//    and the interrupt enabled, only the spi interrupt touches the transfer state
+	if (txlen) {
+		// ** Fill the first half of the hw spi buffer to be sent and prefill the second half
+		size = (txlen > SPI_NODMA_STREAM_BUF_SIZE) ? SPI_NODMA_STREAM_BUF_SIZE : txlen;
+		spi_nodma_buf_fill(&host->hw->data_buf[0], as->txbuf, size);
+		as->txbuf += size;
+		as->txleft -= size;
+		txbytes = size;
+		if (as->txleft) {
+			size = (as->txleft > SPI_NODMA_STREAM_BUF_SIZE) ? SPI_NODMA_STREAM_BUF_SIZE : as->txleft;
+			spi_nodma_buf_fill(&host->hw->data_buf[8], as->txbuf, size);
+			as->txbuf += size;
+			as->txleft -= size;
+			as->nextbits = size*8;
+		}
+		as->half = 1;
+		host->hw->user.usr_mosi = 1;
+		host->hw->user.usr_miso = 0;
+		host->hw->user.usr_mosi_highpart = 0;
+		host->hw->mosi_dlen.usr_mosi_dbitlen = (txbytes*8)-1;
+		host->hw->miso_dlen.usr_miso_dbitlen = 0;
+	}
+	else {
+		// ** Receive only
+		size = (rxlen > SPI_NODMA_HWBUF_SIZE) ? SPI_NODMA_HWBUF_SIZE : rxlen;
+		host->hw->user.usr_mosi = 0;
+		host->hw->user.usr_miso = 1;
+		host->hw->user.usr_mosi_highpart = 0;
+		host->hw->miso_dlen.usr_miso_dbitlen = (size*8)-1;
+		as->rxchunk = size;
+		rxbytes = size;
+	}
+
+	// ** Start the first transfer, the rest is done from spi interrupt
+	SPI_NODMA_STAT(handle->stats.direct_trans++);
+	xSemaphoreTake(as->done, 0);		// completion of a transaction nobody waited for
+	host->hw->slave.trans_done = 0;
+	as->trans = trans;
+	spi_nodma_intr_set(host, 1);
+	spi_nodma_kick(handle, txbytes, rxbytes);
+
+	return ESP_OK;
+}
+
+//--------------------------------------------------------------------------------------------------------
+esp_err_t IRAM_ATTR spi_nodma_transfer_async_wait(spi_nodma_device_handle_t handle, TickType_t ticks_to_wait)
+{
+	SPI_CHECK(handle!=NULL, "invalid handle", ESP_ERR_INVALID_ARG);
+
+	spi_nodma_async_t *as=&handle->host->async;
+	TickType_t start = xTaskGetTickCount(), waited;
+
+	// Any task may wait; the completion is passed on, so all waiting tasks see it
+	while (as->trans) {
+		waited = xTaskGetTickCount() - start;
+		if ((ticks_to_wait != portMAX_DELAY) && (waited >= ticks_to_wait)) return ESP_ERR_TIMEOUT;
+		if (xSemaphoreTake(as->done, (ticks_to_wait == portMAX_DELAY) ? portMAX_DELAY : ticks_to_wait - waited) == pdTRUE) {
+			if (as->trans == NULL) xSemaphoreGive(as->done);
+		}
+	}
+	return ESP_OK;
+}
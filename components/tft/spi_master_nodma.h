@@ -16,14 +16,18 @@
 #ifndef _DRIVER_SPI_MASTER_NODMA_H_
 #define _DRIVER_SPI_MASTER_NODMA_H_
 
+#include <stdio.h>
 #include "esp_err.h"
+#include "esp_attr.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "soc/spi_struct.h"
 
 #include "esp_intr.h"
 #include "esp_intr_alloc.h"
 #include "rom/lldesc.h"
+#include "xtensa/hal.h"
 
 
 #ifdef __cplusplus
@@ -55,8 +59,15 @@ typedef struct {
     int sclk_io_num;                ///< GPIO pin for Spi CLocK signal, or -1 if not used.
     int quadwp_io_num;              ///< GPIO pin for WP (Write Protect) signal which is used as D2 in 4-bit communication modes, or -1 if not used.
     int quadhd_io_num;              ///< GPIO pin for HD (HolD) signal which is used as D3 in 4-bit communication modes, or -1 if not used.
+    int intr_cpu;                   ///< CPU on which the host's spi interrupt is allocated when the bus is initialized (SPI_NODMA_INTR_CPU_x)
 } spi_nodma_bus_config_t;
 
+#define SPI_NODMA_INTR_CPU_AUTO 0   ///< Interrupt is allocated on the cpu of the task which adds the host's first device
+#define SPI_NODMA_INTR_CPU_0    1   ///< Interrupt is allocated on PRO cpu (core 0)
+#define SPI_NODMA_INTR_CPU_1    2   ///< Interrupt is allocated on APP cpu (core 1)
+
+#define SPI_NODMA_DMA_CHAN(host) (host)     // dma channel used by the host: HSPI 1, VSPI 2
+
 
 #define SPI_DEVICE_TXBIT_LSBFIRST          (1<<0)  ///< Transmit command/address/data LSB first instead of the default MSB first
 #define SPI_DEVICE_RXBIT_LSBFIRST          (1<<1)  ///< Receive data LSB first instead of the default MSB first
@@ -65,6 +76,8 @@ typedef struct {
 #define SPI_DEVICE_POSITIVE_CS             (1<<3)  ///< Make CS positive during a transaction instead of negative
 #define SPI_DEVICE_HALFDUPLEX              (1<<4)  ///< Transmit data before receiving it, instead of simultaneously
 #define SPI_DEVICE_CLK_AS_CS               (1<<5)  ///< Output clock on CS line if CS is active
+#define SPI_DEVICE_CLK_NOT_ABOVE           (1<<6)  ///< Use the highest spi clock not above clock_speed_hz instead of the nearest one
+#define SPI_DEVICE_BUS_URGENT              (1<<7)  ///< Latency sensitive device, other devices give it the bus at their preemption points (spi_nodma_device_yield)
 
 #define SPI_ERR_OTHER_CONFIG 7001
 
@@ -89,6 +102,10 @@ typedef struct {
     int queue_size;                 ///< Transaction queue size. This sets how many transactions can be 'in the air' (queued using spi_device_queue_trans but not yet finished using spi_device_get_trans_result) at the same time
     transaction_cb_t pre_cb;        ///< Callback to be called before a transmission is started. This callback from 'spi_nodma_transfer_data' function.
     transaction_cb_t post_cb;       ///< Callback to be called after a transmission has completed. This callback from 'spi_nodma_transfer_data' function.
+    uint8_t priority;               ///< Queued transactions scheduling priority, higher is served first (SPI_SCHED_PRIORITY policy)
+    uint8_t weight;                 ///< Share of the bus time relative to other devices (SPI_SCHED_WEIGHTED_FAIR policy); 0 is the same as 1
+    uint32_t deadline_us;           ///< Maximal time a queued transaction should wait for the bus, in us (SPI_SCHED_DEADLINE policy); 0 for no deadline
+    uint32_t bus_wait_ms;           ///< Maximal time to wait for the bus when the device is selected, in ms; 0 for SPI_SEMAPHORE_WAIT
     uint8_t selected;               ///< **INTERNAL** 1 if the device's CS pin is active
 } spi_nodma_device_interface_config_t;
 
@@ -98,6 +115,10 @@ typedef struct {
 #define SPI_TRANS_MODE_DIOQIO_ADDR    (1<<2)  ///< Also transmit address in mode selected by SPI_MODE_DIO/SPI_MODE_QIO
 #define SPI_TRANS_USE_RXDATA          (1<<3)  ///< Receive into rx_data member of spi_nodma_transaction_t instead into memory at rx_buffer.
 #define SPI_TRANS_USE_TXDATA          (1<<4)  ///< Transmit tx_data member of spi_nodma_transaction_t instead of data at tx_buffer. Do not set tx_buffer when using this.
+#define SPI_TRANS_REPEAT_TX           (1<<5)  ///< Transmit data at tx_buffer ('txpattern_size' bytes) repeatedly until 'length' bits are sent. Only for queued transactions.
+#define SPI_TRANS_PREEMPTIBLE         (1<<6)  ///< In spi_nodma_transfer_batch the bus can be given to a waiting SPI_DEVICE_BUS_URGENT device before this transaction; software CS is deactivated meanwhile
+#define SPI_TRANS_NOTIFY              (1<<7)  ///< Queued transaction: no result in the result queue, the completion is counted and the task waiting in spi_nodma_trans_wait is notified
+#define SPI_TRANS_NO_RESULT           (1<<8)  ///< Queued transaction: no result in the result queue, the completion is only reported by the device's 'post_cb' (spi interrupt)
 
 /**
  * This structure describes one SPI transmission
@@ -117,24 +138,241 @@ struct spi_nodma_transaction_t {
         void *rx_buffer;            ///< Pointer to receive buffer, or NULL for no MISO phase
         uint8_t rx_data[4];         ///< If SPI_USE_RXDATA is set, data is received directly to this variable
     };
+    size_t txpattern_size;          ///< If SPI_TRANS_REPEAT_TX is set, size of the data at tx_buffer in bytes; must be a multiple of 4
+    uint32_t queued_time;           ///< **INTERNAL** cpu cycle count when the transaction was queued
 };
 
 #define NO_CS 3					    // Number of CS pins per SPI host
 #define NO_DEV 6				    // Number of spi devices per SPI host; more than 3 devices can be attached to the same bus if using software CS's
 #define SPI_SEMAPHORE_WAIT 2000     // Time in ms to wait for SPI mutex
+#define SPI_DMA_DESC_NUM 64         // Number of dma descriptors per SPI host, used for queued transactions; each descriptor transfers up to 4092 bytes
+#define SPI_SCHED_MAX_RUN 4         // Default number of consecutive queued transactions of the same device before other devices must be served
+#ifndef SPI_NODMA_STATS
+#define SPI_NODMA_STATS 1           // Collect the performance counters (see spi_nodma_get_stats), set to 0 to compile them out
+#endif
+// APB clock in Hz, the spi clock is derived from it. With esp-idf versions providing 'esp_clk_apb_freq()' the current
+// APB clock is used, it can change at run time (dynamic frequency scaling); device's clock divider is then recalculated
+// when the device is selected after the change
+#if !defined(SPI_NODMA_APB_FREQ) && defined(__has_include)
+#if __has_include("esp_clk.h")
+#include "esp_clk.h"
+#define SPI_NODMA_APB_FREQ() esp_clk_apb_freq()
+#endif
+#endif
+#ifndef SPI_NODMA_APB_FREQ
+#define SPI_NODMA_APB_FREQ() APB_CLK_FREQ
+#endif
+#define SPI_NODMA_CLK_CACHE_SIZE 2  // Number of calculated clock dividers kept per device (e.g. display's write and read clock)
+#define SPI_NODMA_POOL_MAX 32       // Maximum number of transaction descriptors in the device's pool (bits of the free mask)
+#define SPI_NODMA_BUS_HIST_SIZE 16  // Number of buckets of the bus wait time histogram: < 1 us, 1 us, 2-3 us, 4-7 us, ... >= 16 ms
+#define SPI_NODMA_YIELD_WAIT_MS 10  // Maximal time spi_nodma_device_yield blocks waiting for the urgent device to take the bus before taking it back
+#ifndef SPI_NODMA_CAPTURE
+#define SPI_NODMA_CAPTURE 0         // Record the transactions into the capture ring (see spi_nodma_capture_start), set to 1 to compile it in
+#endif
+#define SPI_NODMA_CAPTURE_SIZE 128  // Number of records in the capture ring, the oldest records are overwritten
+#define SPI_NODMA_CAPTURE_DATA 16   // Number of the first transmitted data bytes kept in the record
+
+/**
+ * @brief Scheduling policies for the queued transactions of the devices attached to the same SPI host
+ */
+typedef enum {
+    SPI_SCHED_LOW_CS_FIRST=0,       ///< Device in the lowest slot with a waiting transaction is served first (default)
+    SPI_SCHED_ROUND_ROBIN,          ///< Devices with waiting transactions are served in turn
+    SPI_SCHED_PRIORITY,             ///< Device with the highest 'priority' is served first
+    SPI_SCHED_WEIGHTED_FAIR,        ///< Bus time (transferred bits) is shared between the devices by their 'weight'
+    SPI_SCHED_DEADLINE,             ///< Transaction with the earliest deadline ('deadline_us' after it was queued) is served first
+} spi_nodma_sched_policy_t;
+
+/**
+ * @brief Queued transactions wait time statistics of the spi device
+ */
+typedef struct {
+    uint32_t count;                 ///< Number of the transactions taken from the queue
+    uint32_t max_us;                ///< Longest time a transaction waited in the queue, in us
+    uint32_t avg_us;                ///< Average time a transaction waited in the queue, in us
+} spi_nodma_wait_stats_t;
+
+/**
+ * @brief Performance counters of the spi device or of the spi host (sum of the host and all its attached devices)
+ */
+typedef struct {
+    uint64_t tx_bytes;              ///< Number of bytes transmitted
+    uint64_t rx_bytes;              ///< Number of bytes received
+    uint32_t direct_trans;          ///< Number of direct mode transactions (spi_nodma_transfer_data, _batch, _async)
+    uint32_t queued_trans;          ///< Number of queued transactions sent
+    uint32_t kicks;                 ///< Number of hw transfers started (one per hw spi buffer chunk in direct mode)
+    uint32_t selects;               ///< Number of device selections which had to take the bus
+    uint32_t dev_switches;          ///< Number of times the spi registers were set for the device because another device used the bus
+    uint32_t bus_reconfigs;         ///< Number of times the bus pins were reconfigured for the device
+    uint32_t intr_count;            ///< Number of spi interrupts handled (host only)
+    uint64_t busy_wait_us;          ///< Time spent waiting for the hw transfer to finish in direct mode, in us
+    uint64_t select_wait_us;        ///< Time spent waiting for the bus mutex in spi_nodma_device_select, in us
+    uint64_t intr_us;               ///< Time spent in the spi interrupt handler, in us (host only)
+    uint32_t bus_timeouts;          ///< Number of times the bus was not obtained in 'bus_wait_ms'
+    uint32_t bus_yields;            ///< Number of times the bus was given to an urgent device at a preemption point
+    uint64_t bus_hold_us;           ///< Time the bus was held (device selected or spi_nodma_device_TakeSemaphore), in us
+    uint32_t bus_hold_max_us;       ///< Longest time the bus was held at once, in us
+    uint32_t bus_wait_hist[SPI_NODMA_BUS_HIST_SIZE];  ///< Bus wait times: [0] < 1 us, [i] 2^(i-1) .. 2^i-1 us, the last bucket counts all longer waits
+} spi_nodma_stats_t;
+
+#define SPI_CAPTURE_DIRECT  0       ///< Captured transaction was executed by spi_nodma_transfer_data or spi_nodma_transfer_batch
+#define SPI_CAPTURE_QUEUED  1       ///< Captured transaction was queued and executed from the spi interrupt
+
+/**
+ * @brief Record of a captured transaction (see spi_nodma_capture_start)
+ */
+typedef struct {
+    uint32_t seq;                   ///< Sequence number of the record
+    uint32_t start;                 ///< Cpu cycle count when the transaction was started
+    uint32_t end;                   ///< Cpu cycle count when the transaction was finished, equal to 'start' if it was not (yet)
+    uint32_t clock_hz;              ///< Device's effective spi clock
+    uint32_t dev_flags;             ///< Device's SPI_DEVICE_* flags
+    uint32_t txbits;                ///< Number of transmitted data bits
+    uint32_t rxbits;                ///< Number of received data bits
+    uint64_t address;               ///< Address phase value
+    uint16_t command;               ///< Command phase value
+    uint16_t flags;                 ///< Transaction's SPI_TRANS_* flags
+    uint8_t host;                   ///< Spi host (spi_nodma_host_device_t)
+    uint8_t dev;                    ///< Device's slot on the host
+    uint8_t kind;                   ///< SPI_CAPTURE_DIRECT or SPI_CAPTURE_QUEUED
+    uint8_t ndata;                  ///< Number of bytes in 'data'
+    uint8_t command_bits;           ///< Command phase length
+    uint8_t address_bits;           ///< Address phase length
+    uint8_t dummy_bits;             ///< Dummy phase length
+    uint8_t data[SPI_NODMA_CAPTURE_DATA];  ///< First transmitted data bytes
+} spi_nodma_capture_rec_t;
+
+/**
+ * @brief Formats of the exported capture
+ */
+typedef enum {
+    SPI_CAPTURE_FORMAT_TEXT=0,      ///< One line per record, read by the replay tool (tools/host_emu/spi_emu_replay)
+    SPI_CAPTURE_FORMAT_VCD,         ///< Value change dump of the CS, SCLK and MOSI lines, for logic analyzer software (GTKWave, PulseView, ...)
+} spi_nodma_capture_format_t;
 
 typedef struct spi_nodma_device_t spi_nodma_device_t;
 
+// Performance counters, times in cpu cycles; each set of counters is updated from one context only:
+// device's 'stats' by the task which has the device selected, device's 'isr_stats' and host's 'stats' by the spi interrupt
+typedef struct {
+    uint64_t tx_bytes;              // bytes transmitted
+    uint64_t rx_bytes;              // bytes received
+    uint32_t direct_trans;          // direct mode transactions
+    uint32_t queued_trans;          // queued transactions
+    uint32_t kicks;                 // hw transfers started
+    uint32_t selects;               // device selections
+    uint32_t dev_switches;          // device's registers written to hw
+    uint32_t bus_reconfigs;         // bus pins reconfigured
+    uint32_t intr_count;            // spi interrupts (host)
+    uint64_t busy_wait_cycles;      // cycles spent waiting for cmd.usr to clear
+    uint64_t select_wait_cycles;    // cycles spent waiting for the bus mutex
+    uint64_t intr_cycles;           // cycles spent in spi interrupt (host)
+    uint32_t bus_timeouts;          // bus not obtained in time (updated by the waiting task)
+    uint32_t bus_yields;            // bus given to an urgent device
+    uint64_t bus_hold_cycles;       // cycles the bus was held
+    uint32_t bus_hold_max;          // longest bus hold in cycles
+    uint32_t bus_wait_hist[SPI_NODMA_BUS_HIST_SIZE];  // bus wait time histogram
+} spi_nodma_counters_t;
+
+#if SPI_NODMA_STATS
+#define SPI_NODMA_STAT(x) do { x; } while (0)
+#else
+#define SPI_NODMA_STAT(x) do { } while (0)
+#endif
+
+// Register values of the device, computed when the device is added or its speed is changed
+// and written to the hw when the device is switched to
+typedef struct {
+    uint32_t clock;                 // 'clock' register
+    uint32_t ctrl;                  // bit order bits of the 'ctrl' register
+    uint32_t ctrl2;                 // 'ctrl2' register, cs setup & hold time and miso delay
+    uint32_t user;                  // device's bits of the 'user' register: phases used, edges, duplex & cs timing
+    uint32_t user1;                 // 'user1' register, address and dummy lengths
+    uint32_t user2;                 // 'user2' register, command length
+    uint32_t pin;                   // device's bits of the 'pin' register: clock idle edge & hw cs enable
+    uint32_t eff_clk;               // effective spi clock in Hz
+    uint32_t apb_clk;               // APB clock the values were calculated for
+} spi_nodma_dev_regs_t;
+
+// Transaction descriptor of the device's pool with its staging buffer
+typedef struct {
+    spi_nodma_transaction_t trans;  // must be the first member
+    void *buf;                      // dma capable staging buffer
+} spi_nodma_pool_item_t;
+
+// Preallocated transaction descriptors of the device (spi_nodma_trans_pool_init)
+typedef struct {
+    spi_nodma_pool_item_t *items;   // NULL if the pool is not created
+    uint8_t *bufs;                  // memory of all staging buffers
+    uint32_t count;                 // number of descriptors
+    uint32_t buf_size;              // size of each staging buffer in bytes
+    volatile uint32_t free;         // bit mask of the free descriptors
+} spi_nodma_trans_pool_t;
+
+// Calculated clock divider for the requested clock speed and APB clock
+typedef struct {
+    uint32_t hz;                    // requested clock speed, 0 if the entry is not used
+    uint32_t apb_clk;               // APB clock
+    uint32_t reg;                   // 'clock' register value
+    uint32_t eff_clk;               // effective spi clock
+} spi_nodma_clk_cache_t;
+
+// State of the direct mode transfer executed from interrupt (spi_nodma_transfer_data_async)
+typedef struct {
+    spi_nodma_transaction_t *trans; // transaction in progress, NULL if none
+    spi_nodma_device_t *dev;        // device of the transaction in progress
+    SemaphoreHandle_t done;         // given when the transaction is finished
+    const uint8_t *txbuf;           // next data to be placed to the hw spi buffer
+    uint32_t txleft;                // number of bytes still to be placed to the hw spi buffer
+    uint8_t *rxbuf;                 // where to place the next received data
+    uint32_t rxleft;                // number of bytes still to be received
+    uint32_t rxchunk;               // number of bytes received in the current transfer
+    uint32_t nextbits;              // number of bits prefilled in the next half of the hw spi buffer
+    uint32_t user_val;              // hw 'user' register value to restore after the transaction
+    uint8_t half;                   // half of the hw spi buffer to be sent next
+    spi_nodma_device_t * volatile hold; // device left selected with its software CS active, other devices' queued transactions wait for its deselect
+} spi_nodma_async_t;
+
+// Scheduler state of the SPI host
+typedef struct {
+    spi_nodma_sched_policy_t policy;    // scheduling policy
+    int max_run;                        // max number of consecutive transactions of the current device if others are waiting
+    int run;                            // number of consecutive transactions of the current device
+    uint32_t vclock;                    // virtual time of the last served device (SPI_SCHED_WEIGHTED_FAIR)
+} spi_nodma_sched_t;
+
+// Bus ownership; the bus mutex gives priority inheritance, owner tracking adds recursion
+typedef struct {
+    TaskHandle_t owner_task;                // task holding the bus, NULL if free
+    spi_nodma_device_t *owner;              // device for which the bus was taken
+    uint32_t depth;                         // number of nested takes by the owner task
+    uint32_t taken_time;                    // cpu cycle count when the bus was taken
+    volatile uint32_t urgent;               // number of SPI_DEVICE_BUS_URGENT devices waiting for the bus
+    volatile uint32_t yielding;             // the owner released the bus at a preemption point and waits for the handoff
+    SemaphoreHandle_t handoff;              // given by the task taking the bus while the owner yields
+} spi_nodma_arbiter_t;
+
 typedef struct {
     spi_nodma_device_t *device[NO_DEV];
+    spi_nodma_host_device_t host_dev;
     intr_handle_t intr;
+    volatile uint32_t intr_enabled;         // interrupt enable state, changed only by spi_nodma_intr_set
+    int intr_cpu;                           // cpu the interrupt is allocated on (SPI_NODMA_INTR_CPU_x)
     spi_dev_t *hw;
     spi_nodma_transaction_t *cur_trans;
     int cur_device;
-    lldesc_t dmadesc_tx, dmadesc_rx;
+    lldesc_t dmadesc[SPI_DMA_DESC_NUM];     // dma descriptors pool, shared by receive and transmit chains
     bool no_gpio_matrix;
     QueueHandle_t spi_nodma_bus_mutex;
     spi_nodma_bus_config_t cur_bus_config;
+    spi_nodma_async_t async;
+    spi_nodma_sched_t sched;
+    spi_nodma_arbiter_t arb;
+    spi_nodma_counters_t stats;             // host's performance counters (interrupt)
+#if SPI_NODMA_CAPTURE
+    spi_nodma_capture_rec_t *capture;       // capture record of the queued transaction in progress, NULL if none
+    uint32_t capture_seq;                   // its sequence number, the record may be overwritten meanwhile
+#endif
 } spi_nodma_host_t;
 
 struct spi_nodma_device_t {
@@ -144,6 +382,24 @@ struct spi_nodma_device_t {
     spi_nodma_host_t *host;
     spi_nodma_bus_config_t bus_config;
 	spi_nodma_host_device_t host_dev;
+    int cs;                         // slot of the device in host's 'device' array
+    volatile uint32_t inflight;     // number of queued transactions whose result was not yet taken
+    spi_nodma_dev_regs_t regs;      // precomputed register values of the device
+    volatile uint8_t regs_dirty;    // 'regs' were recalculated, the interrupt writes them before the next queued transaction
+    spi_nodma_clk_cache_t clk_cache[SPI_NODMA_CLK_CACHE_SIZE];  // recently used clock dividers
+    uint32_t clk_cache_next;        // clock cache entry to be replaced next
+    spi_nodma_trans_pool_t pool;    // preallocated transaction descriptors
+    uint32_t vtime;                 // virtual time, transferred bits divided by weight (SPI_SCHED_WEIGHTED_FAIR)
+    uint32_t deadline_cycles;       // 'deadline_us' in cpu cycles
+    TickType_t bus_wait_ticks;      // 'bus_wait_ms' in ticks
+    volatile uint32_t notify_done;  // finished SPI_TRANS_NOTIFY transactions not yet collected by spi_nodma_trans_wait
+    uint32_t notify_at;             // the waiting task is notified when 'notify_done' reaches this
+    TaskHandle_t notify_task;       // task waiting in spi_nodma_trans_wait, cleared by the interrupt which notifies it
+    uint32_t wait_count;            // number of transactions taken from the queue
+    uint32_t wait_max;              // longest queue wait time in cpu cycles
+    uint64_t wait_total;            // sum of queue wait times in cpu cycles
+    spi_nodma_counters_t stats;     // device's performance counters updated from task context
+    spi_nodma_counters_t isr_stats; // device's performance counters updated by the spi interrupt
 };
 
 typedef struct spi_nodma_device_t* spi_nodma_device_handle_t;  ///< Handle for a device on a SPI bus
@@ -192,6 +448,8 @@ esp_err_t spi_nodma_bus_remove_device(spi_nodma_device_handle_t handle);
  * @brief Return the actuall SPI bus speed for the spi device in Hz
  *
  * Some frequencies cannot be set, for example 30000000 will actually set SPI clock to 26666666 Hz
+ * The speed is calculated when the device is added or its speed is set, the spi bus is not accessed.
+ * If the APB clock was changed since, the speed the device will use after its next select is returned.
  *
  * @param handle Device handle obtained using spi_nodma_bus_add_device
  * 
@@ -205,6 +463,8 @@ uint32_t spi_nodma_get_speed(spi_nodma_device_handle_t handle);
  *        This function can be used after the device is initialized
  *
  * Some frequencies cannot be set, for example 30000000 will actually set SPI clock to 26666666 Hz
+ * The nearest possible clock is used, or the highest one not above 'speed' if the device has SPI_DEVICE_CLK_NOT_ABOVE flag.
+ * The last SPI_NODMA_CLK_CACHE_SIZE calculated dividers are kept, switching between them needs no calculation.
  *
  * @param handle Device handle obtained using spi_nodma_bus_add_device
  * @param speed  New device spi clock to be set in Hz
@@ -228,6 +488,8 @@ uint32_t spi_nodma_set_speed(spi_nodma_device_handle_t handle, uint32_t speed);
  * 
  * @return 
  *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_ERR_INVALID_STATE if the calling task has the bus taken for another device
+ *         - ESP_ERR_TIMEOUT       if the bus was not free in 'bus_wait_ms'
  *         - ESP_OK                on success
  */
 esp_err_t spi_nodma_device_select(spi_nodma_device_handle_t handle, int force);
@@ -272,15 +534,22 @@ void spi_nodma_get_native_pins(int host, int *sdi, int *sdo, int *sck);
 /**
  * @brief Transimit and receive data to/from spi device based on transaction data
  * 
- * TRANSMIT 8-bit data to spi device from 'trans->tx_buffer' or 'trans->tx_data' (trans->lenght/8 bytes)
- * and RECEIVE data to 'trans->rx_buffer' or 'trans->rx_data' (trans->rx_length/8 bytes)
- * Lengths must be 8-bit multiples!
+ * TRANSMIT data to spi device from 'trans->tx_buffer' or 'trans->tx_data' (trans->lenght bits)
+ * and RECEIVE data to 'trans->rx_buffer' or 'trans->rx_data' (trans->rx_length bits)
+ * Lengths can be any number of bits (9-bit words for 3-wire displays, for example), the bits are sent
+ *   in the order of bytes in the buffer; the last byte is partially sent/received if the length is not a multiple of 8
  * If trans->rx_buffer is NULL or trans->rx_length is 0, only transmits data
  * If trans->tx_buffer is NULL or trans->length is 0, only receives data
  * If the device is in duplex mode (SPI_DEVICE_HALFDUPLEX flag NOT set), data are transmitted and received simultaneously.
  * If the device is in half duplex mode (SPI_DEVICE_HALFDUPLEX flag IS set), data are received after transmission
  * 'address', 'command' and 'dummy bits' are transmitted before data phase IF set in device's configuration
  *   and IF 'trans->length' and 'trans->rx_length' are NOT both 0
+ * If only transmitting to the device without command, address and dummy phases, the data are streamed
+ *   through both halves of the hw spi buffer (see spi_nodma_stream_begin)
+ * In full duplex mode without command, address and dummy phases, the transmitted and received data are streamed
+ *   through both halves of the hw spi buffer; if trans->rxlength > trans->length, the rest is received after transmission
+ * With SPI_TRANS_MODE_DIO/SPI_TRANS_MODE_QIO flags the data (and, with SPI_TRANS_MODE_DIOQIO_ADDR, the address)
+ *   are transferred on 2/4 lines, only in half duplex mode; the bus must be initialized with 'quadwp_io_num' and 'quadhd_io_num' for QIO
  * If device was not previously selected, it will be selected before transmission and deselected after transmission.
  *
  * @param handle Device handle obtained using spi_nodma_bus_add_device
@@ -295,6 +564,66 @@ void spi_nodma_get_native_pins(int host, int *sdi, int *sdo, int *sck);
  */
 esp_err_t spi_nodma_transfer_data(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans);
 
+/**
+ * @brief Execute an array of transactions back to back in direct mode
+ *
+ * Each transaction is executed as with 'spi_nodma_transfer_data', but the device is selected
+ * (and the spi bus semaphore taken) only once for the whole batch.
+ * All transactions are checked before anything is sent.
+ * Device's 'pre_cb' and 'post_cb' callbacks are called before and after each transaction,
+ * as with 'spi_nodma_transfer_data' (use 'pre_cb' to set the DC line from 'user', for example).
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ * @param trans Pointer to the array of transactions
+ * @param n Number of transactions in the array
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter or any of the transactions is invalid
+ *         - ESP error code        if device cannot be selected
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_transfer_batch(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans, int n);
+
+
+/**
+ * @brief Start transmitting and receiving data to/from spi device in direct mode, without waiting for the transfer to finish
+ *
+ * The hw spi buffer is refilled/emptied from the spi interrupt, the calling task is free to do other work
+ * while the data are transferred. The transmit and receive buffers must stay valid until the transfer is finished.
+ *
+ * Device must be selected before calling this function and deselected after the transfer is finished.
+ * 'command', 'address' and 'dummy bits' are transmitted only once, before the first data.
+ * Data are transmitted first and then received, receiving while transmitting (full duplex) is not supported.
+ * Lengths must be 8-bit multiples, data are transferred in 1-bit mode (SPI_TRANS_MODE_DIO/QIO are not supported).
+ * When the transfer is finished, device's 'post_cb' callback is called FROM THE INTERRUPT CONTEXT
+ * and the host's completion semaphore is given (see spi_nodma_transfer_async_wait); task notifications are not used.
+ * If the device uses software CS, other devices' queued transactions are not sent until it is deselected.
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ * @param trans Pointer to variable containing the description of the transaction that is executed
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_ERR_INVALID_STATE if the device is not selected or another transfer is in progress
+ *         - ESP_ERR_NOT_SUPPORTED if full duplex receive or DIO/QIO mode is requested
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_transfer_data_async(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans);
+
+/**
+ * @brief Wait for the transfer started with spi_nodma_transfer_data_async to finish
+ *
+ * Can be called from any task, also after the transfer is already finished.
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ * @param ticks_to_wait Max. total ticks to wait for the transfer to finish; use portMAX_DELAY to never time out.
+ *
+ * @return
+ *         - ESP_ERR_TIMEOUT       if the transfer was not finished in time
+ *         - ESP_OK                if no transfer is in progress
+ */
+esp_err_t spi_nodma_transfer_async_wait(spi_nodma_device_handle_t handle, TickType_t ticks_to_wait);
+
 
 /**
  * @brief Queue a SPI transaction for execution
@@ -329,6 +658,73 @@ esp_err_t spi_device_queue_trans(spi_nodma_device_handle_t handle, spi_nodma_tra
  */
 esp_err_t spi_device_get_trans_result(spi_nodma_device_handle_t handle, spi_nodma_transaction_t **trans_desc, TickType_t ticks_to_wait);
 
+/**
+ * @brief Wait for the completion of 'count' queued SPI_TRANS_NOTIFY transactions of the device
+ *
+ * The transactions are not put into the result queue, so spi_device_get_trans_result is not used for them.
+ * The spi interrupt counts the completions and notifies the waiting task only once, when 'count' transactions
+ * are finished, so one wakeup covers a batch of transactions. Completions counted before the call are included.
+ * Only one task should wait for the device's transactions; the task's notification value is used.
+ *
+ * @param handle        Device handle obtained using spi_nodma_bus_add_device
+ * @param count         Number of the finished transactions to wait for
+ * @param ticks_to_wait Ticks to wait until the transactions are finished; use portMAX_DELAY to never time out
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_ERR_TIMEOUT       if the transactions were not finished in time (none of the completions is collected)
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_trans_wait(spi_nodma_device_handle_t handle, uint32_t count, TickType_t ticks_to_wait);
+
+/**
+ * @brief Create the device's pool of preallocated transaction descriptors
+ *
+ * Each descriptor has its own dma capable staging buffer of 'buf_size' bytes, so several transactions
+ * can be prepared and queued while the previous ones are in progress, without heap allocations.
+ * The pool is freed when the device is removed.
+ *
+ * @param handle   Device handle obtained using spi_nodma_bus_add_device
+ * @param count    Number of descriptors (1 - SPI_NODMA_POOL_MAX)
+ * @param buf_size Size of each staging buffer in bytes, can be 0
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_ERR_INVALID_STATE if the pool already exists
+ *         - ESP_ERR_NO_MEM        if out of memory
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_trans_pool_init(spi_nodma_device_handle_t handle, int count, uint32_t buf_size);
+
+/**
+ * @brief Take a transaction descriptor from the device's pool
+ *
+ * Lock free, can also be called from the 'post_cb' callback (interrupt context).
+ * The descriptor is returned cleared, with 'tx_buffer' set to its staging buffer.
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ *
+ * @return
+ *         - pointer to the descriptor
+ *         - NULL if the pool is not created or all descriptors are in use
+ */
+spi_nodma_transaction_t *spi_nodma_trans_get(spi_nodma_device_handle_t handle);
+
+/**
+ * @brief Return the staging buffer of the descriptor taken with spi_nodma_trans_get
+ */
+void *spi_nodma_trans_buffer(spi_nodma_transaction_t *trans);
+
+/**
+ * @brief Return the descriptor taken with spi_nodma_trans_get to the device's pool
+ *
+ * Lock free, can also be called from the 'post_cb' callback (interrupt context).
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ * @param trans  Descriptor, it must not be used after this call
+ */
+void spi_nodma_trans_put(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans);
+
 
 /**
  * @brief Do a SPI transaction
@@ -346,16 +742,265 @@ esp_err_t spi_device_get_trans_result(spi_nodma_device_handle_t handle, spi_nodm
  */
 esp_err_t spi_device_transmit(spi_nodma_device_handle_t handle, spi_nodma_transaction_t *trans_desc);
 
+/**
+ * @brief Set the policy used to choose which device's queued transaction is sent next
+ *
+ * If the device used for the last transaction has more transactions waiting, it is preferred
+ * (no bus reconfiguration is needed) for up to 'max_run' consecutive transactions, as long as the policy allows it:
+ * with SPI_SCHED_PRIORITY only if no device with higher priority is waiting, with SPI_SCHED_DEADLINE
+ * only if no other waiting transaction has missed its deadline.
+ * SPI_SCHED_LOW_CS_FIRST policy does not prefer the current device.
+ *
+ * @param host SPI peripheral (HSPI or VSPI), must be initialized
+ * @param policy Scheduling policy
+ * @param max_run Max number of consecutive transactions of the same device while others are waiting;
+ *                0 to use the default (SPI_SCHED_MAX_RUN), 1 to always switch
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_ERR_INVALID_STATE if the host is not initialized
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_set_sched_policy(spi_nodma_host_device_t host, spi_nodma_sched_policy_t policy, int max_run);
+
+/**
+ * @brief Get the statistics of the time the device's queued transactions waited for the bus
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ * @param stats Pointer to the variable to receive the statistics
+ * @param reset If not 0, reset the statistics after reading
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_get_wait_stats(spi_nodma_device_handle_t handle, spi_nodma_wait_stats_t *stats, int reset);
+
+/**
+ * @brief Get the performance counters of the spi device or of the spi host
+ *
+ * Counters are collected only if SPI_NODMA_STATS is not 0, otherwise all values are 0.
+ * Host totals include the counters of the devices currently attached to the host;
+ * counters of the removed devices are not included.
+ *
+ * @param host SPI peripheral (HSPI or VSPI), must be initialized; used if 'handle' is NULL
+ * @param handle Device handle obtained using spi_nodma_bus_add_device, or NULL to get the host totals
+ * @param stats Pointer to the variable to receive the counters
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_ERR_INVALID_STATE if the host is not initialized
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_get_stats(spi_nodma_host_device_t host, spi_nodma_device_handle_t handle, spi_nodma_stats_t *stats);
+
+/**
+ * @brief Reset the performance counters of the spi device or of the spi host and all its devices
+ *
+ * @param host SPI peripheral (HSPI or VSPI), must be initialized; used if 'handle' is NULL
+ * @param handle Device handle obtained using spi_nodma_bus_add_device, or NULL to reset the host and all its devices
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_ERR_INVALID_STATE if the host is not initialized
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_reset_stats(spi_nodma_host_device_t host, spi_nodma_device_handle_t handle);
+
+/**
+ * @brief Start recording the transactions of all hosts into the capture ring
+ *
+ * A record is added for each transaction executed by spi_nodma_transfer_data, spi_nodma_transfer_batch
+ * or from the spi interrupt (queued transactions); device, phase lengths, command and address, the first
+ * SPI_NODMA_CAPTURE_DATA transmitted bytes and start/end cpu cycle counts are recorded.
+ * Transfers started directly with spi_nodma_kick or the stream functions are not recorded.
+ * The capture is only available if SPI_NODMA_CAPTURE is not 0.
+ *
+ * @param clear If not 0, records of the previous capture are removed
+ */
+void spi_nodma_capture_start(int clear);
+
+/**
+ * @brief Stop recording the transactions, the recorded transactions are kept
+ */
+void spi_nodma_capture_stop(void);
+
+/**
+ * @brief Copy the recorded transactions, oldest first
+ *
+ * The capture should be stopped, records added while copying may be inconsistent.
+ *
+ * @param recs Buffer for the records
+ * @param max  Maximal number of records copied
+ *
+ * @return Number of copied records, 0 if the capture is not available
+ */
+int spi_nodma_capture_read(spi_nodma_capture_rec_t *recs, int max);
+
+/**
+ * @brief Write the recorded transactions to the file, oldest first
+ *
+ * In SPI_CAPTURE_FORMAT_VCD format the command, address and recorded data bits are drawn at the device's clock
+ * on one data line; the rest of the transaction is shown as an unknown clock until its recorded end.
+ * Overlapping transactions of different hosts are drawn one after the other.
+ *
+ * @param f      Opened file
+ * @param format SPI_CAPTURE_FORMAT_TEXT or SPI_CAPTURE_FORMAT_VCD
+ *
+ * @return
+ *         - ESP_ERR_INVALID_ARG   if parameter is invalid
+ *         - ESP_ERR_NOT_SUPPORTED if the capture is not available (SPI_NODMA_CAPTURE is 0)
+ *         - ESP_FAIL              if writing to the file failed
+ *         - ESP_OK                on success
+ */
+esp_err_t spi_nodma_capture_export(FILE *f, spi_nodma_capture_format_t format);
+
+
+/**
+ * @brief State of the ping-pong transmit stream
+ *
+ * While one half of the hw spi buffer (data_buf[0-7] or data_buf[8-15]) is being sent,
+ * the other half can be filled with the next data.
+ */
+typedef struct {
+    spi_dev_t *hw;                  ///< Hw registers of the spi host
+    spi_nodma_device_handle_t dev;  ///< Device the data are streamed to
+    uint8_t half;                   ///< Half of the hw spi buffer used for the next transfer (0: data_buf[0-7], 1: data_buf[8-15])
+    uint16_t bits;                  ///< Data length of the last transfer in bits, 0 if not set
+} spi_nodma_stream_t;
+
+#define SPI_NODMA_STREAM_BUF_SIZE 32    // Size of one half of the hw spi buffer in bytes (8 32-bit words)
+
+/**
+ * @brief Wait for the hw transfer of the selected device to finish
+ *
+ * The time spent waiting is added to device's 'busy_wait_us' counter
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ */
+static inline void IRAM_ATTR spi_nodma_wait_ready(spi_nodma_device_handle_t handle)
+{
+    spi_dev_t *hw = handle->host->hw;
+    if (hw->cmd.usr == 0) return;
+#if SPI_NODMA_STATS
+    uint32_t t = xthal_get_ccount();
+    while (hw->cmd.usr);
+    handle->stats.busy_wait_cycles += xthal_get_ccount() - t;
+#else
+    while (hw->cmd.usr);
+#endif
+}
+
+/**
+ * @brief Start the hw transfer prepared in the spi registers of the selected device
+ *
+ * Task context only, the spi interrupt counts its transfers in device's 'isr_stats'
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ * @param txbytes Number of bytes transmitted by the transfer, for the performance counters
+ * @param rxbytes Number of bytes received by the transfer, for the performance counters
+ */
+static inline void IRAM_ATTR spi_nodma_kick(spi_nodma_device_handle_t handle, uint32_t txbytes, uint32_t rxbytes)
+{
+    SPI_NODMA_STAT(handle->stats.tx_bytes += txbytes; handle->stats.rx_bytes += rxbytes; handle->stats.kicks++);
+    handle->host->hw->cmd.usr = 1;
+}
+
+/**
+ * @brief Start transmit only streaming to the selected spi device
+ *
+ * Waits for the spi bus to be ready and prepares the spi host for transmitting data from
+ * alternating halves of the hw spi buffer. Nothing is received during the stream.
+ * Device must be selected and in the state to receive the data (DC set etc.)
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ * @param stream Pointer to the stream state variable
+ *
+ * @return
+ *         - pointer to the first half of hw spi buffer to be filled (max SPI_NODMA_STREAM_BUF_SIZE bytes)
+ */
+volatile uint32_t *spi_nodma_stream_begin(spi_nodma_device_handle_t handle, spi_nodma_stream_t *stream);
+
+/**
+ * @brief Send the filled half of the hw spi buffer
+ *
+ * Waits for the previous transfer to finish, starts sending the filled half and returns immediately,
+ * so the other half can be filled while the data are on the wire.
+ *
+ * @param stream Pointer to the stream state variable
+ * @param bits   Number of bits to send from the filled half (1 - SPI_NODMA_STREAM_BUF_SIZE*8)
+ *
+ * @return
+ *         - pointer to the next half of hw spi buffer to be filled
+ */
+volatile uint32_t *spi_nodma_stream_kick(spi_nodma_stream_t *stream, uint32_t bits);
+
+/**
+ * @brief Send the data from the start of the hw spi buffer again
+ *
+ * For repeated data (fills): the buffer returned by spi_nodma_stream_begin is filled once, up to its
+ * whole size (both halves), and sent as many times as needed. The halves are not switched,
+ * the data length register is only written if 'bits' differs from the previous transfer.
+ * Waits for the previous transfer to finish, starts the transfer and returns immediately.
+ * Don't mix with spi_nodma_stream_kick in the same stream.
+ *
+ * @param stream Pointer to the stream state variable
+ * @param bits   Number of bits to send from data_buf[0] (1 - SPI_NODMA_HWBUF_SIZE*8)
+ */
+void spi_nodma_stream_repeat(spi_nodma_stream_t *stream, uint32_t bits);
+
+/**
+ * @brief Wait for the last transfer of the stream to finish and restore the spi host settings
+ *
+ * @param stream Pointer to the stream state variable
+ */
+void spi_nodma_stream_end(spi_nodma_stream_t *stream);
+
 
 /*
  * Non queued transfers uses the semaphore (taken in select function) to protect the transfer
  * This pair of functions can be used if mixed queued & non-queued transfers are used at the same time
  * 'spi_device_TakeSemaphore' can be used before 'spi_device_queue_trans' or 'spi_device_transmit'
  * 'spi_device_GiveSemaphore' can be used after 'spi_device_get_trans_result' or 'spi_device_transmit'
+ * The bus can be taken recursively by the task holding it for the same device (e.g. selecting the device after TakeSemaphore),
+ * each take must be matched by a give from the same task. Taking it for another device returns ESP_ERR_INVALID_STATE. TakeSemaphore waits max. 'bus_wait_ms' (ESP_ERR_TIMEOUT).
  */
 esp_err_t spi_nodma_device_TakeSemaphore(spi_nodma_device_handle_t handle);
 void spi_nodma_device_GiveSemaphore(spi_nodma_device_handle_t handle);
 
+/**
+ * @brief Preemption point: give the bus to a waiting SPI_DEVICE_BUS_URGENT device
+ *
+ * Can be called by the task which has the device selected between the parts of a long transfer.
+ * If an urgent device waits for the bus, the device's software CS is deactivated and the bus is released.
+ * The calling task blocks until the bus is taken by the waiting task (max. SPI_NODMA_YIELD_WAIT_MS),
+ * so also a lower priority urgent task gets it, then waits for the bus again; the urgent task inherits
+ * the caller's priority meanwhile. The device's registers are written again if needed.
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ *
+ * @return
+ *         - 1 if the bus was given to another device; hw settings not belonging to the device must be set again
+ *         - 0 if no urgent device was waiting or the bus can't be released (queued or async transfer in progress)
+ *         - -1 if the bus could not be taken back; the device is deselected and the transfer must be abandoned
+ */
+int spi_nodma_device_yield(spi_nodma_device_handle_t handle);
+
+/**
+ * @brief Check if a SPI_DEVICE_BUS_URGENT device waits for the bus of the device's host
+ *
+ * Cheap test to be done before preparing a preemption point (e.g. finishing a queued transfer)
+ *
+ * @param handle Device handle obtained using spi_nodma_bus_add_device
+ *
+ * @return
+ *         - 1 if spi_nodma_device_yield would give the bus to an urgent device
+ */
+static inline int IRAM_ATTR spi_nodma_device_urgent(spi_nodma_device_handle_t handle)
+{
+    return ((handle->host->arb.urgent) && ((handle->cfg.flags & SPI_DEVICE_BUS_URGENT) == 0));
+}
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,105 @@
+/*
+ *
+ * HW SPI BUFFER FILL/DRAIN KERNELS
+ *
+ * Copy data between the caller's byte buffers and the 16-word (64 byte) hw spi buffer ('data_buf').
+ * Whole words are moved with one 32-bit access each; if the caller's buffer is not word aligned,
+ * the words are assembled from aligned reads of the words inside the buffer, the bytes before
+ * the first aligned word and after the last one are handled byte by byte (nothing outside the buffer is read).
+ *
+ * The kernels only depend on the C library, so they can also be built on the host (see tools/spi_buf_bench.c)
+ *
+*/
+
+#ifndef _SPI_NODMA_BUF_H_
+#define _SPI_NODMA_BUF_H_
+
+#include <stdint.h>
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+#define SPI_NODMA_HWBUF_SIZE 64     // Size of the hw spi buffer in bytes (16 32-bit words)
+
+// 32-bit word which may alias any buffer type
+typedef uint32_t __attribute__((__may_alias__)) spi_nodma_word_t;
+
+// Copy 'len' bytes (max SPI_NODMA_HWBUF_SIZE) from 'src' to hw spi buffer 'buf'
+// The byte order is the same as the order in which the bytes are sent on spi bus (lowest byte first)
+//-------------------------------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_nodma_buf_fill(volatile uint32_t *buf, const uint8_t *src, uint32_t len)
+{
+	uint32_t nwords = len >> 2;
+	uint32_t tail = len & 3;
+	uint32_t shift = ((uintptr_t)src & 3) * 8;
+	uint32_t i, wd;
+
+	if (shift == 0) {
+		// ** Source is word aligned, copy whole words
+		const spi_nodma_word_t *s = (const spi_nodma_word_t *)src;
+		for (i=0; i<nwords; i++) buf[i] = s[i];
+	}
+	else if (nwords) {
+		// ** Source is not aligned, assemble the words from the bytes left from the previous aligned read
+		//    and the next aligned read; the 'head' bytes before the first aligned word and the bytes
+		//    of the last word after the last aligned word inside the source are loaded byte by byte
+		uint32_t head = 4 - (shift >> 3);
+		const spi_nodma_word_t *s = (const spi_nodma_word_t *)(src + head);
+		uint32_t w0 = 0;
+		for (i=0; i<head; i++) w0 |= (uint32_t)src[i] << (i * 8);
+		for (i=0; i<(nwords-1); i++) {
+			wd = *s++;
+			buf[i] = w0 | (wd << (32 - shift));
+			w0 = wd >> shift;
+		}
+		for (i=head; i<4; i++) w0 |= (uint32_t)src[((nwords-1) * 4) + i] << (i * 8);
+		buf[nwords-1] = w0;
+	}
+
+	if (tail) {
+		// ** Last, partial word
+		src += nwords * 4;
+		wd = (uint32_t)src[0];
+		if (tail > 1) wd |= (uint32_t)src[1] << 8;
+		if (tail > 2) wd |= (uint32_t)src[2] << 16;
+		buf[nwords] = wd;
+	}
+}
+
+// Copy 'len' bytes (max SPI_NODMA_HWBUF_SIZE) from hw spi buffer 'buf' to 'dst'
+//-------------------------------------------------------------------------------------------
+static inline void IRAM_ATTR spi_nodma_buf_drain(volatile uint32_t *buf, uint8_t *dst, uint32_t len)
+{
+	uint32_t nwords = len >> 2;
+	uint32_t tail = len & 3;
+	uint32_t i, wd;
+
+	if (((uintptr_t)dst & 3) == 0) {
+		// ** Destination is word aligned, copy whole words
+		spi_nodma_word_t *d = (spi_nodma_word_t *)dst;
+		for (i=0; i<nwords; i++) d[i] = buf[i];
+	}
+	else {
+		// ** Destination is not aligned, store the words byte by byte
+		for (i=0; i<nwords; i++) {
+			wd = buf[i];
+			dst[(i*4)] = (uint8_t)wd;
+			dst[(i*4)+1] = (uint8_t)(wd >> 8);
+			dst[(i*4)+2] = (uint8_t)(wd >> 16);
+			dst[(i*4)+3] = (uint8_t)(wd >> 24);
+		}
+	}
+
+	if (tail) {
+		// ** Last, partial word
+		dst += nwords * 4;
+		wd = buf[nwords];
+		for (i=0; i<tail; i++) {
+			dst[i] = (uint8_t)wd;
+			wd >>= 8;
+		}
+	}
+}
+
+#endif
@@ -150,6 +150,147 @@ void TFT_drawPixel(int16_t x, int16_t y, color_t color, uint8_t sel) {
   drawPixel(x, y, color, sel);
 }
 
+// Sort key of the pixel, by row and column
+#define PIXEL_KEY(p) (((uint32_t)(uint16_t)(p).y << 16) | (uint16_t)(p).x)
+
+// Pixels collected by the drawing functions, sent with TFT_drawPixels() when full or at the end of drawing
+static tft_pixel_t pix_batch[TFT_PIXEL_BATCH_SIZE];
+static tft_pixel_t pix_sort_buf[TFT_PIXEL_BATCH_SIZE];
+static int pix_batch_count = 0;
+
+// Stable sort of pixels by row and column, 'tmp' must have place for 'count' pixels
+// Bottom-up merge sort, the result is copied back to 'pixels' if needed
+//--------------------------------------------------------------------------
+static void sortPixels(tft_pixel_t *pixels, tft_pixel_t *tmp, int count) {
+	tft_pixel_t *src = pixels;
+	tft_pixel_t *dst = tmp;
+	tft_pixel_t *t;
+	int i, l, r, lend, rend, k;
+
+	for (int width=1; width < count; width *= 2) {
+		for (i=0; i < count; i += 2*width) {
+			l = i;
+			lend = min(i+width, count);
+			r = lend;
+			rend = min(i+2*width, count);
+			k = i;
+			while ((l < lend) && (r < rend)) {
+				// equal keys are taken from the left part first, the order of drawing is kept
+				if (PIXEL_KEY(src[r]) < PIXEL_KEY(src[l])) dst[k++] = src[r++];
+				else dst[k++] = src[l++];
+			}
+			while (l < lend) dst[k++] = src[l++];
+			while (r < rend) dst[k++] = src[r++];
+		}
+		t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != pixels) memcpy(pixels, src, count * sizeof(tft_pixel_t));
+}
+
+// Stable sort without additional memory, used if the buffer can't be allocated
+//-----------------------------------------------------------------
+static void sortPixelsInsert(tft_pixel_t *pixels, int count) {
+	tft_pixel_t p;
+	int j;
+
+	for (int i=1; i < count; i++) {
+		p = pixels[i];
+		for (j=i; (j > 0) && (PIXEL_KEY(pixels[j-1]) > PIXEL_KEY(p)); j--) pixels[j] = pixels[j-1];
+		pixels[j] = p;
+	}
+}
+
+// draw batch of color pixels on screen
+//----------------------------------------------------
+void TFT_drawPixels(tft_pixel_t *pixels, int count) {
+	int n = 0;
+
+	// clipping
+	for (int i=0; i < count; i++) {
+		if ((pixels[i].x < dispWin.x1) || (pixels[i].y < dispWin.y1) || (pixels[i].x > dispWin.x2) || (pixels[i].y > dispWin.y2)) continue;
+		if (n != i) pixels[n] = pixels[i];
+		n++;
+	}
+	if (n == 0) return;
+
+	if (n <= TFT_PIXEL_BATCH_SIZE) sortPixels(pixels, pix_sort_buf, n);
+	else {
+		tft_pixel_t *tmp = malloc(n * sizeof(tft_pixel_t));
+		if (tmp) {
+			sortPixels(pixels, tmp, n);
+			free(tmp);
+		}
+		else sortPixelsInsert(pixels, n);
+	}
+
+	drawPixels(pixels, n);
+}
+
+// fill batch of rectangles
+//----------------------------------------------
+void TFT_fillRects(tft_rect_t *rects, int count) {
+	int n = 0;
+	tft_rect_t *r, *last;
+
+	for (int i=0; i < count; i++) {
+		r = &rects[i];
+		// clipping
+		if (r->x < dispWin.x1) {
+			r->w -= (dispWin.x1 - r->x);
+			r->x = dispWin.x1;
+		}
+		if (r->y < dispWin.y1) {
+			r->h -= (dispWin.y1 - r->y);
+			r->y = dispWin.y1;
+		}
+		if ((r->x + r->w) > (dispWin.x2+1)) r->w = dispWin.x2 - r->x + 1;
+		if ((r->y + r->h) > (dispWin.y2+1)) r->h = dispWin.y2 - r->y + 1;
+		if ((r->w <= 0) || (r->h <= 0)) continue;
+
+		// merge with the previous rectangle if it continues it horizontally or vertically with the same color
+		if (n > 0) {
+			last = &rects[n-1];
+			if (compare_colors(last->color, r->color) == 0) {
+				if ((last->y == r->y) && (last->h == r->h) && ((last->x + last->w) == r->x)) {
+					last->w += r->w;
+					continue;
+				}
+				if ((last->x == r->x) && (last->w == r->w) && ((last->y + last->h) == r->y)) {
+					last->h += r->h;
+					continue;
+				}
+			}
+		}
+		if (n != i) rects[n] = *r;
+		n++;
+	}
+	if (n > 0) fillRects(rects, n);
+}
+
+// add pixel to the batch sent at the end of drawing
+//------------------------------------------------------------------
+static void batchPixel(int16_t x, int16_t y, color_t color) {
+	if ((x < dispWin.x1) || (y < dispWin.y1) || (x > dispWin.x2) || (y > dispWin.y2)) return;
+
+	pix_batch[pix_batch_count].x = x;
+	pix_batch[pix_batch_count].y = y;
+	pix_batch[pix_batch_count].color = color;
+	pix_batch_count++;
+	if (pix_batch_count == TFT_PIXEL_BATCH_SIZE) {
+		TFT_drawPixels(pix_batch, pix_batch_count);
+		pix_batch_count = 0;
+	}
+}
+
+// send the batched pixels
+//--------------------------
+static void batchFlush() {
+	if (pix_batch_count) TFT_drawPixels(pix_batch, pix_batch_count);
+	pix_batch_count = 0;
+}
+
 //-------------------------------------------
 color_t TFT_readPixel(int16_t x, int16_t y) {
 
@@ -238,7 +379,6 @@ static void drawCircleHelper(int16_t x0, int16_t y0, int16_t r, uint8_t cornerna
 	int16_t x = 0;
 	int16_t y = r;
 
-	disp_select();
 	while (x < y) {
 		if (f >= 0) {
 			y--;
@@ -249,23 +389,23 @@ static void drawCircleHelper(int16_t x0, int16_t y0, int16_t r, uint8_t cornerna
 		ddF_x += 2;
 		f += ddF_x;
 		if (cornername & 0x4) {
-			TFT_drawPixel(x0 + x, y0 + y, color, 0);
-			TFT_drawPixel(x0 + y, y0 + x, color, 0);
+			batchPixel(x0 + x, y0 + y, color);
+			batchPixel(x0 + y, y0 + x, color);
 		}
 		if (cornername & 0x2) {
-			TFT_drawPixel(x0 + x, y0 - y, color, 0);
-			TFT_drawPixel(x0 + y, y0 - x, color, 0);
+			batchPixel(x0 + x, y0 - y, color);
+			batchPixel(x0 + y, y0 - x, color);
 		}
 		if (cornername & 0x8) {
-			TFT_drawPixel(x0 - y, y0 + x, color, 0);
-			TFT_drawPixel(x0 - x, y0 + y, color, 0);
+			batchPixel(x0 - y, y0 + x, color);
+			batchPixel(x0 - x, y0 + y, color);
 		}
 		if (cornername & 0x1) {
-			TFT_drawPixel(x0 - y, y0 - x, color, 0);
-			TFT_drawPixel(x0 - x, y0 - y, color, 0);
+			batchPixel(x0 - y, y0 - x, color);
+			batchPixel(x0 - x, y0 - y, color);
 		}
 	}
-	disp_deselect();
+	batchFlush();
 }
 
 // Used to do circles and roundrects
@@ -509,11 +649,10 @@ void TFT_drawCircle(int16_t x, int16_t y, int radius, color_t color) {
   int x1 = 0;
   int y1 = radius;
 
-  disp_select();
-  TFT_drawPixel(x, y + radius, color, 0);
-  TFT_drawPixel(x, y - radius, color, 0);
-  TFT_drawPixel(x + radius, y, color, 0);
-  TFT_drawPixel(x - radius, y, color, 0);
+  batchPixel(x, y + radius, color);
+  batchPixel(x, y - radius, color);
+  batchPixel(x + radius, y, color);
+  batchPixel(x - radius, y, color);
   while(x1 < y1) {
     if (f >= 0) {
       y1--;
@@ -523,16 +662,16 @@ void TFT_drawCircle(int16_t x, int16_t y, int radius, color_t color) {
     x1++;
     ddF_x += 2;
     f += ddF_x;
-    TFT_drawPixel(x + x1, y + y1, color, 0);
-    TFT_drawPixel(x - x1, y + y1, color, 0);
-    TFT_drawPixel(x + x1, y - y1, color, 0);
-    TFT_drawPixel(x - x1, y - y1, color, 0);
-    TFT_drawPixel(x + y1, y + x1, color, 0);
-    TFT_drawPixel(x - y1, y + x1, color, 0);
-    TFT_drawPixel(x + y1, y - x1, color, 0);
-    TFT_drawPixel(x - y1, y - x1, color, 0);
+    batchPixel(x + x1, y + y1, color);
+    batchPixel(x - x1, y + y1, color);
+    batchPixel(x + x1, y - y1, color);
+    batchPixel(x - x1, y - y1, color);
+    batchPixel(x + y1, y + x1, color);
+    batchPixel(x - y1, y + x1, color);
+    batchPixel(x + y1, y - x1, color);
+    batchPixel(x - y1, y - x1, color);
   }
-  disp_deselect();
+  batchFlush();
 }
 
 //---------------------------------------------------------------------
@@ -544,16 +683,14 @@ void TFT_fillCircle(int16_t x, int16_t y, int radius, color_t color) {
 //--------------------------------------------------------------------------------------------------------------------
 static void TFT_draw_ellipse_section(uint16_t x, uint16_t y, uint16_t x0, uint16_t y0, color_t color, uint8_t option)
 {
-	disp_select();
     // upper right
-    if ( option & TFT_ELLIPSE_UPPER_RIGHT ) TFT_drawPixel(x0 + x, y0 - y, color, 0);
+    if ( option & TFT_ELLIPSE_UPPER_RIGHT ) batchPixel(x0 + x, y0 - y, color);
     // upper left
-    if ( option & TFT_ELLIPSE_UPPER_LEFT ) TFT_drawPixel(x0 - x, y0 - y, color, 0);
+    if ( option & TFT_ELLIPSE_UPPER_LEFT ) batchPixel(x0 - x, y0 - y, color);
     // lower right
-    if ( option & TFT_ELLIPSE_LOWER_RIGHT ) TFT_drawPixel(x0 + x, y0 + y, color, 0);
+    if ( option & TFT_ELLIPSE_LOWER_RIGHT ) batchPixel(x0 + x, y0 + y, color);
     // lower left
-    if ( option & TFT_ELLIPSE_LOWER_LEFT ) TFT_drawPixel(x0 - x, y0 + y, color, 0);
-	disp_deselect();
+    if ( option & TFT_ELLIPSE_LOWER_LEFT ) batchPixel(x0 - x, y0 + y, color);
 }
 
 //-------------------------------------------------------------------------------------------------------
@@ -643,7 +780,7 @@ void TFT_draw_ellipse(uint16_t x0, uint16_t y0, uint16_t rx, uint16_t ry, color_
       ychg += rxrx2;
     }
   }
-
+  batchFlush();
 }
 
 //---------------------------------------------------------------------------------------------------------------------------
@@ -1101,7 +1238,6 @@ static int rotatePropChar(int x, int y, int offset) {
   float sin_radian = sin(radian);
 
   uint8_t mask = 0x80;
-  disp_select();
   for (int j=0; j < fontChar.height; j++) {
     for (int i=0; i < fontChar.width; i++) {
       if (((i + (j*fontChar.width)) % 8) == 0) {
@@ -1112,13 +1248,13 @@ static int rotatePropChar(int x, int y, int offset) {
       int newX = (int)(x + (((offset + i) * cos_radian) - ((j+fontChar.adjYOffset)*sin_radian)));
       int newY = (int)(y + (((j+fontChar.adjYOffset) * cos_radian) + ((offset + i) * sin_radian)));
 
-      if ((ch & mask) != 0) TFT_drawPixel(newX,newY,_fg, 0);
-      else if (!_transparent) TFT_drawPixel(newX,newY,_bg, 0);
+      if ((ch & mask) != 0) batchPixel(newX,newY,_fg);
+      else if (!_transparent) batchPixel(newX,newY,_bg);
 
       mask >>= 1;
     }
   }
-  disp_deselect();
+  batchFlush();
 
   return fontChar.xDelta+1;
 }
@@ -1137,7 +1273,6 @@ static int printProportionalChar(int x, int y) {
 
   // draw Glyph
   uint8_t mask = 0x80;
-  disp_select();
   for (j=0; j < fontChar.height; j++) {
     for (i=0; i < fontChar.width; i++) {
       if (((i + (j*fontChar.width)) % 8) == 0) {
@@ -1148,12 +1283,12 @@ static int printProportionalChar(int x, int y) {
       if ((ch & mask) !=0) {
         cx = (uint16_t)(x+fontChar.xOffset+i);
         cy = (uint16_t)(y+j+fontChar.adjYOffset);
-        TFT_drawPixel(cx, cy, _fg, 0);
+        batchPixel(cx, cy, _fg);
       }
       mask >>= 1;
     }
   }
-  disp_deselect();
+  batchFlush();
 
   return fontChar.xDelta;
 }
@@ -1176,7 +1311,6 @@ static void printChar(uint8_t c, int x, int y) {
     TFT_fillRect(x, y, cfont.x_size, cfont.y_size, _bg);
   }
 
-  disp_select();
   for (j=0; j<cfont.y_size; j++) {
     for (k=0; k < fz; k++) {
       ch = cfont.font[temp+k];
@@ -1185,14 +1319,14 @@ static void printChar(uint8_t c, int x, int y) {
         if ((ch & mask) !=0) {
           cx = (uint16_t)(x+i+(k*8));
           cy = (uint16_t)(y+j);
-          TFT_drawPixel(cx, cy, _fg, 0);
+          batchPixel(cx, cy, _fg);
         }
         mask >>= 1;
       }
     }
     temp += (fz);
   }
-  disp_deselect();
+  batchFlush();
 }
 
 // rotated fixed width character
@@ -1210,7 +1344,6 @@ static void rotateChar(uint8_t c, int x, int y, int pos) {
   else fz = cfont.x_size/8;
   temp=((c-cfont.offset)*((fz)*cfont.y_size))+4;
 
-  disp_select();
   for (j=0; j<cfont.y_size; j++) {
     for (zz=0; zz<(fz); zz++) {
       ch = cfont.font[temp+zz];
@@ -1219,14 +1352,14 @@ static void rotateChar(uint8_t c, int x, int y, int pos) {
         newx=(int)(x+(((i+(zz*8)+(pos*cfont.x_size))*cos_radian)-((j)*sin_radian)));
         newy=(int)(y+(((j)*cos_radian)+((i+(zz*8)+(pos*cfont.x_size))*sin_radian)));
 
-        if ((ch & mask) != 0) TFT_drawPixel(newx,newy,_fg, 0);
-        else if (!_transparent) TFT_drawPixel(newx,newy,_bg, 0);
+        if ((ch & mask) != 0) batchPixel(newx,newy,_fg);
+        else if (!_transparent) batchPixel(newx,newy,_bg);
         mask >>= 1;
       }
     }
     temp+=(fz);
   }
-  disp_deselect();
+  batchFlush();
   // calculate x,y for the next char
   TFT_X = (int)(x + ((pos+1) * cfont.x_size * cos_radian));
   TFT_Y = (int)(y + ((pos+1) * cfont.x_size * sin_radian));
@@ -1749,6 +1882,8 @@ static UINT tjd_output (
 	uint16_t right = rect->right + dev->x;
 	uint16_t bottom = rect->bottom + dev->y;
 	uint8_t *dest = (uint8_t *)tft_line;
+	color_t color;
+	disp_pixel_t wd;
 
 	if ((left >= _width) || (top >= _height)) return 1;	// out of screen area, return
 
@@ -1761,9 +1896,14 @@ static UINT tjd_output (
 		    for (x = left; x <= right; x++) {
 		    	// Clip to display area
 		    	if ((x < _width) && (y < _height)) {
-		    		*dest++ = *src++;
-		    		*dest++ = *src++;
-		    		*dest++ = *src++;
+		    		// Convert to display's native pixel format
+		    		color.r = *src++;
+		    		color.g = *src++;
+		    		color.b = *src++;
+		    		wd = color2native(color);
+		    		*dest++ = (uint8_t)wd;
+		    		*dest++ = (uint8_t)(wd >> 8);
+		    		if (COLOR_BITS == 24) *dest++ = (uint8_t)(wd >> 16);
 		    		if (dright < x) dright = x;
 		    		if (dbottom < y) dbottom = y;
 		    	}
@@ -1772,8 +1912,8 @@ static UINT tjd_output (
 	    }
 		len = ((dright-left+1) * (dbottom-top+1));		// calculate length of data
 
-		disp_deselect();
-		send_data(left, top, dright, dbottom, len, tft_line);
+		disp_line_yield();	// an urgent device may use the spi bus between the blocks
+		send_native_line(left, top, dright, dbottom, len, (uint8_t *)tft_line);
 	}
 	else {
 		printf("max data size exceded: %d (%d,%d,%d,%d)\r\n", len, left,top,right,bottom);
@@ -1931,9 +2071,10 @@ int tft_bmp_image(int x, int y, char *fname, uint8_t *imgbuf, int size)
 	struct stat sb;
 	uint32_t xrd = 0;
 	uint8_t err = 9;
-	uint8_t tmpc;
+	color_t color;
+	disp_pixel_t wd;
+	uint8_t *dest;
 	int i;
-	uint8_t use_trans = tft_use_trans;
 
     if (!tft_line) {
 	    printf("Line buffer not allocated\r\n");
@@ -2010,9 +2151,6 @@ exithd:
 		goto exit;
 	}
 
-	// :TODO, When using DMA mode, BMP does not work well, force direct mode;
-	tft_use_trans = 0;
-
 	while (ysize > 0) {
 		// Position at line start
 		// ** BMP images are stored in file from LAST to FIRST line
@@ -2043,23 +2181,26 @@ exithd:
 			printf("Error reading line: %d (%d)\r\n", y, xrd);
 			break;
 		}
-		// Convert colors BGR-888 (BMP) -> RGB-888 (DISPLAY)
+		// Convert colors BGR-888 (BMP) -> display's native pixel format, in place
+		dest = buf;
 		for (i=0;i < xrd;i += 3) {
-			tmpc = buf[i+2] & 0xfc;    // save R
-			buf[i+2] = buf[i] & 0xfc;  // B -> R
-			buf[i] = tmpc;             // R -> B
-			buf[i+1] &= 0xfc;          // G
+			color.b = buf[i];
+			color.g = buf[i+1];
+			color.r = buf[i+2];
+			wd = color2native(color);
+			*dest++ = (uint8_t)wd;
+			*dest++ = (uint8_t)(wd >> 8);
+			if (COLOR_BITS == 24) *dest++ = (uint8_t)(wd >> 16);
 		}
 
-		disp_deselect();
-	    send_data(x, y, xend, y, disp_xsize, tft_line);
+	    disp_line_yield();	// an urgent device may use the spi bus between the lines
+	    send_native_line(x, y, xend, y, disp_xsize, buf);
 
 		y++;	// next image line
 		if (y >= _height) break;
 		ysize--;
 	}
 	disp_deselect();
-	tft_use_trans = use_trans;  // restore mode
 
 exit:
 	if (fhndl) fclose(fhndl);
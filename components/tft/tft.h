@@ -23,6 +23,9 @@
 // this can be changed with setAngleOffset function at runtime
 #define DEFAULT_ANGLE_OFFSET -90
 
+// Number of pixels collected by circle, ellipse and character drawing functions before they are sent with TFT_drawPixels()
+#define TFT_PIXEL_BATCH_SIZE 256
+
 // Color definitions constants
 const color_t TFT_BLACK;
 const color_t TFT_NAVY;
@@ -94,6 +97,29 @@ uint8_t     _forceFixed;    // if not zero force drawing proportional fonts with
 */
 void TFT_drawPixel(int16_t x, int16_t y, color_t color, uint8_t sel);
 
+/*
+ * Draw batch of pixels
+ * All pixels are sent with one activation of the CS, sorted by row and column;
+ * adjacent pixels in the same row with the same color are sent as one write.
+ * If the same coordinates are given more than once, the last pixel is drawn.
+ * 
+ * Params:
+ *   pixels: array of pixels (x, y, color); it is clipped and sorted in place
+ *    count: number of pixels in the array
+*/
+void TFT_drawPixels(tft_pixel_t *pixels, int count);
+
+/*
+ * Fill batch of rectangles
+ * All rectangles are filled with one activation of the CS, in the given order;
+ * a rectangle continuing the previous one horizontally or vertically with the same color is merged with it.
+ * 
+ * Params:
+ *    rects: array of rectangles (x, y, w, h, color); it is clipped and merged in place
+ *    count: number of rectangles in the array
+*/
+void TFT_fillRects(tft_rect_t *rects, int count);
+
 /*
  * Read pixel color value from display GRAM at given x,y coordinates
  * 
@@ -7,15 +7,19 @@
 #include <string.h>
 #include "esp_system.h"
 #include "tftfunc.h"
+#include "spi_nodma_buf.h"
 #include "freertos/task.h"
+#include "soc/gpio_struct.h"
+#include "soc/spi_reg.h"
 
 // ### set it to 16 for ILI9341; 24 for ILI9488 ###
 
 // RGB to GRAYSCALE constants
 // 0.2989  0.5870  0.1140
-#define GS_FACT_R 0.2989
-#define GS_FACT_G 0.4870
-#define GS_FACT_B 0.2140
+// used: 0.2989  0.4870  0.2140, as 16-bit fixed point fractions (sum < 65536, no overflow for 255,255,255)
+#define GS_FACT_R 19589
+#define GS_FACT_G 31916
+#define GS_FACT_B 14025
 
 
 uint8_t tft_use_trans = 1;
@@ -35,18 +39,56 @@ uint8_t tft_disp_type = DISP_TYPE_ILI9488;
 spi_nodma_device_handle_t disp_spi = NULL;
 spi_nodma_device_handle_t ts_spi = NULL;
 
-static spi_nodma_transaction_t tft_trans;
+// Number of display transaction descriptors, one is prepared while the other is sent
+#define DISP_TRANS_POOL_SIZE	2
 
+// Queued display transaction, its completion is notified directly to the waiting task
+static spi_nodma_transaction_t *disp_trans_queued = NULL;
+
+// Address window last set on the display and the position where the next pixel is written
+typedef struct {
+	uint16_t x1, x2;	// columns set with CASET
+	uint16_t y1, y2;	// pages (rows) set with PASET
+	uint16_t x, y;		// position of the next pixel written
+	uint8_t win;		// window is known
+	uint8_t pos;		// position is known, RAM write can continue
+	uint8_t ramwr;		// RAM write command to use for the next write
+} disp_win_t;
+
+static disp_win_t disp_win = { .ramwr = TFT_RAMWR };
+
+// On timeout the transaction stays queued and its descriptor in use, the next call waits for it again
 //-------------------------------------
 esp_err_t IRAM_ATTR wait_trans_finish()
 {
     if (!tft_in_trans) return ESP_OK;
 
-    spi_nodma_transaction_t *rtrans;
     // Wait for transaction to be done
-    esp_err_t ret = spi_device_get_trans_result(disp_spi, &rtrans, 1000*portTICK_RATE_MS);
+    esp_err_t ret = spi_nodma_trans_wait(disp_spi, 1, 1000 / portTICK_RATE_MS);
+    if (ret != ESP_OK) return ret;
+
+    spi_nodma_trans_put(disp_spi, disp_trans_queued);
+    disp_trans_queued = NULL;
     tft_in_trans = 0;
-    return ret;
+    return ESP_OK;
+}
+
+// Get the transaction descriptor from the display device's pool
+// The pool is created on first use, the staging buffers hold one line of pixels in the current color mode
+// Returns NULL if the pool can't be created or its buffers are smaller than 'size' bytes
+// (the color mode was changed after the pool was created); direct mode is used then
+//----------------------------------------------------------------------
+static spi_nodma_transaction_t IRAM_ATTR *disp_trans_get(uint32_t size)
+{
+	if ((disp_spi->pool.items) && (size > disp_spi->pool.buf_size)) return NULL;
+
+	spi_nodma_transaction_t *trans = spi_nodma_trans_get(disp_spi);
+	if (trans) return trans;
+
+	if (disp_spi->pool.items) return NULL;
+	if (spi_nodma_trans_pool_init(disp_spi, DISP_TRANS_POOL_SIZE, TFT_LINEBUF_MAX_SIZE*DISP_PIXEL_BYTES) != ESP_OK) return NULL;
+	if (size > disp_spi->pool.buf_size) return NULL;
+	return spi_nodma_trans_get(disp_spi);
 }
 
 //-------------------------------
@@ -83,136 +125,390 @@ static void IRAM_ATTR disp_spi_transfer_start(int bits) {
 		disp_spi->host->hw->user.usr_miso = 1;
 	}
 	// Start transfer
-	disp_spi->host->hw->cmd.usr = 1;
+	spi_nodma_kick(disp_spi, (bits+7)/8, (disp_spi->cfg.flags & SPI_DEVICE_HALFDUPLEX) ? 0 : (bits+7)/8);
     // Wait for SPI bus ready
-	while (disp_spi->host->hw->cmd.usr);
+	spi_nodma_wait_ready(disp_spi);
+}
+
+// Set D/C pin to 0 (command) or 1 (data) with a single gpio register write
+#if DISP_SPI_9BIT
+#define DISP_DC_CMD()	do {} while (0)
+#define DISP_DC_DATA()	do {} while (0)
+#elif (PIN_NUM_DC < 32)
+#define DISP_DC_CMD()	(GPIO.out_w1tc = (1 << PIN_NUM_DC))
+#define DISP_DC_DATA()	(GPIO.out_w1ts = (1 << PIN_NUM_DC))
+#else
+#define DISP_DC_CMD()	(GPIO.out1_w1tc.data = (1 << (PIN_NUM_DC - 32)))
+#define DISP_DC_DATA()	(GPIO.out1_w1ts.data = (1 << (PIN_NUM_DC - 32)))
+#endif
+
+// Start sending 1 byte display command with D/C pin set to 0, display must be selected
+// With DISP_SPI_CMD_PHASE the command is sent in the hw command phase and the hw spi buffer
+// can be filled with the following data while the command is on the wire
+// disp_spi_cmd_end() must be called before the next transfer
+//------------------------------------------------------
+static void IRAM_ATTR disp_spi_cmd_start(uint8_t cmd) {
+	// Wait for SPI bus ready
+	spi_nodma_wait_ready(disp_spi);
+
+	DISP_DC_CMD();
+#if DISP_SPI_CMD_PHASE
+	disp_spi->host->hw->user.usr_mosi = 0;
+	disp_spi->host->hw->user.usr_miso = 0;
+	disp_spi->host->hw->user.usr_command = 1;
+	disp_spi->host->hw->user2.val = (7 << SPI_USR_COMMAND_BITLEN_S) | cmd;
+	spi_nodma_kick(disp_spi, 1, 0);
+#else
+	disp_spi->host->hw->data_buf[0] = (uint32_t)cmd;
+	disp_spi_transfer_start(8);
+#endif
+}
+
+// Wait until the command is sent and restore the device command phase setup
+//-----------------------------------------
+static void IRAM_ATTR disp_spi_cmd_end() {
+	spi_nodma_wait_ready(disp_spi);
+#if DISP_SPI_CMD_PHASE
+	disp_spi->host->hw->user.usr_command = (disp_spi->regs.user & SPI_USR_COMMAND) ? 1 : 0;
+	disp_spi->host->hw->user2.val = disp_spi->regs.user2;
+#endif
+}
+
+#if DISP_SPI_9BIT
+// Packing of the bytes to 9-bit words of the 3-wire display interface
+typedef struct {
+	uint64_t acc;		// bits not yet placed to the hw spi buffer, the highest is sent first
+	uint32_t nbits;		// number of bits in 'acc'
+	uint32_t idx;		// next 32-bit word of the hw spi buffer
+} disp_pack9_t;
+
+// Add 9-bit word, D/C flag 'dc' followed by 'data' byte, to the hw spi buffer 'buf'
+// Bits are placed in the order of sending, MSB of the lowest byte first
+//----------------------------------------------------------------------------------------------------------
+static inline void IRAM_ATTR disp_pack9(disp_pack9_t *pk, volatile uint32_t *buf, uint32_t data, uint32_t dc)
+{
+	pk->acc = (pk->acc << 9) | (dc << 8) | (data & 0xFF);
+	pk->nbits += 9;
+	if (pk->nbits >= 32) {
+		pk->nbits -= 32;
+		buf[pk->idx++] = __builtin_bswap32((uint32_t)(pk->acc >> pk->nbits));
+	}
+}
+
+// Place the remaining bits to the hw spi buffer and start a new packing
+//-------------------------------------------------------------------------------
+static inline void IRAM_ATTR disp_pack9_flush(disp_pack9_t *pk, volatile uint32_t *buf)
+{
+	if (pk->nbits) buf[pk->idx] = __builtin_bswap32((uint32_t)(pk->acc << (32 - pk->nbits)));
+	pk->acc = 0;
+	pk->nbits = 0;
+	pk->idx = 0;
 }
 
+// Send the command (if cmd >= 0) followed by 'len' data bytes as 9-bit words, display must be selected
+//---------------------------------------------------------------------------------------------
+static void IRAM_ATTR disp_spi_transfer_9bit(int cmd, const uint8_t *data, uint32_t len)
+{
+	spi_nodma_stream_t stream;
+	disp_pack9_t pk = {0};
+	uint32_t items = 0;
+	volatile uint32_t *buf = spi_nodma_stream_begin(disp_spi, &stream);
+
+	if (cmd >= 0) {
+		disp_pack9(&pk, buf, (uint32_t)cmd, 0);
+		items++;
+	}
+	for (uint32_t i=0; i<len; i++) {
+		if (items == DISP_9BIT_HALF_ITEMS) {
+			disp_pack9_flush(&pk, buf);
+			buf = spi_nodma_stream_kick(&stream, items*9);
+			items = 0;
+		}
+		disp_pack9(&pk, buf, data[i], 1);
+		items++;
+	}
+	if (items) {
+		disp_pack9_flush(&pk, buf);
+		spi_nodma_stream_kick(&stream, items*9);
+	}
+	spi_nodma_stream_end(&stream);
+}
+#endif
+
 // Send 1 byte display command, display must be selected
 //------------------------------------------------
 void IRAM_ATTR disp_spi_transfer_cmd(int8_t cmd) {
+	// The command may change the address window or the memory access, the window is set again on next write
+	disp_addrwin_invalidate();
+#if DISP_SPI_9BIT
 	// Wait for SPI bus ready
-	while (disp_spi->host->hw->cmd.usr);
-
-	// Set DC to 0 (command mode);
-    gpio_set_level(PIN_NUM_DC, 0);
-
-    disp_spi->host->hw->data_buf[0] = (uint32_t)cmd;
-    disp_spi_transfer_start(8);
+	spi_nodma_wait_ready(disp_spi);
+
+	// D/C flag 0 (command) is sent first
+    disp_spi->host->hw->data_buf[0] = __builtin_bswap32((uint32_t)(uint8_t)cmd << 23);
+    disp_spi_transfer_start(9);
+#else
+	disp_spi_cmd_start((uint8_t)cmd);
+	disp_spi_cmd_end();
+#endif
 }
 
 // Send command with data to display, display must be selected
 //----------------------------------------------------------------------------------
 void IRAM_ATTR disp_spi_transfer_cmd_data(int8_t cmd, uint8_t *data, uint32_t len) {
-	// Wait for SPI bus ready
-	while (disp_spi->host->hw->cmd.usr);
+	disp_addrwin_invalidate();
 
-    // Set DC to 0 (command mode);
-    gpio_set_level(PIN_NUM_DC, 0);
+	// Wait for SPI bus ready
+	spi_nodma_wait_ready(disp_spi);
 
-    disp_spi->host->hw->data_buf[0] = (uint32_t)cmd;
-    disp_spi_transfer_start(8);
+#if DISP_SPI_9BIT
+	disp_spi_transfer_9bit((uint8_t)cmd, data, len);
+#else
+	disp_spi_cmd_start((uint8_t)cmd);
+	disp_spi_cmd_end();
 
 	if (len == 0) return;
 
-    // Set DC to 1 (data mode);
-	gpio_set_level(PIN_NUM_DC, 1);
+	DISP_DC_DATA();
 
-	uint8_t idx=0, bidx=0;
-	uint32_t bits=0;
-	uint32_t count=0;
-	uint32_t wd = 0;
+	// Send data, filling one half of the hw spi buffer while the other half is sent
+	spi_nodma_stream_t stream;
+	volatile uint32_t *buf = spi_nodma_stream_begin(disp_spi, &stream);
+	uint32_t count = 0;
+	uint32_t size;
 	while (count < len) {
-		// get data byte from buffer
-		wd |= (uint32_t)data[count] << bidx;
-    	count++;
-    	bits += 8;
-		bidx += 8;
-    	if (count == len) {
-    		disp_spi->host->hw->data_buf[idx] = wd;
-    		break;
-    	}
-		if (bidx == 32) {
-			disp_spi->host->hw->data_buf[idx] = wd;
-			idx++;
-			bidx = 0;
-			wd = 0;
-		}
-    	if (idx == 16) {
-    		// SPI buffer full, send data
-			disp_spi_transfer_start(bits);
-    		
-			bits = 0;
-    		idx = 0;
-			bidx = 0;
-    	}
-    }
-    if (bits > 0) disp_spi_transfer_start(bits);
+		size = len - count;
+		if (size > SPI_NODMA_STREAM_BUF_SIZE) size = SPI_NODMA_STREAM_BUF_SIZE;
+		spi_nodma_buf_fill(buf, data+count, size);
+		count += size;
+		buf = spi_nodma_stream_kick(&stream, size*8);
+	}
+	spi_nodma_stream_end(&stream);
+#endif
+}
+
+// Preemption point inside a pixel stream, between whole pixels after a stream kick
+// If an urgent device waits for the spi bus, the stream is ended and the bus is given to it (spi_nodma_device_yield);
+// when it is taken back, the memory write continues where it stopped (RAMWRC) and the stream is started again,
+// '*buf' then points to the start of the hw spi buffer, whose contents are lost if the bus was given.
+// Returns 1 if the bus was given, 0 if not, -1 if it could not be taken back (display deselected, stop writing)
+//-------------------------------------------------------------------------------------
+static int IRAM_ATTR disp_stream_yield(spi_nodma_stream_t *stream, volatile uint32_t **buf)
+{
+	if (!spi_nodma_device_urgent(disp_spi)) return 0;
+
+	spi_nodma_stream_end(stream);
+	int res = spi_nodma_device_yield(disp_spi);
+	if (res < 0) return res;
+	if (res) {
+		// CS was deactivated, which ends the memory write on the display
+#if DISP_SPI_9BIT
+		disp_spi_transfer_9bit(TFT_RAMWRC, NULL, 0);
+#else
+		disp_spi_cmd_start(TFT_RAMWRC);
+		disp_spi_cmd_end();
+		DISP_DC_DATA();
+#endif
+	}
+	*buf = spi_nodma_stream_begin(disp_spi, stream);
+	return res;
+}
+
+// Preemption point between the image lines sent with send_native_line()
+// If an urgent device waits for the spi bus, the line in flight is finished and the bus is given to it;
+// the next line sets the address window and sends the RAM write command as usual
+//------------------------------
+void IRAM_ATTR disp_line_yield()
+{
+	if (!spi_nodma_device_urgent(disp_spi)) return;
+	if (wait_trans_finish() != ESP_OK) return;
+	spi_nodma_device_yield(disp_spi);
+}
+
+// Forget the address window and the write position, both are set again on the next write
+//------------------------------------------
+void IRAM_ATTR disp_addrwin_invalidate()
+{
+	disp_win.win = 0;
+	disp_win.pos = 0;
+	disp_win.ramwr = TFT_RAMWR;
+}
+
+// Move the write position after 'len' pixels are written from (x,y) in the current window
+// Returns 0 if the pixels don't fit in the window
+//-----------------------------------------------------------------------------
+static int IRAM_ATTR disp_addrwin_advance(uint16_t x, uint16_t y, uint32_t len)
+{
+	uint32_t w = disp_win.x2 - disp_win.x1 + 1;
+	uint32_t idx = (x - disp_win.x1) + len;
+
+	if ((y + ((idx - 1) / w)) > disp_win.y2) return 0;
+
+	disp_win.x = disp_win.x1 + (idx % w);
+	disp_win.y = y + (idx / w);
+	disp_win.pos = (disp_win.y <= disp_win.y2);	// at the end of the window the position wraps
+	return 1;
 }
 
 // Set the address window for display write & read commands, display must be selected
-//---------------------------------------------------------------------------------------------------
-static void IRAM_ATTR disp_spi_transfer_addrwin(uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2) {
-	uint32_t wd;
+// 'len' is the number of pixels written next, 0 for reading
+// The RAM write command to be used after it is set in 'disp_win.ramwr'
+//----------------------------------------------------------------------------------------------------------------
+static void IRAM_ATTR disp_spi_transfer_addrwin(uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2, uint32_t len) {
+	uint16_t wx2 = x2;
+	uint16_t wy2 = y2;
+	uint8_t caset = 1, paset = 1;
+
+#if DISP_ADDRWIN_CACHE
+	if (len) {
+		// ** The write continues where the previous one ended; either all pixels are placed in the current row
+		//    or the window has the same columns, no window needs to be set
+		if ((disp_win.pos) && (disp_win.x == x1) && (disp_win.y == y1) &&
+				(((len <= (uint32_t)(x2-x1+1)) && ((x1+len-1) <= disp_win.x2)) || ((x1 == disp_win.x1) && (x2 == disp_win.x2)))) {
+			if (disp_addrwin_advance(x1, y1, len)) {
+				disp_win.ramwr = TFT_RAMWRC;
+				return;
+			}
+		}
+		// ** The pixels are written row by row and the write stops after 'len' pixels,
+		//    so the window can extend to the display's last row, and to the last column if the write
+		//    ends in the first row; the window then often needs no change for the next write
+		if ((len < (uint32_t)(x2-x1+1)) && (x2 < (_width-1))) wx2 = _width-1;
+		if (y2 < (_height-1)) wy2 = _height-1;
+	}
+	if (disp_win.win) {
+		caset = ((x1 != disp_win.x1) || (wx2 != disp_win.x2));
+		paset = ((y1 != disp_win.y1) || (wy2 != disp_win.y2));
+	}
+#endif
+	disp_win.x1 = x1;
+	disp_win.x2 = wx2;
+	disp_win.y1 = y1;
+	disp_win.y2 = wy2;
+	disp_win.win = 1;
+	disp_win.ramwr = TFT_RAMWR;
+	if (len) {
+		// RAM write starts at the window's start
+		if (!disp_addrwin_advance(x1, y1, len)) disp_win.pos = 0;
+	}
+	else disp_win.pos = 0;
 
 	// Wait for SPI bus ready
-	while (disp_spi->host->hw->cmd.usr);
-	disp_spi_transfer_cmd(TFT_CASET);
-
-	wd = (uint32_t)(x1>>8);
-	wd |= (uint32_t)(x1&0xff) << 8;
-	wd |= (uint32_t)(x2>>8) << 16;
-	wd |= (uint32_t)(x2&0xff) << 24;
+	spi_nodma_wait_ready(disp_spi);
+
+#if DISP_SPI_9BIT
+	// Command and its 4 data bytes are sent in one transfer
+	uint8_t data[4];
+	if (caset) {
+		data[0] = x1>>8; data[1] = x1&0xff; data[2] = wx2>>8; data[3] = wx2&0xff;
+		disp_spi_transfer_9bit(TFT_CASET, data, 4);
+	}
+	if (paset) {
+		data[0] = y1>>8; data[1] = y1&0xff; data[2] = wy2>>8; data[3] = wy2&0xff;
+		disp_spi_transfer_9bit(TFT_PASET, data, 4);
+	}
+#else
+	uint32_t wd;
 
-    // Set DC to 1 (data mode);
-	gpio_set_level(PIN_NUM_DC, 1);
+	if (caset) {
+		disp_spi_cmd_start(TFT_CASET);
 
-	disp_spi->host->hw->data_buf[0] = wd;
-    disp_spi_transfer_start(32);
+		// the data is placed to the hw spi buffer while the command is sent
+		wd = (uint32_t)(x1>>8);
+		wd |= (uint32_t)(x1&0xff) << 8;
+		wd |= (uint32_t)(wx2>>8) << 16;
+		wd |= (uint32_t)(wx2&0xff) << 24;
+		disp_spi->host->hw->data_buf[0] = wd;
 
-	disp_spi_transfer_cmd(TFT_PASET);
+		disp_spi_cmd_end();
+		DISP_DC_DATA();
+		disp_spi_transfer_start(32);
+	}
 
-	wd = (uint32_t)(y1>>8);
-	wd |= (uint32_t)(y1&0xff) << 8;
-	wd |= (uint32_t)(y2>>8) << 16;
-	wd |= (uint32_t)(y2&0xff) << 24;
+	if (paset) {
+		disp_spi_cmd_start(TFT_PASET);
 
-    // Set DC to 1 (data mode);
-	gpio_set_level(PIN_NUM_DC, 1);
+		wd = (uint32_t)(y1>>8);
+		wd |= (uint32_t)(y1&0xff) << 8;
+		wd |= (uint32_t)(wy2>>8) << 16;
+		wd |= (uint32_t)(wy2&0xff) << 24;
+		disp_spi->host->hw->data_buf[0] = wd;
 
-	disp_spi->host->hw->data_buf[0] = wd;
-    disp_spi_transfer_start(32);
+		disp_spi_cmd_end();
+		DISP_DC_DATA();
+		disp_spi_transfer_start(32);
+	}
+#endif
 }
 
-// Convert color to gray scale
-//----------------------------------------------
-static color_t IRAM_ATTR color2gs(color_t color)
+// Convert color to gray scale level, integer only
+//-----------------------------------------------------------
+static inline uint32_t IRAM_ATTR color2gs(color_t color)
 {
-    color_t _color;
-    float gs_clr;
-
-    gs_clr = GS_FACT_R * color.r + GS_FACT_G * color.g + GS_FACT_B * color.b;
+	return ((GS_FACT_R * color.r) + (GS_FACT_G * color.g) + (GS_FACT_B * color.b)) >> 16;
+}
 
-    _color.r = (uint8_t)gs_clr;
-	_color.g = (uint8_t)gs_clr;
-	_color.b = (uint8_t)gs_clr;
+// Convert color to native pixel data, gray scale conversion is done in the same step
+// 'gs' and 'bits' are passed so that the pixel loops can keep them in registers
+//-------------------------------------------------------------------------------------------
+static inline disp_pixel_t IRAM_ATTR _color2native(color_t color, uint8_t gs, uint8_t bits)
+{
+	uint32_t r = color.r;
+	uint32_t g = color.g;
+	uint32_t b = color.b;
+
+	if (gs) {
+		r = color2gs(color);
+		g = r;
+		b = r;
+	}
+	if (bits == 16) {
+		// RGB 16-bit, 2 byte format, sent as rrrrrggg gggbbbbb
+		return (r & 0xF8) | (g >> 5) | ((g & 0x1C) << 11) | ((b & 0xF8) << 5);
+	}
+	// RGB 18-bit, 3 byte format, sent as r, g, b
+	return r | (g << 8) | (b << 16);
+}
 
-	return _color;
+// Convert color to the display's native pixel format, in the order of sending (lowest byte first)
+//-------------------------------------------------
+disp_pixel_t IRAM_ATTR color2native(color_t color)
+{
+	return _color2native(color, gray_scale, COLOR_BITS);
 }
 
-//---------------------------------------
-static uint32_t pack_color(color_t color)
+// Convert 'len' colors to native pixels, 'dst' may be the same buffer as 'src'
+//-----------------------------------------------------------------------------------
+uint32_t IRAM_ATTR colors2native(uint8_t *dst, const color_t *src, uint32_t len)
 {
-	uint32_t color16 = 0;
-	uint8_t *buf16 = (uint8_t *)(&color16);
+	uint8_t *d = dst;
+	uint8_t gs = gray_scale;
+	uint8_t bits = COLOR_BITS;
+	disp_pixel_t wd;
+
+	for (uint32_t n=0; n<len; n++) {
+		wd = _color2native(src[n], gs, bits);
+		*d++ = (uint8_t)wd;
+		*d++ = (uint8_t)(wd >> 8);
+		if (bits == 24) *d++ = (uint8_t)(wd >> 16);
+	}
+	return d - dst;
+}
 
-	// Convert RGB 18-bit, 3 byte colors to RGB 16-bit, 2 byte format
-	buf16[0] = color.r & 0xF8;
-	buf16[0] |= (color.g & 0xE0) >> 5;
-	buf16[1] = (color.g & 0x1C) << 3;
-	buf16[1] |= (color.b & 0xF8) >> 3;
+// Send one pixel to the address window, display must be selected
+//----------------------------------------------------
+static void IRAM_ATTR _TFT_sendPixel(disp_pixel_t wd)
+{
+#if DISP_SPI_9BIT
+	disp_spi_transfer_9bit(disp_win.ramwr, (uint8_t *)&wd, COLOR_BITS/8);
+#else
+	disp_spi_cmd_start(disp_win.ramwr);
+	disp_spi->host->hw->data_buf[0] = wd;
+	disp_spi_cmd_end();
 
-	return color16;
+	DISP_DC_DATA();
+    disp_spi_transfer_start(COLOR_BITS);
+#endif
 }
 
 // Set display pixel at given coordinates to given color
@@ -226,33 +522,63 @@ void IRAM_ATTR drawPixel(int16_t x, int16_t y, color_t color, uint8_t sel)
 	}
 	else wait_trans_finish();
 
-	disp_spi_transfer_addrwin(x, x+1, y, y+1);
+	disp_spi_transfer_addrwin(x, x+1, y, y+1, 1);
 
-    color_t _color;
-	uint32_t wd;
-
-	disp_spi_transfer_cmd(TFT_RAMWR);
+	_TFT_sendPixel(color2native(color));
 
-	if (gray_scale) _color = color2gs(color);
-	else _color = color;
+    if (sel) disp_deselect();
+}
 
-	if (COLOR_BITS == 16) {
-		wd = pack_color(_color);
-	}
-	else {
-		wd = (uint32_t)_color.r;
-		wd |= (uint32_t)_color.g << 8;
-		wd |= (uint32_t)_color.b << 16;
+#if !DISP_SPI_9BIT
+// Fill the hw spi buffer with 'count' colors 'wd' (3-byte colors continue across the 32-bit words)
+//-------------------------------------------------------------------------------------
+static void IRAM_ATTR _TFT_fillColorBuf(volatile uint32_t *buf, uint32_t wd, uint32_t count)
+{
+	uint64_t acc = 0;
+	uint32_t nbits = 0, idx = 0;
+
+	for (uint32_t n=0; n<count; n++) {
+		acc |= (uint64_t)wd << nbits;
+		nbits += COLOR_BITS;
+		if (nbits >= 32) {
+			buf[idx++] = (uint32_t)acc;
+			acc >>= 32;
+			nbits -= 32;
+		}
 	}
+	if (nbits) buf[idx] = (uint32_t)acc;
+}
 
-    // Set DC to 1 (data mode);
-	gpio_set_level(PIN_NUM_DC, 1);
-
-	disp_spi->host->hw->data_buf[0] = wd;
-    disp_spi_transfer_start(COLOR_BITS);
-
-    if (sel) disp_deselect();
+// Send color data 'wd' to display 'len' times
+// The whole hw spi buffer is filled with the color only once and sent repeatedly,
+// as many whole colors as fit in it with each transfer
+// ** Device must already be selected, RAM write command sent and DC set to data **
+//-------------------------------------------------------------------
+static void IRAM_ATTR _TFT_fillColorRep(uint32_t wd, uint32_t len)
+{
+	uint32_t chunk = (SPI_NODMA_HWBUF_SIZE*8) / COLOR_BITS;	// number of colors fitting in the hw spi buffer
+	uint32_t kicks = 0;
+	spi_nodma_stream_t stream;
+	volatile uint32_t *buf = spi_nodma_stream_begin(disp_spi, &stream);
+
+	if (chunk > len) chunk = len;	// short runs only need 'len' colors in the buffer
+	_TFT_fillColorBuf(buf, wd, chunk);
+
+	while (len) {
+		uint32_t n = (len > chunk) ? chunk : len;
+		// Data length is only changed for the last, shorter transfer
+		spi_nodma_stream_repeat(&stream, n * COLOR_BITS);
+		len -= n;
+		// ** Preemption point, the buffer is filled again if it was used by another device
+		if ((len) && ((++kicks % (DISP_YIELD_BYTES / SPI_NODMA_HWBUF_SIZE)) == 0)) {
+			int res = disp_stream_yield(&stream, &buf);
+			if (res < 0) return;
+			if (res) _TFT_fillColorBuf(buf, wd, chunk);
+		}
+	}
+	spi_nodma_stream_end(&stream);
 }
+#endif
 
 // If rep==true  repeat sending color data to display 'len' times
 // If rep==false send 'len' color data from color buffer to display
@@ -264,109 +590,171 @@ static void IRAM_ATTR _TFT_pushColorRep(color_t *color, uint32_t len, uint8_t re
 
 	uint32_t count = 0;	// sent color counter
 	uint32_t cidx = 0;	// color buffer index
-	uint32_t wd = 0;	// used to place color data to 32-bit register in hw spi buffer
-	float gs_clr = 0;
-
-	// * Wait for SPI bus ready
-	while (disp_spi->host->hw->cmd.usr);
-
-	// * Prepare spi device
-	disp_spi->host->hw->user.usr_mosi_highpart = 0;
-	disp_spi->host->hw->user.usr_miso_highpart = 0;
-	disp_spi->host->hw->user.usr_mosi = 1;
-	disp_spi->host->hw->miso_dlen.usr_miso_dbitlen = 0;
-	disp_spi->host->hw->user.usr_miso = 0;
+	uint32_t wd = 0;	// color data packed as it is sent to the display
+	uint32_t npix;
+	uint32_t kicks = 0;
+	uint8_t gs = gray_scale;	// kept in registers in the pixel loop
+	uint8_t bits = COLOR_BITS;
+	spi_nodma_stream_t stream;
+	volatile uint32_t *buf;
+#if DISP_SPI_9BIT
+	// every color byte is sent as 9-bit word
+	disp_pack9_t pk = {0};
+	uint32_t pixbytes = COLOR_BITS / 8;
+	uint32_t half_pixels = DISP_9BIT_HALF_ITEMS / pixbytes;	// number of colors fitting in half of hw spi buffer
+	uint32_t pixbits = pixbytes * 9;							// number of bits sent for each color
+#else
+	uint64_t acc;		// used to place color data to 32-bit registers in hw spi buffer
+	uint32_t nbits, idx;
+	uint32_t half_pixels = (SPI_NODMA_STREAM_BUF_SIZE*8) / COLOR_BITS;	// number of colors fitting in half of hw spi buffer
+	uint32_t pixbits = COLOR_BITS;
+#endif
 
 	// * Send RAM write command
-    gpio_set_level(PIN_NUM_DC, 0);						// set DC to 0 (command mode);
-    disp_spi->host->hw->data_buf[0] = (uint32_t)TFT_RAMWR;
-	disp_spi->host->hw->mosi_dlen.usr_mosi_dbitlen = 7;	// send 8 bits
-	disp_spi->host->hw->cmd.usr = 1;					// Start transfer
-	while (disp_spi->host->hw->cmd.usr);				// Wait for SPI bus ready
-
-	gpio_set_level(PIN_NUM_DC, 1);						// Set DC to 1 (data mode);
+#if DISP_SPI_9BIT
+	disp_spi_transfer_9bit(disp_win.ramwr, NULL, 0);
+#else
+	disp_spi_cmd_start(disp_win.ramwr);
+	disp_spi_cmd_end();
+	DISP_DC_DATA();										// Set DC to 1 (data mode);
+
+	if (rep) {
+		// Solid color, no refill of the hw spi buffer
+		_TFT_fillColorRep(color2native(color[0]), len);
+		return;
+	}
+#endif
 
+	if (rep) wd = color2native(color[0]);
 
+	// * Fill one half of the hw spi buffer while the other half is sent
+	buf = spi_nodma_stream_begin(disp_spi, &stream);
 	while (count < len) {
     	// ==== Push color data to spi buffer ====
-		// ** Get color data from color buffer **
-		if (COLOR_BITS == 16) {
-			if (gray_scale) wd = pack_color(color2gs(color[cidx]));
-			else wd = pack_color(color[cidx]);
-		}
-		else {
-			if (gray_scale) {
-			    gs_clr = GS_FACT_R * color[cidx].r + GS_FACT_G * color[cidx].g + GS_FACT_B * color[cidx].b;
-				wd = (uint32_t)gs_clr;
-				wd |=  (uint32_t)gs_clr << 8;
-				wd |= (uint32_t)gs_clr << 16;
+#if !DISP_SPI_9BIT
+		acc = 0;
+		nbits = 0;
+		idx = 0;
+#endif
+		npix = 0;
+		while ((npix < half_pixels) && (count < len)) {
+			// ** Get color data from color buffer **
+			if (rep == 0) {
+				wd = _color2native(color[cidx], gs, bits);
+				cidx++;
 			}
-			else {
-				wd = (uint32_t)color[cidx].r;
-				wd |= (uint32_t)color[cidx].g << 8;
-				wd |= (uint32_t)color[cidx].b << 16;
+#if DISP_SPI_9BIT
+			for (uint32_t b=0; b<pixbytes; b++) disp_pack9(&pk, buf, wd >> (b*8), 1);
+#else
+			acc |= (uint64_t)wd << nbits;
+			nbits += bits;
+			if (nbits >= 32) {
+				buf[idx++] = (uint32_t)acc;
+				acc >>= 32;
+				nbits -= 32;
 			}
+#endif
+			npix++;
+	    	count++;	// Increment sent colors counter
 		}
-        disp_spi->host->hw->data_buf[0] = wd;
-		disp_spi->host->hw->mosi_dlen.usr_mosi_dbitlen = COLOR_BITS-1;	// set number of bits to be sent
-        disp_spi->host->hw->cmd.usr = 1;								// Start transfer
-		while (disp_spi->host->hw->cmd.usr);							// Wait for SPI bus ready
+#if DISP_SPI_9BIT
+		disp_pack9_flush(&pk, buf);
+#else
+		if (nbits) buf[idx] = (uint32_t)acc;
+#endif
+
+		buf = spi_nodma_stream_kick(&stream, npix * pixbits);
 
-    	count++;	// Increment sent colors counter
-        if (rep == 0) cidx++;
+		// ** Preemption point, each half holds whole colors
+		if ((count < len) && ((++kicks % (DISP_YIELD_BYTES / SPI_NODMA_STREAM_BUF_SIZE)) == 0)) {
+			if (disp_stream_yield(&stream, &buf) < 0) return;
+		}
     }
+	spi_nodma_stream_end(&stream);
 }
 
-// ** Send color data using DMA mode **
-//------------------------------------------------------------------------
-static void IRAM_ATTR _TFT_pushColorRep_trans(color_t color, uint32_t len)
+// Fill the transaction's staging buffer with the color pattern
+// The buffer is sent repeatedly in one transaction
+//-----------------------------------------------------------------------------------------------
+static void IRAM_ATTR _TFT_pushColorRep_prep(spi_nodma_transaction_t *trans, color_t color, uint32_t len)
 {
-    uint32_t size, tosend;
-    esp_err_t ret = ESP_OK;
-    color_t _color;
-
-	if (gray_scale) _color = color2gs(color);
-	else _color = color;
+    uint32_t size;
+    uint32_t pixsize = DISP_PIXEL_BYTES;
+    disp_pixel_t wd = color2native(color);
 
+	// The pattern fits in the staging buffer and is a multiple of 4 pixels (4 bytes)
+	uint32_t max_size = (disp_spi->pool.buf_size / pixsize) & ~3;
 	size = len;
-    if (size > TFT_LINEBUF_MAX_SIZE) size = TFT_LINEBUF_MAX_SIZE;
+    if (size > max_size) size = max_size;
 
-	uint16_t *buf16 = (uint16_t *)tft_line;
+	uint8_t *buf = (uint8_t *)spi_nodma_trans_buffer(trans);
     for (uint32_t n=0; n<size;n++) {
-	    if (COLOR_BITS == 16) buf16[n] = (uint16_t)pack_color(_color);
-	    else tft_line[n] = _color;
+	    *buf++ = (uint8_t)wd;
+	    *buf++ = (uint8_t)(wd >> 8);
+	    if (COLOR_BITS == 24) *buf++ = (uint8_t)(wd >> 16);
+    }
+
+    //Set data length, in bits
+    trans->length = len * pixsize * 8;
+    if (len > size) {
+    	// Send the buffer repeatedly (up to TFT_LINEBUF_MAX_SIZE pixels, multiple of 4 bytes)
+    	trans->flags = SPI_TRANS_REPEAT_TX;
+    	trans->txpattern_size = size * pixsize;
     }
+}
 
+// ** Send color data using DMA mode **
+// Sends RAM write command 'cmd' and queues the prepared transaction, it is finished in disp_select()/disp_deselect()
+// If it can't be queued, the descriptor is returned to the pool
+//-------------------------------------------------------------------------------------
+static esp_err_t IRAM_ATTR disp_queue_ramwr(spi_nodma_transaction_t *trans, uint8_t cmd)
+{
 	// ** RAM write command
-	// Set DC to 0 (command mode);
-    gpio_set_level(PIN_NUM_DC, 0);
-    disp_spi->host->hw->data_buf[0] = (uint32_t)TFT_RAMWR;
-    disp_spi_transfer_start(8);
+	disp_spi_cmd_start(cmd);
+	disp_spi_cmd_end();
 
 	// Set DC to 1 (data mode);
-	gpio_set_level(PIN_NUM_DC, 1);
-
-	tosend = len;
-	while (tosend > 0) {
-	    memset(&tft_trans, 0, sizeof(spi_nodma_transaction_t));
-		size = tosend;
-	    if (size > TFT_LINEBUF_MAX_SIZE) size = TFT_LINEBUF_MAX_SIZE;
-
-	    tft_trans.tx_buffer = (uint8_t *)tft_line;
-	    //Set data length, in bits
-	    if (COLOR_BITS == 16) tft_trans.length = size * 2 * 8;
-	    else  tft_trans.length = size * 3 * 8;
-
-	    //Queue transaction.
-		ret = spi_device_queue_trans(disp_spi, &tft_trans, 1000*portTICK_RATE_MS);
-	    tft_in_trans = 1;
-		if (ret != ESP_OK) break;
-
-		ret = wait_trans_finish();
-		if (ret != ESP_OK) break;
+	DISP_DC_DATA();
+
+    //Queue transaction, no result is returned, wait_trans_finish() waits for the notification
+	trans->flags |= SPI_TRANS_NOTIFY;
+	if (spi_device_queue_trans(disp_spi, trans, 1000*portTICK_RATE_MS) == ESP_OK) {
+		disp_trans_queued = trans;
+		tft_in_trans = 1;
+		return ESP_OK;
+	}
+	spi_nodma_trans_put(disp_spi, trans);
+	disp_win.pos = 0;	// no data was written
+	return ESP_FAIL;
+}
 
-	    tosend -= size;
-    }
+// Queue the prepared fill transaction in parts of max. DISP_YIELD_BYTES with a preemption point between them
+// The pattern holds whole pixels of one color, so every part can start with it; the parts after
+// the first one continue the memory write (RAMWRC), also if the bus was given to another device meanwhile
+//--------------------------------------------------------------------
+static void IRAM_ATTR disp_queue_fill(spi_nodma_transaction_t *trans)
+{
+	uint32_t bytes = trans->length / 8;
+	uint8_t cmd = disp_win.ramwr;
+
+	while (bytes > DISP_YIELD_BYTES) {
+		trans->length = DISP_YIELD_BYTES * 8;
+		if (disp_queue_ramwr(trans, cmd) != ESP_OK) return;
+		// Wait for the part, the descriptor is kept for the next one; on timeout it stays queued
+		if (spi_nodma_trans_wait(disp_spi, 1, 1000 / portTICK_RATE_MS) != ESP_OK) return;
+		disp_trans_queued = NULL;
+		tft_in_trans = 0;
+		bytes -= DISP_YIELD_BYTES;
+
+		// ** Preemption point
+		if (spi_nodma_device_yield(disp_spi) < 0) {
+			spi_nodma_trans_put(disp_spi, trans);
+			return;
+		}
+		cmd = TFT_RAMWRC;
+	}
+	trans->length = bytes * 8;
+	disp_queue_ramwr(trans, cmd);
 }
 
 // Write 'len' 16-bit color data to TFT 'window' (x1,y2),(x2,y2)
@@ -374,72 +762,219 @@ static void IRAM_ATTR _TFT_pushColorRep_trans(color_t color, uint32_t len)
 //-------------------------------------------------------------------------------------------
 void IRAM_ATTR TFT_pushColorRep(int x1, int y1, int x2, int y2, color_t color, uint32_t len)
 {
-	if (disp_select() != ESP_OK) return;
+	spi_nodma_transaction_t *trans = NULL;
+
+	// 3-wire 9-bit display data can only be sent in direct mode
+	if ((tft_use_trans) && (!DISP_SPI_9BIT)) {
+		// The buffer is filled while the previous transaction may still be in progress
+		trans = disp_trans_get(4 * DISP_PIXEL_BYTES);	// at least a 4 pixel pattern
+		if (trans) _TFT_pushColorRep_prep(trans, color, len);
+	}
+
+	if (disp_select() != ESP_OK) {
+		if (trans) spi_nodma_trans_put(disp_spi, trans);
+		return;
+	}
 
 	// ** Send address window **
-	disp_spi_transfer_addrwin(x1, x2, y1, y2);
+	disp_spi_transfer_addrwin(x1, x2, y1, y2, len);
 
-	if (tft_use_trans) _TFT_pushColorRep_trans(color, len);
+	if (trans) disp_queue_fill(trans);
 	else _TFT_pushColorRep(&color, len, 1);
+	// The bus is released on return, other devices on the host are not blocked
+	disp_deselect();
+}
+
+// Send 'size' bytes of native pixel data from buffer to display
+// ** Device must already be selected and address window set **
+//----------------------------------------------------------------------
+static void IRAM_ATTR _TFT_pushNative(const uint8_t *buf, uint32_t size)
+{
+	if (!(disp_spi->cfg.flags & SPI_DEVICE_HALFDUPLEX)) return;
 
+#if DISP_SPI_9BIT
+	disp_spi_transfer_9bit(disp_win.ramwr, buf, size);
+#else
+	spi_nodma_stream_t stream;
+	volatile uint32_t *hwbuf;
+	uint32_t n, kicks = 0;
+
+	// * Send RAM write command
+	disp_spi_cmd_start(disp_win.ramwr);
+	disp_spi_cmd_end();
+	DISP_DC_DATA();										// Set DC to 1 (data mode);
+
+	// * Fill one half of the hw spi buffer while the other half is sent, no conversion needed
+	hwbuf = spi_nodma_stream_begin(disp_spi, &stream);
+	while (size) {
+		n = (size > SPI_NODMA_STREAM_BUF_SIZE) ? SPI_NODMA_STREAM_BUF_SIZE : size;
+		spi_nodma_buf_fill(hwbuf, buf, n);
+		hwbuf = spi_nodma_stream_kick(&stream, n*8);
+		buf += n;
+		size -= n;
+		// ** Preemption point, DISP_YIELD_BYTES is a multiple of the pixel size
+		if ((size) && ((++kicks % (DISP_YIELD_BYTES / SPI_NODMA_STREAM_BUF_SIZE)) == 0)) {
+			if (disp_stream_yield(&stream, &hwbuf) < 0) return;
+		}
+	}
+	spi_nodma_stream_end(&stream);
+#endif
+}
+
+// Write 'len' native pixels to TFT 'window' (x1,y2),(x2,y2) from given buffer
+// In transaction mode the data is copied to the staging buffer, 'buf' can be reused on return
+// If 'keep' is set, the queued transaction is left in flight with the display selected
+//-------------------------------------------------------------------------------------------------------------
+static void IRAM_ATTR _send_native(int x1, int y1, int x2, int y2, uint32_t len, const uint8_t *buf, int keep)
+{
+	spi_nodma_transaction_t *trans = NULL;
+	uint32_t size = len * DISP_PIXEL_BYTES;
+
+	if ((tft_use_trans) && (!DISP_SPI_9BIT) && (size <= TFT_LINEBUF_MAX_SIZE*DISP_PIXEL_BYTES)) {
+	    // ** Send pixel data using transaction mode **
+		// The data is copied while the previous transaction may still be in progress
+		trans = disp_trans_get(size);
+		if (trans) {
+			memcpy(spi_nodma_trans_buffer(trans), buf, size);
+		    trans->length = size * 8;  //Data length, in bits
+		}
+	}
+
+	if (disp_select() != ESP_OK) {
+		if (trans) spi_nodma_trans_put(disp_spi, trans);
+		return;
+	}
+
+	// ** Send address window **
+	disp_spi_transfer_addrwin(x1, x2, y1, y2, len);
+
+	if (trans) {
+		disp_queue_ramwr(trans, disp_win.ramwr);
+		// ** The queued transaction is left in flight, it is finished in the next disp_select()/disp_deselect(),
+		//    so the next line can be prepared in the other pool entry while this one is sent
+		if (keep) return;
+	}
+	else _TFT_pushNative(buf, size);
 	disp_deselect();
 }
 
+// Write 'len' native pixels to TFT 'window' (x1,y2),(x2,y2) from given buffer
+// The display is deselected on return
+//-----------------------------------------------------------------------------------------
+void IRAM_ATTR send_native(int x1, int y1, int x2, int y2, uint32_t len, const uint8_t *buf)
+{
+	_send_native(x1, y1, x2, y2, len, buf, 0);
+}
+
+// Write one of the consecutive image lines, as send_native()
+// In transaction mode the line is left in flight and the display stays selected (the spi bus is not released),
+// the next line is prepared while it is sent; call disp_deselect() after the last line
+//----------------------------------------------------------------------------------------------
+void IRAM_ATTR send_native_line(int x1, int y1, int x2, int y2, uint32_t len, const uint8_t *buf)
+{
+	_send_native(x1, y1, x2, y2, len, buf, 1);
+}
+
 // Write 'len' color data to TFT 'window' (x1,y2),(x2,y2) from given buffer
+// The colors are converted to native pixels, 'buf' is not changed
 //-----------------------------------------------------------------------------------
 void IRAM_ATTR send_data(int x1, int y1, int x2, int y2, uint32_t len, color_t *buf)
 {
-	if (disp_select() != ESP_OK) return;
+	spi_nodma_transaction_t *trans = NULL;
+
+	if ((tft_use_trans) && (!DISP_SPI_9BIT) && (len <= TFT_LINEBUF_MAX_SIZE)) {
+	    // ** Send color data using transaction mode **
+		// The colors are converted to the staging buffer while the previous transaction may still be in progress
+		trans = disp_trans_get(len * DISP_PIXEL_BYTES);
+		if (trans) {
+		    trans->length = colors2native(spi_nodma_trans_buffer(trans), buf, len) * 8;  //Data length, in bits
+		}
+	}
+
+	if (disp_select() != ESP_OK) {
+		if (trans) spi_nodma_trans_put(disp_spi, trans);
+		return;
+	}
 
 	// ** Send address window **
-	disp_spi_transfer_addrwin(x1, x2, y1, y2);
+	disp_spi_transfer_addrwin(x1, x2, y1, y2, len);
 
-	if (tft_use_trans) {
-	    // ** Send color data using transaction mode **
-		// ** RAM write command
-		// Set DC to 0 (command mode);
-	    gpio_set_level(PIN_NUM_DC, 0);
-	    disp_spi->host->hw->data_buf[0] = (uint32_t)TFT_RAMWR;
-	    disp_spi_transfer_start(8);
-
-		//Transaction descriptors
-	    memset(&tft_trans, 0, sizeof(spi_nodma_transaction_t));
-
-	    uint32_t size = 0;
-	    if (COLOR_BITS == 16) {
-			uint16_t *buf16 = (uint16_t *)buf;
-			for (int n=0; n<len; n++) {
-				if (gray_scale) buf16[n] = (uint16_t)pack_color(color2gs(buf[n]));
-				else buf16[n] = (uint16_t)pack_color(buf[n]);
-			}
-	    	size = len * 2;
-	    }
-	    else {
-	    	if (gray_scale) {
-	    		for (int n=0; n<len;n++) {
-					buf[n] = color2gs(buf[n]);
-	    		}
-	    	}
-	    	size = len * 3;
-	    }
-
-	    tft_trans.tx_buffer = (uint8_t *)buf;
-	    tft_trans.length = size * 8;  //Data length, in bits
-
-	    // Set DC to 1 (data mode);
-		gpio_set_level(PIN_NUM_DC, 1);
-
-	    //Queue transaction.
-	    spi_device_queue_trans(disp_spi, &tft_trans, 1000*portTICK_RATE_MS);
-	    tft_in_trans = 1;
+	if (trans) {
+	    // ** RAM write command and queue the transaction, it is finished in the next disp_select()/disp_deselect()
+		disp_queue_ramwr(trans, disp_win.ramwr);
 	}
 	else {
-		// ** Send pixel buffer **
+		// ** Send pixel buffer, converted while sending **
 		_TFT_pushColorRep(buf, len, 0);
 		disp_deselect();
 	}
 }
 
+// Draw 'count' pixels sorted by row and column, all must be inside the display
+// Of the pixels with the same coordinates the last one is drawn
+// Each run of adjacent pixels of the same color in a row is sent as one write; with the address window
+// cache the next run in the same row only needs the column start, or no window at all if it is adjacent
+//--------------------------------------------------------------
+void IRAM_ATTR drawPixels(const tft_pixel_t *pixels, int count)
+{
+	if (!(disp_spi->cfg.flags & SPI_DEVICE_HALFDUPLEX)) return;
+	if (disp_select() != ESP_OK) return;
+
+	int i = 0, n, k;
+	uint32_t len;
+	uint16_t x2;
+	disp_pixel_t wd;
+	color_t color;
+
+	while (i < count) {
+		// skip to the last pixel with the same coordinates
+		for (n=i; ((n+1) < count) && (pixels[n+1].x == pixels[i].x) && (pixels[n+1].y == pixels[i].y); n++);
+		color = pixels[n].color;
+		wd = color2native(color);
+		len = 1;
+
+		// extend the run with the next column while it has the same color
+		for (k=n+1; k < count; k=n+1) {
+			if ((pixels[k].y != pixels[i].y) || ((pixels[k].x - pixels[i].x) != (int)len)) break;
+			for (n=k; ((n+1) < count) && (pixels[n+1].x == pixels[k].x) && (pixels[n+1].y == pixels[k].y); n++);
+			if (color2native(pixels[n].color) != wd) break;
+			len++;
+		}
+
+		// the window extends to the display's right edge, writes stay in the row
+		x2 = pixels[i].x + len - 1;
+		if (x2 < (_width - 1)) x2 = _width - 1;
+		disp_spi_transfer_addrwin(pixels[i].x, x2, pixels[i].y, pixels[i].y, len);
+		if (len == 1) _TFT_sendPixel(wd);
+		else _TFT_pushColorRep(&color, len, 1);
+		i = k;
+	}
+
+	disp_deselect();
+}
+
+// Fill 'count' rectangles in the given order, all must be inside the display
+//------------------------------------------------------------
+void IRAM_ATTR fillRects(const tft_rect_t *rects, int count)
+{
+	if (!(disp_spi->cfg.flags & SPI_DEVICE_HALFDUPLEX)) return;
+	if (disp_select() != ESP_OK) return;
+
+	uint32_t len;
+	color_t color;
+
+	for (int i=0; i<count; i++) {
+		if ((rects[i].w <= 0) || (rects[i].h <= 0)) continue;
+		len = rects[i].w * rects[i].h;
+		color = rects[i].color;
+		disp_spi_transfer_addrwin(rects[i].x, rects[i].x + rects[i].w - 1, rects[i].y, rects[i].y + rects[i].h - 1, len);
+		if (len == 1) _TFT_sendPixel(color2native(color));
+		else _TFT_pushColorRep(&color, len, 1);
+	}
+
+	disp_deselect();
+}
+
 // Reads pixels/colors from the TFT's GRAM
 //----------------------------------------------------------------------------
 int IRAM_ATTR read_data(int x1, int y1, int x2, int y2, int len, uint8_t *buf)
@@ -457,7 +992,7 @@ int IRAM_ATTR read_data(int x1, int y1, int x2, int y2, int len, uint8_t *buf)
 	if (disp_select() != ESP_OK) return -2;
 
 	// ** Send address window **
-	disp_spi_transfer_addrwin(x1, x2, y1, y2);
+	disp_spi_transfer_addrwin(x1, x2, y1, y2, 0);
 
     // ** GET pixels/colors **
 	disp_spi_transfer_cmd(TFT_RAMRD);
@@ -500,6 +1035,8 @@ uint16_t IRAM_ATTR touch_get_data(uint8_t type)
 	memset(&t, 0, sizeof(t));            //Zero out the transaction
 	uint8_t rxdata[2] = {0};
 
+	// The display may still be selected with its last queued transaction in flight (send_data, send_native_line)
+	if (disp_deselect() != ESP_OK) return 0;
 	if (spi_nodma_device_select(ts_spi, 0)) return 0;
 
 	// send command byte & receive 2 byte response
@@ -22,6 +22,7 @@
 #define PIN_NUM_CLK  18
 #define PIN_NUM_CS   5
 // Display command/data pin
+// Set to -1 if the display uses 3-wire 9-bit interface (D/C flag is sent as the first bit of every 9-bit word)
 #define PIN_NUM_DC   26
 // Touch screen CS pin
 #define PIN_NUM_TCS  25
@@ -42,6 +43,19 @@
 uint8_t tft_disp_type;
 
 
+#define DISP_SPI_9BIT			(PIN_NUM_DC < 0)	// 3-wire 9-bit display interface, no D/C pin
+// Set to 1 to send display commands in the hw spi command phase; the command's data are then placed
+// to the hw spi buffer while the command is on the wire. Set to 0 to send commands as 8-bit data.
+#define DISP_SPI_CMD_PHASE		1
+// Set to 1 to keep track of the address window last set on the display; unchanged CASET/PASET are not sent and
+// a write starting where the previous one ended is sent with Memory Write Continue (TFT_RAMWRC) instead of RAMWR.
+// Call disp_addrwin_invalidate() after sending display commands without disp_spi_transfer_cmd[_data]()
+#define DISP_ADDRWIN_CACHE		1
+#define DISP_9BIT_HALF_ITEMS	((SPI_NODMA_STREAM_BUF_SIZE*8) / 9)	// number of 9-bit words fitting in half of hw spi buffer
+// Long pixel writes have a preemption point after every DISP_YIELD_BYTES bytes, where the spi bus is given to a waiting
+// SPI_DEVICE_BUS_URGENT device (e.g. touch controller); multiple of the hw spi buffer size and of 2 and 3 byte pixels
+#define DISP_YIELD_BYTES		3072
+
 #define TFT_MAX_DISP_SIZE		480					// maximum display dimension in pixel
 #define TFT_LINEBUF_MAX_SIZE	TFT_MAX_DISP_SIZE	// line buffer maximum size in words (uint16_t)
 
@@ -79,6 +93,7 @@ uint8_t tft_disp_type;
 #define TFT_PASET      0x2B
 #define TFT_RAMWR      0x2C
 #define TFT_RAMRD      0x2E
+#define TFT_RAMWRC     0x3C
 #define TFT_MADCTL	   0x36
 #define TFT_PTLAR 	   0x30
 #define TFT_ENTRYM 	   0xB7
@@ -173,9 +188,31 @@ typedef struct {
 } color_t;
 
 
+// Pixel and rectangle of the batch drawing functions
+typedef struct {
+	int16_t x;
+	int16_t y;
+	color_t color;
+} tft_pixel_t;
+
+typedef struct {
+	int16_t x;
+	int16_t y;
+	int16_t w;
+	int16_t h;
+	color_t color;
+} tft_rect_t;
+
 // 24 (default) or 16 only valid for ILI9341
 uint8_t COLOR_BITS;
 
+// Pixel in the display's native format, bytes in the order of sending (lowest byte first)
+// RGB565 (2 bytes) if COLOR_BITS is 16, RGB666 in 3 bytes if 24; gray scale already applied
+typedef uint32_t disp_pixel_t;
+
+// Number of bytes sent for each native pixel
+#define DISP_PIXEL_BYTES	(COLOR_BITS / 8)
+
 // use DMA transfer if set to 1
 uint8_t tft_use_trans;
 uint8_t tft_in_trans;
@@ -195,13 +232,22 @@ uint16_t _height;
 
 void disp_spi_transfer_cmd(int8_t cmd);
 void disp_spi_transfer_cmd_data(int8_t cmd, uint8_t *data, uint32_t len);
+void disp_addrwin_invalidate();
 
 esp_err_t IRAM_ATTR disp_deselect();
 esp_err_t IRAM_ATTR disp_select();
+esp_err_t IRAM_ATTR wait_trans_finish();
+void disp_line_yield();
 
 void drawPixel(int16_t x, int16_t y, color_t color, uint8_t sel);
 void send_data(int x1, int y1, int x2, int y2, uint32_t len, color_t *buf);
+void send_native(int x1, int y1, int x2, int y2, uint32_t len, const uint8_t *buf);
+void send_native_line(int x1, int y1, int x2, int y2, uint32_t len, const uint8_t *buf);
+disp_pixel_t color2native(color_t color);
+uint32_t colors2native(uint8_t *dst, const color_t *src, uint32_t len);
 void TFT_pushColorRep(int x1, int y1, int x2, int y2, color_t data, uint32_t len);
+void drawPixels(const tft_pixel_t *pixels, int count);
+void fillRects(const tft_rect_t *rects, int count);
 int read_data(int x1, int y1, int x2, int y2, int len, uint8_t *buf);
 color_t readPixel(int16_t x, int16_t y);
 
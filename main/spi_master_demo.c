@@ -198,7 +198,9 @@ static void ili_init(spi_nodma_device_handle_t spi)
     uint8_t tft_pix_fmt = DISP_COLOR_BITS_24;
 
     //Initialize non-SPI GPIOs
+#if !DISP_SPI_9BIT
     gpio_set_direction(PIN_NUM_DC, GPIO_MODE_OUTPUT);
+#endif
 
 #if PIN_NUM_BCKL
     gpio_set_direction(PIN_NUM_BCKL, GPIO_MODE_OUTPUT);
@@ -0,0 +1,393 @@
+/*
+ * FreeRTOS queues, mutexes, task notifications and ticks used by spi_master_nodma.c, implemented with pthreads (tools/host_emu)
+ *
+ * Every pthread which calls these functions is a "task"; one tick is 1 ms.
+ * Threads run on "core" 0 unless created with xTaskCreatePinnedToCore, priorities are ignored.
+ * The "FromISR" functions never block, they are called from the emulator thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "rom/ets_sys.h"
+#include "xtensa/hal.h"
+#include "spi_emu.h"
+
+#define EMU_CPU_MHZ 240
+
+struct emu_queue_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // signalled on every send and receive
+    uint32_t len;
+    uint32_t item_size;
+    uint32_t count;
+    uint32_t head;
+    uint8_t *items;
+};
+
+struct emu_task_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify;
+};
+
+static __thread struct emu_task_s *cur_task = NULL;
+static __thread BaseType_t cur_core = 0;
+static pthread_mutex_t isr_lock = PTHREAD_MUTEX_INITIALIZER;    // held while an interrupt handler runs
+
+//------------------------------------------------
+static void cond_init_monotonic(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Wait on the condition for max 'ticks'; returns 0 on timeout
+//------------------------------------------------------------------------------------------------------
+static int cond_wait_ticks(pthread_cond_t *cond, pthread_mutex_t *lock, const struct timespec *deadline)
+{
+    if (deadline == NULL) {
+        pthread_cond_wait(cond, lock);
+        return 1;
+    }
+    return (pthread_cond_timedwait(cond, lock, deadline) == 0);
+}
+
+// Absolute monotonic time after 'ticks', NULL if waiting forever
+//--------------------------------------------------------------------------------
+static const struct timespec *ticks_deadline(TickType_t ticks, struct timespec *ts)
+{
+    if (ticks == portMAX_DELAY) return NULL;
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ticks / 1000;
+    ts->tv_nsec += (long)(ticks % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+// A task woken from the interrupt handler waits for the handler to return
+//----------------------------
+static void isr_wait(void)
+{
+    pthread_mutex_lock(&isr_lock);
+    pthread_mutex_unlock(&isr_lock);
+}
+
+//---------------------------
+void spi_emu_isr_enter(void)
+{
+    pthread_mutex_lock(&isr_lock);
+}
+
+//--------------------------
+void spi_emu_isr_exit(void)
+{
+    pthread_mutex_unlock(&isr_lock);
+}
+
+
+// ==== Queues ====
+
+//-----------------------------------------------------------------
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size)
+{
+    struct emu_queue_s *q = calloc(1, sizeof(struct emu_queue_s));
+    if (q == NULL) return NULL;
+    q->len = len;
+    q->item_size = item_size;
+    if (item_size) {
+        q->items = calloc(len, item_size);
+        if (q->items == NULL) {
+            free(q);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    cond_init_monotonic(&q->cond);
+    return q;
+}
+
+//-----------------------------------
+void vQueueDelete(QueueHandle_t q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+    free(q->items);
+    free(q);
+}
+
+//-----------------------------------------------------------------------------
+static BaseType_t queue_put(QueueHandle_t q, const void *item)
+{
+    if (q->count == q->len) return pdFALSE;
+    if (q->item_size) memcpy(q->items + (((q->head + q->count) % q->len) * q->item_size), item, q->item_size);
+    q->count++;
+    pthread_cond_broadcast(&q->cond);
+    return pdTRUE;
+}
+
+//-----------------------------------------------------------
+static BaseType_t queue_get(QueueHandle_t q, void *item, int remove)
+{
+    if (q->count == 0) return pdFALSE;
+    if ((q->item_size) && (item)) memcpy(item, q->items + (q->head * q->item_size), q->item_size);
+    if (remove) {
+        q->head = (q->head + 1) % q->len;
+        q->count--;
+        pthread_cond_broadcast(&q->cond);
+    }
+    return pdTRUE;
+}
+
+//-----------------------------------------------------------------------------------
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks_to_wait)
+{
+    struct timespec ts;
+    const struct timespec *deadline = ticks_deadline(ticks_to_wait, &ts);
+    BaseType_t res;
+
+    pthread_mutex_lock(&q->lock);
+    while (((res = queue_put(q, item)) == pdFALSE) && (ticks_to_wait)) {
+        if (!cond_wait_ticks(&q->cond, &q->lock, deadline)) {
+            res = queue_put(q, item);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return res;
+}
+
+//----------------------------------------------------------------------------
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks_to_wait)
+{
+    struct timespec ts;
+    const struct timespec *deadline = ticks_deadline(ticks_to_wait, &ts);
+    BaseType_t res;
+
+    pthread_mutex_lock(&q->lock);
+    while (((res = queue_get(q, item, 1)) == pdFALSE) && (ticks_to_wait)) {
+        if (!cond_wait_ticks(&q->cond, &q->lock, deadline)) {
+            res = queue_get(q, item, 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (res) isr_wait();
+    return res;
+}
+
+//-----------------------------------------------------------------------------------------
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken)
+{
+    pthread_mutex_lock(&q->lock);
+    BaseType_t res = queue_put(q, item);
+    pthread_mutex_unlock(&q->lock);
+    if ((res) && (woken)) *woken = pdTRUE;
+    return res;
+}
+
+//------------------------------------------------------------------------------------
+BaseType_t xQueueReceiveFromISR(QueueHandle_t q, void *item, BaseType_t *woken)
+{
+    pthread_mutex_lock(&q->lock);
+    BaseType_t res = queue_get(q, item, 1);
+    pthread_mutex_unlock(&q->lock);
+    if ((res) && (woken)) *woken = pdTRUE;
+    return res;
+}
+
+//------------------------------------------------------------
+BaseType_t xQueuePeekFromISR(QueueHandle_t q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    BaseType_t res = queue_get(q, item, 0);
+    pthread_mutex_unlock(&q->lock);
+    return res;
+}
+
+//-----------------------------------------------------
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    pthread_mutex_lock(&q->lock);
+    UBaseType_t n = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+//------------------------------------------------------------
+UBaseType_t uxQueueMessagesWaitingFromISR(QueueHandle_t q)
+{
+    return uxQueueMessagesWaiting(q);
+}
+
+// Mutex is a queue of length 1 with zero sized items, initially full
+//--------------------------------------------
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    QueueHandle_t q = xQueueCreate(1, 0);
+    if (q) q->count = 1;
+    return q;
+}
+
+// Binary semaphore is a queue of length 1 with zero sized items, initially empty
+//---------------------------------------------
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xQueueCreate(1, 0);
+}
+
+
+// ==== Tasks ====
+
+//------------------------------------------
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (cur_task == NULL) {
+        // Each thread gets its task structure on first use; it is never freed
+        cur_task = calloc(1, sizeof(struct emu_task_s));
+        if (cur_task == NULL) abort();
+        pthread_mutex_init(&cur_task->lock, NULL);
+        cond_init_monotonic(&cur_task->cond);
+    }
+    return cur_task;
+}
+
+//-------------------------------------
+void xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notify++;
+    pthread_cond_broadcast(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+}
+
+//--------------------------------------------------------------------
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+    xTaskNotifyGive(task);
+    if (woken) *woken = pdTRUE;
+}
+
+//-----------------------------------------------------------------------------
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    struct timespec ts;
+    const struct timespec *deadline = ticks_deadline(ticks_to_wait, &ts);
+    uint32_t res;
+
+    pthread_mutex_lock(&task->lock);
+    while ((task->notify == 0) && (ticks_to_wait)) {
+        if (!cond_wait_ticks(&task->cond, &task->lock, deadline)) break;
+    }
+    res = task->notify;
+    if (res) {
+        if (clear_on_exit) task->notify = 0;
+        else task->notify--;
+    }
+    pthread_mutex_unlock(&task->lock);
+    if (res) isr_wait();
+    return res;
+}
+
+//------------------------------
+BaseType_t xPortGetCoreID(void)
+{
+    return cur_core;
+}
+
+typedef struct {
+    TaskFunction_t task_code;
+    void *arg;
+    BaseType_t core_id;
+} emu_task_start_t;
+
+//--------------------------------------
+static void *emu_task_start(void *arg)
+{
+    emu_task_start_t start = *(emu_task_start_t *)arg;
+    free(arg);
+    cur_core = start.core_id;
+    start.task_code(start.arg);
+    return NULL;
+}
+
+// The task runs in a detached thread which reports 'core_id' from xPortGetCoreID()
+//----------------------------------------------------------------------------------------------------------------
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    emu_task_start_t *start = malloc(sizeof(emu_task_start_t));
+    if (start == NULL) return pdFAIL;
+    start->task_code = task_code;
+    start->arg = arg;
+    start->core_id = core_id;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int res = pthread_create(&thread, &attr, emu_task_start, start);
+    pthread_attr_destroy(&attr);
+    if (res != 0) {
+        free(start);
+        return pdFAIL;
+    }
+    if (created_task) *created_task = NULL;
+    return pdPASS;
+}
+
+// Only deleting the calling task is supported
+//---------------------------------
+void vTaskDelete(TaskHandle_t task)
+{
+    pthread_exit(NULL);
+}
+
+//-------------------------------
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = { .tv_sec = ticks / 1000, .tv_nsec = (long)(ticks % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+//------------------------------
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(spi_emu_time_ns() / 1000000ULL);
+}
+
+
+// ==== ROM & HAL ====
+
+//--------------------------------
+uint32_t ets_get_cpu_frequency(void)
+{
+    return EMU_CPU_MHZ;
+}
+
+//------------------------------
+void ets_delay_us(uint32_t us)
+{
+    uint64_t end = spi_emu_time_ns() + (uint64_t)us * 1000;
+    while (spi_emu_time_ns() < end);
+}
+
+// Cycle counter of the emulated cpu
+//----------------------------
+uint32_t xthal_get_ccount(void)
+{
+    return (uint32_t)((spi_emu_time_ns() * EMU_CPU_MHZ) / 1000);
+}
@@ -0,0 +1,78 @@
+/*
+ * Slave models for the spi peripheral emulator (tools/host_emu), see spi_emu.h
+*/
+
+#include <string.h>
+#include "spi_emu.h"
+
+// ==== Capture: stores the received data, sends an incrementing byte sequence ====
+
+//-------------------------------------------------------------------------------
+static void capture_command(spi_emu_slave_t *slave, uint32_t value, int bits)
+{
+    spi_emu_capture_t *cap = (spi_emu_capture_t *)slave->ctx;
+    cap->commands++;
+    cap->last_command = value;
+}
+
+//-------------------------------------------------------------------------------
+static void capture_address(spi_emu_slave_t *slave, uint64_t value, int bits)
+{
+    spi_emu_capture_t *cap = (spi_emu_capture_t *)slave->ctx;
+    cap->last_address = value;
+}
+
+//------------------------------------------------------------------------------------------------
+static void capture_data(spi_emu_slave_t *slave, const uint8_t *mosi, uint8_t *miso, int bits)
+{
+    spi_emu_capture_t *cap = (spi_emu_capture_t *)slave->ctx;
+    uint32_t bytes = (bits + 7) / 8;
+
+    if (mosi) {
+        cap->mosi_bits += bits;
+        if ((cap->dc_gpio < 0) || (spi_emu_gpio_get(cap->dc_gpio))) {
+            uint32_t n = bytes;
+            if (n > (cap->size - cap->len)) n = cap->size - cap->len;
+            memcpy(cap->buf + cap->len, mosi, n);
+            cap->len += n;
+        }
+    }
+    if (miso) {
+        cap->miso_bits += bits;
+        for (uint32_t i=0; i<bytes; i++) miso[i] = cap->miso_next++;
+    }
+}
+
+//------------------------------------------------------------------------------------------------------------------------------
+void spi_emu_capture_init(spi_emu_slave_t *slave, spi_emu_capture_t *cap, uint8_t *buf, uint32_t size, uint8_t miso_first)
+{
+    memset(cap, 0, sizeof(spi_emu_capture_t));
+    cap->buf = buf;
+    cap->size = (buf) ? size : 0;
+    cap->miso_next = miso_first;
+    cap->dc_gpio = -1;
+
+    memset(slave, 0, sizeof(spi_emu_slave_t));
+    slave->command = capture_command;
+    slave->address = capture_address;
+    slave->data = capture_data;
+    slave->ctx = cap;
+}
+
+
+// ==== Loopback: sends back the received data ====
+
+//-------------------------------------------------------------------------------------------------
+static void loopback_data(spi_emu_slave_t *slave, const uint8_t *mosi, uint8_t *miso, int bits)
+{
+    if (miso == NULL) return;
+    if (mosi) memcpy(miso, mosi, (bits + 7) / 8);
+    else memset(miso, 0xFF, (bits + 7) / 8);
+}
+
+//------------------------------------------------
+void spi_emu_loopback_init(spi_emu_slave_t *slave)
+{
+    memset(slave, 0, sizeof(spi_emu_slave_t));
+    slave->data = loopback_data;
+}
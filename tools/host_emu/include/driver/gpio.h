@@ -0,0 +1,30 @@
+/*
+ * Host stand-in for the ESP-IDF header of the same name (tools/host_emu)
+ * Output levels are kept by the emulator, slave models can read them with spi_emu_gpio_get()
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+
+typedef enum {
+    GPIO_MODE_INPUT = 1,
+    GPIO_MODE_OUTPUT = 2,
+    GPIO_MODE_INPUT_OUTPUT = 3,
+} gpio_mode_t;
+
+#define GPIO_PIN_COUNT                  40
+#define GPIO_IS_VALID_GPIO(n)           ((n) >= 0 && (n) < GPIO_PIN_COUNT)
+#define GPIO_IS_VALID_OUTPUT_GPIO(n)    ((n) >= 0 && (n) < 34)
+#define PIN_FUNC_GPIO                   2
+#define PIN_FUNC_SELECT(reg, func)      do { (void)(reg); (void)(func); } while (0)
+
+extern const uint32_t GPIO_PIN_MUX_REG[GPIO_PIN_COUNT];
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level);
+int gpio_get_level(gpio_num_t gpio_num);
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode);
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv);
+void gpio_matrix_in(uint32_t gpio, uint32_t signal_idx, bool inv);
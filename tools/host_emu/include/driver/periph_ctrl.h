@@ -0,0 +1,11 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu) */
+#pragma once
+
+typedef enum {
+    PERIPH_SPI_MODULE,
+    PERIPH_HSPI_MODULE,
+    PERIPH_VSPI_MODULE,
+} periph_module_t;
+
+void periph_module_enable(periph_module_t module);
+void periph_module_disable(periph_module_t module);
@@ -0,0 +1,4 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu), the APB clock is set with spi_emu_set_apb_freq() */
+#pragma once
+
+int esp_clk_apb_freq(void);
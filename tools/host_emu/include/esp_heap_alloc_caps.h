@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the ESP-IDF header of the same name (tools/host_emu)
+ * MALLOC_CAP_DMA blocks are registered, so the emulated dma can resolve 20-bit descriptor addresses
+ */
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_32BIT    (1<<1)
+#define MALLOC_CAP_8BIT     (1<<2)
+#define MALLOC_CAP_DMA      (1<<3)
+
+void *pvPortMallocCaps(size_t size, uint32_t caps);
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for the ESP-IDF header of the same name (tools/host_emu)
+ * Interrupt handlers are called from the emulator thread (see spi_emu.c)
+ */
+#pragma once
+#include "esp_err.h"
+
+typedef struct intr_handle_data_t *intr_handle_t;
+typedef void (*intr_handler_t)(void *arg);
+
+#define ESP_INTR_FLAG_IRAM          (1<<10)
+#define ESP_INTR_FLAG_INTRDISABLED  (1<<11)
+
+esp_err_t esp_intr_alloc(int source, int flags, intr_handler_t handler, void *arg, intr_handle_t *ret_handle);
+esp_err_t esp_intr_free(intr_handle_t handle);
+esp_err_t esp_intr_enable(intr_handle_t handle);
+esp_err_t esp_intr_disable(intr_handle_t handle);
@@ -0,0 +1,4 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu) */
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
@@ -0,0 +1,5 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu) */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
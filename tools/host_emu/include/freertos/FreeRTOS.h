@@ -0,0 +1,35 @@
+/*
+ * Host stand-in for the FreeRTOS header of the same name (tools/host_emu)
+ * FreeRTOS primitives are implemented with pthreads in emu_rtos.c, one tick is 1 ms.
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "esp_attr.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE             0
+#define pdTRUE              1
+#define pdPASS              1
+#define pdFAIL              0
+#define portMAX_DELAY       0xffffffffUL
+#define portTICK_RATE_MS    1
+#define portTICK_PERIOD_MS  1
+#define configTICK_RATE_HZ  1000
+#define pdMS_TO_TICKS(x)    (x)
+#define configMAX_PRIORITIES    25
+#define portNUM_PROCESSORS      2
+
+#define portYIELD_FROM_ISR()    do { } while (0)
+
+typedef struct emu_queue_s *QueueHandle_t;
+typedef struct emu_queue_s *SemaphoreHandle_t;
+typedef struct emu_task_s *TaskHandle_t;
+
+BaseType_t xPortGetCoreID(void);
+
+#include "freertos/queue.h"
@@ -0,0 +1,13 @@
+/* Host stand-in for the FreeRTOS header of the same name (tools/host_emu) */
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size);
+void vQueueDelete(QueueHandle_t q);
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks_to_wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks_to_wait);
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken);
+BaseType_t xQueueReceiveFromISR(QueueHandle_t q, void *item, BaseType_t *woken);
+BaseType_t xQueuePeekFromISR(QueueHandle_t q, void *item);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+UBaseType_t uxQueueMessagesWaitingFromISR(QueueHandle_t q);
@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the FreeRTOS header of the same name (tools/host_emu)
+ * As in FreeRTOS, a mutex and a binary semaphore are queues of length 1 with zero sized items.
+ */
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+#define xSemaphoreTake(s, ticks)            xQueueReceive((s), NULL, (ticks))
+#define xSemaphoreGive(s)                   xQueueSend((s), NULL, 0)
+#define xSemaphoreGiveFromISR(s, woken)     xQueueSendFromISR((s), NULL, (woken))
+#define vSemaphoreDelete(s)                 vQueueDelete(s)
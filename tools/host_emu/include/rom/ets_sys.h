@@ -0,0 +1,6 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu) */
+#pragma once
+#include <stdint.h>
+
+uint32_t ets_get_cpu_frequency(void);
+void ets_delay_us(uint32_t us);
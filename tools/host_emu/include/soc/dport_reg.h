@@ -0,0 +1,4 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu) */
+#pragma once
+#include "soc/soc.h"
+#define DPORT_SPI_DMA_CHAN_SEL_REG  0x3ff005a8
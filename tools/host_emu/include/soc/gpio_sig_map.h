@@ -0,0 +1,38 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu), only the spi signals */
+#pragma once
+#define SPICLK_OUT_IDX 0
+#define SPIQ_OUT_IDX 1
+#define SPID_OUT_IDX 2
+#define SPIHD_OUT_IDX 3
+#define SPIWP_OUT_IDX 4
+#define SPICS0_OUT_IDX 5
+#define SPICS1_OUT_IDX 6
+#define SPICS2_OUT_IDX 7
+#define SPIQ_IN_IDX 1
+#define SPID_IN_IDX 2
+#define SPIHD_IN_IDX 3
+#define SPIWP_IN_IDX 4
+#define HSPICLK_OUT_IDX 8
+#define HSPIQ_OUT_IDX 9
+#define HSPID_OUT_IDX 10
+#define HSPICS0_OUT_IDX 11
+#define HSPIHD_OUT_IDX 12
+#define HSPIWP_OUT_IDX 13
+#define HSPIQ_IN_IDX 9
+#define HSPID_IN_IDX 10
+#define HSPIHD_IN_IDX 12
+#define HSPIWP_IN_IDX 13
+#define HSPICS1_OUT_IDX 61
+#define HSPICS2_OUT_IDX 62
+#define VSPICLK_OUT_IDX 63
+#define VSPIQ_OUT_IDX 64
+#define VSPID_OUT_IDX 65
+#define VSPIHD_OUT_IDX 66
+#define VSPIWP_OUT_IDX 67
+#define VSPICS0_OUT_IDX 68
+#define VSPICS1_OUT_IDX 69
+#define VSPICS2_OUT_IDX 70
+#define VSPIQ_IN_IDX 64
+#define VSPID_IN_IDX 65
+#define VSPIHD_IN_IDX 66
+#define VSPIWP_IN_IDX 67
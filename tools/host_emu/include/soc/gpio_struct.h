@@ -0,0 +1,32 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu), only the output registers */
+#pragma once
+#include <stdint.h>
+
+typedef volatile struct {
+    uint32_t bt_select;
+    uint32_t out;
+    uint32_t out_w1ts;
+    uint32_t out_w1tc;
+    union {
+        struct {
+            uint32_t data:     8;
+            uint32_t reserved8:24;
+        };
+        uint32_t val;
+    } out1;
+    union {
+        struct {
+            uint32_t data:     8;
+            uint32_t reserved8:24;
+        };
+        uint32_t val;
+    } out1_w1ts;
+    union {
+        struct {
+            uint32_t data:     8;
+            uint32_t reserved8:24;
+        };
+        uint32_t val;
+    } out1_w1tc;
+} gpio_dev_t;
+extern gpio_dev_t GPIO;
@@ -0,0 +1,14 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu) */
+#pragma once
+#include <stdint.h>
+
+#define APB_CLK_FREQ                80000000
+#define BIT(n)                      (1UL<<(n))
+#define SET_PERI_REG_BITS(reg, bit_map, value, shift)   do { (void)(reg); (void)(bit_map); (void)(value); (void)(shift); } while (0)
+
+#define ETS_SPI1_INTR_SOURCE        28
+#define ETS_SPI2_INTR_SOURCE        29
+#define ETS_SPI3_INTR_SOURCE        30
+#define ETS_SPI1_DMA_INTR_SOURCE    53
+#define ETS_SPI2_DMA_INTR_SOURCE    54
+#define ETS_SPI3_DMA_INTR_SOURCE    55
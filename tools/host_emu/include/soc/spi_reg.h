@@ -0,0 +1,69 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu), bits match soc/spi_struct.h */
+#pragma once
+#include "soc/soc.h"
+
+#define SPI_FASTRD_MODE         BIT(13)
+#define SPI_FREAD_DUAL          BIT(14)
+#define SPI_FREAD_QUAD          BIT(20)
+#define SPI_FREAD_DIO           BIT(23)
+#define SPI_FREAD_QIO           BIT(24)
+#define SPI_RD_BIT_ORDER        BIT(25)
+#define SPI_WR_BIT_ORDER        BIT(26)
+
+#define SPI_SETUP_TIME          0x0000000F
+#define SPI_SETUP_TIME_V        0xF
+#define SPI_SETUP_TIME_S        0
+#define SPI_HOLD_TIME           0x0000000F
+#define SPI_HOLD_TIME_V         0xF
+#define SPI_HOLD_TIME_S         4
+#define SPI_MISO_DELAY_MODE     0x00000003
+#define SPI_MISO_DELAY_MODE_V   0x3
+#define SPI_MISO_DELAY_MODE_S   16
+
+#define SPI_CLK_EQU_SYSCLK      BIT(31)
+#define SPI_CLKDIV_PRE_V        0x1FFF
+#define SPI_CLKDIV_PRE_S        18
+#define SPI_CLKCNT_N_V          0x3F
+#define SPI_CLKCNT_N_S          12
+#define SPI_CLKCNT_H_V          0x3F
+#define SPI_CLKCNT_H_S          6
+#define SPI_CLKCNT_L_V          0x3F
+#define SPI_CLKCNT_L_S          0
+
+#define SPI_DOUTDIN             BIT(0)
+#define SPI_CS_HOLD             BIT(4)
+#define SPI_CS_SETUP            BIT(5)
+#define SPI_CK_I_EDGE           BIT(6)
+#define SPI_CK_OUT_EDGE         BIT(7)
+#define SPI_SIO                 BIT(16)
+
+#define SPI_FWRITE_DUAL         BIT(12)
+#define SPI_FWRITE_QUAD         BIT(13)
+#define SPI_FWRITE_DIO          BIT(14)
+#define SPI_FWRITE_QIO          BIT(15)
+#define SPI_USR_MISO_HIGHPART   BIT(24)
+#define SPI_USR_MOSI_HIGHPART   BIT(25)
+#define SPI_USR_MOSI            BIT(27)
+#define SPI_USR_MISO            BIT(28)
+#define SPI_USR_DUMMY           BIT(29)
+#define SPI_USR_ADDR            BIT(30)
+#define SPI_USR_COMMAND         BIT(31)
+
+#define SPI_USR_ADDR_BITLEN_V       0x3F
+#define SPI_USR_ADDR_BITLEN_S       26
+#define SPI_USR_DUMMY_CYCLELEN_V    0xFF
+#define SPI_USR_DUMMY_CYCLELEN_S    0
+#define SPI_USR_COMMAND_BITLEN_V    0xF
+#define SPI_USR_COMMAND_BITLEN_S    28
+#define SPI_USR_COMMAND_VALUE_V     0xFFFF
+#define SPI_USR_COMMAND_VALUE_S     0
+
+#define SPI_CS0_DIS             BIT(0)
+#define SPI_CS1_DIS             BIT(1)
+#define SPI_CS2_DIS             BIT(2)
+#define SPI_CK_IDLE_EDGE        BIT(29)
+
+#define SPI_OUT_RST             BIT(2)
+#define SPI_IN_RST              BIT(3)
+#define SPI_AHBM_FIFO_RST       BIT(4)
+#define SPI_AHBM_RST            BIT(5)
@@ -0,0 +1,243 @@
+/*
+ * Host stand-in for the ESP-IDF header of the same name (tools/host_emu)
+ * Same register fields and bit positions as the ESP32 spi peripheral; registers not used
+ * by the driver are left out, so the offsets are not the same as on the chip.
+ */
+#pragma once
+#include <stdint.h>
+
+typedef volatile struct {
+    union {
+        struct {
+            uint32_t reserved0:        16;
+            uint32_t flash_per:         1;
+            uint32_t flash_pes:         1;
+            uint32_t usr:               1;          // start user defined transaction, cleared when it is done
+            uint32_t flash_hpm:         1;
+            uint32_t flash_res:         1;
+            uint32_t flash_dp:          1;
+            uint32_t flash_ce:          1;
+            uint32_t flash_be:          1;
+            uint32_t flash_se:          1;
+            uint32_t flash_pp:          1;
+            uint32_t flash_wrsr:        1;
+            uint32_t flash_rdsr:        1;
+            uint32_t flash_rdid:        1;
+            uint32_t flash_wrdi:        1;
+            uint32_t flash_wren:        1;
+            uint32_t flash_read:        1;
+        };
+        uint32_t val;
+    } cmd;
+    uint32_t addr;
+    union {
+        struct {
+            uint32_t reserved0:        10;
+            uint32_t fcs_crc_en:        1;
+            uint32_t tx_crc_en:         1;
+            uint32_t wait_flash_idle_en: 1;
+            uint32_t fastrd_mode:       1;
+            uint32_t fread_dual:        1;
+            uint32_t resandres:         1;
+            uint32_t reserved16:        4;
+            uint32_t fread_quad:        1;
+            uint32_t wp:                1;
+            uint32_t wrsr_2b:           1;
+            uint32_t fread_dio:         1;
+            uint32_t fread_qio:         1;
+            uint32_t rd_bit_order:      1;
+            uint32_t wr_bit_order:      1;
+            uint32_t reserved27:        5;
+        };
+        uint32_t val;
+    } ctrl;
+    union {
+        struct {
+            uint32_t reserved0:        16;
+            uint32_t cs_hold_delay_res: 12;
+            uint32_t cs_hold_delay:     4;
+        };
+        uint32_t val;
+    } ctrl1;
+    uint32_t rd_status;
+    union {
+        struct {
+            uint32_t setup_time:        4;
+            uint32_t hold_time:         4;
+            uint32_t ck_out_low_mode:   4;
+            uint32_t ck_out_high_mode:  4;
+            uint32_t miso_delay_mode:   2;
+            uint32_t miso_delay_num:    3;
+            uint32_t mosi_delay_mode:   2;
+            uint32_t mosi_delay_num:    3;
+            uint32_t cs_delay_mode:     2;
+            uint32_t cs_delay_num:      4;
+        };
+        uint32_t val;
+    } ctrl2;
+    union {
+        struct {
+            uint32_t clkcnt_l:          6;
+            uint32_t clkcnt_h:          6;
+            uint32_t clkcnt_n:          6;
+            uint32_t clkdiv_pre:       13;
+            uint32_t clk_equ_sysclk:    1;
+        };
+        uint32_t val;
+    } clock;
+    union {
+        struct {
+            uint32_t doutdin:           1;
+            uint32_t reserved1:         3;
+            uint32_t cs_hold:           1;
+            uint32_t cs_setup:          1;
+            uint32_t ck_i_edge:         1;
+            uint32_t ck_out_edge:       1;
+            uint32_t reserved8:         2;
+            uint32_t rd_byte_order:     1;
+            uint32_t wr_byte_order:     1;
+            uint32_t fwrite_dual:       1;
+            uint32_t fwrite_quad:       1;
+            uint32_t fwrite_dio:        1;
+            uint32_t fwrite_qio:        1;
+            uint32_t sio:               1;
+            uint32_t usr_hold_pol:      1;
+            uint32_t usr_dout_hold:     1;
+            uint32_t usr_din_hold:      1;
+            uint32_t usr_dummy_hold:    1;
+            uint32_t usr_addr_hold:     1;
+            uint32_t usr_cmd_hold:      1;
+            uint32_t usr_prep_hold:     1;
+            uint32_t usr_miso_highpart: 1;
+            uint32_t usr_mosi_highpart: 1;
+            uint32_t usr_dummy_idle:    1;
+            uint32_t usr_mosi:          1;
+            uint32_t usr_miso:          1;
+            uint32_t usr_dummy:         1;
+            uint32_t usr_addr:          1;
+            uint32_t usr_command:       1;
+        };
+        uint32_t val;
+    } user;
+    union {
+        struct {
+            uint32_t usr_dummy_cyclelen: 8;
+            uint32_t reserved8:        18;
+            uint32_t usr_addr_bitlen:   6;
+        };
+        uint32_t val;
+    } user1;
+    union {
+        struct {
+            uint32_t usr_command_value: 16;
+            uint32_t reserved16:       12;
+            uint32_t usr_command_bitlen: 4;
+        };
+        uint32_t val;
+    } user2;
+    union {
+        struct {
+            uint32_t usr_mosi_dbitlen: 24;
+            uint32_t reserved24:        8;
+        };
+        uint32_t val;
+    } mosi_dlen;
+    union {
+        struct {
+            uint32_t usr_miso_dbitlen: 24;
+            uint32_t reserved24:        8;
+        };
+        uint32_t val;
+    } miso_dlen;
+    uint32_t slv_wr_status;
+    union {
+        struct {
+            uint32_t cs0_dis:           1;
+            uint32_t cs1_dis:           1;
+            uint32_t cs2_dis:           1;
+            uint32_t reserved3:         2;
+            uint32_t ck_dis:            1;
+            uint32_t master_cs_pol:     3;
+            uint32_t reserved9:         2;
+            uint32_t master_ck_sel:     3;
+            uint32_t reserved14:       15;
+            uint32_t ck_idle_edge:      1;
+            uint32_t cs_keep_active:    1;
+            uint32_t reserved31:        1;
+        };
+        uint32_t val;
+    } pin;
+    union {
+        struct {
+            uint32_t rd_buf_done:       1;
+            uint32_t wr_buf_done:       1;
+            uint32_t rd_sta_done:       1;
+            uint32_t wr_sta_done:       1;
+            uint32_t trans_done:        1;          // set when the transaction is done, interrupt if 'trans_inten'
+            uint32_t rd_buf_inten:      1;
+            uint32_t wr_buf_inten:      1;
+            uint32_t rd_sta_inten:      1;
+            uint32_t wr_sta_inten:      1;
+            uint32_t trans_inten:       1;
+            uint32_t cs_i_mode:         2;
+            uint32_t reserved12:        5;
+            uint32_t last_command:      3;
+            uint32_t last_state:        3;
+            uint32_t trans_cnt:         4;
+            uint32_t cmd_define:        1;
+            uint32_t wr_rd_sta_en:      1;
+            uint32_t wr_rd_buf_en:      1;
+            uint32_t slave_mode:        1;
+            uint32_t sync_reset:        1;
+        };
+        uint32_t val;
+    } slave;
+    uint32_t data_buf[16];
+    union {
+        struct {
+            uint32_t reserved0:         2;
+            uint32_t out_rst:           1;
+            uint32_t in_rst:            1;
+            uint32_t ahbm_fifo_rst:     1;
+            uint32_t ahbm_rst:          1;
+            uint32_t in_loop_test:      1;
+            uint32_t out_loop_test:     1;
+            uint32_t out_auto_wrback:   1;
+            uint32_t out_eof_mode:      1;
+            uint32_t outdscr_burst_en:  1;
+            uint32_t indscr_burst_en:   1;
+            uint32_t out_data_burst_en: 1;
+            uint32_t reserved13:        1;
+            uint32_t dma_rx_stop:       1;
+            uint32_t dma_tx_stop:       1;
+            uint32_t dma_continue:      1;
+            uint32_t reserved17:       15;
+        };
+        uint32_t val;
+    } dma_conf;
+    union {
+        struct {
+            uint32_t addr:             20;          // low 20 bits of the first descriptor address
+            uint32_t reserved20:        8;
+            uint32_t stop:              1;
+            uint32_t start:             1;
+            uint32_t restart:           1;
+            uint32_t reserved31:        1;
+        };
+        uint32_t val;
+    } dma_out_link;
+    union {
+        struct {
+            uint32_t addr:             20;
+            uint32_t auto_ret:          1;
+            uint32_t reserved21:        7;
+            uint32_t stop:              1;
+            uint32_t start:             1;
+            uint32_t restart:           1;
+            uint32_t reserved31:        1;
+        };
+        uint32_t val;
+    } dma_in_link;
+} spi_dev_t;
+
+extern spi_dev_t SPI0, SPI1, SPI2, SPI3;
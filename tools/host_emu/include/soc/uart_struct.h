@@ -0,0 +1,2 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu), not used */
+#pragma once
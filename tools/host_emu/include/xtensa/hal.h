@@ -0,0 +1,5 @@
+/* Host stand-in for the ESP-IDF header of the same name (tools/host_emu), ccount runs at ets_get_cpu_frequency() MHz */
+#pragma once
+#include <stdint.h>
+
+uint32_t xthal_get_ccount(void);
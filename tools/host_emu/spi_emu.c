@@ -0,0 +1,463 @@
+/*
+ * Host emulator of the ESP32 SPI peripheral (tools/host_emu), see spi_emu.h
+ *
+ * Also provides the ESP-IDF functions used by spi_master_nodma.c which touch the hardware:
+ * interrupt allocation, gpio, peripheral and APB clocks and the dma capable heap.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include "esp_intr_alloc.h"
+#include "esp_heap_alloc_caps.h"
+#include "soc/soc.h"
+#include "esp_clk.h"
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+#include "soc/gpio_struct.h"
+#include "driver/periph_ctrl.h"
+#include "rom/lldesc.h"
+#include "spi_emu.h"
+
+spi_dev_t SPI0, SPI1, SPI2, SPI3;
+gpio_dev_t GPIO;    // direct gpio register writes (display DC) are only stored
+
+const uint32_t GPIO_PIN_MUX_REG[GPIO_PIN_COUNT] = { 0 };
+
+struct intr_handle_data_t {
+    intr_handler_t handler;
+    void *arg;
+    volatile int enabled;
+};
+
+typedef struct {
+    spi_dev_t *hw;
+    int irq;                        // interrupt source of the host
+    spi_emu_slave_t *slave;
+    struct intr_handle_data_t intr; // handler allocated with esp_intr_alloc
+    int intr_cpu;                   // core of the task which allocated the handler
+    spi_emu_stats_t stats;
+    uint8_t *txbuf;                 // data phase buffers
+    uint8_t *rxbuf;
+    uint32_t bufsize;
+} emu_host_t;
+
+static emu_host_t emu_host[3] = {
+    { .hw=&SPI1, .irq=ETS_SPI1_INTR_SOURCE },
+    { .hw=&SPI2, .irq=ETS_SPI2_INTR_SOURCE },
+    { .hw=&SPI3, .irq=ETS_SPI3_INTR_SOURCE },
+};
+
+static spi_emu_timing_t emu_timing = { .time_scale=0, .trans_ns=0 };
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t emu_thread;
+static volatile int emu_running = 0;
+static int emu_single_cpu = 0;      // the emulator thread must not spin if it shares the only cpu with the driver
+static volatile int gpio_level[GPIO_PIN_COUNT];
+static volatile int emu_apb_freq = APB_CLK_FREQ;
+
+// dma capable heap blocks, used to resolve the 20-bit descriptor addresses
+#define EMU_DMA_BLOCKS 64
+static struct {
+    uint8_t *ptr;
+    size_t size;
+} dma_block[EMU_DMA_BLOCKS];
+static int dma_block_next = 0;
+static pthread_mutex_t dma_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+//---------------------------
+uint64_t spi_emu_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// ==== ESP-IDF functions ====
+
+//--------------------------------------------------
+void *pvPortMallocCaps(size_t size, uint32_t caps)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, sizeof(void *), (size) ? size : 4) != 0) return NULL;
+    if (caps & MALLOC_CAP_DMA) {
+        pthread_mutex_lock(&dma_lock);
+        dma_block[dma_block_next].ptr = p;
+        dma_block[dma_block_next].size = size;
+        dma_block_next = (dma_block_next + 1) % EMU_DMA_BLOCKS;
+        pthread_mutex_unlock(&dma_lock);
+    }
+    return p;
+}
+
+// Find the dma capable memory whose address ends with 'addr' (as set in dma_out_link/dma_in_link)
+// The most recently allocated block is checked first
+//--------------------------------------------
+static lldesc_t *dma_desc_addr(uint32_t addr)
+{
+    lldesc_t *res = NULL;
+    pthread_mutex_lock(&dma_lock);
+    for (int n=1; n<=EMU_DMA_BLOCKS; n++) {
+        int i = (dma_block_next + EMU_DMA_BLOCKS - n) % EMU_DMA_BLOCKS;
+        uintptr_t base = (uintptr_t)dma_block[i].ptr;
+        if (base == 0) continue;
+        uintptr_t cand = (base & ~(uintptr_t)0xFFFFF) | addr;
+        if (cand < base) cand += 0x100000;
+        if (cand + sizeof(lldesc_t) <= base + dma_block[i].size) {
+            res = (lldesc_t *)cand;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dma_lock);
+    return res;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+esp_err_t esp_intr_alloc(int source, int flags, intr_handler_t handler, void *arg, intr_handle_t *ret_handle)
+{
+    for (int h=0; h<3; h++) {
+        if (emu_host[h].irq == source) {
+            emu_host[h].intr.handler = handler;
+            emu_host[h].intr.arg = arg;
+            emu_host[h].intr.enabled = (flags & ESP_INTR_FLAG_INTRDISABLED) ? 0 : 1;
+            emu_host[h].intr_cpu = xPortGetCoreID();
+            if (ret_handle) *ret_handle = &emu_host[h].intr;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+//-------------------------------------------
+esp_err_t esp_intr_free(intr_handle_t handle)
+{
+    handle->enabled = 0;
+    handle->handler = NULL;
+    return ESP_OK;
+}
+
+//---------------------------------------------
+esp_err_t esp_intr_enable(intr_handle_t handle)
+{
+    handle->enabled = 1;
+    return ESP_OK;
+}
+
+//----------------------------------------------
+esp_err_t esp_intr_disable(intr_handle_t handle)
+{
+    handle->enabled = 0;
+    return ESP_OK;
+}
+
+//-----------------------------------------------------------
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if (!GPIO_IS_VALID_GPIO(gpio_num)) return ESP_ERR_INVALID_ARG;
+    gpio_level[gpio_num] = (level) ? 1 : 0;
+    return ESP_OK;
+}
+
+//-------------------------------------
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    if (!GPIO_IS_VALID_GPIO(gpio_num)) return 0;
+    return gpio_level[gpio_num];
+}
+
+//-----------------------------------------------------------------
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    return (GPIO_IS_VALID_GPIO(gpio_num)) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv) { }
+void gpio_matrix_in(uint32_t gpio, uint32_t signal_idx, bool inv) { }
+void periph_module_enable(periph_module_t module) { }
+void periph_module_disable(periph_module_t module) { }
+
+//------------------------
+int esp_clk_apb_freq(void)
+{
+    return emu_apb_freq;
+}
+
+
+// ==== Emulator ====
+
+//----------------------------
+int spi_emu_gpio_get(int gpio)
+{
+    return gpio_get_level(gpio);
+}
+
+//---------------------------------
+uint32_t spi_emu_clock_hz(int host)
+{
+    spi_dev_t *hw = emu_host[host].hw;
+    if (hw->clock.clk_equ_sysclk) return emu_apb_freq;
+    return emu_apb_freq / ((hw->clock.clkdiv_pre + 1) * (hw->clock.clkcnt_n + 1));
+}
+
+//---------------------------
+int spi_emu_intr_cpu(int host)
+{
+    if (emu_host[host].intr.handler == NULL) return -1;
+    return emu_host[host].intr_cpu;
+}
+
+//-------------------------------
+int spi_emu_intr_enabled(int host)
+{
+    return emu_host[host].intr.enabled;
+}
+
+//-------------------------------
+void spi_emu_set_apb_freq(int hz)
+{
+    emu_apb_freq = hz;
+}
+
+//----------------------------------------------------
+void spi_emu_attach(int host, spi_emu_slave_t *slave)
+{
+    emu_host[host].slave = slave;
+}
+
+//---------------------------------------------------------
+void spi_emu_set_timing(const spi_emu_timing_t *timing)
+{
+    emu_timing = *timing;
+}
+
+//-------------------------------------------------------------------
+void spi_emu_get_stats(int host, spi_emu_stats_t *stats, int reset)
+{
+    pthread_mutex_lock(&stats_lock);
+    *stats = emu_host[host].stats;
+    if (reset) memset(&emu_host[host].stats, 0, sizeof(spi_emu_stats_t));
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Make sure the data phase buffers can hold 'bytes'
+//---------------------------------------------------------
+static void emu_buffers(emu_host_t *eh, uint32_t bytes)
+{
+    if (bytes <= eh->bufsize) return;
+    eh->txbuf = realloc(eh->txbuf, bytes);
+    eh->rxbuf = realloc(eh->rxbuf, bytes);
+    if ((eh->txbuf == NULL) || (eh->rxbuf == NULL)) {
+        fprintf(stderr, "spi_emu: out of memory\n");
+        abort();
+    }
+    eh->bufsize = bytes;
+}
+
+// Read 'bytes' of transmit data from the dma descriptor chain; looped chains are followed until all data are read
+//--------------------------------------------------------------------
+static void emu_dma_read(lldesc_t *desc, uint8_t *dst, uint32_t bytes)
+{
+    while (bytes > 0) {
+        if (desc == NULL) {
+            // end of the chain before all data were sent
+            memset(dst, 0, bytes);
+            return;
+        }
+        uint32_t n = desc->length;
+        if (n > bytes) n = bytes;
+        memcpy(dst, (const uint8_t *)desc->buf, n);
+        dst += n;
+        bytes -= n;
+        desc = desc->qe.stqe_next;
+    }
+}
+
+// Write 'bytes' of received data to the dma descriptor chain
+//--------------------------------------------------------------------------
+static void emu_dma_write(lldesc_t *desc, const uint8_t *src, uint32_t bytes)
+{
+    while ((bytes > 0) && (desc != NULL)) {
+        uint32_t n = desc->size;
+        if (n > bytes) n = bytes;
+        memcpy((uint8_t *)desc->buf, src, n);
+        desc->length = n;
+        src += n;
+        bytes -= n;
+        if (bytes == 0) desc->eof = 1;
+        desc = desc->qe.stqe_next;
+    }
+}
+
+// Execute the transaction started by setting 'cmd.usr'
+//------------------------------------
+static void emu_execute(emu_host_t *eh)
+{
+    spi_dev_t *hw = eh->hw;
+    spi_emu_slave_t *slave = eh->slave;
+    uint64_t start = spi_emu_time_ns();
+    uint64_t cycles = 0;
+    uint32_t txbits = 0, rxbits = 0, bits;
+    int tx_lines = 1, rx_lines = 1, addr_lines = 1;
+
+    __sync_synchronize();
+
+    // ** Number of data lines used in data and address phases
+    if (hw->user.fwrite_qio || hw->user.fwrite_quad) tx_lines = 4;
+    else if (hw->user.fwrite_dio || hw->user.fwrite_dual) tx_lines = 2;
+    if (hw->ctrl.fread_qio || hw->ctrl.fread_quad) rx_lines = 4;
+    else if (hw->ctrl.fread_dio || hw->ctrl.fread_dual) rx_lines = 2;
+    if (hw->user.fwrite_qio || hw->ctrl.fread_qio) addr_lines = 4;
+    else if (hw->user.fwrite_dio || hw->ctrl.fread_dio) addr_lines = 2;
+
+    // ** Command phase
+    if (hw->user.usr_command) {
+        bits = hw->user2.usr_command_bitlen + 1;
+        if ((slave) && (slave->command)) slave->command(slave, hw->user2.usr_command_value & ((1UL << bits) - 1), bits);
+        cycles += bits;
+    }
+    // ** Address phase
+    if (hw->user.usr_addr) {
+        bits = hw->user1.usr_addr_bitlen + 1;
+        uint64_t addr = (bits > 32) ? (((uint64_t)hw->addr << 32) | hw->slv_wr_status) : hw->addr;
+        if ((slave) && (slave->address)) slave->address(slave, addr, bits);
+        cycles += (bits + addr_lines - 1) / addr_lines;
+    }
+    // ** Dummy phase
+    if (hw->user.usr_dummy) cycles += hw->user1.usr_dummy_cyclelen + 1;
+
+    // ** Data phase
+    if (hw->user.usr_mosi) txbits = hw->mosi_dlen.usr_mosi_dbitlen + 1;
+    if (hw->user.usr_miso) rxbits = hw->miso_dlen.usr_miso_dbitlen + 1;
+    // In full duplex mode the data phase length is given by mosi length
+    if ((hw->user.doutdin) && (txbits)) rxbits = (rxbits) ? txbits : 0;
+
+    emu_buffers(eh, ((txbits > rxbits) ? txbits : rxbits) / 8 + 4);
+
+    if (txbits) {
+        uint32_t bytes = (txbits + 7) / 8;
+        if (hw->dma_out_link.start) {
+            emu_dma_read(dma_desc_addr(hw->dma_out_link.addr), eh->txbuf, bytes);
+        } else {
+            uint32_t offset = (hw->user.usr_mosi_highpart) ? 32 : 0;
+            if (bytes > (64 - offset)) bytes = 64 - offset;    // hw buffer size
+            memcpy(eh->txbuf, (const uint8_t *)hw->data_buf + offset, bytes);
+        }
+    }
+    if ((hw->user.doutdin) && (txbits) && (rxbits)) {
+        // full duplex
+        if ((slave) && (slave->data)) slave->data(slave, eh->txbuf, eh->rxbuf, txbits);
+        else memset(eh->rxbuf, 0xFF, (rxbits + 7) / 8);
+        cycles += txbits;
+    } else {
+        // half duplex, data are received after transmission
+        if (txbits) {
+            if ((slave) && (slave->data)) slave->data(slave, eh->txbuf, NULL, txbits);
+            cycles += (txbits + tx_lines - 1) / tx_lines;
+        }
+        if (rxbits) {
+            if ((slave) && (slave->data)) slave->data(slave, NULL, eh->rxbuf, rxbits);
+            else memset(eh->rxbuf, 0xFF, (rxbits + 7) / 8);
+            cycles += (rxbits + rx_lines - 1) / rx_lines;
+        }
+    }
+    if (rxbits) {
+        uint32_t bytes = (rxbits + 7) / 8;
+        if (hw->dma_in_link.start) {
+            emu_dma_write(dma_desc_addr(hw->dma_in_link.addr), eh->rxbuf, bytes);
+        } else {
+            uint32_t offset = (hw->user.usr_miso_highpart) ? 32 : 0;
+            if (bytes > (64 - offset)) bytes = 64 - offset;
+            memcpy((uint8_t *)hw->data_buf + offset, eh->rxbuf, bytes);
+        }
+    }
+    hw->dma_out_link.start = 0;
+    hw->dma_in_link.start = 0;
+
+    // ** Bit-time model
+    uint64_t wire_ns = ((cycles * 1000000000ULL) / spi_emu_clock_hz(eh - emu_host)) + emu_timing.trans_ns;
+    if (emu_timing.time_scale > 0) {
+        uint64_t end = start + (uint64_t)(wire_ns * emu_timing.time_scale);
+        if (emu_single_cpu) {
+            // let the driver run while the data are on the wire
+            struct timespec ts = { .tv_sec = end / 1000000000ULL, .tv_nsec = end % 1000000000ULL };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+        }
+        else while (spi_emu_time_ns() < end);
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    eh->stats.transactions++;
+    eh->stats.mosi_bits += txbits;
+    eh->stats.miso_bits += rxbits;
+    eh->stats.cycles += cycles;
+    eh->stats.wire_ns += wire_ns;
+    eh->stats.busy_ns += spi_emu_time_ns() - start;
+    pthread_mutex_unlock(&stats_lock);
+
+    __sync_synchronize();
+    hw->slave.trans_done = 1;
+    hw->cmd.usr = 0;
+}
+
+//---------------------------------------
+static void *emu_task(void *arg)
+{
+    const struct timespec idle = { .tv_sec = 0, .tv_nsec = 10000 };
+
+    if (emu_single_cpu) prctl(PR_SET_TIMERSLACK, 1);
+    while (emu_running) {
+        int active = 0;
+        for (int h=1; h<3; h++) {
+            emu_host_t *eh = &emu_host[h];
+            if (eh->hw->cmd.usr) {
+                emu_execute(eh);
+                active = 1;
+            }
+            // Interrupt is level triggered, the handler is called while the condition is active
+            if ((eh->intr.enabled) && (eh->intr.handler) && (eh->hw->slave.trans_inten) && (eh->hw->slave.trans_done) && (eh->hw->cmd.usr == 0)) {
+                pthread_mutex_lock(&stats_lock);
+                eh->stats.interrupts++;
+                pthread_mutex_unlock(&stats_lock);
+                spi_emu_isr_enter();
+                eh->intr.handler(eh->intr.arg);
+                spi_emu_isr_exit();
+                active = 1;
+            }
+        }
+        if ((emu_single_cpu) && (!active)) nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+//----------------------
+void spi_emu_start(void)
+{
+    if (emu_running) return;
+    emu_running = 1;
+    emu_single_cpu = (sysconf(_SC_NPROCESSORS_ONLN) < 2);
+    if (pthread_create(&emu_thread, NULL, emu_task, NULL) != 0) {
+        fprintf(stderr, "spi_emu: cannot start the emulator thread\n");
+        abort();
+    }
+    if (emu_single_cpu) {
+        // The driver busy waits for the transactions; with the lowest priority it is preempted
+        // as soon as the emulator thread wakes up
+        struct sched_param param = { .sched_priority = 0 };
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    }
+}
+
+//---------------------
+void spi_emu_stop(void)
+{
+    if (!emu_running) return;
+    emu_running = 0;
+    pthread_join(emu_thread, NULL);
+}
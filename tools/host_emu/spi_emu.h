@@ -0,0 +1,156 @@
+/*
+ *
+ * HOST EMULATOR OF THE ESP32 SPI PERIPHERAL
+ *
+ * Lets 'spi_master_nodma.c' run unmodified on Linux, for benchmarking and regression checks without hardware.
+ *
+ * SPI1, SPI2 and SPI3 'spi_dev_t' register blocks are plain memory, serviced by the emulator thread:
+ *  - when 'cmd.usr' is set, the transaction is executed as the hw would:
+ *    command, address, dummy and data phases from 'user', 'user1', 'user2', 'mosi_dlen', 'miso_dlen';
+ *    data from/to 'data_buf' (honoring 'usr_mosi_highpart'/'usr_miso_highpart') or the dma descriptor chains
+ *  - the bytes are passed to the slave model attached to the host
+ *  - the wire time is computed from the clock register and the phases' bit lengths (bit-time model),
+ *    the emulator waits that long (scaled by 'time_scale') before clearing 'cmd.usr' and setting 'slave.trans_done'
+ *  - while 'slave.trans_done' and 'slave.trans_inten' are set, the interrupt handler allocated for the host
+ *    with 'esp_intr_alloc' (if enabled) is called from the emulator thread
+ *
+ * On single cpu hosts the thread calling 'spi_emu_start' is set to the lowest priority (the driver busy waits)
+ * and the emulator thread polls the registers every 10 us instead of spinning.
+ *
+ * Bit order, spi mode and cs timing registers are not modelled, data are passed to the slave as they are in memory.
+ *
+*/
+
+#ifndef _SPI_EMU_H_
+#define _SPI_EMU_H_
+
+#include <stdint.h>
+#include "soc/spi_struct.h"
+
+typedef struct spi_emu_slave_s spi_emu_slave_t;
+
+/*
+ * Slave model attached to the emulated spi host
+ * Any of the callbacks can be NULL.
+ */
+struct spi_emu_slave_s {
+    // Command phase, 'bits' long
+    void (*command)(spi_emu_slave_t *slave, uint32_t value, int bits);
+    // Address phase, 'bits' long
+    void (*address)(spi_emu_slave_t *slave, uint64_t value, int bits);
+    // Data phase, 'bits' long; 'mosi' is NULL if nothing is sent, 'miso' is NULL if nothing is received
+    // In full duplex both are set, 'miso' must be filled with ((bits+7)/8) bytes
+    void (*data)(spi_emu_slave_t *slave, const uint8_t *mosi, uint8_t *miso, int bits);
+    void *ctx;              // model's state
+};
+
+// Bit-time model
+typedef struct {
+    double time_scale;      // emulated wire time multiplier; 0: transactions finish immediately, 1: real time
+    uint32_t trans_ns;      // fixed time added to each transaction (cs setup, hw start latency), in ns
+} spi_emu_timing_t;
+
+// Emulated host statistics
+typedef struct {
+    uint32_t transactions;  // number of executed transactions
+    uint32_t interrupts;    // number of interrupt handler calls
+    uint64_t mosi_bits;     // data bits sent
+    uint64_t miso_bits;     // data bits received
+    uint64_t cycles;        // spi clock cycles of all phases (data and address phases use 2/4 lines in DIO/QIO mode)
+    uint64_t wire_ns;       // modelled time on the wire
+    uint64_t busy_ns;       // host time between 'cmd.usr' seen set and cleared by the emulator
+} spi_emu_stats_t;
+
+/**
+ * @brief Start the emulator thread
+ */
+void spi_emu_start(void);
+
+/**
+ * @brief Stop the emulator thread
+ */
+void spi_emu_stop(void);
+
+/**
+ * @brief Attach the slave model to the spi host (1: HSPI, 2: VSPI)
+ */
+void spi_emu_attach(int host, spi_emu_slave_t *slave);
+
+/**
+ * @brief Set the bit-time model used for all hosts
+ */
+void spi_emu_set_timing(const spi_emu_timing_t *timing);
+
+/**
+ * @brief Get and optionally reset the emulated host statistics
+ */
+void spi_emu_get_stats(int host, spi_emu_stats_t *stats, int reset);
+
+/**
+ * @brief Return spi clock set in the host's clock register, in Hz
+ */
+uint32_t spi_emu_clock_hz(int host);
+
+/**
+ * @brief Return the core on which the host's interrupt handler was allocated, -1 if not allocated
+ */
+int spi_emu_intr_cpu(int host);
+
+/**
+ * @brief Return 1 if the host's interrupt is enabled
+ */
+int spi_emu_intr_enabled(int host);
+
+/**
+ * @brief Set the APB clock returned by esp_clk_apb_freq(), as dynamic frequency scaling would (default 80 MHz)
+ */
+void spi_emu_set_apb_freq(int hz);
+
+/**
+ * @brief Return the last level set on the gpio with gpio_set_level()
+ */
+int spi_emu_gpio_get(int gpio);
+
+/**
+ * @brief Monotonic host time in ns
+ */
+uint64_t spi_emu_time_ns(void);
+
+/**
+ * @brief Interrupt handlers run between these calls (emulator thread)
+ *
+ * As on the ESP32, a task woken from an interrupt handler continues only after the handler returns.
+ */
+void spi_emu_isr_enter(void);
+void spi_emu_isr_exit(void);
+
+
+// ==== Slave models (emu_slaves.c) ====
+
+// State of the capture slave model
+typedef struct {
+    uint8_t *buf;           // received (mosi) data are stored here, up to 'size' bytes
+    uint32_t size;
+    uint32_t len;           // number of bytes stored in 'buf'
+    uint64_t mosi_bits;     // total number of bits received from master
+    uint64_t miso_bits;     // total number of bits sent to master
+    uint32_t commands;      // number of command phases
+    uint32_t last_command;  // value of the last command phase
+    uint64_t last_address;  // value of the last address phase
+    uint8_t miso_next;      // next byte sent to master; sent bytes are an incrementing sequence
+    int dc_gpio;            // if >= 0, only data sent while this gpio is high are stored in 'buf'
+} spi_emu_capture_t;
+
+/**
+ * @brief Initialize the capture slave model
+ *
+ * Stores the received data, sends an incrementing byte sequence starting with 'miso_first'.
+ */
+void spi_emu_capture_init(spi_emu_slave_t *slave, spi_emu_capture_t *cap, uint8_t *buf, uint32_t size, uint8_t miso_first);
+
+/**
+ * @brief Initialize the loopback slave model, sends back the received data (full duplex)
+ */
+void spi_emu_loopback_init(spi_emu_slave_t *slave);
+
+#endif
@@ -0,0 +1,1162 @@
+/*
+ * Self-check and benchmark of spi_master_nodma.c running on the host, against the emulated spi peripheral
+ *
+ * Build & run from the project directory:
+ *   make -C tools/host_emu bench
+ *
+ * Options:
+ *   -c        only run the functional checks
+ *   -n bytes  number of bytes transferred in each benchmark scenario (default 16384)
+ *   -m ns     fail if the driver overhead of any scenario is more than 'ns' per byte
+ *   -w file   write the capture of the transfer scenarios' transactions (input for spi_emu_replay)
+ *
+ * The driver overhead is measured with transactions finishing immediately (time_scale=0):
+ *   (wall time - emulator busy time) / bytes
+ * It is host cpu time (including the hand-off to the emulator thread), only useful for comparing driver versions.
+ * The effective throughput at each spi clock is measured with the real time bit-time model (time_scale=1)
+ * and shown with the percentage of the time the data were on the wire.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "spi_master_nodma.h"
+#include "spi_emu.h"
+#include "soc/soc.h"
+
+#define EMU_HOST        VSPI_HOST
+#define EMU_PIN_MISO    19
+#define EMU_PIN_MOSI    23
+#define EMU_PIN_CLK     18
+#define EMU_PIN_CS      5
+#define EMU_PIN_TCS     4
+#define EMU_PIN_FCS     15
+#define REPEAT_SIZE     960     // one 480 pixel RGB565 line
+#define HOST2           HSPI_HOST
+#define HOST2_PIN_MISO  12
+#define HOST2_PIN_MOSI  13
+#define HOST2_PIN_CLK   14
+#define HOST2_PIN_CLK2  27      // second device on HOST2 uses a different clock pin
+#define HOST2_PIN_CS    26
+#define HOST2_PIN_CS2   25
+#define NOTIFY_TRANS    16      // queued transactions of the notified completion check
+#define HOST2_TRANS     200     // queued transactions of each host in the parallel check
+#define EMU_PIN_UCS     16      // software CS of the urgent device
+#define BULK_TRANS      16      // transactions of the preemptible batch
+
+typedef struct {
+    const char *name;
+    int dev;                    // device used: 0: display-like, 1: with command phase, 2: full duplex
+    void (*run)(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len);
+} scenario_t;
+
+static spi_nodma_device_handle_t disp = NULL;     // display-like device, no command phase, software CS
+static spi_nodma_device_handle_t cmddev = NULL;   // touch-like device, 8-bit command phase, hardware CS
+static spi_nodma_device_handle_t fdxdev = NULL;   // adc-like device, full duplex, software CS
+static uint8_t *fdx_rx;                           // receive buffer of the full duplex scenario
+static spi_emu_slave_t slave;
+static spi_emu_capture_t cap;
+static uint8_t *cap_buf;
+static uint32_t cap_size;
+static int failed = 0;
+static spi_nodma_transaction_t *cb_trans[8];     // transactions passed to 'pre_cb' / 'post_cb'
+static int cb_pre, cb_post;
+
+
+// ==== Scenarios ====
+
+//-----------------------------------------------------------------------------------
+static void run_direct_tx(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = buf;
+    t.length = len * 8;
+    t.command = 0xA5;
+    if (spi_nodma_transfer_data(handle, &t) != ESP_OK) failed++;
+}
+
+//-----------------------------------------------------------------------------------
+static void run_direct_rx(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.rx_buffer = buf;
+    t.rxlength = len * 8;
+    if (spi_nodma_transfer_data(handle, &t) != ESP_OK) failed++;
+}
+
+// Full duplex, the data received while sending are stored in 'fdx_rx'
+//---------------------------------------------------------------------------------------
+static void run_direct_duplex(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = buf;
+    t.length = len * 8;
+    t.rx_buffer = fdx_rx;
+    t.rxlength = len * 8;
+    if (spi_nodma_transfer_data(handle, &t) != ESP_OK) failed++;
+}
+
+//----------------------------------------------------------------------------------
+static void run_async_tx(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = buf;
+    t.length = len * 8;
+    if (spi_nodma_device_select(handle, 0) != ESP_OK) {
+        failed++;
+        return;
+    }
+    if (spi_nodma_transfer_data_async(handle, &t) != ESP_OK) failed++;
+    else if (spi_nodma_transfer_async_wait(handle, 1000) != ESP_OK) failed++;
+    spi_nodma_device_deselect(handle);
+}
+
+//------------------------------------------------
+static void count_pre_cb(spi_nodma_transaction_t *t)
+{
+    if (cb_pre < 8) cb_trans[cb_pre] = t;
+    cb_pre++;
+}
+
+// the transaction must be the one passed to 'pre_cb' last
+//-------------------------------------------------
+static void count_post_cb(spi_nodma_transaction_t *t)
+{
+    if ((cb_post >= 8) || (cb_post != (cb_pre - 1)) || (cb_trans[cb_post] != t)) cb_post = -100;
+    cb_post++;
+}
+
+// Batch of (max) 16 transactions with alternating 'user' field
+//-------------------------------------------------------------------------------
+static void run_batch(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t[16];
+    int n = (len < 16) ? len : 16;
+    uint32_t part = len / n;
+    memset(t, 0, sizeof(t));
+    for (int i=0; i<n; i++) {
+        t[i].tx_buffer = buf + (i * part);
+        t[i].length = ((i == (n-1)) ? (len - ((n-1) * part)) : part) * 8;
+        t[i].user = (void *)(intptr_t)(i & 1);
+    }
+    if (spi_nodma_transfer_batch(handle, t, n) != ESP_OK) failed++;
+}
+
+//------------------------------------------------------------------------------------
+static void run_queued_tx(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = buf;
+    t.length = len * 8;
+    if (spi_nodma_device_select(handle, 0) != ESP_OK) {
+        failed++;
+        return;
+    }
+    if (spi_device_transmit(handle, &t) != ESP_OK) failed++;
+    spi_nodma_device_deselect(handle);
+}
+
+//------------------------------------------------------------------------------------
+static void run_queued_rx(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.rx_buffer = buf;
+    t.rxlength = len * 8;
+    if (spi_nodma_device_select(handle, 0) != ESP_OK) {
+        failed++;
+        return;
+    }
+    if (spi_device_transmit(handle, &t) != ESP_OK) failed++;
+    spi_nodma_device_deselect(handle);
+}
+
+// 'len' bytes from the first REPEAT_SIZE bytes of 'buf', sent repeatedly
+//----------------------------------------------------------------------------------------
+static void run_queued_repeat(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = buf;
+    t.length = len * 8;
+    t.flags = SPI_TRANS_REPEAT_TX;
+    t.txpattern_size = REPEAT_SIZE;
+    if (spi_nodma_device_select(handle, 0) != ESP_OK) {
+        failed++;
+        return;
+    }
+    if (spi_device_transmit(handle, &t) != ESP_OK) failed++;
+    spi_nodma_device_deselect(handle);
+}
+
+// 16-byte transactions alternating between the two devices, the device with command phase sends the odd ones
+//-----------------------------------------------------------------------------------
+static void run_switch(spi_nodma_device_handle_t handle, uint8_t *buf, uint32_t len)
+{
+    spi_nodma_transaction_t t;
+    for (uint32_t i=0; i<len; i+=16) {
+        memset(&t, 0, sizeof(t));
+        t.tx_buffer = buf + i;
+        t.length = (((len - i) > 16) ? 16 : (len - i)) * 8;
+        t.command = 0xA5;
+        if (spi_nodma_transfer_data(((i / 16) & 1) ? cmddev : disp, &t) != ESP_OK) failed++;
+    }
+}
+
+static const scenario_t scenarios[] = {
+    { "direct tx (stream)",  0, run_direct_tx },
+    { "direct tx + command", 1, run_direct_tx },
+    { "direct rx",           0, run_direct_rx },
+    { "direct full duplex",  2, run_direct_duplex },
+    { "async tx",            0, run_async_tx },
+    { "batch tx (16 items)", 0, run_batch },
+    { "queued dma tx",       0, run_queued_tx },
+    { "queued dma rx",       0, run_queued_rx },
+    { "queued repeat tx",    0, run_queued_repeat },
+    { "device switch",       0, run_switch },
+};
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenario_t))
+
+//-----------------------------------------------------------------------
+static spi_nodma_device_handle_t scenario_device(const scenario_t *sc)
+{
+    if (sc->dev == 1) return cmddev;
+    if (sc->dev == 2) return fdxdev;
+    return disp;
+}
+
+//-------------------------------------------
+static void set_speed_all(uint32_t speed)
+{
+    spi_nodma_set_speed(disp, speed);
+    spi_nodma_set_speed(cmddev, speed);
+    spi_nodma_set_speed(fdxdev, speed);
+}
+
+
+// ==== Checks ====
+
+//------------------------------------------------------------------------
+static void check(const char *name, int ok)
+{
+    printf("  %-28s %s\n", name, (ok) ? "OK" : "FAIL");
+    if (!ok) failed++;
+}
+
+//------------------------------------------------------------
+static void capture_reset(uint8_t miso_first)
+{
+    spi_emu_capture_init(&slave, &cap, cap_buf, cap_size, miso_first);
+}
+
+// Data received in 'buf' must be the slave's incrementing sequence
+//-------------------------------------------------------------
+static int check_sequence(uint8_t *buf, uint32_t len, uint8_t first)
+{
+    for (uint32_t i=0; i<len; i++) {
+        if (buf[i] != (uint8_t)(first + i)) return 0;
+    }
+    return 1;
+}
+
+//----------------------------------------------
+static void run_checks(uint8_t *tx, uint8_t *rx)
+{
+    uint32_t sizes[] = { 1, 3, 4, 31, 32, 33, 64, 65, 1000, 4092, 4093, 10001 };
+
+    printf("Functional checks\n");
+    for (int s=0; s<(int)(sizeof(sizes)/sizeof(uint32_t)); s++) {
+        uint32_t len = sizes[s];
+        int ok = 1;
+        for (int n=0; n<(int)NUM_SCENARIOS; n++) {
+            const scenario_t *sc = &scenarios[n];
+            spi_nodma_device_handle_t handle = scenario_device(sc);
+            if ((sc->run == run_queued_repeat) && (len % 4)) continue;
+            capture_reset((uint8_t)len);
+            memset(rx, 0, len);
+            int before = failed;
+            sc->run(handle, (sc->run == run_direct_rx || sc->run == run_queued_rx) ? rx : tx, len);
+            if (failed != before) {
+                printf("  %s, %u bytes: driver error\n", sc->name, len);
+                ok = 0;
+                continue;
+            }
+            if ((sc->run == run_direct_rx) || (sc->run == run_queued_rx)) {
+                ok &= check_sequence(rx, len, (uint8_t)len);
+            } else if (sc->run == run_direct_duplex) {
+                ok &= ((cap.len == len) && (memcmp(cap.buf, tx, len) == 0) && check_sequence(fdx_rx, len, (uint8_t)len));
+            } else if (sc->run == run_queued_repeat) {
+                for (uint32_t i=0; i<len; i+=REPEAT_SIZE) {
+                    uint32_t part = ((len - i) > REPEAT_SIZE) ? REPEAT_SIZE : len - i;
+                    ok &= (memcmp(cap.buf + i, tx, part) == 0);
+                }
+                ok &= (cap.len == len);
+            } else {
+                ok &= ((cap.len == len) && (memcmp(cap.buf, tx, len) == 0));
+            }
+            // the command phase is repeated with every hw buffer sized chunk
+            if (sc->dev == 1) ok &= ((cap.commands == ((len + 63) / 64)) && (cap.last_command == 0xA5));
+            else if (sc->run == run_switch) ok &= (cap.commands == (((len + 15) / 16) / 2));
+            else ok &= (cap.commands == 0);
+            if (!ok) {
+                printf("  %s, %u bytes: data mismatch\n", sc->name, len);
+                break;
+            }
+        }
+        char name[40];
+        sprintf(name, "all scenarios, %u bytes", len);
+        check(name, ok);
+    }
+
+    // ** Full duplex, receiving more than sent: the rest is received after the transmission
+    spi_nodma_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = tx;
+    t.length = 10 * 8;
+    t.rx_buffer = rx;
+    t.rxlength = 100 * 8;
+    capture_reset(7);
+    memset(rx, 0, 100);
+    check("full duplex, rx > tx", (spi_nodma_transfer_data(fdxdev, &t) == ESP_OK) && (cap.len == 10) &&
+          (memcmp(cap.buf, tx, 10) == 0) && check_sequence(rx, 100, 7) && (cap.mosi_bits == 80) && (cap.miso_bits == 800));
+
+    // ** Batch: both callbacks for each transaction, also if the 'user' field does not change
+    spi_nodma_transaction_t bt[4];
+    memset(bt, 0, sizeof(bt));
+    for (int i=0; i<4; i++) {
+        bt[i].tx_buffer = tx + (i * 8);
+        bt[i].length = 8 * 8;
+        bt[i].user = (void *)(intptr_t)(i / 2);
+    }
+    cb_pre = cb_post = 0;
+    disp->cfg.pre_cb = count_pre_cb;
+    disp->cfg.post_cb = count_post_cb;
+    capture_reset(0);
+    int ok = (spi_nodma_transfer_batch(disp, bt, 4) == ESP_OK);
+    disp->cfg.pre_cb = NULL;
+    disp->cfg.post_cb = NULL;
+    ok &= ((cb_pre == 4) && (cb_post == 4) && (cap.len == 32) && (memcmp(cap.buf, tx, 32) == 0));
+    for (int i=0; i<4; i++) ok &= (cb_trans[i] == &bt[i]);
+    check("batch callbacks per transaction", ok);
+}
+
+// Transfer 'txbits' and receive 'rxbits' bits, in direct or queued mode
+//---------------------------------------------------------------------------------------------------------------------------------------------
+static int bits_check(spi_nodma_device_handle_t handle, int queued, uint8_t *tx, uint32_t txbits, uint8_t *rx, uint32_t rxbits, uint32_t commands)
+{
+    spi_nodma_transaction_t t, *rt;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = (txbits) ? tx : NULL;
+    t.length = txbits;
+    t.rx_buffer = (rxbits) ? rx : NULL;
+    t.rxlength = rxbits;
+    t.command = 0xA5;
+    capture_reset(3);
+    memset(rx, 0, (rxbits+7)/8 + 4);
+    if (queued) {
+        if ((spi_device_queue_trans(handle, &t, portMAX_DELAY) != ESP_OK) ||
+            (spi_device_get_trans_result(handle, &rt, portMAX_DELAY) != ESP_OK)) return 0;
+    }
+    else if (spi_nodma_transfer_data(handle, &t) != ESP_OK) return 0;
+
+    // full duplex device clocks in while sending, the data are only stored up to 'rxbits'
+    uint32_t miso_bits = ((handle == fdxdev) && (rxbits <= txbits)) ? txbits : rxbits;
+    return ((cap.mosi_bits == txbits) && (cap.miso_bits == miso_bits) && (cap.commands == commands) &&
+            (memcmp(cap.buf, tx, (txbits+7)/8) == 0) && check_sequence(rx, (rxbits+7)/8, 3) && (rx[(rxbits+7)/8] == 0));
+}
+
+// Lengths which are not multiples of 8 bits
+//---------------------------------------------------
+static void run_bits_checks(uint8_t *tx, uint8_t *rx)
+{
+    check("9 bits, direct tx", bits_check(disp, 0, tx, 9, rx, 0, 0));
+    check("300 bits, direct tx", bits_check(disp, 0, tx, 300, rx, 0, 0));
+    check("523 bits, direct tx + cmd", bits_check(cmddev, 0, tx, 523, rx, 0, 2));
+    check("13 bits, direct rx", bits_check(disp, 0, tx, 0, rx, 13, 0));
+    check("77 bits, direct full duplex", bits_check(fdxdev, 0, tx, 77, rx, 77, 0));
+    check("9 bits, queued tx", bits_check(disp, 1, tx, 9, rx, 0, 0));
+    check("2051 bits, queued dma tx", bits_check(disp, 1, tx, 2051, rx, 0, 0));
+    check("20 bits, queued rx", bits_check(disp, 1, tx, 0, rx, 20, 0));
+}
+
+// Transfer in the mode selected by 'flags' (SPI_TRANS_MODE_x), the transfer must take 'cycles' spi clock cycles
+//------------------------------------------------------------------------------------------------------------------------------------------------------
+static int io_mode_check(spi_nodma_device_handle_t handle, int queued, uint32_t flags, uint8_t *tx, uint32_t txlen, uint8_t *rx, uint32_t rxlen, uint64_t cycles)
+{
+    spi_nodma_transaction_t t, *rt;
+    spi_emu_stats_t stats;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = (txlen) ? tx : NULL;
+    t.length = txlen * 8;
+    t.rx_buffer = (rxlen) ? rx : NULL;
+    t.rxlength = rxlen * 8;
+    t.command = 0xA5;
+    t.flags = flags;
+    capture_reset(3);
+    memset(rx, 0, rxlen);
+    spi_emu_get_stats(EMU_HOST, &stats, 1);
+    if (queued) {
+        if ((spi_device_queue_trans(handle, &t, portMAX_DELAY) != ESP_OK) ||
+            (spi_device_get_trans_result(handle, &rt, portMAX_DELAY) != ESP_OK)) return 0;
+    }
+    else if (spi_nodma_transfer_data(handle, &t) != ESP_OK) return 0;
+    spi_emu_get_stats(EMU_HOST, &stats, 1);
+
+    return ((stats.cycles == cycles) && (cap.len == txlen) && (memcmp(cap.buf, tx, txlen) == 0) && check_sequence(rx, rxlen, 3));
+}
+
+// Dual and quad I/O modes
+//------------------------------------------------------
+static void run_io_mode_checks(uint8_t *tx, uint8_t *rx)
+{
+    spi_nodma_transaction_t t;
+
+    check("QIO, direct tx", io_mode_check(disp, 0, SPI_TRANS_MODE_QIO, tx, 256, rx, 0, 256*2));
+    check("DIO, direct rx", io_mode_check(disp, 0, SPI_TRANS_MODE_DIO, tx, 0, rx, 100, 100*4));
+    // the 1-bit command phase is sent with each 64 byte chunk
+    check("DIO, direct tx + cmd", io_mode_check(cmddev, 0, SPI_TRANS_MODE_DIO, tx, 100, rx, 0, (2*8) + (100*4)));
+    check("QIO, queued dma tx", io_mode_check(disp, 1, SPI_TRANS_MODE_QIO, tx, 2000, rx, 0, 2000*2));
+    check("1-bit after QIO", io_mode_check(disp, 0, 0, tx, 10, rx, 0, 10*8));
+
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = tx;
+    t.length = 8;
+    t.flags = SPI_TRANS_MODE_QIO;
+    check("QIO, full duplex rejected", spi_nodma_transfer_data(fdxdev, &t) == ESP_ERR_INVALID_ARG);
+}
+
+// Error of the spi clock nearest to 'hz' the hw can generate from 'apb' clock, all pre/n combinations are tried
+//-----------------------------------------------------
+static uint32_t nearest_clock_err(int apb, int hz)
+{
+    uint32_t best = abs(apb - hz);
+    for (int n=1; n<=64; n++) {
+        for (int pre=1; pre<=8192; pre++) {
+            uint32_t err = abs((apb / (pre * n)) - hz);
+            if (err < best) best = err;
+        }
+    }
+    return best;
+}
+
+// The clock set must be the nearest possible one and must be used by the hw
+//-----------------------------------------------------------
+static int clock_check(uint8_t *tx, int apb, uint32_t speed)
+{
+    uint32_t eff = spi_nodma_get_speed(disp);
+    run_direct_tx(disp, tx, 4);
+    return ((abs((int)eff - (int)speed) == nearest_clock_err(apb, speed)) && (spi_emu_clock_hz(EMU_HOST) == eff) &&
+            (spi_nodma_get_speed(disp) == eff));
+}
+
+// Clock divider solver and APB clock changes
+//--------------------------------------
+static void run_clock_checks(uint8_t *tx)
+{
+    const uint32_t speeds[] = { 200, 100000, 333333, 1000000, 7000000, 13000000, 26000000, 30000000, 41000000, 61000000 };
+    int ok = 1;
+
+    for (int i=0; i<(int)(sizeof(speeds)/sizeof(uint32_t)); i++) {
+        spi_nodma_set_speed(disp, speeds[i]);
+        ok &= clock_check(tx, APB_CLK_FREQ, speeds[i]);
+    }
+    check("nearest clock", ok);
+
+    // APB clock changed by dynamic frequency scaling, the divider is recalculated on the next select
+    spi_nodma_set_speed(disp, 30000000);
+    spi_emu_set_apb_freq(40000000);
+    ok = clock_check(tx, 40000000, 30000000);
+    spi_emu_set_apb_freq(APB_CLK_FREQ);
+    ok &= clock_check(tx, APB_CLK_FREQ, 30000000);
+    check("APB clock change", ok);
+
+    // queued transactions need no select, the divider is recalculated when the transaction is queued
+    // and written by the interrupt also if it follows the same device's transaction still on the wire
+    spi_nodma_transaction_t t, t0, *rt;
+    spi_emu_timing_t timing = { .time_scale=100, .trans_ns=0 };
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = tx;
+    t.length = 4 * 8;
+    t0 = t;
+    t0.length = 1000 * 8;
+    spi_emu_set_timing(&timing);
+    ok = (spi_device_queue_trans(disp, &t0, portMAX_DELAY) == ESP_OK);
+    vTaskDelay(1);
+    spi_emu_set_apb_freq(40000000);
+    ok &= (spi_device_queue_trans(disp, &t, portMAX_DELAY) == ESP_OK);
+    ok &= ((spi_device_get_trans_result(disp, &rt, portMAX_DELAY) == ESP_OK) && (rt == &t0));
+    ok &= ((spi_device_get_trans_result(disp, &rt, portMAX_DELAY) == ESP_OK) && (rt == &t));
+    timing.time_scale = 0;
+    spi_emu_set_timing(&timing);
+    uint32_t eff = spi_nodma_get_speed(disp);
+    ok &= ((abs((int)eff - 30000000) == nearest_clock_err(40000000, 30000000)) && (spi_emu_clock_hz(EMU_HOST) == eff));
+    spi_emu_set_apb_freq(APB_CLK_FREQ);
+    ok &= (spi_device_transmit(disp, &t) == ESP_OK);
+    eff = spi_nodma_get_speed(disp);
+    ok &= ((abs((int)eff - 30000000) == nearest_clock_err(APB_CLK_FREQ, 30000000)) && (spi_emu_clock_hz(EMU_HOST) == eff));
+    check("APB clock change, queued", ok);
+    set_speed_all(40000000);
+}
+
+// Preallocated transaction descriptors: two transactions queued from the pool's staging buffers
+//-------------------------------------
+static void run_pool_check(uint8_t *tx)
+{
+    spi_nodma_transaction_t *t[4];
+    spi_nodma_transaction_t *rtrans;
+    int ok = (spi_nodma_trans_pool_init(disp, 3, 64) == ESP_OK);
+
+    for (int i=0; i<4; i++) t[i] = spi_nodma_trans_get(disp);
+    ok &= ((t[0]) && (t[1]) && (t[2]) && (t[3] == NULL));
+    if (!ok) {
+        check("transaction pool", 0);
+        return;
+    }
+    spi_nodma_trans_put(disp, t[2]);
+    ok &= (spi_nodma_trans_pool_init(disp, 3, 64) == ESP_ERR_INVALID_STATE);
+
+    capture_reset(0);
+    for (int i=0; i<2; i++) {
+        ok &= ((t[i]->tx_buffer == spi_nodma_trans_buffer(t[i])) && (t[i]->length == 0) && (t[i]->flags == 0));
+        memcpy(spi_nodma_trans_buffer(t[i]), tx + (i*64), 64);
+        t[i]->length = 64 * 8;
+    }
+    if (spi_nodma_device_select(disp, 0) != ESP_OK) ok = 0;
+    for (int i=0; i<2; i++) {
+        if (spi_device_queue_trans(disp, t[i], portMAX_DELAY) != ESP_OK) ok = 0;
+    }
+    for (int i=0; i<2; i++) {
+        if (spi_device_get_trans_result(disp, &rtrans, portMAX_DELAY) != ESP_OK) ok = 0;
+        else {
+            ok &= (rtrans == t[i]);
+            spi_nodma_trans_put(disp, rtrans);
+        }
+    }
+    spi_nodma_device_deselect(disp);
+    ok &= ((cap.len == 128) && (memcmp(cap_buf, tx, 128) == 0));
+
+    // all descriptors are free again
+    for (int i=0; i<4; i++) t[i] = spi_nodma_trans_get(disp);
+    ok &= ((t[0]) && (t[1]) && (t[2]) && (t[3] == NULL));
+    for (int i=0; i<3; i++) spi_nodma_trans_put(disp, t[i]);
+    check("transaction pool", ok);
+}
+
+// Completions notified to the task: one wait for a batch, no result queue round trip
+//------------------------------------------
+static void run_notify_check(uint8_t *tx)
+{
+    spi_nodma_transaction_t t[NOTIFY_TRANS];
+    spi_nodma_transaction_t *rtrans;
+    int ok = 1;
+
+    capture_reset(0);
+    memset(t, 0, sizeof(t));
+    for (int i=0; i<NOTIFY_TRANS; i++) {
+        t[i].tx_buffer = tx + (i*32);
+        t[i].length = 32 * 8;
+        // the first one is only reported by the post callback (there is none here)
+        t[i].flags = (i == 0) ? SPI_TRANS_NO_RESULT : SPI_TRANS_NOTIFY;
+    }
+    if (spi_nodma_device_select(disp, 0) != ESP_OK) ok = 0;
+    for (int i=0; i<NOTIFY_TRANS; i++) {
+        if (spi_device_queue_trans(disp, &t[i], portMAX_DELAY) != ESP_OK) ok = 0;
+    }
+    ok &= (spi_nodma_trans_wait(disp, NOTIFY_TRANS-1, 1000 / portTICK_PERIOD_MS) == ESP_OK);
+    ok &= ((disp->inflight == 0) && (disp->notify_done == 0) && (disp->notify_task == NULL));
+    // nothing was put into the result queue, nothing more to wait for
+    ok &= (spi_device_get_trans_result(disp, &rtrans, 0) == ESP_ERR_TIMEOUT);
+    ok &= (spi_nodma_trans_wait(disp, 1, 10 / portTICK_PERIOD_MS) == ESP_ERR_TIMEOUT);
+    ok &= (disp->notify_task == NULL);
+    spi_nodma_device_deselect(disp);
+    ok &= ((cap.len == NOTIFY_TRANS*32) && (memcmp(cap_buf, tx, NOTIFY_TRANS*32) == 0));
+    check("notified completion", ok);
+}
+
+typedef struct {
+    spi_nodma_device_handle_t handle;
+    esp_err_t ret;
+} async_wait_t;
+
+//---------------------------------------
+static void *async_wait_task(void *arg)
+{
+    async_wait_t *w = (async_wait_t *)arg;
+    w->ret = spi_nodma_transfer_async_wait(w->handle, portMAX_DELAY);
+    return NULL;
+}
+
+// Interrupt driven transfers: completion nobody waited for leaves nothing pending for the task,
+// another task can wait for the transfer, receive only transfer
+//-----------------------------------------
+static void run_async_check(uint8_t *tx, uint8_t *rx)
+{
+    spi_nodma_transaction_t t;
+    async_wait_t w = { .handle=disp, .ret=ESP_FAIL };
+    pthread_t thread;
+    int ok;
+
+    capture_reset(3);
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = tx;
+    t.length = 100 * 8;
+    ok = (spi_nodma_device_select(disp, 0) == ESP_OK);
+    ok &= (spi_nodma_transfer_data_async(disp, &t) == ESP_OK);
+    for (int i=0; (i<1000) && (disp->host->async.trans); i++) usleep(1000);
+    ok &= ((disp->host->async.trans == NULL) && (ulTaskNotifyTake(pdTRUE, 0) == 0));
+    ok &= (spi_nodma_transfer_async_wait(disp, 0) == ESP_OK);
+
+    t.tx_buffer = tx + 100;
+    t.length = 200 * 8;
+    ok &= (spi_nodma_transfer_data_async(disp, &t) == ESP_OK);
+    pthread_create(&thread, NULL, async_wait_task, &w);
+    pthread_join(thread, NULL);
+    ok &= (w.ret == ESP_OK);
+
+    memset(&t, 0, sizeof(t));
+    memset(rx, 0, 150);
+    t.rx_buffer = rx;
+    t.rxlength = 150 * 8;
+    ok &= (spi_nodma_transfer_data_async(disp, &t) == ESP_OK);
+    ok &= (spi_nodma_transfer_async_wait(disp, 1000 / portTICK_PERIOD_MS) == ESP_OK);
+    ok &= (spi_nodma_device_deselect(disp) == ESP_OK);
+    ok &= ((cap.len == 300) && (memcmp(cap_buf, tx, 300) == 0) && check_sequence(rx, 150, 3));
+    check("interrupt transfer completion", ok);
+
+    // other device's transaction queued during the interrupt transfer waits until the device's software CS is deactivated,
+    // the device's own queued transactions are sent meanwhile
+    spi_nodma_transaction_t qt, ot, *rt;
+    spi_emu_timing_t timing = { .time_scale=100, .trans_ns=0 };
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = tx;
+    t.length = 1000 * 8;
+    memset(&qt, 0, sizeof(qt));
+    qt.tx_buffer = tx;
+    qt.length = 4 * 8;
+    qt.command = 0xA5;
+    ot = qt;
+    spi_emu_set_timing(&timing);
+    ok = (spi_nodma_device_select(disp, 0) == ESP_OK);
+    ok &= (spi_nodma_transfer_data_async(disp, &t) == ESP_OK);
+    ok &= (spi_device_queue_trans(cmddev, &qt, portMAX_DELAY) == ESP_OK);
+    ok &= (spi_nodma_transfer_async_wait(disp, portMAX_DELAY) == ESP_OK);
+    ok &= (spi_device_queue_trans(disp, &ot, portMAX_DELAY) == ESP_OK);
+    ok &= ((spi_device_get_trans_result(disp, &rt, 1000 / portTICK_PERIOD_MS) == ESP_OK) && (rt == &ot));
+    usleep(10000);
+    ok &= ((spi_device_get_trans_result(cmddev, &rt, 0) == ESP_ERR_TIMEOUT) && (spi_emu_gpio_get(EMU_PIN_CS) == 0));
+    ok &= (spi_nodma_device_deselect(disp) == ESP_OK);
+    ok &= ((spi_device_get_trans_result(cmddev, &rt, 1000 / portTICK_PERIOD_MS) == ESP_OK) && (rt == &qt));
+    timing.time_scale = 0;
+    spi_emu_set_timing(&timing);
+    check("queued held while async CS active", ok);
+}
+
+// Functions disabling the interrupt while they access its state restore the previous state,
+// an interrupt switched off when the transactions were finished is not enabled again
+//------------------------------------------------
+static void run_intr_state_check(uint8_t *tx)
+{
+    spi_nodma_transaction_t t;
+    spi_nodma_wait_stats_t ws;
+    int ok;
+
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = tx;
+    t.length = 16 * 8;
+    ok = (spi_nodma_device_select(disp, 0) == ESP_OK);
+    ok &= (spi_device_transmit(disp, &t) == ESP_OK);
+    ok &= (spi_nodma_device_deselect(disp) == ESP_OK);
+    for (int i=0; (i<1000) && (spi_emu_intr_enabled(EMU_HOST)); i++) usleep(1000);
+    ok &= (spi_emu_intr_enabled(EMU_HOST) == 0);
+#if SPI_NODMA_STATS
+    uint32_t intr_count = disp->host->stats.intr_count;
+#endif
+    ok &= (spi_nodma_set_sched_policy(EMU_HOST, SPI_SCHED_LOW_CS_FIRST, 0) == ESP_OK);
+    ok &= (spi_nodma_get_wait_stats(disp, &ws, 0) == ESP_OK);
+    ok &= (spi_emu_intr_enabled(EMU_HOST) == 0);
+    usleep(10000);
+#if SPI_NODMA_STATS
+    ok &= (disp->host->stats.intr_count == intr_count);
+#endif
+    check("interrupt state restored", ok);
+}
+
+#if SPI_NODMA_CAPTURE
+// Number of lines of the file containing 'str'
+//------------------------------------------------------
+static int count_lines(FILE *f, const char *str)
+{
+    char line[256];
+    int n = 0;
+
+    rewind(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, str)) n++;
+    }
+    return n;
+}
+
+// Transactions recorded into the capture ring and exported
+//----------------------------------------
+static void run_capture_check(uint8_t *tx)
+{
+    spi_nodma_transaction_t t;
+    spi_nodma_capture_rec_t recs[4];
+    char cs[16];
+
+    spi_nodma_capture_start(1);
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = tx;
+    t.length = 20 * 8;
+    t.command = 0xA5;
+    int ok = (spi_nodma_transfer_data(cmddev, &t) == ESP_OK);
+    t.length = 100 * 8;
+    t.command = 0;
+    ok &= ((spi_nodma_device_select(disp, 0) == ESP_OK) && (spi_device_transmit(disp, &t) == ESP_OK));
+    spi_nodma_device_deselect(disp);
+    spi_nodma_capture_stop();
+    ok &= (spi_nodma_transfer_data(cmddev, &t) == ESP_OK);
+
+    ok &= (spi_nodma_capture_read(recs, 4) == 2);
+    ok &= ((recs[0].kind == SPI_CAPTURE_DIRECT) && (recs[0].host == EMU_HOST) && (recs[0].dev == cmddev->cs) &&
+           (recs[0].command_bits == 8) && (recs[0].command == 0xA5) && (recs[0].txbits == 20*8) && (recs[0].rxbits == 0) &&
+           (recs[0].ndata == SPI_NODMA_CAPTURE_DATA) && (memcmp(recs[0].data, tx, SPI_NODMA_CAPTURE_DATA) == 0));
+    ok &= ((recs[1].kind == SPI_CAPTURE_QUEUED) && (recs[1].dev == disp->cs) && (recs[1].txbits == 100*8) &&
+           (recs[1].seq == recs[0].seq+1) && (recs[1].clock_hz == spi_nodma_get_speed(disp)));
+    ok &= ((recs[0].end != recs[0].start) && (recs[1].end != recs[1].start));
+    check("capture ring", ok);
+
+    FILE *f = tmpfile();
+    ok = ((f) && (spi_nodma_capture_export(f, SPI_CAPTURE_FORMAT_TEXT) == ESP_OK));
+    ok &= ((f) && (count_lines(f, "") == 4) && (count_lines(f, " 0xa5 ") == 1));
+    if (f) fclose(f);
+    f = tmpfile();
+    ok &= ((f) && (spi_nodma_capture_export(f, SPI_CAPTURE_FORMAT_VCD) == ESP_OK));
+    // cs of each device goes low once, the rest of the queued transaction is not recorded
+    sprintf(cs, "0c%d_%d", EMU_HOST, disp->cs);
+    ok &= ((f) && (count_lines(f, "$enddefinitions") == 1) && (count_lines(f, cs) == 1));
+    sprintf(cs, "xs%d", EMU_HOST);
+    ok &= ((f) && (count_lines(f, cs) == 2));
+    if (f) fclose(f);
+    check("capture export", ok);
+}
+#endif
+
+typedef struct {
+    spi_nodma_device_handle_t handle;
+    uint8_t *buf;
+    uint32_t len;
+    int ok;
+} host_run_t;
+
+//-------------------------------------
+static void *host_run_task(void *arg)
+{
+    host_run_t *run = (host_run_t *)arg;
+    spi_nodma_transaction_t t;
+
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = run->buf;
+    t.length = run->len * 8;
+    run->ok = (spi_nodma_device_select(run->handle, 0) == ESP_OK);
+    for (int i=0; (i<HOST2_TRANS) && (run->ok); i++) {
+        if (spi_device_transmit(run->handle, &t) != ESP_OK) run->ok = 0;
+    }
+    spi_nodma_device_deselect(run->handle);
+    return NULL;
+}
+
+// HSPI and VSPI used at the same time from two tasks; interrupt allocated on the requested core
+//---------------------------------------
+static void run_host_checks(uint8_t *tx)
+{
+    spi_emu_slave_t slave2;
+    spi_emu_capture_t cap2;
+    uint8_t *cap2_buf = malloc(1000);
+    spi_nodma_device_handle_t hdev = NULL, hdev2 = NULL;
+    spi_nodma_bus_config_t buscfg = {
+        .miso_io_num=HOST2_PIN_MISO,
+        .mosi_io_num=HOST2_PIN_MOSI,
+        .sclk_io_num=HOST2_PIN_CLK,
+        .quadwp_io_num=-1,
+        .quadhd_io_num=-1,
+        .intr_cpu=SPI_NODMA_INTR_CPU_1
+    };
+    spi_nodma_device_interface_config_t devcfg = {
+        .clock_speed_hz=20000000,
+        .mode=0,
+        .spics_io_num=HOST2_PIN_CS,
+        .spics_ext_io_num=-1,
+        .flags=SPI_DEVICE_HALFDUPLEX,
+        .queue_size=2,
+    };
+    int ok;
+
+    if (cap2_buf == NULL) {
+        check("second host", 0);
+        return;
+    }
+    spi_emu_capture_init(&slave2, &cap2, cap2_buf, 1000, 0);
+    spi_emu_attach(HOST2, &slave2);
+    ok = (spi_nodma_bus_add_device(HOST2, &buscfg, &devcfg, &hdev) == ESP_OK);
+    buscfg.sclk_io_num = HOST2_PIN_CLK2;
+    devcfg.spics_io_num = HOST2_PIN_CS2;
+    ok &= (spi_nodma_bus_add_device(HOST2, &buscfg, &devcfg, &hdev2) == ESP_OK);
+    if (!ok) {
+        check("second host", 0);
+        free(cap2_buf);
+        return;
+    }
+    check("interrupt on requested cpu", (spi_emu_intr_cpu(HOST2) == 1) && (spi_emu_intr_cpu(EMU_HOST) == 0));
+
+    // queued transactions after the bus is rerouted to other pins need the host's interrupt
+    run_queued_tx(hdev, tx, 100);
+    run_queued_tx(hdev2, tx + 100, 100);
+    run_queued_tx(hdev, tx + 200, 100);
+    check("queued after bus reroute", (!failed) && (cap2.len == 300) && (memcmp(cap2_buf, tx, 300) == 0));
+
+    // both hosts from two tasks at the same time
+    host_run_t run[2] = {
+        { .handle=disp, .buf=tx, .len=1000 },
+        { .handle=hdev, .buf=tx+1000, .len=1000 },
+    };
+    pthread_t thread[2];
+    capture_reset(0);
+    spi_emu_capture_init(&slave2, &cap2, cap2_buf, 1000, 0);
+    for (int i=0; i<2; i++) pthread_create(&thread[i], NULL, host_run_task, &run[i]);
+    for (int i=0; i<2; i++) pthread_join(thread[i], NULL);
+    ok = (run[0].ok) && (run[1].ok);
+    ok &= ((cap.mosi_bits == (uint64_t)HOST2_TRANS*1000*8) && (memcmp(cap_buf, tx, 1000) == 0));
+    ok &= ((cap2.mosi_bits == (uint64_t)HOST2_TRANS*1000*8) && (memcmp(cap2_buf, tx+1000, 1000) == 0));
+    check("HSPI and VSPI in parallel", ok);
+
+    spi_nodma_bus_remove_device(hdev2);
+    spi_nodma_bus_remove_device(hdev);
+    check("second host freed", spi_emu_intr_cpu(HOST2) == -1);
+    spi_emu_attach(HOST2, NULL);
+    free(cap2_buf);
+}
+
+typedef struct {
+    spi_nodma_device_handle_t handle;
+    uint8_t *buf;
+    esp_err_t ret;
+    uint64_t bulk_bits;         // bits captured when the device got the bus
+} bus_run_t;
+
+// Select the device (waits for the bus), send 4 bytes
+//------------------------------------
+static void *bus_run_task(void *arg)
+{
+    bus_run_t *run = (bus_run_t *)arg;
+    spi_nodma_transaction_t t;
+
+    run->ret = spi_nodma_device_select(run->handle, 0);
+    if (run->ret != ESP_OK) return NULL;
+    run->bulk_bits = cap.mosi_bits;
+    memset(&t, 0, sizeof(t));
+    t.tx_buffer = run->buf;
+    t.length = 4 * 8;
+    run->ret = spi_nodma_transfer_data(run->handle, &t);
+    spi_nodma_device_deselect(run->handle);
+    return NULL;
+}
+
+// Bus arbitration: recursion, bounded wait, preemption of a batch by an urgent device
+//-----------------------------------------
+static void run_arbiter_checks(uint8_t *tx)
+{
+    spi_nodma_device_handle_t urgdev = NULL;
+    spi_nodma_transaction_t bulk[BULK_TRANS];
+#if SPI_NODMA_STATS
+    spi_nodma_stats_t st;
+#endif
+    pthread_t thread;
+    bus_run_t run;
+    int ok;
+
+    // nested takes by the same task, the bus is free again after the last give
+    ok = (spi_nodma_device_TakeSemaphore(disp) == ESP_OK);
+    ok &= (spi_nodma_device_TakeSemaphore(disp) == ESP_OK);
+    ok &= (spi_nodma_device_select(disp, 0) == ESP_OK);
+    run_direct_tx(disp, tx, 10);
+    ok &= (spi_nodma_device_deselect(disp) == ESP_OK);
+    spi_nodma_device_GiveSemaphore(disp);
+    spi_nodma_device_GiveSemaphore(disp);
+    run = (bus_run_t){ .handle=cmddev, .buf=tx };
+    pthread_create(&thread, NULL, bus_run_task, &run);
+    pthread_join(thread, NULL);
+    check("bus recursion", (ok) && (run.ret == ESP_OK) && (disp->host->arb.owner_task == NULL));
+
+    // another device cannot be selected while the task has the bus for the selected device,
+    // the selected device keeps the bus and its settings
+    ok = (spi_nodma_device_select(disp, 0) == ESP_OK);
+    ok &= (spi_nodma_device_select(cmddev, 0) == ESP_ERR_INVALID_STATE);
+    ok &= ((cmddev->cfg.selected == 0) && (disp->host->arb.owner == disp) && (disp->host->arb.depth == 1));
+    ok &= (disp->host->cur_device == disp->cs);
+    ok &= (spi_nodma_device_select(disp, 1) == ESP_OK);
+    ok &= (disp->host->arb.depth == 1);
+    ok &= (spi_nodma_device_deselect(disp) == ESP_OK);
+    ok &= (disp->host->arb.owner_task == NULL);
+    check("other device while selected", ok);
+
+    // 'bus_wait_ms' of cmddev is 100 ms
+    spi_nodma_reset_stats(EMU_HOST, cmddev);
+    ok = (spi_nodma_device_select(disp, 0) == ESP_OK);
+    uint64_t t = spi_emu_time_ns();
+    run = (bus_run_t){ .handle=cmddev, .buf=tx };
+    pthread_create(&thread, NULL, bus_run_task, &run);
+    pthread_join(thread, NULL);
+    t = spi_emu_time_ns() - t;
+    spi_nodma_device_deselect(disp);
+    ok &= ((run.ret == ESP_ERR_TIMEOUT) && (t >= 90000000ULL) && (t < 1000000000ULL));
+#if SPI_NODMA_STATS
+    ok &= ((spi_nodma_get_stats(EMU_HOST, cmddev, &st) == ESP_OK) && (st.bus_timeouts == 1));
+#endif
+    check("bus wait timeout", ok);
+
+    // the urgent device gets the bus at a preemption point of the batch
+    spi_nodma_device_interface_config_t urgcfg = {
+        .clock_speed_hz=10000000,
+        .mode=0,
+        .spics_io_num=-1,
+        .spics_ext_io_num=EMU_PIN_UCS,
+        .flags=SPI_DEVICE_HALFDUPLEX|SPI_DEVICE_BUS_URGENT,
+        .queue_size=1,
+    };
+    spi_nodma_bus_config_t buscfg = {
+        .miso_io_num=EMU_PIN_MISO,
+        .mosi_io_num=EMU_PIN_MOSI,
+        .sclk_io_num=EMU_PIN_CLK,
+        .quadwp_io_num=-1,
+        .quadhd_io_num=-1
+    };
+    if (spi_nodma_bus_add_device(EMU_HOST, &buscfg, &urgcfg, &urgdev) != ESP_OK) {
+        check("urgent device preempts batch", 0);
+        return;
+    }
+    memset(bulk, 0, sizeof(bulk));
+    for (int i=0; i<BULK_TRANS; i++) {
+        bulk[i].tx_buffer = tx + (i*64);
+        bulk[i].length = 64 * 8;
+        bulk[i].flags = SPI_TRANS_PREEMPTIBLE;
+    }
+    spi_nodma_reset_stats(EMU_HOST, NULL);
+    capture_reset(0);
+    ok = (spi_nodma_device_select(disp, 0) == ESP_OK);
+    run = (bus_run_t){ .handle=urgdev, .buf=tx, .ret=ESP_FAIL, .bulk_bits=0 };
+    pthread_create(&thread, NULL, bus_run_task, &run);
+    // wait until the urgent device waits for the bus
+    for (int i=0; (i<1000) && (disp->host->arb.urgent == 0); i++) usleep(1000);
+    ok &= (spi_nodma_transfer_batch(disp, bulk, BULK_TRANS) == ESP_OK);
+    spi_nodma_device_deselect(disp);
+    pthread_join(thread, NULL);
+    ok &= ((run.ret == ESP_OK) && (run.bulk_bits < BULK_TRANS*64*8));
+    ok &= (cap.mosi_bits == (BULK_TRANS*64*8) + 32);
+#if SPI_NODMA_STATS
+    uint32_t n = 0;
+    ok &= ((spi_nodma_get_stats(EMU_HOST, disp, &st) == ESP_OK) && (st.bus_yields >= 1));
+    ok &= (spi_nodma_get_stats(EMU_HOST, urgdev, &st) == ESP_OK);
+    for (int i=1; i<SPI_NODMA_BUS_HIST_SIZE; i++) n += st.bus_wait_hist[i];
+    ok &= ((st.selects == 1) && (n == 1) && (st.bus_hold_us <= st.bus_hold_max_us + 1));
+#endif
+    check("urgent device preempts batch", ok);
+    spi_nodma_bus_remove_device(urgdev);
+}
+
+#if SPI_NODMA_STATS
+//--------------------------------------
+static void run_stats_check(uint8_t *tx)
+{
+    spi_nodma_stats_t st, hst;
+    int ok;
+
+    spi_nodma_reset_stats(EMU_HOST, NULL);
+    run_direct_tx(disp, tx, 100);
+    run_queued_tx(cmddev, tx, 10);
+    ok = ((spi_nodma_get_stats(EMU_HOST, disp, &st) == ESP_OK) &&
+          (spi_nodma_get_stats(EMU_HOST, NULL, &hst) == ESP_OK));
+    // 100 bytes are streamed in 32 byte halves of the hw buffer
+    ok &= ((st.tx_bytes == 100) && (st.rx_bytes == 0) && (st.direct_trans == 1) && (st.kicks == 4) && (st.selects == 1));
+    ok &= ((hst.tx_bytes == 110) && (hst.direct_trans == 1) && (hst.queued_trans == 1) && (hst.kicks == 5) && (hst.intr_count > 0));
+    // the queued transaction is counted by the interrupt, in device's interrupt counters
+    ok &= ((spi_nodma_get_stats(EMU_HOST, cmddev, &st) == ESP_OK) && (st.tx_bytes == 10) && (st.queued_trans == 1) && (st.kicks == 1));
+    ok &= ((cmddev->stats.kicks == 0) && (cmddev->isr_stats.kicks == 1));
+    check("performance counters", ok);
+}
+#endif
+
+
+// ==== Benchmark ====
+
+//------------------------------------------------------------------------------------------------------------
+static void bench(uint8_t *tx, uint8_t *rx, uint32_t len, double max_overhead)
+{
+    const uint32_t clocks[] = { 1000000, 10000000, 20000000, 40000000, 80000000 };
+    const int nclocks = sizeof(clocks) / sizeof(uint32_t);
+    spi_emu_timing_t timing = { .time_scale=0, .trans_ns=0 };
+    spi_emu_stats_t stats;
+
+    printf("\nBenchmark, %u bytes per scenario\n", len);
+    printf("%-22s %10s |", "scenario", "ns/byte");
+    for (int c=0; c<nclocks; c++) printf(" %7.1f MHz    ", clocks[c] / 1e6);
+    printf("\n%-22s %10s |", "", "overhead");
+    for (int c=0; c<nclocks; c++) printf(" MB/s  (wire%%) ");
+    printf("\n");
+
+    for (int n=0; n<(int)NUM_SCENARIOS; n++) {
+        const scenario_t *sc = &scenarios[n];
+        spi_nodma_device_handle_t handle = scenario_device(sc);
+        uint8_t *buf = (sc->run == run_direct_rx || sc->run == run_queued_rx) ? rx : tx;
+
+        // ** Driver overhead, transactions finish immediately
+        timing.time_scale = 0;
+        spi_emu_set_timing(&timing);
+        set_speed_all(40000000);
+        capture_reset(0);
+        sc->run(handle, buf, len);  // warm up
+        spi_emu_get_stats(EMU_HOST, &stats, 1);
+        uint64_t t0 = spi_emu_time_ns();
+        sc->run(handle, buf, len);
+        uint64_t wall = spi_emu_time_ns() - t0;
+        spi_emu_get_stats(EMU_HOST, &stats, 1);
+        double overhead = (double)(wall - ((stats.busy_ns < wall) ? stats.busy_ns : wall)) / len;
+        printf("%-22s %10.2f |", sc->name, overhead);
+        if ((max_overhead > 0) && (overhead > max_overhead)) failed++;
+
+        // ** Throughput with the real time bit-time model
+        timing.time_scale = 1;
+        spi_emu_set_timing(&timing);
+        for (int c=0; c<nclocks; c++) {
+            set_speed_all(clocks[c]);
+            capture_reset(0);
+            spi_emu_get_stats(EMU_HOST, &stats, 1);
+            t0 = spi_emu_time_ns();
+            sc->run(handle, buf, len);
+            wall = spi_emu_time_ns() - t0;
+            spi_emu_get_stats(EMU_HOST, &stats, 1);
+            printf(" %6.2f (%3.0f%%) ", ((double)len * 1000.0) / wall, (100.0 * stats.wire_ns) / wall);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    timing.time_scale = 0;
+    spi_emu_set_timing(&timing);
+}
+
+//=================================
+int main(int argc, char *argv[])
+{
+    int only_checks = 0;
+    uint32_t len = 16384;
+    double max_overhead = 0;
+    const char *capture_file = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cn:m:w:")) != -1) {
+        if (opt == 'c') only_checks = 1;
+        else if (opt == 'n') len = strtoul(optarg, NULL, 0);
+        else if (opt == 'm') max_overhead = strtod(optarg, NULL);
+        else if (opt == 'w') capture_file = optarg;
+        else {
+            fprintf(stderr, "usage: %s [-c] [-n bytes] [-m max_overhead_ns_per_byte] [-w capture_file]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (len < REPEAT_SIZE) len = REPEAT_SIZE;
+
+    cap_size = (len > 10001) ? len : 10001;
+    cap_buf = malloc(cap_size);
+    uint8_t *tx = malloc(cap_size);
+    uint8_t *rx = malloc(cap_size);
+    fdx_rx = malloc(cap_size);
+    if ((cap_buf == NULL) || (tx == NULL) || (rx == NULL) || (fdx_rx == NULL)) return 1;
+    for (uint32_t i=0; i<cap_size; i++) tx[i] = (uint8_t)((i * 131) + (i >> 8));
+
+    spi_emu_start();
+    capture_reset(0);
+    spi_emu_attach(EMU_HOST, &slave);
+
+    spi_nodma_bus_config_t buscfg = {
+        .miso_io_num=EMU_PIN_MISO,
+        .mosi_io_num=EMU_PIN_MOSI,
+        .sclk_io_num=EMU_PIN_CLK,
+        .quadwp_io_num=-1,
+        .quadhd_io_num=-1
+    };
+    spi_nodma_device_interface_config_t devcfg = {
+        .clock_speed_hz=40000000,
+        .mode=0,
+        .spics_io_num=-1,
+        .spics_ext_io_num=EMU_PIN_CS,
+        .flags=SPI_DEVICE_HALFDUPLEX,
+        .queue_size=2,
+    };
+    spi_nodma_device_interface_config_t cmdcfg = {
+        .clock_speed_hz=40000000,
+        .mode=0,
+        .spics_io_num=EMU_PIN_TCS,
+        .spics_ext_io_num=-1,
+        .command_bits=8,
+        .flags=SPI_DEVICE_HALFDUPLEX,
+        .queue_size=1,
+        .bus_wait_ms=100,
+    };
+    spi_nodma_device_interface_config_t fdxcfg = {
+        .clock_speed_hz=40000000,
+        .mode=0,
+        .spics_io_num=-1,
+        .spics_ext_io_num=EMU_PIN_FCS,
+        .flags=0,
+        .queue_size=1,
+    };
+    if ((spi_nodma_bus_add_device(EMU_HOST, &buscfg, &devcfg, &disp) != ESP_OK) ||
+        (spi_nodma_bus_add_device(EMU_HOST, &buscfg, &cmdcfg, &cmddev) != ESP_OK) ||
+        (spi_nodma_bus_add_device(EMU_HOST, &buscfg, &fdxcfg, &fdxdev) != ESP_OK)) {
+        printf("Cannot add devices\n");
+        return 1;
+    }
+
+    spi_nodma_capture_start(1);
+    run_checks(tx, rx);
+    spi_nodma_capture_stop();
+    if (capture_file) {
+        FILE *f = fopen(capture_file, "w");
+        if ((f == NULL) || (spi_nodma_capture_export(f, SPI_CAPTURE_FORMAT_TEXT) != ESP_OK)) {
+            printf("Cannot write the capture to %s\n", capture_file);
+            failed++;
+        }
+        if (f) fclose(f);
+    }
+    run_bits_checks(tx, rx);
+    run_io_mode_checks(tx, rx);
+    run_clock_checks(tx);
+    run_pool_check(tx);
+    run_notify_check(tx);
+    run_async_check(tx, rx);
+    run_intr_state_check(tx);
+#if SPI_NODMA_CAPTURE
+    run_capture_check(tx);
+#endif
+    run_host_checks(tx);
+    run_arbiter_checks(tx);
+#if SPI_NODMA_STATS
+    run_stats_check(tx);
+#endif
+    if ((!only_checks) && (!failed)) bench(tx, rx, len, max_overhead);
+
+    spi_nodma_bus_remove_device(fdxdev);
+    spi_nodma_bus_remove_device(cmddev);
+    spi_nodma_bus_remove_device(disp);
+    spi_emu_stop();
+
+    if (failed) printf("\nFAILED\n");
+    return (failed) ? 1 : 0;
+}
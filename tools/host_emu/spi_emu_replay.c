@@ -0,0 +1,311 @@
+/*
+ * Replay of a transaction capture through spi_master_nodma.c running on the host, against the emulated spi peripheral
+ *
+ * The capture is recorded on the target with 'spi_nodma_capture_start' (SPI_NODMA_CAPTURE=1) and written
+ * with 'spi_nodma_capture_export' in SPI_CAPTURE_FORMAT_TEXT format.
+ *
+ * Build & run from the project directory:
+ *   make -C tools/host_emu replay CAPTURE=capture.txt
+ *
+ * Options:
+ *   -t        keep the recorded start times of the transactions, otherwise they are replayed as fast as possible
+ *   -r        use the real time bit-time model (time_scale=1), otherwise the transactions finish immediately
+ *   -o file   write the capture of the replay in text format, for comparing with the input
+ *   -v file   write the capture of the replay in VCD format
+ *
+ * A device is added for each host/device slot found in the capture (in the order of the slots), with the recorded
+ * clock, phase lengths and flags; it uses a software CS.
+ * The recorded first data bytes are transmitted repeatedly, received data are discarded.
+ * Queued transactions are queued and their result is taken before the next record is replayed.
+ * The driver overhead of the direct and of the queued transactions is shown as in spi_emu_bench:
+ *   (wall time - emulator busy time) / bytes
+ * Only the last SPI_NODMA_CAPTURE_SIZE transactions of the replay are kept in its capture.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "spi_master_nodma.h"
+#include "spi_emu.h"
+#include "soc/soc.h"
+#include "rom/ets_sys.h"
+
+#define REPLAY_MAX_LINE     256
+#define REPLAY_TRANS_FLAGS  (SPI_TRANS_MODE_DIO|SPI_TRANS_MODE_QIO|SPI_TRANS_MODE_DIOQIO_ADDR)
+
+// Bus pins of HSPI and VSPI, software CS pins of the replayed devices
+static const int bus_pins[3][3] = {{-1, -1, -1}, {12, 13, 14}, {19, 23, 18}};   // miso, mosi, sclk
+static const int cs_pins[] = {5, 4, 15, 16, 17, 21, 22, 25, 26, 27, 32, 33};
+
+static spi_nodma_device_handle_t replay_dev[3][NO_DEV];
+static int cs_used = 0;
+static uint8_t *txbuf = NULL;
+static uint8_t *rxbuf = NULL;
+static uint32_t buf_size = 0;
+
+// Time spent replaying the transactions of each kind
+typedef struct {
+    uint32_t count;
+    uint64_t bytes;
+    uint64_t wall_ns;
+    uint64_t busy_ns;
+} replay_stats_t;
+
+// Parse the record line written by spi_nodma_capture_export, returns 0 if it is not a record
+//------------------------------------------------------------------
+static int parse_record(const char *line, spi_nodma_capture_rec_t *rec)
+{
+    unsigned v[16];
+    unsigned long long address;
+    char data[2*SPI_NODMA_CAPTURE_DATA+2];
+
+    if (sscanf(line, "%u %u %u %u %u %u %u %x %x %u %x %u %llx %u %u %u %34s",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10], &v[11],
+               &address, &v[12], &v[13], &v[14], data) != 17) return 0;
+    memset(rec, 0, sizeof(spi_nodma_capture_rec_t));
+    rec->seq = v[0];
+    rec->start = v[1];
+    rec->end = v[2];
+    rec->host = v[3];
+    rec->dev = v[4];
+    rec->kind = v[5];
+    rec->clock_hz = v[6];
+    rec->dev_flags = v[7];
+    rec->flags = v[8];
+    rec->command_bits = v[9];
+    rec->command = v[10];
+    rec->address_bits = v[11];
+    rec->address = address;
+    rec->dummy_bits = v[12];
+    rec->txbits = v[13];
+    rec->rxbits = v[14];
+    if ((rec->host > VSPI_HOST) || (rec->dev >= NO_DEV)) return 0;
+    if (strcmp(data, "-") != 0) {
+        for (int i=0; (i < SPI_NODMA_CAPTURE_DATA) && (data[2*i]) && (data[2*i+1]); i++) {
+            unsigned b;
+            if (sscanf(&data[2*i], "%2x", &b) != 1) break;
+            rec->data[i] = b;
+            rec->ndata++;
+        }
+    }
+    return 1;
+}
+
+// Device of the record, added with the recorded settings when first used
+//--------------------------------------------------------------------------
+static spi_nodma_device_handle_t record_device(spi_nodma_capture_rec_t *rec)
+{
+    if (replay_dev[rec->host][rec->dev]) return replay_dev[rec->host][rec->dev];
+    if (cs_used >= (int)(sizeof(cs_pins)/sizeof(cs_pins[0]))) return NULL;
+
+    spi_nodma_bus_config_t buscfg = {
+        .miso_io_num=bus_pins[rec->host][0],
+        .mosi_io_num=bus_pins[rec->host][1],
+        .sclk_io_num=bus_pins[rec->host][2],
+        .quadwp_io_num=-1,
+        .quadhd_io_num=-1
+    };
+    spi_nodma_device_interface_config_t devcfg = {
+        .command_bits=rec->command_bits,
+        .address_bits=rec->address_bits,
+        .dummy_bits=rec->dummy_bits,
+        .clock_speed_hz=(rec->clock_hz) ? rec->clock_hz : 1000000,
+        .mode=0,
+        .spics_io_num=-1,
+        .spics_ext_io_num=cs_pins[cs_used],
+        .flags=rec->dev_flags,
+        .queue_size=1,
+    };
+    if (spi_nodma_bus_add_device(rec->host, &buscfg, &devcfg, &replay_dev[rec->host][rec->dev]) != ESP_OK) return NULL;
+    cs_used++;
+    return replay_dev[rec->host][rec->dev];
+}
+
+// Transmit buffer filled with the recorded data repeated, both buffers at least 'bytes' long
+//----------------------------------------------------------------
+static int record_buffers(spi_nodma_capture_rec_t *rec, uint32_t bytes)
+{
+    if (bytes > buf_size) {
+        free(txbuf);
+        free(rxbuf);
+        txbuf = malloc(bytes);
+        rxbuf = malloc(bytes);
+        if ((txbuf == NULL) || (rxbuf == NULL)) return 0;
+        buf_size = bytes;
+    }
+    for (uint32_t i=0; i<bytes; i++) txbuf[i] = (rec->ndata) ? rec->data[i % rec->ndata] : 0;
+    return 1;
+}
+
+//---------------------------------------------------------------------------------------------
+static int replay_record(spi_nodma_capture_rec_t *rec, spi_nodma_device_handle_t handle, replay_stats_t *stats)
+{
+    spi_nodma_transaction_t t, *rtrans;
+    spi_emu_stats_t emu;
+    uint32_t txbytes = (rec->txbits+7)/8;
+    uint32_t rxbytes = (rec->rxbits+7)/8;
+    esp_err_t ret;
+
+    if (!record_buffers(rec, (txbytes > rxbytes) ? txbytes : rxbytes)) return 0;
+    memset(&t, 0, sizeof(t));
+    t.flags = rec->flags & REPLAY_TRANS_FLAGS;
+    t.command = rec->command;
+    t.address = rec->address;
+    if (rec->txbits) {
+        t.tx_buffer = txbuf;
+        t.length = rec->txbits;
+    }
+    if (rec->rxbits) {
+        t.rx_buffer = rxbuf;
+        t.rxlength = rec->rxbits;
+    }
+
+    spi_emu_get_stats(rec->host, &emu, 1);
+    uint64_t t0 = spi_emu_time_ns();
+    if (rec->kind == SPI_CAPTURE_QUEUED) {
+        ret = spi_device_queue_trans(handle, &t, portMAX_DELAY);
+        if (ret == ESP_OK) ret = spi_device_get_trans_result(handle, &rtrans, portMAX_DELAY);
+    }
+    else ret = spi_nodma_transfer_data(handle, &t);
+    stats->wall_ns += spi_emu_time_ns() - t0;
+    spi_emu_get_stats(rec->host, &emu, 1);
+    stats->busy_ns += emu.busy_ns;
+    stats->bytes += txbytes + rxbytes;
+    stats->count++;
+    return (ret == ESP_OK);
+}
+
+//------------------------------------------------------------
+static void print_stats(const char *name, replay_stats_t *stats)
+{
+    if (stats->count == 0) return;
+    printf("  %-8s %8u trans %12llu bytes %10.3f ms", name, stats->count, (unsigned long long)stats->bytes, stats->wall_ns / 1e6);
+    if (stats->bytes) printf(" %8.2f ns/byte overhead", (double)(stats->wall_ns - stats->busy_ns) / stats->bytes);
+    printf("\n");
+}
+
+//--------------------------------------------------------------
+static int write_capture(const char *name, spi_nodma_capture_format_t format)
+{
+    FILE *f = fopen(name, "w");
+    if (f == NULL) return 0;
+    esp_err_t ret = spi_nodma_capture_export(f, format);
+    fclose(f);
+    return (ret == ESP_OK);
+}
+
+//=================================
+int main(int argc, char *argv[])
+{
+    int timed = 0;
+    const char *out_text = NULL;
+    const char *out_vcd = NULL;
+    spi_emu_timing_t timing = {.time_scale = 0, .trans_ns = 0};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tro:v:")) != -1) {
+        if (opt == 't') timed = 1;
+        else if (opt == 'r') timing.time_scale = 1;
+        else if (opt == 'o') out_text = optarg;
+        else if (opt == 'v') out_vcd = optarg;
+        else optind = argc;
+    }
+    if (optind != argc-1) {
+        fprintf(stderr, "usage: %s [-t] [-r] [-o out.txt] [-v out.vcd] capture.txt\n", argv[0]);
+        return 2;
+    }
+    FILE *f = fopen(argv[optind], "r");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    // Records are loaded first, the devices are added in the order of their slots, so they get the recorded slots
+    char line[REPLAY_MAX_LINE];
+    unsigned cpu_mhz = ets_get_cpu_frequency();
+    spi_nodma_capture_rec_t *recs = NULL;
+    int nrec = 0, size = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') {
+            char *p = strstr(line, "cpu_mhz=");
+            if (p) cpu_mhz = strtoul(p+8, NULL, 10);
+            continue;
+        }
+        if (nrec == size) {
+            size += 1024;
+            recs = realloc(recs, size * sizeof(spi_nodma_capture_rec_t));
+            if (recs == NULL) return 1;
+        }
+        if (parse_record(line, &recs[nrec])) nrec++;
+    }
+    fclose(f);
+
+    // Slaves only count the bits
+    static uint8_t slave_buf[2][16];
+    spi_emu_slave_t slave[2];
+    spi_emu_capture_t cap[2];
+    spi_emu_start();
+    spi_emu_set_timing(&timing);
+    for (int i=0; i<2; i++) {
+        spi_emu_capture_init(&slave[i], &cap[i], slave_buf[i], sizeof(slave_buf[i]), 0);
+        spi_emu_attach(HSPI_HOST+i, &slave[i]);
+    }
+    for (int h=HSPI_HOST; h<=VSPI_HOST; h++) {
+        for (int d=0; d<NO_DEV; d++) {
+            for (int i=0; i<nrec; i++) {
+                if ((recs[i].host == h) && (recs[i].dev == d)) {
+                    record_device(&recs[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+    uint32_t prev_start = (nrec) ? recs[0].start : 0;
+    uint64_t offset = 0, t_start = spi_emu_time_ns();
+    int replayed = 0, skipped = 0, failed = 0;
+    replay_stats_t stats[2];
+    memset(stats, 0, sizeof(stats));
+
+    spi_nodma_capture_start(1);
+    for (int i=0; i<nrec; i++) {
+        spi_nodma_capture_rec_t *rec = &recs[i];
+        spi_nodma_device_handle_t handle = replay_dev[rec->host][rec->dev];
+        if (handle == NULL) {
+            skipped++;
+            continue;
+        }
+        if (timed) {
+            // Recorded start time relative to the first record, the cycle counter can wrap around between the records
+            offset += (uint32_t)(rec->start - prev_start);
+            prev_start = rec->start;
+            uint64_t due = t_start + ((offset * 1000) / ((cpu_mhz) ? cpu_mhz : 1));
+            uint64_t now;
+            while ((now = spi_emu_time_ns()) < due) {
+                // Sleep while far from the start time, then spin
+                if ((due - now) > 200000) usleep(100);
+            }
+        }
+        if (!replay_record(rec, handle, &stats[(rec->kind == SPI_CAPTURE_QUEUED) ? 1 : 0])) failed++;
+        replayed++;
+    }
+    spi_nodma_capture_stop();
+
+    printf("Replayed %d transactions (%d skipped, %d failed)\n", replayed, skipped, failed);
+    print_stats("direct", &stats[0]);
+    print_stats("queued", &stats[1]);
+    if ((out_text) && (!write_capture(out_text, SPI_CAPTURE_FORMAT_TEXT))) failed++;
+    if ((out_vcd) && (!write_capture(out_vcd, SPI_CAPTURE_FORMAT_VCD))) failed++;
+
+    for (int h=0; h<3; h++) {
+        for (int d=0; d<NO_DEV; d++) {
+            if (replay_dev[h][d]) spi_nodma_bus_remove_device(replay_dev[h][d]);
+        }
+    }
+    spi_emu_stop();
+    free(recs);
+    free(txbuf);
+    free(rxbuf);
+    return (failed) ? 1 : 0;
+}
@@ -0,0 +1,779 @@
+/*
+ * Self-check and benchmark of the display pixel pipeline (tftfunc.c) running on the host, against the emulated spi peripheral
+ *
+ * Build & run from the project directory:
+ *   make -C tools/host_emu tft-bench
+ *
+ * Options:
+ *   -c        only run the functional checks
+ *   -n pixels number of pixels converted/sent in each benchmark scenario (default 307200, one 640x480 screen)
+ *
+ * Pixel rates are host cpu rates, only useful for comparing versions and the color vs. gray scale modes.
+ * 'float gs' is the previous floating point gray scale conversion, kept here as the reference.
+ * 'send_data' sends lines through the driver in direct mode with transactions finishing immediately (time_scale=0).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tftfunc.h"
+#include "spi_emu.h"
+
+#define EMU_HOST        VSPI_HOST
+#define EMU_PIN_MISO    19
+#define EMU_PIN_MOSI    23
+#define EMU_PIN_CLK     18
+#define EMU_PIN_CS      5
+#define EMU_PIN_UCS     16      // software CS of the urgent device
+#define LINE_PIXELS     320     // pixels sent with each send_data() call
+
+static spi_emu_slave_t slave;
+static spi_emu_capture_t cap;
+static uint8_t *cap_buf;
+static uint32_t cap_size;
+static int failed = 0;
+
+// Previous gray scale conversion and RGB565 packing, used as the reference
+//---------------------------------------------------------------------------------
+static uint32_t __attribute__((noinline)) ref_native(color_t color, int gs, int bits)
+{
+    if (gs) {
+        float gs_clr = 0.2989 * color.r + 0.4870 * color.g + 0.2140 * color.b;
+        color.r = (uint8_t)gs_clr;
+        color.g = (uint8_t)gs_clr;
+        color.b = (uint8_t)gs_clr;
+    }
+    if (bits == 16) {
+        uint32_t color16 = 0;
+        uint8_t *buf16 = (uint8_t *)(&color16);
+        buf16[0] = color.r & 0xF8;
+        buf16[0] |= (color.g & 0xE0) >> 5;
+        buf16[1] = (color.g & 0x1C) << 3;
+        buf16[1] |= (color.b & 0xF8) >> 3;
+        return color16;
+    }
+    return (uint32_t)color.r | ((uint32_t)color.g << 8) | ((uint32_t)color.b << 16);
+}
+
+//---------------------------------------------------------------------------------------------
+static uint32_t ref_colors2native(uint8_t *dst, const color_t *src, uint32_t len, int gs, int bits)
+{
+    uint8_t *d = dst;
+    for (uint32_t n=0; n<len; n++) {
+        uint32_t wd = ref_native(src[n], gs, bits);
+        *d++ = (uint8_t)wd;
+        *d++ = (uint8_t)(wd >> 8);
+        if (bits == 24) *d++ = (uint8_t)(wd >> 16);
+    }
+    return d - dst;
+}
+
+//------------------------------------------------------------------------
+static void check(const char *name, int ok)
+{
+    printf("  %-28s %s\n", name, (ok) ? "OK" : "FAIL");
+    if (!ok) failed++;
+}
+
+//--------------------------
+static void capture_reset()
+{
+    spi_emu_capture_init(&slave, &cap, cap_buf, cap_size, 0);
+}
+
+// ==== Checks ====
+
+// All colors are converted and compared with the previous conversion
+// The integer gray level may differ by one from the truncated floating point result,
+// in 16-bit mode the gray pixel must be the RGB565 packed integer gray level
+//----------------------------------------------
+static void run_conversion_checks()
+{
+    uint32_t gs_diff = 0, gs_exact = 0, pack_diff = 0;
+    color_t color, gray;
+    uint32_t level, ref;
+
+    for (uint32_t c=0; c<0x1000000; c++) {
+        color.r = c >> 16;
+        color.g = c >> 8;
+        color.b = c;
+        gray_scale = 0;
+        COLOR_BITS = 16;
+        if (color2native(color) != ref_native(color, 0, 16)) pack_diff++;
+        COLOR_BITS = 24;
+        if (color2native(color) != ref_native(color, 0, 24)) pack_diff++;
+
+        gray_scale = 1;
+        level = color2native(color);
+        ref = ref_native(color, 1, 24);
+        if (level == ref) gs_exact++;
+        else if (((level & 0xFF) + 1 != (ref & 0xFF)) && ((level & 0xFF) != (ref & 0xFF) + 1)) gs_diff++;
+        if (level != (level & 0xFF) * 0x010101) gs_diff++;
+        gray.r = level;
+        gray.g = level;
+        gray.b = level;
+        COLOR_BITS = 16;
+        if (color2native(color) != ref_native(gray, 0, 16)) gs_diff++;
+    }
+    gray_scale = 0;
+    COLOR_BITS = 24;
+    check("native packing", pack_diff == 0);
+    check("integer gray scale", gs_diff == 0);
+    printf("  %-28s %.2f%%\n", "gray equal to float", (100.0 * gs_exact) / 0x1000000);
+}
+
+// Data sent by send_data() must end with the native pixels, the command and window bytes precede them
+//-------------------------------------------------------------------------------
+static int send_check(color_t *line, uint8_t *native, uint32_t len, int trans)
+{
+    tft_use_trans = trans;
+    uint32_t size = colors2native(native, line, len);
+    capture_reset();
+    send_data(0, 0, len-1, 0, len, line);
+    disp_deselect();
+    if (cap.len < size) return 0;
+    return (memcmp(cap_buf + cap.len - size, native, size) == 0);
+}
+
+// A queued line still on the wire after the wait times out stays owned by the queued transaction:
+// the next wait finishes it and returns its descriptor to the pool, the data is sent completely
+//--------------------------------------------------------------
+static int trans_timeout_check(color_t *line, uint8_t *native)
+{
+    spi_emu_timing_t timing = { .time_scale=1, .trans_ns=0 };
+    uint32_t speed = spi_nodma_get_speed(disp_spi);
+    uint32_t size = colors2native(native, line, 100);
+    int ok;
+
+    tft_use_trans = 1;
+    capture_reset();
+    spi_emu_set_timing(&timing);
+    // 2400 data bits at 2 kHz are on the wire for 1.2 s, the wait times out after 1 s
+    spi_nodma_set_speed(disp_spi, 2000);
+    send_data(0, 0, 99, 0, 100, line);
+    ok = (wait_trans_finish() == ESP_ERR_TIMEOUT);
+    ok &= ((tft_in_trans == 1) && (disp_spi->pool.free != 3));
+    ok &= (wait_trans_finish() == ESP_OK);
+    ok &= ((tft_in_trans == 0) && (disp_spi->pool.free == 3));
+    disp_deselect();
+    timing.time_scale = 0;
+    spi_emu_set_timing(&timing);
+    spi_nodma_set_speed(disp_spi, speed);
+    return ((ok) && (cap.len >= size) && (memcmp(cap_buf + cap.len - size, native, size) == 0));
+}
+
+// Queued image lines are left in flight, the next line is prepared in the other pool entry;
+// the display stays selected until disp_deselect(), which finishes the last line.
+// send_native() and TFT_pushColorRep() release the bus on return
+//---------------------------------------------------------------
+static int inflight_check(color_t *line, uint8_t *native)
+{
+    uint32_t size = colors2native(native, line, 100);
+    color_t color = { .r=0x10, .g=0x20, .b=0x30 };
+    int ok;
+
+    tft_use_trans = 1;
+    send_native(0, 0, 99, 0, 100, native);
+    ok = ((tft_in_trans == 0) && (disp_spi->cfg.selected == 0) && (disp_spi->pool.free == 3));
+    TFT_pushColorRep(0, 0, 99, 9, color, 1000);
+    ok &= ((tft_in_trans == 0) && (disp_spi->cfg.selected == 0) && (disp_spi->pool.free == 3));
+    capture_reset();
+    send_native_line(0, 0, 99, 0, 100, native);
+    ok &= ((tft_in_trans == 1) && (disp_spi->cfg.selected == 1) && (disp_spi->pool.free != 3));
+    send_native_line(0, 1, 99, 1, 100, native + size/2);
+    ok &= ((tft_in_trans == 1) && (disp_spi->pool.free != 3));
+    ok &= (disp_deselect() == ESP_OK);
+    ok &= ((tft_in_trans == 0) && (disp_spi->cfg.selected == 0) && (disp_spi->pool.free == 3));
+    ok &= ((cap.len >= size*2) && (memcmp(cap_buf + cap.len - size, native + size/2, size) == 0));
+    return ok;
+}
+
+//-------------------------------------------------
+static void run_send_checks(color_t *line, uint8_t *native)
+{
+    char name[40];
+
+    for (int bits=16; bits<=24; bits+=8) {
+        for (int gs=0; gs<2; gs++) {
+            COLOR_BITS = bits;
+            gray_scale = gs;
+            for (int trans=0; trans<2; trans++) {
+                sprintf(name, "send_data %d-bit%s%s", bits, (gs) ? " gs" : "", (trans) ? " trans" : "");
+                check(name, send_check(line, native, LINE_PIXELS, trans) && send_check(line, native, 7, trans));
+            }
+        }
+    }
+    gray_scale = 0;
+    COLOR_BITS = 24;
+    // the pool was created in 16-bit mode, 24-bit lines which don't fit are sent in direct mode
+    check("pool buffers for color mode", disp_spi->pool.buf_size == TFT_LINEBUF_MAX_SIZE*2);
+    check("queued lines in flight", inflight_check(line, native));
+    check("queued line wait timeout", trans_timeout_check(line, native));
+}
+
+// ==== Display model: CASET, PASET, RAMWR and RAMWRC to a frame buffer of native pixels ====
+// Display commands are sent in the hw command phase (DISP_SPI_CMD_PHASE), the data in the data phase
+
+#define MODEL_W     480
+#define MODEL_H     480
+
+typedef struct {
+    uint16_t x1, x2, y1, y2;    // address window
+    uint16_t x, y;              // write position
+    uint8_t cmd;
+    uint8_t args[4];
+    uint32_t nargs;
+    uint32_t acc;               // bytes of the pixel being received
+    uint32_t nacc;
+    uint32_t commands;          // received commands
+    uint32_t winsets;           // received CASET and PASET commands
+    uint32_t ramwrc;            // received RAMWRC commands
+    uint32_t pixels;            // received pixels
+    uint32_t other;             // transfers to another device (display CS inactive), they end the memory write
+    uint32_t errors;            // pixels written outside the frame buffer
+    uint32_t fb[MODEL_H][MODEL_W];
+} disp_model_t;
+
+static disp_model_t *model;
+static spi_emu_slave_t model_slave;
+static uint32_t (*ref_fb)[MODEL_W];
+
+//-------------------------------------------------------------------------------
+static void model_command(spi_emu_slave_t *slave, uint32_t value, int bits)
+{
+    disp_model_t *m = (disp_model_t *)slave->ctx;
+    if (spi_emu_gpio_get(EMU_PIN_CS)) {
+        m->cmd = 0;
+        m->other++;
+        return;
+    }
+    m->cmd = value & 0xFF;
+    m->nargs = 0;
+    m->nacc = 0;
+    m->acc = 0;
+    m->commands++;
+    if ((m->cmd == TFT_CASET) || (m->cmd == TFT_PASET)) m->winsets++;
+    else if (m->cmd == TFT_RAMWR) {
+        m->x = m->x1;
+        m->y = m->y1;
+    }
+    else if (m->cmd == TFT_RAMWRC) m->ramwrc++;
+}
+
+//------------------------------------------------------------------------------------------------
+static void model_data(spi_emu_slave_t *slave, const uint8_t *mosi, uint8_t *miso, int bits)
+{
+    disp_model_t *m = (disp_model_t *)slave->ctx;
+    uint32_t bytes = (bits + 7) / 8;
+
+    if (miso) memset(miso, 0, bytes);
+    if (spi_emu_gpio_get(EMU_PIN_CS)) {
+        m->cmd = 0;
+        m->other++;
+        return;
+    }
+    if (mosi == NULL) return;
+    for (uint32_t i=0; i<bytes; i++) {
+        if ((m->cmd == TFT_CASET) || (m->cmd == TFT_PASET)) {
+            if (m->nargs < 4) m->args[m->nargs++] = mosi[i];
+            if (m->nargs == 4) {
+                uint16_t s = (m->args[0] << 8) | m->args[1];
+                uint16_t e = (m->args[2] << 8) | m->args[3];
+                if (m->cmd == TFT_CASET) { m->x1 = s; m->x2 = e; }
+                else { m->y1 = s; m->y2 = e; }
+            }
+        }
+        else if ((m->cmd == TFT_RAMWR) || (m->cmd == TFT_RAMWRC)) {
+            m->acc |= (uint32_t)mosi[i] << (m->nacc * 8);
+            if (++m->nacc < DISP_PIXEL_BYTES) continue;
+            if ((m->x < MODEL_W) && (m->y < MODEL_H)) m->fb[m->y][m->x] = m->acc;
+            else m->errors++;
+            m->pixels++;
+            m->acc = 0;
+            m->nacc = 0;
+            // next column, next row at the window's end, window start after the last row
+            if (m->x < m->x2) m->x++;
+            else {
+                m->x = m->x1;
+                m->y = (m->y < m->y2) ? m->y + 1 : m->y1;
+            }
+        }
+    }
+}
+
+// Reference of the pixels written to the window (x1,y1),(x2,y2)
+//----------------------------------------------------------------------------------------
+static void ref_write(int x1, int y1, int x2, int y2, uint32_t len, uint32_t wd, const color_t *buf)
+{
+    int x = x1, y = y1;
+    for (uint32_t n=0; n<len; n++) {
+        ref_fb[y][x] = (buf) ? color2native(buf[n]) : wd;
+        if (x < x2) x++;
+        else { x = x1; y = (y < y2) ? y + 1 : y1; }
+    }
+}
+
+// Random drawing with the address window cache compared with the reference frame buffer
+//--------------------------------------------------------------------------
+static int addrwin_check(color_t *line, int bits, int trans, uint32_t ops)
+{
+    color_t color;
+    int x, y, w, h;
+
+    COLOR_BITS = bits;
+    tft_use_trans = trans;
+    memset(model, 0, sizeof(disp_model_t));
+    memset(ref_fb, 0, sizeof(uint32_t) * MODEL_W * MODEL_H);
+    disp_addrwin_invalidate();
+    srand(bits + trans);
+
+    for (uint32_t n=0; n<ops; n++) {
+        color.r = rand();
+        color.g = rand();
+        color.b = rand();
+        x = rand() % _width;
+        y = rand() % _height;
+        w = 1 + rand() % (_width - x);
+        h = 1 + rand() % (_height - y);
+        switch (rand() % 6) {
+            case 0:     // filled rectangle
+                TFT_pushColorRep(x, y, x+w-1, y+h-1, color, w*h);
+                ref_write(x, y, x+w-1, y+h-1, w*h, color2native(color), NULL);
+                break;
+            case 1:     // vertical line
+                TFT_pushColorRep(x, y, x, y+h-1, color, h);
+                ref_write(x, y, x, y+h-1, h, color2native(color), NULL);
+                break;
+            case 2:     // horizontal run of pixels
+                if (w > 40) w = 40;
+                for (int i=0; i<w; i++) {
+                    color.r += 5;
+                    drawPixel(x+i, y, color, 1);
+                    ref_write(x+i, y, x+i+1, y+1, 1, color2native(color), NULL);
+                }
+                break;
+            case 3:     // image lines
+                if (h > 20) h = 20;
+                for (int i=0; i<h; i++) {
+                    send_data(x, y+i, x+w-1, y+i, w, line + (i & 7));
+                    ref_write(x, y+i, x+w-1, y+i, w, 0, line + (i & 7));
+                }
+                break;
+            case 4:     // image block
+                if (w*h > LINE_PIXELS) h = LINE_PIXELS / w;
+                send_data(x, y, x+w-1, y+h-1, w*h, line);
+                ref_write(x, y, x+w-1, y+h-1, w*h, 0, line);
+                break;
+            default:    // other command
+                disp_select();
+                disp_spi_transfer_cmd(TFT_INVOFF);
+                disp_deselect();
+                break;
+        }
+    }
+    disp_deselect();
+    COLOR_BITS = 24;
+    tft_use_trans = 1;
+    return ((model->errors == 0) && (memcmp(model->fb, ref_fb, sizeof(uint32_t) * MODEL_W * MODEL_H) == 0));
+}
+
+// Consecutive image lines: the window is set for the first line only, the other lines continue the RAM write
+//--------------------------------------------------------
+static int addrwin_lines_check(color_t *line, uint32_t lines)
+{
+    memset(model, 0, sizeof(disp_model_t));
+    disp_addrwin_invalidate();
+    for (uint32_t i=0; i<lines; i++) send_data(10, 5+i, 10+99, 5+i, 100, line);
+    disp_deselect();
+    return ((model->winsets == 2) && (model->ramwrc == lines-1) && (model->commands == lines+2));
+}
+
+// Stable sort of the pixels by row and column, the order TFT_drawPixels passes them to drawPixels
+//---------------------------------------------------------
+static void sort_pixels(tft_pixel_t *pixels, int count)
+{
+    tft_pixel_t p;
+    int j;
+    for (int i=1; i<count; i++) {
+        p = pixels[i];
+        for (j=i; (j > 0) && ((pixels[j-1].y > p.y) || ((pixels[j-1].y == p.y) && (pixels[j-1].x > p.x))); j--) pixels[j] = pixels[j-1];
+        pixels[j] = p;
+    }
+}
+
+// Random pixel batches with duplicates and runs, and random rectangle batches,
+// compared with the reference frame buffer written in the drawing order
+//------------------------------------------------------------
+static int batch_check(int bits, int trans, uint32_t batches)
+{
+    tft_pixel_t pixels[300];
+    tft_rect_t rects[20];
+    color_t color;
+    int count, len;
+
+    COLOR_BITS = bits;
+    tft_use_trans = trans;
+    memset(model, 0, sizeof(disp_model_t));
+    memset(ref_fb, 0, sizeof(uint32_t) * MODEL_W * MODEL_H);
+    disp_addrwin_invalidate();
+    srand(100 + bits + trans);
+
+    for (uint32_t n=0; n<batches; n++) {
+        // pixels: short same color runs and single pixels in a small area, so coordinates repeat
+        count = 0;
+        int x0 = rand() % (_width - 32), y0 = rand() % (_height - 16);
+        while (count < 300) {
+            color.r = rand() & 3;
+            color.g = 0x40;
+            color.b = rand();
+            len = 1 + rand() % 8;
+            int x = x0 + rand() % 32, y = y0 + rand() % 16;
+            for (int i=0; (i<len) && (count < 300) && ((x+i) < _width); i++) {
+                pixels[count].x = x+i;
+                pixels[count].y = y;
+                pixels[count].color = color;
+                ref_fb[y][x+i] = color2native(color);
+                count++;
+            }
+        }
+        sort_pixels(pixels, count);
+        drawPixels(pixels, count);
+
+        // overlapping rectangles
+        count = 1 + rand() % 20;
+        for (int i=0; i<count; i++) {
+            rects[i].x = rand() % _width;
+            rects[i].y = rand() % _height;
+            rects[i].w = 1 + rand() % ((_width - rects[i].x < 60) ? _width - rects[i].x : 60);
+            rects[i].h = 1 + rand() % ((_height - rects[i].y < 60) ? _height - rects[i].y : 60);
+            rects[i].color.r = rand();
+            rects[i].color.g = rand();
+            rects[i].color.b = rand();
+            ref_write(rects[i].x, rects[i].y, rects[i].x+rects[i].w-1, rects[i].y+rects[i].h-1,
+                      rects[i].w*rects[i].h, color2native(rects[i].color), NULL);
+        }
+        fillRects(rects, count);
+    }
+    COLOR_BITS = 24;
+    tft_use_trans = 1;
+    return ((model->errors == 0) && (memcmp(model->fb, ref_fb, sizeof(uint32_t) * MODEL_W * MODEL_H) == 0));
+}
+
+typedef struct {
+    spi_nodma_device_handle_t handle;
+    esp_err_t ret;
+    uint32_t pixels;            // pixels received by the display when the urgent device got the bus
+} urgent_run_t;
+
+// Select the urgent device (waits for the bus), send 4 bytes
+//---------------------------------------
+static void *urgent_task(void *arg)
+{
+    urgent_run_t *run = (urgent_run_t *)arg;
+    spi_nodma_transaction_t t;
+
+    run->ret = spi_nodma_device_select(run->handle, 0);
+    if (run->ret != ESP_OK) return NULL;
+    run->pixels = model->pixels;
+    memset(&t, 0, sizeof(t));
+    t.length = 4 * 8;
+    t.flags = SPI_TRANS_USE_TXDATA;
+    run->ret = spi_nodma_transfer_data(run->handle, &t);
+    spi_nodma_device_deselect(run->handle);
+    return NULL;
+}
+
+// An urgent device waiting for the bus gets it at a preemption point of a full screen fill;
+// the fill continues with RAMWRC after the display CS was inactive
+//--------------------------------------------------------------------------------
+static int urgent_fill_check(spi_nodma_device_handle_t urgdev, int bits, int trans)
+{
+    color_t color = { .r=0x40, .g=0x80, .b=0xC0 };
+    uint32_t len = (uint32_t)_width * _height;
+    urgent_run_t run = { .handle=urgdev, .ret=ESP_FAIL, .pixels=0 };
+    pthread_t thread;
+    int ok;
+
+    COLOR_BITS = bits;
+    tft_use_trans = trans;
+    memset(model, 0, sizeof(disp_model_t));
+    memset(ref_fb, 0, sizeof(uint32_t) * MODEL_W * MODEL_H);
+    disp_addrwin_invalidate();
+    ref_write(0, 0, _width-1, _height-1, len, color2native(color), NULL);
+
+    // the display task holds the bus until the urgent device waits for it
+    ok = (spi_nodma_device_TakeSemaphore(disp_spi) == ESP_OK);
+    pthread_create(&thread, NULL, urgent_task, &run);
+    for (int i=0; (i<1000) && (disp_spi->host->arb.urgent == 0); i++) usleep(1000);
+    TFT_pushColorRep(0, 0, _width-1, _height-1, color, len);
+    spi_nodma_device_GiveSemaphore(disp_spi);
+    pthread_join(thread, NULL);
+
+    ok &= ((run.ret == ESP_OK) && (run.pixels > 0) && (run.pixels < len) && (model->other > 0));
+    ok &= ((model->pixels == len) && (model->errors == 0));
+    ok &= (memcmp(model->fb, ref_fb, sizeof(uint32_t) * MODEL_W * MODEL_H) == 0);
+    COLOR_BITS = 24;
+    tft_use_trans = 1;
+    return ok;
+}
+
+//-------------------------------------------------
+static void run_urgent_checks()
+{
+    spi_nodma_device_handle_t urgdev = NULL;
+    char name[40];
+    spi_nodma_bus_config_t buscfg = {
+        .miso_io_num=EMU_PIN_MISO,
+        .mosi_io_num=EMU_PIN_MOSI,
+        .sclk_io_num=EMU_PIN_CLK,
+        .quadwp_io_num=-1,
+        .quadhd_io_num=-1
+    };
+    spi_nodma_device_interface_config_t urgcfg = {
+        .clock_speed_hz=10000000,
+        .mode=0,
+        .spics_io_num=-1,
+        .spics_ext_io_num=EMU_PIN_UCS,
+        .flags=SPI_DEVICE_HALFDUPLEX|SPI_DEVICE_BUS_URGENT,
+        .queue_size=1,
+    };
+
+    if (spi_nodma_bus_add_device(EMU_HOST, &buscfg, &urgcfg, &urgdev) != ESP_OK) {
+        check("urgent device preempts fill", 0);
+        return;
+    }
+    for (int bits=16; bits<=24; bits+=8) {
+        for (int trans=0; trans<2; trans++) {
+            sprintf(name, "urgent preempts fill %d-bit%s", bits, (trans) ? " trans" : "");
+            check(name, urgent_fill_check(urgdev, bits, trans));
+        }
+    }
+    spi_nodma_bus_remove_device(urgdev);
+}
+
+//-------------------------------------------------
+static void run_addrwin_checks(color_t *line)
+{
+    char name[40];
+
+    model = malloc(sizeof(disp_model_t));
+    ref_fb = malloc(sizeof(uint32_t) * MODEL_W * MODEL_H);
+    if ((model == NULL) || (ref_fb == NULL)) {
+        check("address window", 0);
+        return;
+    }
+    memset(&model_slave, 0, sizeof(spi_emu_slave_t));
+    model_slave.command = model_command;
+    model_slave.data = model_data;
+    model_slave.ctx = model;
+    spi_emu_attach(EMU_HOST, &model_slave);
+
+    for (int bits=16; bits<=24; bits+=8) {
+        for (int trans=0; trans<2; trans++) {
+            sprintf(name, "address window %d-bit%s", bits, (trans) ? " trans" : "");
+            check(name, addrwin_check(line, bits, trans, 2000));
+        }
+    }
+#if DISP_ADDRWIN_CACHE
+    check("address window image lines", addrwin_lines_check(line, 50));
+#endif
+    for (int bits=16; bits<=24; bits+=8) {
+        for (int trans=0; trans<2; trans++) {
+            sprintf(name, "batches %d-bit%s", bits, (trans) ? " trans" : "");
+            check(name, batch_check(bits, trans, 200));
+        }
+    }
+    run_urgent_checks();
+
+    spi_emu_attach(EMU_HOST, &slave);
+    free(ref_fb);
+    free(model);
+}
+
+// ==== Benchmark ====
+
+//------------------------------------------------------------------------------------------------
+static double kernel_rate(color_t *line, uint8_t *native, uint32_t pixels, int gs, int bits, int ref)
+{
+    COLOR_BITS = bits;
+    gray_scale = gs;
+    uint64_t t0 = spi_emu_time_ns();
+    for (uint32_t n=0; n<pixels; n+=LINE_PIXELS) {
+        if (ref) ref_colors2native(native, line, LINE_PIXELS, gs, bits);
+        else colors2native(native, line, LINE_PIXELS);
+    }
+    uint64_t wall = spi_emu_time_ns() - t0;
+    return (pixels * 1000.0) / wall;
+}
+
+//------------------------------------------------------------------------------
+static double send_rate(color_t *line, uint32_t pixels, int gs, int bits)
+{
+    COLOR_BITS = bits;
+    gray_scale = gs;
+    tft_use_trans = 0;
+    uint64_t t0 = spi_emu_time_ns();
+    for (uint32_t n=0; n<pixels; n+=LINE_PIXELS) {
+        capture_reset();
+        send_data(0, 0, LINE_PIXELS-1, 0, LINE_PIXELS, line);
+    }
+    disp_deselect();
+    uint64_t wall = spi_emu_time_ns() - t0;
+    return (pixels * 1000.0) / wall;
+}
+
+// Circle outline pixels in the drawing order of TFT_drawCircle
+//------------------------------------------------------------------------
+static int circle_pixels(tft_pixel_t *pixels, int x0, int y0, int r, color_t color)
+{
+    int f = 1 - r, ddF_x = 1, ddF_y = -2 * r, x = 0, y = r, count = 0;
+    int pts[4][2] = { {x0, y0+r}, {x0, y0-r}, {x0+r, y0}, {x0-r, y0} };
+
+    for (int i=0; i<4; i++) {
+        pixels[count].x = pts[i][0]; pixels[count].y = pts[i][1]; pixels[count++].color = color;
+    }
+    while (x < y) {
+        if (f >= 0) { y--; ddF_y += 2; f += ddF_y; }
+        x++; ddF_x += 2; f += ddF_x;
+        int oct[8][2] = { {x0+x, y0+y}, {x0-x, y0+y}, {x0+x, y0-y}, {x0-x, y0-y},
+                          {x0+y, y0+x}, {x0-y, y0+x}, {x0+y, y0-x}, {x0-y, y0-x} };
+        for (int i=0; i<8; i++) {
+            pixels[count].x = oct[i][0]; pixels[count].y = oct[i][1]; pixels[count++].color = color;
+        }
+    }
+    return count;
+}
+
+// Wire traffic and time of a circle outline drawn pixel by pixel and as one sorted batch
+//----------------------------------------------
+static void circle_bench(uint32_t trans_ns)
+{
+    spi_emu_timing_t timing = { .time_scale=0, .trans_ns=trans_ns };
+    spi_emu_stats_t stats;
+    tft_pixel_t *pixels = malloc(sizeof(tft_pixel_t) * 8 * _height);
+    color_t color = { .r=0xF0, .g=0x80, .b=0x10 };
+    uint64_t t0, wall;
+
+    if (pixels == NULL) return;
+    spi_emu_set_timing(&timing);
+    spi_emu_attach(EMU_HOST, NULL);
+    int count = circle_pixels(pixels, _width/2, _height/2, _height/2 - 2, color);
+
+    printf("\nCircle outline, %d pixels, %u ns per transaction\n", count, trans_ns);
+    printf("%-22s %10s %10s %10s %10s\n", "scenario", "trans", "bytes", "wire us", "host us");
+    for (int batch=0; batch<2; batch++) {
+        disp_addrwin_invalidate();
+        spi_emu_get_stats(EMU_HOST, &stats, 1);
+        t0 = spi_emu_time_ns();
+        if (batch) {
+            sort_pixels(pixels, count);
+            drawPixels(pixels, count);
+        }
+        else {
+            disp_select();
+            for (int i=0; i<count; i++) drawPixel(pixels[i].x, pixels[i].y, color, 0);
+        }
+        disp_deselect();
+        wall = spi_emu_time_ns() - t0;
+        spi_emu_get_stats(EMU_HOST, &stats, 1);
+        printf("%-22s %10u %10llu %10.1f %10.1f\n", (batch) ? "drawPixels batch" : "drawPixel",
+               stats.transactions, (unsigned long long)(stats.mosi_bits / 8), stats.wire_ns / 1000.0, wall / 1000.0);
+    }
+    spi_emu_attach(EMU_HOST, &slave);
+    free(pixels);
+}
+
+//----------------------------------------------------------------
+static void bench(color_t *line, uint8_t *native, uint32_t pixels)
+{
+    spi_emu_timing_t timing = { .time_scale=0, .trans_ns=0 };
+    spi_emu_set_timing(&timing);
+
+    printf("\nBenchmark, %u pixels per scenario, Mpixels/s\n", pixels);
+    printf("%-22s %10s %10s %10s %10s\n", "scenario", "16 color", "16 gs", "24 color", "24 gs");
+    printf("%-22s", "colors2native");
+    for (int bits=16; bits<=24; bits+=8) {
+        for (int gs=0; gs<2; gs++) printf(" %10.2f", kernel_rate(line, native, pixels, gs, bits, 0));
+    }
+    printf("\n%-22s", "float gs (previous)");
+    for (int bits=16; bits<=24; bits+=8) {
+        for (int gs=0; gs<2; gs++) printf(" %10.2f", kernel_rate(line, native, pixels, gs, bits, 1));
+    }
+    printf("\n%-22s", "send_data direct");
+    for (int bits=16; bits<=24; bits+=8) {
+        for (int gs=0; gs<2; gs++) printf(" %10.2f", send_rate(line, pixels, gs, bits));
+    }
+    printf("\n");
+    gray_scale = 0;
+    COLOR_BITS = 24;
+    circle_bench(0);
+    circle_bench(1000);
+}
+
+//=================================
+int main(int argc, char *argv[])
+{
+    int only_checks = 0;
+    uint32_t pixels = 640*480;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cn:")) != -1) {
+        if (opt == 'c') only_checks = 1;
+        else if (opt == 'n') pixels = strtoul(optarg, NULL, 0);
+        else {
+            fprintf(stderr, "usage: %s [-c] [-n pixels]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (pixels < LINE_PIXELS) pixels = LINE_PIXELS;
+
+    cap_size = LINE_PIXELS*3 + 64;
+    cap_buf = malloc(cap_size);
+    color_t *line = malloc(LINE_PIXELS * sizeof(color_t));
+    uint8_t *native = malloc(LINE_PIXELS * 3);
+    if ((cap_buf == NULL) || (line == NULL) || (native == NULL)) return 1;
+    for (uint32_t i=0; i<LINE_PIXELS; i++) {
+        line[i].r = (uint8_t)(i * 131);
+        line[i].g = (uint8_t)(i * 71 + 17);
+        line[i].b = (uint8_t)(i * 29 + 101);
+    }
+
+    spi_emu_start();
+    capture_reset();
+    spi_emu_attach(EMU_HOST, &slave);
+
+    spi_nodma_bus_config_t buscfg = {
+        .miso_io_num=EMU_PIN_MISO,
+        .mosi_io_num=EMU_PIN_MOSI,
+        .sclk_io_num=EMU_PIN_CLK,
+        .quadwp_io_num=-1,
+        .quadhd_io_num=-1
+    };
+    spi_nodma_device_interface_config_t devcfg = {
+        .clock_speed_hz=40000000,
+        .mode=0,
+        .spics_io_num=-1,
+        .spics_ext_io_num=EMU_PIN_CS,
+        .flags=SPI_DEVICE_HALFDUPLEX,
+        .queue_size=2,
+    };
+    if (spi_nodma_bus_add_device(EMU_HOST, &buscfg, &devcfg, &disp_spi) != ESP_OK) {
+        printf("Cannot add display device\n");
+        return 1;
+    }
+
+    printf("Checks\n");
+    run_conversion_checks();
+    run_send_checks(line, native);
+    run_addrwin_checks(line);
+
+    if ((!only_checks) && (!failed)) bench(line, native, pixels);
+
+    spi_nodma_bus_remove_device(disp_spi);
+    spi_emu_stop();
+
+    if (failed) printf("\nFAILED\n");
+    return (failed) ? 1 : 0;
+}
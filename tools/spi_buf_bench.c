@@ -0,0 +1,176 @@
+/*
+ * Host micro-benchmark of the hw spi buffer fill/drain kernels
+ *
+ * Compares the byte-by-byte buffer handling previously used in 'spi_nodma_transfer_data()'
+ * with the word-wide kernels from 'spi_nodma_buf.h', for aligned and unaligned buffers.
+ * The hw spi buffer is emulated with a volatile 16-word array.
+ *
+ * Build & run from the project directory:
+ *   cc -O2 -Icomponents/tft -o spi_buf_bench tools/spi_buf_bench.c && ./spi_buf_bench
+ * Add '-fsanitize=address' to also check the kernels never access memory outside the buffers.
+ *
+ * On x86 the cycles are counted with the time stamp counter, on other hosts nanoseconds are used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "spi_nodma_buf.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLE_UNIT "cycle"
+static uint64_t get_cycles(void) { return __rdtsc(); }
+#else
+#define CYCLE_UNIT "ns"
+static uint64_t get_cycles(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+#define BENCH_SIZE  (480*320*3)     // one full ILI9488 frame
+#define BENCH_LOOPS 20
+
+static volatile uint32_t data_buf[16];
+
+// Byte-by-byte fill, as done before the word-wide kernels were added
+//----------------------------------------------------------------------------
+static void legacy_fill(volatile uint32_t *buf, const uint8_t *src, uint32_t len)
+{
+	uint32_t count = 0, bits = 0, wd;
+	uint8_t bc, idx = 0;
+	while (count < len) {
+		wd = 0;
+		for (bc=0;bc<32;bc+=8) {
+			wd |= (uint32_t)src[count] << bc;
+			count++;
+			bits += 8;
+			if (count == len) break;
+		}
+		buf[idx] = wd;
+		idx++;
+	}
+}
+
+// Byte-by-byte drain, as done before the word-wide kernels were added
+//----------------------------------------------------------------------
+static void legacy_drain(volatile uint32_t *buf, uint8_t *dst, uint32_t len)
+{
+	uint32_t rdbits = len * 8, rdcount = len, rd_read = 0, wd;
+	uint8_t bc, rdidx = 0;
+	while (rdbits > 0) {
+		wd = buf[rdidx];
+		rdidx++;
+		for (bc=0;bc<32;bc+=8) {
+			dst[rd_read++] = (uint8_t)((wd >> bc) & 0xFF);
+			rdcount--;
+			rdbits -= 8;
+			if (rdcount == 0) return;
+		}
+	}
+}
+
+typedef void (*fill_func_t)(volatile uint32_t *buf, const uint8_t *src, uint32_t len);
+typedef void (*drain_func_t)(volatile uint32_t *buf, uint8_t *dst, uint32_t len);
+
+//-----------------------------------------------------------------------------------
+static double bench_fill(fill_func_t func, const uint8_t *src, uint32_t size, int loops)
+{
+	uint64_t best = UINT64_MAX;
+	for (int l=0; l<loops; l++) {
+		uint64_t start = get_cycles();
+		for (uint32_t n=0; n<size; n+=SPI_NODMA_HWBUF_SIZE) {
+			uint32_t chunk = size - n;
+			if (chunk > SPI_NODMA_HWBUF_SIZE) chunk = SPI_NODMA_HWBUF_SIZE;
+			func(data_buf, src+n, chunk);
+		}
+		uint64_t t = get_cycles() - start;
+		if (t < best) best = t;
+	}
+	return (double)size / (double)best;
+}
+
+//-------------------------------------------------------------------------------
+static double bench_drain(drain_func_t func, uint8_t *dst, uint32_t size, int loops)
+{
+	uint64_t best = UINT64_MAX;
+	for (int l=0; l<loops; l++) {
+		uint64_t start = get_cycles();
+		for (uint32_t n=0; n<size; n+=SPI_NODMA_HWBUF_SIZE) {
+			uint32_t chunk = size - n;
+			if (chunk > SPI_NODMA_HWBUF_SIZE) chunk = SPI_NODMA_HWBUF_SIZE;
+			func(data_buf, dst+n, chunk);
+		}
+		uint64_t t = get_cycles() - start;
+		if (t < best) best = t;
+	}
+	return (double)size / (double)best;
+}
+
+// Check the new kernels give the same result as the legacy code for all offsets and lengths
+//----------------------
+static int check_kernels()
+{
+	uint8_t src[SPI_NODMA_HWBUF_SIZE+8], d1[SPI_NODMA_HWBUF_SIZE+8], d2[SPI_NODMA_HWBUF_SIZE+8];
+	uint32_t ref[16];
+
+	for (uint32_t i=0; i<sizeof(src); i++) src[i] = (uint8_t)(i * 37 + 11);
+
+	for (int off=0; off<4; off++) {
+		for (uint32_t len=1; len<=SPI_NODMA_HWBUF_SIZE; len++) {
+			memset((void *)data_buf, 0, sizeof(data_buf));
+			legacy_fill(data_buf, src+off, len);
+			memcpy(ref, (void *)data_buf, sizeof(ref));
+			// the source is copied to a heap buffer of the exact size, so that
+			// reads after its end are caught when built with '-fsanitize=address'
+			uint8_t *hsrc = malloc(off+len);
+			if (hsrc == NULL) return 1;
+			memcpy(hsrc+off, src+off, len);
+			memset((void *)data_buf, 0, sizeof(data_buf));
+			spi_nodma_buf_fill(data_buf, hsrc+off, len);
+			free(hsrc);
+			if (memcmp(ref, (void *)data_buf, ((len+3)/4)*4) != 0) {
+				printf("fill mismatch: offset=%d len=%u\n", off, len);
+				return 1;
+			}
+			memset(d1, 0, sizeof(d1));
+			memset(d2, 0, sizeof(d2));
+			legacy_drain(data_buf, d1+off, len);
+			spi_nodma_buf_drain(data_buf, d2+off, len);
+			if (memcmp(d1, d2, sizeof(d1)) != 0) {
+				printf("drain mismatch: offset=%d len=%u\n", off, len);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+//=========
+int main()
+{
+	if (check_kernels()) return 1;
+	printf("Kernels check OK\n\n");
+
+	uint8_t *buf = malloc(BENCH_SIZE+4);
+	if (buf == NULL) return 1;
+	for (int i=0; i<BENCH_SIZE+4; i++) buf[i] = (uint8_t)i;
+
+	printf("bytes per %s, %d bytes in %d-byte chunks\n", CYCLE_UNIT, BENCH_SIZE, SPI_NODMA_HWBUF_SIZE);
+	printf("offset     fill: legacy      new  speedup |  drain: legacy      new  speedup\n");
+	for (int off=0; off<4; off++) {
+		double lf = bench_fill(legacy_fill, buf+off, BENCH_SIZE, BENCH_LOOPS);
+		double nf = bench_fill(spi_nodma_buf_fill, buf+off, BENCH_SIZE, BENCH_LOOPS);
+		double ld = bench_drain(legacy_drain, buf+off, BENCH_SIZE, BENCH_LOOPS);
+		double nd = bench_drain(spi_nodma_buf_drain, buf+off, BENCH_SIZE, BENCH_LOOPS);
+		printf("%6d        %8.3f %8.3f  %6.2fx |        %8.3f %8.3f  %6.2fx\n", off, lf, nf, nf/lf, ld, nd, nd/ld);
+	}
+
+	free(buf);
+	return 0;
+}